@@ -0,0 +1,270 @@
+#include "ArchiveIndex.h"
+#include "Bytes.h"
+#include "Md5.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+namespace ngdp {
+
+void ArchiveIndex::Init() {
+	m_entries.Init();
+	m_filter.Init();
+}
+
+void ArchiveIndex::Destroy(Heap *h) {
+	m_entries.Destroy(h);
+	m_filter.Destroy(h);
+}
+
+bool ArchiveIndex::Parse(Heap *h, const Slice<u8> &data, int archive) {
+	if (data.m_size < kFooterSize) {
+		return false;
+	}
+	// footer = u8 tocHash[8] | u8 version | u8 _[2] | u8 blockSizeKB |
+	//          u8 offsetBytes | u8 sizeBytes | u8 keySize | u8 hashSize |
+	//          u32le elementCount | u8 footerHash[8]
+	const u8 *footer = data.m_data + data.m_size - kFooterSize;
+	int version = footer[8];
+	int blockSize = footer[11] * 1024;
+	int offsetBytes = footer[12];
+	int sizeBytes = footer[13];
+	int keySize = footer[14];
+	int hashSize = footer[15];
+	int elementCount = (int)LoadLE32(footer + 16);
+	if (version != 1 || hashSize != 8 || keySize != 16 || sizeBytes != 4 || blockSize == 0) {
+		return false;
+	}
+	if (offsetBytes != 0 && offsetBytes != 4 && offsetBytes != 6) {
+		return false;
+	}
+
+	int entrySize = keySize + sizeBytes + offsetBytes;
+	int blockCount = (data.m_size - kFooterSize) / (blockSize + keySize + hashSize);
+	int entriesPerBlock = blockSize / entrySize;
+	ArchiveIndexEntry *dst = m_entries.Alloc(h, elementCount);
+	int n = 0;
+	for (int b = 0; b < blockCount && n < elementCount; b++) {
+		const u8 *p = data.m_data + b * blockSize;
+		for (int i = 0; i < entriesPerBlock && n < elementCount; i++, p += entrySize) {
+			// Blocks are zero-padded after their last entry
+			if (p[0] == 0 && memcmp(p, p + 1, keySize - 1) == 0) {
+				break;
+			}
+			ArchiveIndexEntry *e = &dst[n++];
+			memcpy(e->m_key.k, p, keySize);
+			e->m_size = LoadBE32(p + keySize);
+			const u8 *ofs = p + keySize + sizeBytes;
+			if (offsetBytes == 6) {
+				e->m_archive = LoadBE16(ofs);
+				e->m_offset = LoadBE32(ofs + 2);
+			} else if (offsetBytes == 4) {
+				e->m_archive = archive;
+				e->m_offset = LoadBE32(ofs);
+			} else {
+				// Index of loose files; they are fetched by their own key
+				e->m_archive = -1;
+				e->m_offset = 0;
+			}
+		}
+	}
+	// Drop any slots the footer promised but the blocks did not contain
+	m_entries.m_size -= elementCount - n;
+	return n == elementCount;
+}
+
+static bool entryLess(const ArchiveIndexEntry &a, const ArchiveIndexEntry &b) {
+	return a.m_key < b.m_key;
+}
+
+// Merges the sorted runs [starts[i], starts[i + 1]) of src, for first <= i <
+// last, into the same span of dst.  The runs' next entries are kept in a
+// binary heap ordered by key.
+static void mergeRuns(const ArchiveIndexEntry *src, ArchiveIndexEntry *dst, const int *starts, int first, int last) {
+	int pos[ArchiveIndex::kMergeWays];
+	int end[ArchiveIndex::kMergeWays];
+	int heap[ArchiveIndex::kMergeWays];
+	int count = 0;
+	auto less = [&](int a, int b) {
+		return entryLess(src[pos[a]], src[pos[b]]);
+	};
+	auto siftDown = [&](int i) {
+		for (;;) {
+			int least = i;
+			int l = 2 * i + 1;
+			if (l < count && less(heap[l], heap[least])) {
+				least = l;
+			}
+			if (l + 1 < count && less(heap[l + 1], heap[least])) {
+				least = l + 1;
+			}
+			if (least == i) {
+				return;
+			}
+			std::swap(heap[i], heap[least]);
+			i = least;
+		}
+	};
+	for (int r = first; r < last; r++) {
+		int k = r - first;
+		pos[k] = starts[r];
+		end[k] = starts[r + 1];
+		if (pos[k] < end[k]) {
+			heap[count++] = k;
+		}
+	}
+	for (int i = count / 2 - 1; i >= 0; i--) {
+		siftDown(i);
+	}
+	ArchiveIndexEntry *out = dst + starts[first];
+	while (count) {
+		int k = heap[0];
+		*out++ = src[pos[k]++];
+		if (pos[k] == end[k]) {
+			heap[0] = heap[--count];
+		}
+		siftDown(0);
+	}
+}
+
+void ArchiveIndex::Sort(Heap *h, WorkerPool *pool) {
+	int n = m_entries.m_size;
+	Buffer<int> starts;
+	starts.Init();
+	starts.Push(h, 0);
+	for (int i = 1; i < n; i++) {
+		if (entryLess(m_entries[i], m_entries[i - 1])) {
+			starts.Push(h, i);
+		}
+	}
+	// Merging only pays off for a few long runs.
+	if (starts.m_size > 1 && starts.m_size > n / 8) {
+		std::sort(m_entries.begin(), m_entries.end(), entryLess);
+		starts.m_size = 1;
+	}
+	starts.Push(h, n);
+
+	Buffer<ArchiveIndexEntry> other;
+	other.Init();
+	if (starts.m_size > 2) {
+		other.Alloc(h, n);
+	}
+	ArchiveIndexEntry *src = m_entries.m_storage;
+	ArchiveIndexEntry *dst = other.m_storage;
+	while (starts.m_size > 2) {
+		int runs = starts.m_size - 1;
+		int groups = (runs + kMergeWays - 1) / kMergeWays;
+		if (pool && groups > 1) {
+			std::atomic<int> left(groups);
+			std::atomic<int> done(0);
+			for (int g = 0; g < groups; g++) {
+				int first = g * kMergeWays;
+				int last = first + kMergeWays < runs ? first + kMergeWays : runs;
+				const int *s = starts.m_storage;
+				pool->Submit([=, &left, &done]() {
+					mergeRuns(src, dst, s, first, last);
+					if (left.fetch_sub(1) == 1) {
+						done.store(1, std::memory_order_release);
+					}
+				});
+			}
+			pool->Wait(done);
+		} else {
+			for (int g = 0; g < groups; g++) {
+				int first = g * kMergeWays;
+				mergeRuns(src, dst, starts.m_storage, first, first + kMergeWays < runs ? first + kMergeWays : runs);
+			}
+		}
+		// Each group is now one run.
+		int kept = 0;
+		for (int r = 0; r < runs; r += kMergeWays) {
+			starts[kept++] = starts[r];
+		}
+		starts[kept++] = n;
+		starts.m_size = kept;
+		std::swap(src, dst);
+	}
+	if (src != m_entries.m_storage) {
+		std::swap(m_entries.m_storage, other.m_storage);
+		std::swap(m_entries.m_capacity, other.m_capacity);
+	}
+	other.Destroy(h);
+	starts.Destroy(h);
+}
+
+void ArchiveIndex::WriteGroup(Heap *h, Buffer<u8> *out) const {
+	int perBlock = kGroupBlockSize / kGroupEntrySize;
+	int count = 0;
+	for (const ArchiveIndexEntry &e : m_entries) {
+		count += e.m_archive >= 0;
+	}
+	int blockCount = (count + perBlock - 1) / perBlock;
+	u8 *blocks = out->AllocZero(h, blockCount * (kGroupBlockSize + 16 + 8) + kFooterSize);
+	u8 *lastKeys = blocks + blockCount * kGroupBlockSize;
+	u8 *blockHashes = lastKeys + blockCount * 16;
+	u8 *footer = blockHashes + blockCount * 8;
+
+	int n = 0;
+	for (const ArchiveIndexEntry &e : m_entries) {
+		// Entries for loose files have no place in an archive group.
+		if (e.m_archive < 0) {
+			continue;
+		}
+		u8 *p = blocks + (n / perBlock) * kGroupBlockSize + (n % perBlock) * kGroupEntrySize;
+		memcpy(p, e.m_key.k, 16);
+		StoreBE32(p + 16, e.m_size);
+		StoreBE16(p + 20, (u16)e.m_archive);
+		StoreBE32(p + 22, e.m_offset);
+		n++;
+		if (n % perBlock == 0 || n == count) {
+			memcpy(lastKeys + ((n - 1) / perBlock) * 16, e.m_key.k, 16);
+		}
+	}
+	Key digest;
+	for (int b = 0; b < blockCount; b++) {
+		Md5::Sum(blocks + b * kGroupBlockSize, kGroupBlockSize, &digest);
+		memcpy(blockHashes + b * 8, digest.k, 8);
+	}
+
+	Md5::Sum(lastKeys, blockCount * (16 + 8), &digest);
+	memcpy(footer, digest.k, 8);
+	footer[8] = 1;
+	footer[11] = kGroupBlockSize / 1024;
+	footer[12] = 6;
+	footer[13] = 4;
+	footer[14] = 16;
+	footer[15] = 8;
+	StoreLE32(footer + 16, (u32)count);
+	// The footer's own hash covers its fields with the hash zeroed.
+	Md5::Sum(footer + 8, kFooterSize - 8, &digest);
+	memcpy(footer + 20, digest.k, 8);
+}
+
+void ArchiveIndex::BuildFilter(Heap *h) {
+	m_filter.Reset(h, m_entries.m_size);
+	for (const ArchiveIndexEntry &e : m_entries) {
+		m_filter.Add(e.m_key.k);
+	}
+}
+
+const ArchiveIndexEntry *ArchiveIndex::Find(const Key &ekey) const {
+	if (!m_filter.MayContain(ekey.k)) {
+		return nullptr;
+	}
+	int lo = 0;
+	int hi = m_entries.m_size;
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) >> 1);
+		int cmp = m_entries[mid].m_key.Compare(ekey);
+		if (cmp == 0) {
+			return &m_entries[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return nullptr;
+}
+
+}
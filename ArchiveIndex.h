@@ -0,0 +1,66 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Key.h"
+#include "KeyFilter.h"
+
+namespace ngdp {
+
+struct WorkerPool;
+
+// Location of an encoded file inside a CDN archive.
+struct ArchiveIndexEntry {
+	Key m_key;
+	u32 m_size;
+	u32 m_offset;
+	// Index into CDNConfig::m_archives
+	s32 m_archive;
+};
+
+// ArchiveIndex maps encoded keys to their location in the CDN archives listed
+// by the CDN config.  It is built from the archives' .index files (or from the
+// archive-group index, which already carries archive numbers), then sorted
+// once for binary search.
+//
+// A CDN .index file is a sequence of fixed-size blocks of sorted entries
+//   key | u32be size | [u16be archive] u32be offset
+// followed by a table of contents (the last key and a partial md5 of each
+// block) and a 28-byte footer describing the field widths.
+struct ArchiveIndex {
+	Buffer<ArchiveIndexEntry> m_entries;
+	KeyFilter m_filter;
+
+	static const int kFooterSize = 28;
+	// Block size and entry size of the archive-group indexes WriteGroup makes
+	static const int kGroupBlockSize = 4096;
+	static const int kGroupEntrySize = 16 + 4 + 6;
+	// Runs merged at once by each task of a Sort pass
+	static const int kMergeWays = 16;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Appends the entries of a .index file.  archive is the archive number
+	// stored with each entry; it is ignored for archive-group indexes, whose
+	// entries have their own.
+	bool Parse(Heap *h, const Slice<u8> &data, int archive);
+
+	// Sorts entries by key; must be called after the last Parse.  Each
+	// Parse appends a run that is already sorted, so the runs are merged
+	// kMergeWays at a time, the merges of each pass spread over pool if it
+	// is not null.
+	void Sort(Heap *h, WorkerPool *pool);
+
+	// Writes the sorted entries as an archive-group index, which a later
+	// Parse reads back with every entry's archive number.
+	void WriteGroup(Heap *h, Buffer<u8> *out) const;
+
+	// Rebuilds m_filter from m_entries; Find works without it, but has to
+	// search for every absent key.
+	void BuildFilter(Heap *h);
+
+	const ArchiveIndexEntry *Find(const Key &ekey) const;
+};
+
+}
@@ -0,0 +1,419 @@
+#include "std.h"
+#include "ArchiveIndex.h"
+#include "Buffer.h"
+#include "Config.h"
+#include "Heap.h"
+#include "Key.h"
+#include "KeyMap.h"
+#include "Strings.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define NGDP_BENCH_TSC 1
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#define NGDP_BENCH_TSC 1
+#endif
+
+// Microbenchmarks of the primitives every read path is built on, over
+// synthetic inputs sized like real configs and indexes.  The inputs come from
+// a fixed seed, so runs of different commits measure the same work.
+//
+// Each benchmark prints one JSON object per line: the best pass's time-stamp
+// counter ticks and nanoseconds per item, and the allocations and bytes
+// allocated per pass.
+
+namespace ngdp {
+
+// Allocations made through the benchmark heap
+static s64 allocCount;
+static s64 allocBytes;
+
+static void *countingMalloc(size_t size) {
+	allocCount++;
+	allocBytes += size;
+	return malloc(size);
+}
+
+static void countingFree(void *ptr) {
+	free(ptr);
+}
+
+static void *countingRealloc(void *ptr, size_t size) {
+	allocCount++;
+	allocBytes += size;
+	return realloc(ptr, size);
+}
+
+// Time-stamp counter ticks, which run at a fixed rate on current CPUs; zero
+// where there is no counter.
+static u64 ticks() {
+#ifdef NGDP_BENCH_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static s64 nanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift64*, so the inputs are the same on every machine
+struct Random {
+	u64 m_state;
+
+	u64 Next() {
+		m_state ^= m_state >> 12;
+		m_state ^= m_state << 25;
+		m_state ^= m_state >> 27;
+		return m_state * 0x2545f4914f6cdd1dull;
+	}
+
+	void NextKey(Key *key) {
+		u64 a = Next();
+		u64 b = Next();
+		memcpy(key->k, &a, 8);
+		memcpy(key->k + 8, &b, 8);
+	}
+};
+
+// Results are added here so the work is not optimized away.
+static volatile u64 sink;
+
+struct Bench {
+	Heap m_heap;
+	const char *m_filter;
+	int m_passes;
+
+	// Runs pass m_passes times, and reports the best pass's cost per item.
+	void Run(const char *name, s64 items, const std::function<void()> &pass) {
+		if (m_filter && !strstr(name, m_filter)) {
+			return;
+		}
+		u64 bestTicks = ~0ull;
+		s64 bestNs = INT64_MAX;
+		s64 allocs = 0;
+		s64 bytes = 0;
+		for (int i = 0; i < m_passes; i++) {
+			s64 count = allocCount;
+			s64 size = allocBytes;
+			s64 ns = nanoseconds();
+			u64 t = ticks();
+			pass();
+			t = ticks() - t;
+			ns = nanoseconds() - ns;
+			bestTicks = t < bestTicks ? t : bestTicks;
+			bestNs = ns < bestNs ? ns : bestNs;
+			allocs = allocCount - count;
+			bytes = allocBytes - size;
+		}
+		printf("{\"name\":\"%s\",\"items\":%lld,\"passes\":%d,\"ticksPerItem\":%.3f,\"nsPerItem\":%.3f,\"allocsPerPass\":%lld,\"allocBytesPerPass\":%lld}\n",
+			name, (long long)items, m_passes, (f64)bestTicks / items, (f64)bestNs / items, (long long)allocs, (long long)bytes);
+		fflush(stdout);
+	}
+};
+
+// Sizes of the synthetic inputs, after a current build of a large product
+static const int kArchiveCount = 2500;
+static const int kPatchArchiveCount = 1000;
+static const int kBuildCount = 30;
+static const int kKeyCount = 1 << 16;
+static const int kIndexEntryCount = 1 << 20;
+static const int kLookupCount = 1 << 16;
+
+static void appendKeyList(Heap *h, StringBuffer &sb, Random &r, int count) {
+	for (int i = 0; i < count; i++) {
+		Key key;
+		r.NextKey(&key);
+		if (i) {
+			sb.AppendChar(h, ' ');
+		}
+		key.WriteHex(h, sb);
+	}
+}
+
+static void makeCDNConfig(Heap *h, Random &r, Buffer<u8> *out) {
+	StringBuffer sb;
+	sb.Init(out);
+	Key key;
+	sb.AppendString(h, "# CDN Configuration\n\narchives = ");
+	appendKeyList(h, sb, r, kArchiveCount);
+	sb.AppendString(h, "\narchive-group = ");
+	r.NextKey(&key);
+	key.WriteHex(h, sb);
+	sb.AppendString(h, "\npatch-archives = ");
+	appendKeyList(h, sb, r, kPatchArchiveCount);
+	sb.AppendString(h, "\npatch-archive-group = ");
+	r.NextKey(&key);
+	key.WriteHex(h, sb);
+	sb.AppendString(h, "\nbuilds = ");
+	appendKeyList(h, sb, r, kBuildCount);
+	sb.AppendChar(h, '\n');
+}
+
+static void makeBuildConfig(Heap *h, Random &r, Buffer<u8> *out) {
+	static const char *const singleKeys[] = {"root", "install", "download", "size", "partial-priority", "patch", "patch-config"};
+	static const char *const keyPairs[] = {"encoding", "install", "download", "size", "vfs-root"};
+	StringBuffer sb;
+	sb.Init(out);
+	sb.AppendString(h, "# Build Configuration\n\n");
+	for (const char *name : singleKeys) {
+		sb.AppendString(h, name);
+		sb.AppendString(h, " = ");
+		appendKeyList(h, sb, r, 1);
+		sb.AppendChar(h, '\n');
+	}
+	for (const char *name : keyPairs) {
+		sb.AppendString(h, name);
+		sb.AppendString(h, " = ");
+		appendKeyList(h, sb, r, 2);
+		sb.AppendString(h, "\n");
+		sb.AppendString(h, name);
+		sb.AppendString(h, "-size = ");
+		sb.AppendInt(h, (int)(r.Next() & 0x3fffffff));
+		sb.AppendChar(h, ' ');
+		sb.AppendInt(h, (int)(r.Next() & 0x3fffffff));
+		sb.AppendChar(h, '\n');
+	}
+	sb.AppendString(h, "build-name = WOW-40000patch9.0.1_Retail\nbuild-uid = wow\nbuild-product = WoW\n"
+		"build-playbuild-installer = ngdptool_casc2\nbuild-partial-priority = ");
+	for (int i = 0; i < 40; i++) {
+		sb.AppendString(h, i ? " " : "");
+		appendKeyList(h, sb, r, 1);
+		sb.AppendString(h, ":262144");
+	}
+	sb.AppendChar(h, '\n');
+}
+
+static int run(int argc, char **argv) {
+	Bench bench;
+	bench.m_heap = Heap{countingMalloc, countingFree, countingRealloc};
+	bench.m_filter = nullptr;
+	bench.m_passes = 20;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			bench.m_filter = argv[++i];
+		} else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+			bench.m_passes = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: bench [--filter SUBSTRING] [--passes N]\n");
+			return 2;
+		}
+	}
+	if (bench.m_passes <= 0) {
+		fprintf(stderr, "--passes must be positive\n");
+		return 2;
+	}
+	Heap *h = &bench.m_heap;
+	Random r = {0x6e67647062656e63ull};
+
+	Buffer<u8> cdnConfig;
+	Buffer<u8> buildConfig;
+	cdnConfig.Init();
+	buildConfig.Init();
+	makeCDNConfig(h, r, &cdnConfig);
+	makeBuildConfig(h, r, &buildConfig);
+	String cdnText = cdnConfig.MakeSlice();
+	String buildText = buildConfig.MakeSlice();
+	int archivesEnd = cdnText.Substring(0, cdnText.Index("\narchive-group")).m_size;
+	String archives = cdnText.Substring(cdnText.Index("=") + 2, archivesEnd);
+
+	Buffer<Key> keys;
+	Buffer<u8> hex;
+	keys.Init(h, kKeyCount);
+	hex.Init();
+	StringBuffer hexSb;
+	hexSb.Init(&hex);
+	for (int i = 0; i < kKeyCount; i++) {
+		r.NextKey(keys.Alloc(h, 1));
+		keys[i].WriteHex(h, hexSb);
+	}
+
+	ArchiveIndex index;
+	index.Init();
+	for (int i = 0; i < kIndexEntryCount; i++) {
+		ArchiveIndexEntry *e = index.m_entries.Alloc(h, 1);
+		r.NextKey(&e->m_key);
+		e->m_size = (u32)(r.Next() & 0xfffff);
+		e->m_offset = (u32)(r.Next() & 0x3fffffff);
+		e->m_archive = (s32)(r.Next() % kArchiveCount);
+	}
+	// Half of the lookups are for keys in the index.
+	Buffer<Key> lookups;
+	lookups.Init(h, kLookupCount);
+	for (int i = 0; i < kLookupCount; i++) {
+		Key *key = lookups.Alloc(h, 1);
+		if (i & 1) {
+			*key = index.m_entries[(int)(r.Next() % kIndexEntryCount)].m_key;
+		} else {
+			r.NextKey(key);
+		}
+	}
+	std::sort(index.m_entries.begin(), index.m_entries.end(), [](const ArchiveIndexEntry &a, const ArchiveIndexEntry &b) {
+		return a.m_key < b.m_key;
+	});
+
+	bench.Run("Buffer::Push", 1 << 20, [&]() {
+		Buffer<u32> b;
+		b.Init();
+		for (u32 i = 0; i < 1 << 20; i++) {
+			b.Push(h, i);
+		}
+		sink += b[b.m_size - 1];
+		b.Destroy(h);
+	});
+
+	// Appends of the sizes download sinks see
+	bench.Run("Buffer::Alloc", 4096, [&]() {
+		Buffer<u8> b;
+		b.Init();
+		for (int i = 0; i < 4096; i++) {
+			memset(b.Alloc(h, 1460 + (i & 511)), 0, 1);
+		}
+		sink += b.m_size;
+		b.Destroy(h);
+	});
+
+	bench.Run("String::Split", kArchiveCount, [&]() {
+		Buffer<String> parts = archives.Split(h, " ");
+		sink += parts.m_size;
+		parts.Destroy(h);
+	});
+
+	// Items are bytes searched.
+	bench.Run("String::Index byte", cdnText.m_size, [&]() {
+		sink += cdnText.Index("\x01");
+	});
+
+	bench.Run("String::Index", cdnText.m_size, [&]() {
+		sink += cdnText.Index("build-partial");
+	});
+
+	bench.Run("String::Count byte", cdnText.m_size, [&]() {
+		sink += cdnText.Count(" ");
+	});
+
+	bench.Run("String::Count", cdnText.m_size, [&]() {
+		sink += cdnText.Count("ff");
+	});
+
+	bench.Run("Key::InitFromHexString", kKeyCount, [&]() {
+		String s = hex.MakeSlice();
+		Key key;
+		for (int i = 0; i < kKeyCount; i++) {
+			key.InitFromHexString(s.Substring(i * 32, i * 32 + 32));
+			sink += key.k[0];
+		}
+	});
+
+	bench.Run("StringBuffer::AppendHexByte", kKeyCount * 16, [&]() {
+		Buffer<u8> out;
+		out.Init();
+		StringBuffer sb;
+		sb.Init(&out);
+		for (const Key &key : keys) {
+			key.WriteHex(h, sb);
+		}
+		sink += out.m_size;
+		out.Destroy(h);
+	});
+
+	// Items are bytes parsed.
+	bench.Run("ParseConfig cdn", cdnText.m_size, [&]() {
+		ParseConfig(h, cdnText, [&](const String &key, const String &value) {
+			sink += key.m_size + value.m_size;
+		});
+	});
+
+	bench.Run("ParseConfig build", buildText.m_size, [&]() {
+		ParseConfig(h, buildText, [&](const String &key, const String &value) {
+			sink += key.m_size + value.m_size;
+		});
+	});
+
+	bench.Run("CDNConfig::Init", cdnText.m_size, [&]() {
+		CDNConfig config;
+		config.Init(h, cdnText);
+		sink += config.m_archives.m_size;
+		config.Destroy(h);
+	});
+
+	// Items are keys sorted.
+	Buffer<Key> sorted;
+	sorted.Init(h, kKeyCount);
+	bench.Run("Key compare (sort)", kKeyCount, [&]() {
+		sorted.m_size = 0;
+		sorted.Append(h, keys.m_storage, keys.m_size);
+		std::sort(sorted.begin(), sorted.end(), [](const Key &a, const Key &b) {
+			return a < b;
+		});
+		sink += sorted[0].k[0];
+	});
+	sorted.Destroy(h);
+
+	bench.Run("ArchiveIndex::Find", kLookupCount, [&]() {
+		for (const Key &key : lookups) {
+			sink += index.Find(key) != nullptr;
+		}
+	});
+
+	index.BuildFilter(h);
+	bench.Run("ArchiveIndex::Find filtered", kLookupCount, [&]() {
+		for (const Key &key : lookups) {
+			sink += index.Find(key) != nullptr;
+		}
+	});
+
+	KeyMap<int> map;
+	KeyMap<int, 9> shortMap;
+	map.Init();
+	shortMap.Init();
+	map.Reserve(h, kIndexEntryCount);
+	shortMap.Reserve(h, kIndexEntryCount);
+	for (int i = 0; i < kIndexEntryCount; i++) {
+		*map.Insert(h, index.m_entries[i].m_key) = i;
+		*shortMap.Insert(h, index.m_entries[i].m_key) = i;
+	}
+	bench.Run("KeyMap::Find", kLookupCount, [&]() {
+		for (const Key &key : lookups) {
+			sink += map.Find(key) != nullptr;
+		}
+	});
+
+	bench.Run("KeyMap::Find 9-byte", kLookupCount, [&]() {
+		for (const Key &key : lookups) {
+			sink += shortMap.Find(key) != nullptr;
+		}
+	});
+
+	bench.Run("KeyMap::Insert", kKeyCount, [&]() {
+		KeyMap<int> m;
+		m.Init();
+		for (int i = 0; i < kKeyCount; i++) {
+			*m.Insert(h, keys[i]) = i;
+		}
+		sink += m.m_size;
+		m.Destroy(h);
+	});
+	shortMap.Destroy(h);
+	map.Destroy(h);
+
+	lookups.Destroy(h);
+	index.Destroy(h);
+	hex.Destroy(h);
+	keys.Destroy(h);
+	buildConfig.Destroy(h);
+	cdnConfig.Destroy(h);
+	return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+	return ngdp::run(argc, argv);
+}
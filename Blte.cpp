@@ -0,0 +1,452 @@
+#include "Blte.h"
+#include "Bytes.h"
+#include "Crypt.h"
+#include "Md5.h"
+#include "Trace.h"
+#include "ngdp.h"
+
+#include <zlib.h>
+
+namespace ngdp {
+
+int BlteHeader::RequiredSize(const u8 *data, int size) {
+	assert(size >= kPrefixSize);
+	if (memcmp(data, "BLTE", 4) != 0) {
+		return -1;
+	}
+	u32 headerSize = LoadBE32(data + 4);
+	if (headerSize == 0) {
+		return kPrefixSize;
+	}
+	if (headerSize < kPrefixSize + 4 || headerSize > 0x7fffffff) {
+		return -1;
+	}
+	return (int)headerSize;
+}
+
+bool BlteHeader::Init(const u8 *data, int size, int encodedSize, int decodedSize) {
+	int required = RequiredSize(data, size);
+	if (required < 0 || required > size) {
+		return false;
+	}
+	m_encodedSize = encodedSize;
+	m_decodedSize = decodedSize;
+	if (LoadBE32(data + 4) == 0) {
+		m_headerSize = kPrefixSize;
+		m_chunkCount = 1;
+		m_table = nullptr;
+		return encodedSize > kPrefixSize;
+	}
+	u8 flags = data[8];
+	if (flags != 0x0f) {
+		return false;
+	}
+	m_headerSize = required;
+	m_chunkCount = (int)LoadBE24(data + 9);
+	m_table = data + 12;
+	if (12 + m_chunkCount * kTableEntrySize != m_headerSize || m_chunkCount == 0) {
+		return false;
+	}
+	// Check the table once, so walking it stays within the file and its
+	// offsets cannot overflow.
+	s64 encodedTotal = 0;
+	s64 decodedTotal = 0;
+	BlteChunk chunk;
+	for (int i = 0; i < m_chunkCount; i++) {
+		LoadEntry(i, &chunk);
+		if (chunk.m_encodedSize < 0 || chunk.m_decodedSize < 0) {
+			return false;
+		}
+		encodedTotal += chunk.m_encodedSize;
+		decodedTotal += chunk.m_decodedSize;
+	}
+	if (encodedSize >= 0 && encodedTotal > (s64)encodedSize - m_headerSize) {
+		return false;
+	}
+	if (decodedSize >= 0 && decodedTotal != decodedSize) {
+		return false;
+	}
+	return m_headerSize + encodedTotal <= 0x7fffffff && decodedTotal <= 0x7fffffff;
+}
+
+void BlteHeader::LoadEntry(int index, BlteChunk *chunk) const {
+	chunk->m_index = index;
+	if (!m_table) {
+		chunk->m_encodedSize = m_encodedSize - kPrefixSize;
+		chunk->m_decodedSize = m_decodedSize;
+		chunk->m_checksum = nullptr;
+		return;
+	}
+	const u8 *entry = m_table + index * kTableEntrySize;
+	chunk->m_encodedSize = (int)LoadBE32(entry);
+	chunk->m_decodedSize = (int)LoadBE32(entry + 4);
+	chunk->m_checksum = entry + 8;
+}
+
+bool BlteHeader::Seek(int decodedOffset, BlteChunk *chunk) const {
+	if (decodedOffset < 0) {
+		return false;
+	}
+	chunk->m_encodedOffset = m_headerSize;
+	chunk->m_decodedOffset = 0;
+	LoadEntry(0, chunk);
+	while (decodedOffset >= chunk->m_decodedOffset + chunk->m_decodedSize) {
+		if (!Next(chunk)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool BlteHeader::Next(BlteChunk *chunk) const {
+	int next = chunk->m_index + 1;
+	if (next >= m_chunkCount) {
+		return false;
+	}
+	chunk->m_encodedOffset += chunk->m_encodedSize;
+	chunk->m_decodedOffset += chunk->m_decodedSize;
+	LoadEntry(next, chunk);
+	return true;
+}
+
+void BlteHeader::MaxChunkSizes(int *maxEncoded, int *maxDecoded) const {
+	int enc = 0;
+	int dec = 0;
+	BlteChunk chunk;
+	for (int i = 0; i < m_chunkCount; i++) {
+		LoadEntry(i, &chunk);
+		if (chunk.m_encodedSize > enc) {
+			enc = chunk.m_encodedSize;
+		}
+		if (chunk.m_decodedSize > dec) {
+			dec = chunk.m_decodedSize;
+		}
+	}
+	*maxEncoded = enc;
+	*maxDecoded = dec;
+}
+
+bool BlteVerifyChunk(const u8 *chunk, int chunkSize, const u8 *checksum) {
+	Key digest;
+	Md5::Sum(chunk, chunkSize, &digest);
+	return memcmp(digest.k, checksum, 16) == 0;
+}
+
+int BlteVerify(const u8 *data, int size, Key *ekey) {
+	BlteHeader header;
+	if (size < BlteHeader::kPrefixSize || !header.Init(data, size, size, -1)) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	if (!header.m_table) {
+		Md5::Sum(data, size, ekey);
+		return NGDP_ERROR_SUCCESS;
+	}
+	int offset = header.m_headerSize;
+	for (int i = 0; i < header.m_chunkCount; i++) {
+		const u8 *entry = header.m_table + i * BlteHeader::kTableEntrySize;
+		int chunkSize = (int)LoadBE32(entry);
+		if (chunkSize <= 0 || chunkSize > size - offset || !BlteVerifyChunk(data + offset, chunkSize, entry + 8)) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		offset += chunkSize;
+	}
+	if (offset != size) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	Md5::Sum(data, header.m_headerSize, ekey);
+	return NGDP_ERROR_SUCCESS;
+}
+
+static int inflateChunk(const u8 *src, int srcSize, u8 *dst, int dstSize) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	z.next_in = (Bytef *)src;
+	z.avail_in = (uInt)srcSize;
+	z.next_out = dst;
+	z.avail_out = (uInt)dstSize;
+	int zres = inflate(&z, Z_FINISH);
+	bool ok = zres == Z_STREAM_END && z.avail_out == 0;
+	inflateEnd(&z);
+	return ok ? NGDP_ERROR_SUCCESS : NGDP_ERROR_CORRUPT_DATA;
+}
+
+// Inflates a zlib stream of unknown decoded size, growing out as needed.
+static int inflateAppend(Heap *h, const u8 *src, int srcSize, Buffer<u8> *out) {
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	z.next_in = (Bytef *)src;
+	z.avail_in = (uInt)srcSize;
+	int zres = Z_OK;
+	while (zres == Z_OK) {
+		int step = srcSize * 2 + 4096;
+		int start = out->m_size;
+		u8 *dst = out->Alloc(h, step);
+		z.next_out = dst;
+		z.avail_out = (uInt)step;
+		zres = inflate(&z, Z_NO_FLUSH);
+		out->m_size = start + step - (int)z.avail_out;
+	}
+	inflateEnd(&z);
+	return zres == Z_STREAM_END ? NGDP_ERROR_SUCCESS : NGDP_ERROR_CORRUPT_DATA;
+}
+
+// Decrypted payloads are inflated through a buffer of this size, so a block
+// is still in cache when inflate reads it.
+static const int kDecryptBlockSize = 16 * 1024;
+
+// The parsed header of an 'E' chunk:
+//   u8 nameSize (8) | u64le name | u8 ivSize (4 or 8) | iv | u8 type ('S' or 'A')
+// followed by the encrypted chunk, mode byte first.
+struct EncryptedChunk {
+	u64 m_name;
+	u8 m_iv[8];
+	int m_ivSize;
+	u8 m_type;
+	const u8 *m_data;
+	int m_size;
+};
+
+static bool parseEncrypted(const u8 *payload, int size, EncryptedChunk *e) {
+	if (size < 1 || payload[0] != 8 || size < 1 + 8 + 1) {
+		return false;
+	}
+	e->m_name = LoadLE64(payload + 1);
+	e->m_ivSize = payload[9];
+	int typeAt = 10 + e->m_ivSize;
+	if ((e->m_ivSize != 4 && e->m_ivSize != 8) || size < typeAt + 2) {
+		return false;
+	}
+	memset(e->m_iv, 0, sizeof(e->m_iv));
+	memcpy(e->m_iv, payload + 10, e->m_ivSize);
+	e->m_type = payload[typeAt];
+	e->m_data = payload + typeAt + 1;
+	e->m_size = size - typeAt - 1;
+	return true;
+}
+
+// Decrypts and decodes an encrypted chunk with cipher.
+template <typename Cipher>
+static int decodeDecrypted(Cipher *cipher, const u8 *data, int size, u8 *dst, int decodedSize) {
+	u8 mode;
+	cipher->Apply(data, &mode, 1);
+	data++;
+	size--;
+	if (mode == 'N') {
+		if (size != decodedSize) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		cipher->Apply(data, dst, size);
+		return NGDP_ERROR_SUCCESS;
+	}
+	if (mode != 'Z') {
+		return NGDP_ERROR_UNSUPPORTED_ENCODING;
+	}
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	u8 block[kDecryptBlockSize];
+	z.next_out = dst;
+	z.avail_out = (uInt)decodedSize;
+	int zres = Z_OK;
+	while (size > 0 && zres == Z_OK) {
+		int n = size < kDecryptBlockSize ? size : kDecryptBlockSize;
+		cipher->Apply(data, block, n);
+		data += n;
+		size -= n;
+		z.next_in = block;
+		z.avail_in = (uInt)n;
+		zres = inflate(&z, size ? Z_NO_FLUSH : Z_FINISH);
+		if (zres == Z_OK && z.avail_in) {
+			// Out of room before the stream ended
+			break;
+		}
+	}
+	bool ok = zres == Z_STREAM_END && z.avail_out == 0;
+	inflateEnd(&z);
+	return ok ? NGDP_ERROR_SUCCESS : NGDP_ERROR_CORRUPT_DATA;
+}
+
+static int decryptChunk(const u8 *payload, int payloadSize, u8 *dst, int decodedSize, const Keyring *keys, int chunkIndex) {
+	EncryptedChunk e;
+	if (!parseEncrypted(payload, payloadSize, &e)) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	u8 key[16];
+	if (!keys || !keys->Find(e.m_name, key)) {
+		// Skipped without decrypting anything
+		memset(dst, 0, decodedSize);
+		return NGDP_ERROR_MISSING_KEY;
+	}
+	// Each chunk's IV is the file's, with the chunk index mixed into its
+	// first four bytes.
+	for (int i = 0; i < 4; i++) {
+		e.m_iv[i] ^= (u8)(chunkIndex >> (8 * i));
+	}
+	if (e.m_type == 'S') {
+		Salsa20 salsa;
+		salsa.Init(key, 16, e.m_iv);
+		return decodeDecrypted(&salsa, e.m_data, e.m_size, dst, decodedSize);
+	}
+	if (e.m_type == 'A') {
+		u8 arc4Key[24];
+		memcpy(arc4Key, key, 16);
+		memcpy(arc4Key + 16, e.m_iv, e.m_ivSize);
+		Arc4 arc4;
+		arc4.Init(arc4Key, 16 + e.m_ivSize);
+		return decodeDecrypted(&arc4, e.m_data, e.m_size, dst, decodedSize);
+	}
+	return NGDP_ERROR_UNSUPPORTED_ENCODING;
+}
+
+bool BlteEncryptedKeyName(const u8 *chunk, int chunkSize, u64 *name) {
+	EncryptedChunk e;
+	if (chunkSize < 1 || chunk[0] != 'E' || !parseEncrypted(chunk + 1, chunkSize - 1, &e)) {
+		return false;
+	}
+	*name = e.m_name;
+	return true;
+}
+
+int BlteDecodeChunk(const u8 *chunk, int chunkSize, u8 *dst, int decodedSize, const Keyring *keys, int chunkIndex) {
+	if (chunkSize < 1) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	const u8 *payload = chunk + 1;
+	int payloadSize = chunkSize - 1;
+	switch (chunk[0]) {
+	case 'N':
+		if (payloadSize != decodedSize) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		memcpy(dst, payload, decodedSize);
+		return NGDP_ERROR_SUCCESS;
+	case 'Z':
+		return inflateChunk(payload, payloadSize, dst, decodedSize);
+	case 'E':
+		return decryptChunk(payload, payloadSize, dst, decodedSize, keys, chunkIndex);
+	default:
+		// 'F' (nested frames), '4' (lz4hc)
+		return NGDP_ERROR_UNSUPPORTED_ENCODING;
+	}
+}
+
+void BlteStream::Init(const BlteHeader *header, const BlteChunk &first, int count, const u8 *encoded, const BlteChunkFn &onChunk) {
+	m_source = header;
+	m_encoded = encoded;
+	m_encodedOffset = first.m_encodedOffset;
+	m_chunk = first;
+	m_remaining = count;
+	m_result = NGDP_ERROR_SUCCESS;
+	m_onChunk = onChunk;
+	m_tracer = nullptr;
+}
+
+void BlteStream::InitFile(const u8 *encoded, int encodedSize, int decodedSize, const BlteChunkFn &onChunk) {
+	// Until the header arrives, the only known chunk is the file itself.
+	m_header.m_encodedSize = encodedSize;
+	m_header.m_decodedSize = decodedSize;
+	m_source = nullptr;
+	m_encoded = encoded;
+	m_encodedOffset = 0;
+	m_remaining = 1;
+	m_result = NGDP_ERROR_SUCCESS;
+	m_onChunk = onChunk;
+	m_tracer = nullptr;
+}
+
+int BlteStream::Advance(int received) {
+	if (m_result || !m_remaining) {
+		return m_result;
+	}
+	if (!m_source) {
+		if (received < BlteHeader::kPrefixSize) {
+			return m_result;
+		}
+		int required = BlteHeader::RequiredSize(m_encoded, received);
+		if (required < 0) {
+			return m_result = NGDP_ERROR_CORRUPT_DATA;
+		}
+		if (received < required) {
+			return m_result;
+		}
+		if (!m_header.Init(m_encoded, received, m_header.m_encodedSize, m_header.m_decodedSize) || !m_header.Seek(0, &m_chunk)) {
+			return m_result = NGDP_ERROR_CORRUPT_DATA;
+		}
+		m_source = &m_header;
+		m_remaining = m_header.m_chunkCount;
+	}
+	while (m_remaining && m_chunk.m_encodedOffset + m_chunk.m_encodedSize - m_encodedOffset <= received) {
+		const u8 *data = m_encoded + (m_chunk.m_encodedOffset - m_encodedOffset);
+		if (m_chunk.m_checksum) {
+			TraceSpan span(m_tracer, "verify", "verify chunk");
+			span.SetValue("chunk", m_chunk.m_index);
+			span.SetBytes(m_chunk.m_encodedSize);
+			if (!BlteVerifyChunk(data, m_chunk.m_encodedSize, m_chunk.m_checksum)) {
+				return m_result = span.SetError(NGDP_ERROR_CORRUPT_DATA);
+			}
+		}
+		m_result = m_onChunk(m_chunk, data);
+		if (m_result) {
+			return m_result;
+		}
+		if (--m_remaining) {
+			m_source->Next(&m_chunk);
+		}
+	}
+	return m_result;
+}
+
+int BlteDecode(Heap *h, const Slice<u8> &encoded, int decodedSize, Buffer<u8> *out) {
+	if (encoded.m_size < BlteHeader::kPrefixSize) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	BlteHeader header;
+	if (!header.Init(encoded.m_data, encoded.m_size, encoded.m_size, decodedSize)) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	if (decodedSize == 0) {
+		return NGDP_ERROR_SUCCESS;
+	}
+
+	if (!header.m_table && decodedSize < 0) {
+		const u8 *chunk = encoded.m_data + header.m_headerSize;
+		int chunkSize = encoded.m_size - header.m_headerSize;
+		if (chunk[0] == 'N') {
+			out->Append(h, chunk + 1, chunkSize - 1);
+			return NGDP_ERROR_SUCCESS;
+		} else if (chunk[0] == 'Z') {
+			return inflateAppend(h, chunk + 1, chunkSize - 1, out);
+		}
+		return NGDP_ERROR_UNSUPPORTED_ENCODING;
+	}
+
+	BlteChunk chunk;
+	if (!header.Seek(0, &chunk)) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	do {
+		if (chunk.m_encodedOffset + chunk.m_encodedSize > encoded.m_size) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		const u8 *src = encoded.m_data + chunk.m_encodedOffset;
+		if (chunk.m_checksum && !BlteVerifyChunk(src, chunk.m_encodedSize, chunk.m_checksum)) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		u8 *dst = out->Alloc(h, chunk.m_decodedSize);
+		int err = BlteDecodeChunk(src, chunk.m_encodedSize, dst, chunk.m_decodedSize, nullptr, chunk.m_index);
+		if (err) {
+			return err;
+		}
+	} while (header.Next(&chunk));
+	return NGDP_ERROR_SUCCESS;
+}
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Key.h"
+
+#include <functional>
+
+namespace ngdp {
+
+struct Keyring;
+struct Tracer;
+
+// A BlteChunk describes one chunk of a BLTE-encoded file.  Encoded offsets are
+// relative to the start of the encoded file (including the BLTE header), and
+// decoded offsets are relative to the start of the decoded file.
+struct BlteChunk {
+	int m_index;
+	int m_encodedOffset;
+	int m_encodedSize;
+	int m_decodedOffset;
+	int m_decodedSize;
+	// MD5 of the encoded chunk, pointing into the header's chunk table; null
+	// for a file without a chunk table, whose only check is its encoded key.
+	const u8 *m_checksum;
+};
+
+// BlteHeader is a parsed view of the header at the start of a BLTE-encoded
+// file.  It does not own the header bytes, which must outlive it.
+//
+//   'BLTE' | u32be headerSize | u8 flags | u24be chunkCount | chunkCount * entry
+//   entry = u32be encodedSize | u32be decodedSize | u8 md5[16]
+//
+// A headerSize of zero means there is no chunk table, and everything after
+// the first 8 bytes is a single chunk.
+struct BlteHeader {
+	// Offset of the first chunk's data within the encoded file
+	int m_headerSize;
+	int m_chunkCount;
+	const u8 *m_table;
+	// Total sizes, used for the implicit chunk of a file without a table
+	int m_encodedSize;
+	int m_decodedSize;
+
+	static const int kPrefixSize = 8;
+	static const int kTableEntrySize = 24;
+
+	// Returns the number of bytes at the start of the file needed to parse the
+	// header, or -1 if data is not BLTE.  size must be at least kPrefixSize.
+	static int RequiredSize(const u8 *data, int size);
+
+	// Parses a header from data, which must hold at least RequiredSize bytes.
+	// encodedSize and decodedSize are the file's total sizes if known (-1 if
+	// not); a file without a chunk table needs encodedSize to locate its chunk.
+	// A chunk table whose chunks do not fit in encodedSize, or do not add up
+	// to decodedSize, is rejected.
+	bool Init(const u8 *data, int size, int encodedSize, int decodedSize);
+
+	// Sets chunk to the chunk containing decodedOffset.  Returns false if
+	// decodedOffset is outside the file.
+	bool Seek(int decodedOffset, BlteChunk *chunk) const;
+
+	// Advances chunk to the chunk that follows it.  Returns false after the
+	// last chunk.
+	bool Next(BlteChunk *chunk) const;
+
+	// Returns the largest encoded and decoded chunk sizes.
+	void MaxChunkSizes(int *maxEncoded, int *maxDecoded) const;
+
+private:
+	void LoadEntry(int index, BlteChunk *chunk) const;
+};
+
+// Called by BlteStream with each encoded chunk once it has arrived and been
+// verified.  Returns an NGDP_ERROR code.
+typedef std::function<int(const BlteChunk &chunk, const u8 *data)> BlteChunkFn;
+
+// BlteStream follows consecutive chunks of a BLTE-encoded file as their
+// encoded bytes arrive in a buffer, passing on each chunk as soon as it is
+// whole, so that decoding overlaps the transfer of the chunks after it.
+struct BlteStream {
+	BlteHeader m_header;
+	const BlteHeader *m_source;
+	// The buffer the bytes arrive in, and the encoded offset of its start
+	const u8 *m_encoded;
+	int m_encodedOffset;
+	// The next chunk to pass on, and how many are left
+	BlteChunk m_chunk;
+	int m_remaining;
+	int m_result;
+	BlteChunkFn m_onChunk;
+	// Records the chunk checks if set; Init clears it
+	Tracer *m_tracer;
+
+	// Streams count chunks from first, whose bytes arrive at encoded.
+	void Init(const BlteHeader *header, const BlteChunk &first, int count, const u8 *encoded, const BlteChunkFn &onChunk);
+
+	// Streams a whole file of known sizes arriving at encoded, header first.
+	void InitFile(const u8 *encoded, int encodedSize, int decodedSize, const BlteChunkFn &onChunk);
+
+	// Passes on the chunks that lie within the first received bytes of the
+	// buffer.  Returns an NGDP_ERROR code; once a chunk fails, every later
+	// call returns its error.
+	int Advance(int received);
+
+	bool Done() const {
+		return m_remaining == 0;
+	}
+};
+
+// Checks an encoded chunk against its MD5.
+bool BlteVerifyChunk(const u8 *chunk, int chunkSize, const u8 *checksum);
+
+// Checks a whole encoded file: its header, and each chunk against its
+// checksum.  Sets ekey to the file's encoded key, the MD5 of its chunk table
+// (or of the whole file without one).  Returns an NGDP_ERROR code.
+int BlteVerify(const u8 *data, int size, Key *ekey);
+
+// Decodes one encoded chunk (mode byte followed by payload) into dst, which
+// must be exactly the chunk's decoded size.  An encrypted ('E') chunk is
+// decrypted with its named key from keys (which may be null) and the chunk's
+// index in the file; if the key is not there, dst is zeroed and
+// NGDP_ERROR_MISSING_KEY returned.  Returns an NGDP_ERROR code.
+int BlteDecodeChunk(const u8 *chunk, int chunkSize, u8 *dst, int decodedSize, const Keyring *keys, int chunkIndex);
+
+// Sets name to the key name of an encrypted chunk; returns false for any
+// other chunk.
+bool BlteEncryptedKeyName(const u8 *chunk, int chunkSize, u64 *name);
+
+// Decodes a complete BLTE-encoded file, appending the result to out.
+// decodedSize may be -1 if unknown.  Encrypted chunks cannot be decoded this
+// way.  Returns an NGDP_ERROR code.
+int BlteDecode(Heap *h, const Slice<u8> &encoded, int decodedSize, Buffer<u8> *out);
+
+}
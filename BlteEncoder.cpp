@@ -0,0 +1,233 @@
+#include "BlteEncoder.h"
+#include "Blte.h"
+#include "Bytes.h"
+#include "ngdp.h"
+
+#include <new>
+#include <zlib.h>
+
+namespace ngdp {
+
+// Chunks queued on the pool per worker thread before Write waits; this bounds
+// the decoded data held in copies.
+static const int kPendingChunksPerThread = 2;
+
+BlteEncoder *BlteEncoder::Create(Heap *h, WorkerPool *pool, const Espec *spec) {
+	BlteEncoder *e = new (h->Alloc(sizeof(BlteEncoder))) BlteEncoder();
+	e->Init(h, pool, spec);
+	return e;
+}
+
+void BlteEncoder::Free(BlteEncoder *e) {
+	Heap *h = e->m_heap;
+	e->Destroy();
+	e->~BlteEncoder();
+	h->Free(e);
+}
+
+void BlteEncoder::Init(Heap *h, WorkerPool *pool, const Espec *spec) {
+	m_heap = h;
+	m_pool = pool;
+	m_spec = spec;
+	m_block = 0;
+	m_blockChunks = 0;
+	m_input.Init();
+	m_contentHash.Init();
+	m_decodedSize = 0;
+	m_chunks.Init();
+	m_pending = 0;
+	StartChunk();
+}
+
+void BlteEncoder::Destroy() {
+	Wait(0);
+	for (BlteEncodedChunk *chunk : m_chunks) {
+		chunk->m_data.Destroy(m_heap);
+		m_heap->Free(chunk);
+	}
+	m_chunks.Destroy(m_heap);
+	m_input.Destroy(m_heap);
+}
+
+void BlteEncoder::StartChunk() {
+	if (m_block >= m_spec->m_blocks.m_size) {
+		m_inputTarget = 0;
+		return;
+	}
+	m_inputTarget = m_spec->m_blocks[m_block].m_size;
+	if (m_inputTarget > 0 && m_input.m_capacity < m_inputTarget) {
+		m_input.Destroy(m_heap);
+		m_input.Init(m_heap, m_inputTarget);
+	}
+}
+
+void BlteEncoder::Wait(int pending) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_progress.wait(lock, [&] { return m_pending <= pending; });
+}
+
+static void encodeChunk(Heap *h, const EspecBlock &block, const Buffer<u8> &input, BlteEncodedChunk *chunk) {
+	chunk->m_decodedSize = input.m_size;
+	chunk->m_error = NGDP_ERROR_SUCCESS;
+	if (block.m_codec == 'n') {
+		chunk->m_data.Init(h, 1 + input.m_size);
+		chunk->m_data.m_storage[0] = 'N';
+		if (input.m_size) {
+			memcpy(chunk->m_data.m_storage + 1, input.m_storage, input.m_size);
+		}
+		chunk->m_data.m_size = 1 + input.m_size;
+	} else {
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit2(&zs, block.m_level, Z_DEFLATED, block.m_windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			chunk->m_error = NGDP_ERROR_UNSUPPORTED_ENCODING;
+			chunk->m_data.Init();
+			return;
+		}
+		int bound = 1 + (int)deflateBound(&zs, input.m_size);
+		chunk->m_data.Init(h, bound);
+		chunk->m_data.m_storage[0] = 'Z';
+		zs.next_in = input.m_storage;
+		zs.avail_in = input.m_size;
+		zs.next_out = chunk->m_data.m_storage + 1;
+		zs.avail_out = bound - 1;
+		if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+			chunk->m_error = NGDP_ERROR_UNSUPPORTED_ENCODING;
+		}
+		chunk->m_data.m_size = 1 + (int)zs.total_out;
+		deflateEnd(&zs);
+	}
+	Md5::Sum(chunk->m_data.m_storage, chunk->m_data.m_size, &chunk->m_checksum);
+}
+
+int BlteEncoder::Dispatch() {
+	if (m_block >= m_spec->m_blocks.m_size) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	Wait(m_pool->ThreadCount() * kPendingChunksPerThread - 1);
+
+	BlteEncodedChunk *chunk = (BlteEncodedChunk *)m_heap->Alloc(sizeof(BlteEncodedChunk));
+	m_chunks.Push(m_heap, chunk);
+	EspecBlock block = m_spec->m_blocks[m_block];
+	Buffer<u8> input = m_input;
+	m_input.Init();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending++;
+	}
+	m_pool->Submit([this, block, input, chunk]() mutable {
+		encodeChunk(m_heap, block, input, chunk);
+		input.Destroy(m_heap);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending--;
+		m_progress.notify_all();
+	});
+
+	const EspecBlock &current = m_spec->m_blocks[m_block];
+	m_blockChunks++;
+	if (current.m_size < 0 || (current.m_count >= 0 && m_blockChunks == current.m_count)) {
+		m_block++;
+		m_blockChunks = 0;
+	}
+	StartChunk();
+	return NGDP_ERROR_SUCCESS;
+}
+
+int BlteEncoder::Write(const u8 *data, int size) {
+	m_contentHash.Update(data, size);
+	m_decodedSize += size;
+	while (size > 0) {
+		if (m_inputTarget == 0) {
+			return NGDP_ERROR_INVALID_ARGUMENT;
+		}
+		int n = size;
+		if (m_inputTarget > 0 && n > m_inputTarget - m_input.m_size) {
+			n = m_inputTarget - m_input.m_size;
+		}
+		m_input.Append(m_heap, data, n);
+		data += n;
+		size -= n;
+		if (m_input.m_size == m_inputTarget) {
+			int err = Dispatch();
+			if (err) {
+				return err;
+			}
+		}
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int BlteEncoder::Finish(const BlteWriteFn &write, Key *contentKey, Key *encodedKey, int *encodedSize, s64 *decodedSize) {
+	int err;
+	if (m_input.m_size > 0 || m_chunks.m_size == 0) {
+		if ((err = Dispatch())) {
+			return err;
+		}
+	}
+	Wait(0);
+	s64 total = 0;
+	for (BlteEncodedChunk *chunk : m_chunks) {
+		if (chunk->m_error) {
+			return chunk->m_error;
+		}
+		total += chunk->m_data.m_size;
+	}
+
+	Buffer<u8> header;
+	if (m_spec->m_chunked) {
+		int headerSize = BlteHeader::kPrefixSize + 4 + m_chunks.m_size * BlteHeader::kTableEntrySize;
+		header.Init(m_heap, headerSize);
+		u8 *p = header.m_storage;
+		memcpy(p, "BLTE", 4);
+		StoreBE32(p + 4, headerSize);
+		p[8] = 0x0f;
+		StoreBE24(p + 9, m_chunks.m_size);
+		p += 12;
+		for (BlteEncodedChunk *chunk : m_chunks) {
+			StoreBE32(p, chunk->m_data.m_size);
+			StoreBE32(p + 4, chunk->m_decodedSize);
+			memcpy(p + 8, chunk->m_checksum.k, 16);
+			p += BlteHeader::kTableEntrySize;
+		}
+		header.m_size = headerSize;
+		Md5::Sum(header.m_storage, header.m_size, encodedKey);
+	} else {
+		// Without a chunk table, the encoded key covers the whole file.
+		header.Init(m_heap, BlteHeader::kPrefixSize);
+		memcpy(header.m_storage, "BLTE\0\0\0\0", BlteHeader::kPrefixSize);
+		header.m_size = BlteHeader::kPrefixSize;
+		Md5 md5;
+		md5.Init();
+		md5.Update(header.m_storage, header.m_size);
+		for (BlteEncodedChunk *chunk : m_chunks) {
+			md5.Update(chunk->m_data.m_storage, chunk->m_data.m_size);
+		}
+		md5.Final(encodedKey);
+	}
+	total += header.m_size;
+	if (total > 0x7fffffff) {
+		header.Destroy(m_heap);
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+
+	err = write(header.m_storage, header.m_size);
+	header.Destroy(m_heap);
+	for (BlteEncodedChunk *chunk : m_chunks) {
+		if (err) {
+			break;
+		}
+		err = write(chunk->m_data.m_storage, chunk->m_data.m_size);
+		// Release each chunk as soon as it is written
+		chunk->m_data.Destroy(m_heap);
+		chunk->m_data.Init();
+	}
+	if (err) {
+		return err;
+	}
+	m_contentHash.Final(contentKey);
+	*encodedSize = (int)total;
+	*decodedSize = m_decodedSize;
+	return NGDP_ERROR_SUCCESS;
+}
+
+}
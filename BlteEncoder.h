@@ -0,0 +1,75 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Key.h"
+#include "Md5.h"
+#include "Espec.h"
+#include "WorkerPool.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+
+namespace ngdp {
+
+// An encoded chunk: mode byte followed by payload
+struct BlteEncodedChunk {
+	Buffer<u8> m_data;
+	int m_decodedSize;
+	Key m_checksum;
+	int m_error;
+};
+
+typedef std::function<int(const u8 *data, int size)> BlteWriteFn;
+
+// BlteEncoder splits a file into chunks as its encoding spec describes and
+// encodes the chunks in parallel on a WorkerPool as soon as each is complete.
+// Decoded data is copied only until its chunk is encoded; the encoded chunks
+// are kept until Finish, since the chunk table that precedes them needs their
+// sizes and checksums.
+struct BlteEncoder {
+	Heap *m_heap;
+	WorkerPool *m_pool;
+	// Borrowed from the client's EspecCache
+	const Espec *m_spec;
+
+	// Position in the spec: the block being filled and its chunks so far
+	int m_block;
+	int m_blockChunks;
+	// Decoded bytes of the chunk being filled, and the chunk's size (-1 when
+	// it takes the rest of the file)
+	Buffer<u8> m_input;
+	int m_inputTarget;
+
+	Md5 m_contentHash;
+	s64 m_decodedSize;
+	Buffer<BlteEncodedChunk *> m_chunks;
+
+	// Guards m_pending, which counts chunks queued on the pool
+	std::mutex m_mutex;
+	std::condition_variable m_progress;
+	int m_pending;
+
+	static BlteEncoder *Create(Heap *h, WorkerPool *pool, const Espec *spec);
+	static void Free(BlteEncoder *e);
+
+	// Adds the next size bytes of the decoded file.  Returns an NGDP_ERROR
+	// code; NGDP_ERROR_INVALID_ARGUMENT if the spec's blocks are exhausted.
+	int Write(const u8 *data, int size);
+
+	// Encodes the remaining data and passes the complete encoded file to
+	// write, header first.  Sets the file's content and encoded keys and
+	// sizes.
+	int Finish(const BlteWriteFn &write, Key *contentKey, Key *encodedKey, int *encodedSize, s64 *decodedSize);
+
+private:
+	void Init(Heap *h, WorkerPool *pool, const Espec *spec);
+	void Destroy();
+	void StartChunk();
+	int Dispatch();
+	void Wait(int pending);
+};
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "std.h"
+
+namespace ngdp {
+
+// Fixed-width integer loads and stores for the on-disk and on-wire formats.
+// NGDP formats mix big-endian (BLTE, encoding, CDN indexes) and little-endian
+// (CASC .idx and data headers) fields, so the byte order is always explicit.
+
+inline u16 LoadBE16(const u8 *p) {
+	return (u16)((p[0] << 8) | p[1]);
+}
+
+inline u32 LoadBE24(const u8 *p) {
+	return ((u32)p[0] << 16) | ((u32)p[1] << 8) | (u32)p[2];
+}
+
+inline u32 LoadBE32(const u8 *p) {
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | (u32)p[3];
+}
+
+inline u64 LoadBE40(const u8 *p) {
+	return ((u64)p[0] << 32) | (u64)LoadBE32(p + 1);
+}
+
+inline u64 LoadBE64(const u8 *p) {
+	return ((u64)LoadBE32(p) << 32) | (u64)LoadBE32(p + 4);
+}
+
+inline u16 LoadLE16(const u8 *p) {
+	return (u16)(p[0] | (p[1] << 8));
+}
+
+inline u32 LoadLE32(const u8 *p) {
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+inline u64 LoadLE64(const u8 *p) {
+	return (u64)LoadLE32(p) | ((u64)LoadLE32(p + 4) << 32);
+}
+
+inline void StoreBE16(u8 *p, u16 v) {
+	p[0] = (u8)(v >> 8);
+	p[1] = (u8)v;
+}
+
+inline void StoreBE24(u8 *p, u32 v) {
+	p[0] = (u8)(v >> 16);
+	p[1] = (u8)(v >> 8);
+	p[2] = (u8)v;
+}
+
+inline void StoreBE32(u8 *p, u32 v) {
+	p[0] = (u8)(v >> 24);
+	p[1] = (u8)(v >> 16);
+	p[2] = (u8)(v >> 8);
+	p[3] = (u8)v;
+}
+
+inline void StoreBE40(u8 *p, u64 v) {
+	p[0] = (u8)(v >> 32);
+	StoreBE32(p + 1, (u32)v);
+}
+
+inline void StoreLE16(u8 *p, u16 v) {
+	p[0] = (u8)v;
+	p[1] = (u8)(v >> 8);
+}
+
+inline void StoreLE32(u8 *p, u32 v) {
+	p[0] = (u8)v;
+	p[1] = (u8)(v >> 8);
+	p[2] = (u8)(v >> 16);
+	p[3] = (u8)(v >> 24);
+}
+
+inline void StoreLE64(u8 *p, u64 v) {
+	StoreLE32(p, (u32)v);
+	StoreLE32(p + 4, (u32)(v >> 32));
+}
+
+}
@@ -0,0 +1,596 @@
+#include "CascWriter.h"
+#include "Bytes.h"
+#include "Client.h"
+
+#include <stdarg.h>
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#define _heap &m_client->m_heap
+
+namespace ngdp {
+
+// Takes the installation's write lock without waiting.  The OS drops it when
+// the process exits, so a crashed writer leaves nothing to clean up.
+#ifdef _WIN32
+
+static bool lockInstallation(const char *path, uptr *lock) {
+	HANDLE f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (f == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	OVERLAPPED o;
+	memset(&o, 0, sizeof(o));
+	if (!LockFileEx(f, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &o)) {
+		CloseHandle(f);
+		return false;
+	}
+	*lock = (uptr)f;
+	return true;
+}
+
+static void unlockInstallation(uptr lock) {
+	CloseHandle((HANDLE)lock);
+}
+
+#else
+
+static bool lockInstallation(const char *path, uptr *lock) {
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB)) {
+		close(fd);
+		return false;
+	}
+	*lock = (uptr)fd;
+	return true;
+}
+
+static void unlockInstallation(uptr lock) {
+	close((int)lock);
+}
+
+#endif
+
+CascWriter *CascWriter::Create(Client *c) {
+	// Another process's writer would append at the offsets this one does,
+	// and remove the .idx versions it publishes.
+	StackBuffer<u8, 256> path;
+	path.Init();
+	path.Append(&c->m_heap, c->m_local->m_path.m_storage, c->m_local->m_dataPathSize);
+	path.Append(&c->m_heap, (const u8 *)".lock", 6);
+	uptr lock;
+	bool locked = lockInstallation((const char *)path.m_storage, &lock);
+	path.Destroy(&c->m_heap);
+	if (!locked) {
+		c->Log("Another process is writing to %s; files will not be stored there", c->m_cascPath);
+		return nullptr;
+	}
+	CascWriter *w = new (c->m_heap.Alloc(sizeof(CascWriter))) CascWriter();
+	w->m_lockFile = lock;
+	w->Init(c);
+	return w;
+}
+
+void CascWriter::Free(CascWriter *w) {
+	if (w) {
+		Heap h = w->m_client->m_heap;
+		w->Destroy();
+		unlockInstallation(w->m_lockFile);
+		w->~CascWriter();
+		h.Free(w);
+	}
+}
+
+void CascWriter::Init(Client *c) {
+	m_client = c;
+	m_queue.Init();
+	m_committing = false;
+	m_dataFile = nullptr;
+	m_path.Init();
+	m_path.Append(_heap, c->m_local->m_path.m_storage, c->m_local->m_dataPathSize);
+
+	// Continue the archive with the highest number, after its last indexed
+	// record.
+	const LocalStorage &local = *c->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	m_archive = 0;
+	m_archiveSize = 0;
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		const Buffer<u8> &entries = local.Entries(b);
+		for (int i = 0; i + entrySize <= entries.m_size; i += entrySize) {
+			const u8 *e = entries.m_storage + i;
+			u64 location = LoadBE40(e + local.m_keyBytes);
+			int archive = (int)(location >> local.m_offsetBits);
+			s64 end = (s64)(location & ((1ull << local.m_offsetBits) - 1)) + LoadLE32(e + local.m_keyBytes + local.m_offsetBytes);
+			if (archive > m_archive || (archive == m_archive && end > m_archiveSize)) {
+				m_archive = archive;
+				m_archiveSize = end;
+			}
+		}
+	}
+}
+
+void CascWriter::Destroy() {
+	if (m_dataFile) {
+		m_client->m_file.Close(m_dataFile);
+	}
+	m_queue.Destroy(_heap);
+	m_path.Destroy(_heap);
+}
+
+const char *CascWriter::Path(const char *fmt, ...) {
+	m_path.m_size = m_client->m_local->m_dataPathSize;
+	char *dst = (char *)m_path.Alloc(_heap, 64);
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(dst, 64, fmt, args);
+	va_end(args);
+	return (const char *)m_path.m_storage;
+}
+
+int CascWriter::Store(const Key &ekey, const u8 *data, int size) {
+	// Includes waiting for another thread's commit to take this file
+	TraceSpan span(Client::CurrentTracer(m_client), "disk", "store");
+	span.SetKey("ekey", ekey);
+	span.SetBytes(size);
+	Request req;
+	req.m_ekey = ekey;
+	req.m_data = data;
+	req.m_size = size;
+	req.m_result = NGDP_ERROR_SUCCESS;
+	req.m_done = false;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_queue.Push(_heap, &req);
+	while (!req.m_done) {
+		if (m_committing) {
+			m_committed.wait(lock);
+			continue;
+		}
+		// Lead the next commit with everything queued so far.
+		m_committing = true;
+		Buffer<Request *> batch = m_queue;
+		m_queue.Init();
+		lock.unlock();
+		{
+			TraceSpan commitSpan(Client::CurrentTracer(m_client), "disk", "commit");
+			commitSpan.SetValue("files", batch.m_size);
+			Commit(&batch);
+		}
+		lock.lock();
+		for (Request *r : batch) {
+			r->m_done = true;
+		}
+		batch.Destroy(_heap);
+		m_committing = false;
+		m_committed.notify_all();
+	}
+	return span.SetError(req.m_result);
+}
+
+int CascWriter::Drop(const u8 *entries, int count) {
+	const LocalStorage &local = *m_client->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	Buffer<u8> dropped[LocalStorage::kBucketCount];
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		dropped[b].Init();
+	}
+	for (int i = 0; i < count; i++) {
+		const u8 *e = entries + i * entrySize;
+		Key key;
+		memset(key.k, 0, 16);
+		memcpy(key.k, e, local.m_keyBytes);
+		dropped[LocalStorage::Bucket(key)].Append(_heap, e, entrySize);
+	}
+
+	TakeTurn();
+	int err = NGDP_ERROR_SUCCESS;
+	Buffer<u8> none;
+	none.Init();
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		Buffer<u8> &d = dropped[b];
+		if (!err && d.m_size) {
+			int n = d.m_size / entrySize;
+			Buffer<int> order;
+			order.Init(_heap, n);
+			for (int i = 0; i < n; i++) {
+				order.Push(_heap, i);
+			}
+			std::sort(order.begin(), order.end(), [&](int x, int y) {
+				return memcmp(d.m_storage + x * entrySize, d.m_storage + y * entrySize, entrySize) < 0;
+			});
+			Buffer<u8> sorted;
+			sorted.Init(_heap, d.m_size);
+			for (int i : order) {
+				sorted.Append(_heap, d.m_storage + i * entrySize, entrySize);
+			}
+			order.Destroy(_heap);
+			err = PublishBucket(b, &none, &sorted);
+			sorted.Destroy(_heap);
+		}
+		d.Destroy(_heap);
+	}
+	EndTurn();
+	return err;
+}
+
+void CascWriter::TakeTurn() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_committing) {
+		m_committed.wait(lock);
+	}
+	m_committing = true;
+}
+
+void CascWriter::EndTurn() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_committing = false;
+	m_committed.notify_all();
+}
+
+void CascWriter::UsedArchives(bool *used) {
+	const LocalStorage &local = *m_client->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	memset(used, 0, 256 * sizeof(bool));
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		const Buffer<u8> &entries = local.Entries(b);
+		for (int i = 0; i + entrySize <= entries.m_size; i += entrySize) {
+			u64 archive = LoadBE40(entries.m_storage + i + local.m_keyBytes) >> local.m_offsetBits;
+			if (archive < 256) {
+				used[archive] = true;
+			}
+		}
+	}
+	used[m_archive] = true;
+}
+
+int CascWriter::NextArchive() {
+	bool used[256];
+	UsedArchives(used);
+	for (int archive = 0; archive < 256; archive++) {
+		if (used[archive]) {
+			continue;
+		}
+		// A file nothing points to may still be read by a reader that
+		// looked it up earlier; Retire removes it once none can be.
+		void *f = m_client->m_file.Open(Path("data.%03d", archive), "rb");
+		if (!f) {
+			return archive;
+		}
+		m_client->m_file.Close(f);
+	}
+	return -1;
+}
+
+int CascWriter::Seal(const int *archives, int count) {
+	TakeTurn();
+	int err = NGDP_ERROR_SUCCESS;
+	bool current = false;
+	for (int i = 0; i < count; i++) {
+		current = current || archives[i] == m_archive;
+	}
+	if (current && m_archiveSize > 0) {
+		int next = NextArchive();
+		if (next < 0 || (m_dataFile && m_client->m_file.Sync(m_dataFile))) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+		} else {
+			if (m_dataFile) {
+				m_client->m_file.Close(m_dataFile);
+				m_dataFile = nullptr;
+			}
+			m_archive = next;
+			m_archiveSize = 0;
+		}
+	}
+	EndTurn();
+	return err;
+}
+
+// Returns the entry in entries with entry's key, or null.
+static const u8 *findEntry(const Buffer<u8> &entries, const u8 *entry, int keyBytes, int entrySize) {
+	int lo = 0;
+	int hi = entries.m_size / entrySize;
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) >> 1);
+		const u8 *e = entries.m_storage + mid * entrySize;
+		int cmp = memcmp(e, entry, keyBytes);
+		if (cmp == 0) {
+			return e;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return nullptr;
+}
+
+int CascWriter::Relocate(Buffer<Request *> *batch, const u8 *oldEntries) {
+	const LocalStorage &local = *m_client->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	TakeTurn();
+	int err = Append(batch);
+	Buffer<u8> added[LocalStorage::kBucketCount];
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		added[b].Init();
+	}
+	for (int i = 0; !err && i < batch->m_size; i++) {
+		Request *r = (*batch)[i];
+		const u8 *old = oldEntries + i * entrySize;
+		int bucket = LocalStorage::Bucket(r->m_ekey);
+		// A file dropped or stored again meanwhile is left as it is; its
+		// new copy is never indexed.
+		const u8 *current = findEntry(local.Entries(bucket), old, local.m_keyBytes, entrySize);
+		if (!current || memcmp(current, old, entrySize) != 0) {
+			continue;
+		}
+		u8 *e = added[bucket].Alloc(_heap, entrySize);
+		memcpy(e, old, local.m_keyBytes);
+		StoreBE40(e + local.m_keyBytes, ((u64)r->m_archive << local.m_offsetBits) | (u64)r->m_offset);
+		StoreLE32(e + local.m_keyBytes + local.m_offsetBytes, LocalStorage::kRecordHeaderSize + r->m_size);
+	}
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		if (!err && added[b].m_size) {
+			err = PublishBucket(b, &added[b], nullptr);
+		}
+		added[b].Destroy(_heap);
+	}
+	EndTurn();
+	for (Request *r : *batch) {
+		r->m_result = err;
+	}
+	return err;
+}
+
+int CascWriter::Retire(const int *archives, int count, int *removed) {
+	*removed = 0;
+	TakeTurn();
+	bool used[256];
+	UsedArchives(used);
+	// Nothing can look up a record in the unused archives any more, but
+	// reads that did so earlier may still be running.
+	LocalStorage &local = *m_client->m_local;
+	local.WaitForReaders();
+	int err = NGDP_ERROR_SUCCESS;
+	for (int i = 0; i < count; i++) {
+		int archive = archives[i];
+		if (archive < 0 || archive >= 256 || used[archive]) {
+			continue;
+		}
+		local.CloseArchive(archive);
+		if (m_client->m_file.Remove(Path("data.%03d", archive))) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+		} else {
+			++*removed;
+		}
+	}
+	EndTurn();
+	return err;
+}
+
+bool CascWriter::OpenArchive(int archive) {
+	if (m_dataFile) {
+		m_client->m_file.Close(m_dataFile);
+		m_dataFile = nullptr;
+	}
+	const char *path = Path("data.%03d", archive);
+	m_dataFile = m_client->m_file.Open(path, "r+b");
+	if (!m_dataFile) {
+		m_dataFile = m_client->m_file.Open(path, "w+b");
+	}
+	return m_dataFile != nullptr;
+}
+
+void CascWriter::Commit(Buffer<Request *> *batch) {
+	// Drop files that are already stored or repeated within the batch.
+	Buffer<Request *> pending;
+	pending.Init();
+	for (int i = 0; i < batch->m_size; i++) {
+		Request *r = (*batch)[i];
+		LocalIndexEntry entry;
+		bool skip = m_client->m_local->Find(r->m_ekey, &entry);
+		for (int j = 0; j < i && !skip; j++) {
+			skip = (*batch)[j]->m_ekey == r->m_ekey;
+		}
+		if (!skip) {
+			pending.Push(_heap, r);
+		}
+	}
+	if (pending.m_size == 0) {
+		pending.Destroy(_heap);
+		return;
+	}
+
+	int err = Append(&pending);
+
+	// Group the new index entries by bucket and publish each bucket once.
+	const LocalStorage &local = *m_client->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	Buffer<u8> added[LocalStorage::kBucketCount];
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		added[b].Init();
+	}
+	if (!err) {
+		for (Request *r : pending) {
+			u8 *e = added[LocalStorage::Bucket(r->m_ekey)].Alloc(_heap, entrySize);
+			memcpy(e, r->m_ekey.k, local.m_keyBytes);
+			StoreBE40(e + local.m_keyBytes, ((u64)r->m_archive << local.m_offsetBits) | (u64)r->m_offset);
+			StoreLE32(e + local.m_keyBytes + local.m_offsetBytes, LocalStorage::kRecordHeaderSize + r->m_size);
+		}
+	}
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		if (!err && added[b].m_size) {
+			err = PublishBucket(b, &added[b], nullptr);
+		}
+		added[b].Destroy(_heap);
+	}
+	if (err) {
+		m_client->Log("Unable to store %d files in local storage (%d)", pending.m_size, err);
+		for (Request *r : pending) {
+			r->m_result = err;
+		}
+	}
+	pending.Destroy(_heap);
+}
+
+int CascWriter::Append(Buffer<Request *> *batch) {
+	const LocalStorage &local = *m_client->m_local;
+	s64 limit = (s64)1 << local.m_offsetBits;
+	if (local.m_archiveSizeLimit && (s64)local.m_archiveSizeLimit < limit) {
+		limit = (s64)local.m_archiveSizeLimit;
+	}
+	if (!m_dataFile && !OpenArchive(m_archive)) {
+		return NGDP_ERROR_FILE_READ_FAILED;
+	}
+	FileIO &file = m_client->m_file;
+	if (file.Seek(m_dataFile, (long)m_archiveSize, SEEK_SET)) {
+		return NGDP_ERROR_FILE_READ_FAILED;
+	}
+	for (Request *r : *batch) {
+		s64 recordSize = LocalStorage::kRecordHeaderSize + (s64)r->m_size;
+		if (m_archiveSize + recordSize > limit) {
+			// Finish this archive and start the next one.
+			int next = NextArchive();
+			if (file.Sync(m_dataFile) || next < 0 || !OpenArchive(next)) {
+				return NGDP_ERROR_FILE_READ_FAILED;
+			}
+			m_archive = next;
+			m_archiveSize = 0;
+			if (recordSize > limit) {
+				return NGDP_ERROR_INVALID_ARGUMENT;
+			}
+		}
+		// Record header: key bytes reversed | u32le size | u16 flags |
+		// u32 checksums
+		u8 header[LocalStorage::kRecordHeaderSize];
+		memset(header, 0, sizeof(header));
+		for (int i = 0; i < 16; i++) {
+			header[i] = r->m_ekey.k[15 - i];
+		}
+		StoreLE32(header + 16, (u32)recordSize);
+		if (file.Write(header, 1, sizeof(header), m_dataFile) != sizeof(header) ||
+			file.Write((void *)r->m_data, 1, r->m_size, m_dataFile) != (size_t)r->m_size) {
+			return NGDP_ERROR_FILE_READ_FAILED;
+		}
+		r->m_archive = m_archive;
+		r->m_offset = (int)m_archiveSize;
+		m_archiveSize += recordSize;
+	}
+	// The one sync for the whole batch
+	if (file.Sync(m_dataFile)) {
+		return NGDP_ERROR_FILE_READ_FAILED;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int CascWriter::PublishBucket(int bucket, Buffer<u8> *added, const Buffer<u8> *dropped) {
+	LocalStorage &local = *m_client->m_local;
+	int keyBytes = local.m_keyBytes;
+	int entrySize = keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+
+	// Sort the new entries, then merge them with the current ones; a new
+	// entry replaces an old one with the same key.
+	int addedCount = added->m_size / entrySize;
+	Buffer<int> order;
+	order.Init(_heap, addedCount > 0 ? addedCount : 1);
+	for (int i = 0; i < addedCount; i++) {
+		order.Push(_heap, i);
+	}
+	const u8 *newEntries = added->m_storage;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return memcmp(newEntries + a * entrySize, newEntries + b * entrySize, keyBytes) < 0;
+	});
+	const Buffer<u8> &old = local.Entries(bucket);
+	int oldCount = old.m_size / entrySize;
+	int droppedCount = dropped ? dropped->m_size / entrySize : 0;
+	Buffer<u8> merged;
+	merged.Init(_heap, old.m_size + added->m_size);
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	while (i < oldCount || j < addedCount) {
+		const u8 *a = i < oldCount ? old.m_storage + i * entrySize : nullptr;
+		const u8 *b = j < addedCount ? newEntries + order[j] * entrySize : nullptr;
+		int cmp = !a ? 1 : !b ? -1 : memcmp(a, b, keyBytes);
+		if (cmp < 0) {
+			while (k < droppedCount && memcmp(dropped->m_storage + k * entrySize, a, entrySize) < 0) {
+				k++;
+			}
+			if (k == droppedCount || memcmp(dropped->m_storage + k * entrySize, a, entrySize) != 0) {
+				merged.Append(_heap, a, entrySize);
+			}
+			i++;
+			continue;
+		}
+		if (cmp == 0) {
+			i++;
+		}
+		// The last of several new entries with one key wins
+		while (j + 1 < addedCount && memcmp(b, newEntries + order[j + 1] * entrySize, keyBytes) == 0) {
+			b = newEntries + order[++j] * entrySize;
+		}
+		merged.Append(_heap, b, entrySize);
+		j++;
+	}
+	order.Destroy(_heap);
+
+	u8 header[LocalStorage::kIndexEntriesOffset];
+	memset(header, 0, sizeof(header));
+	StoreLE32(header, 0x10);
+	StoreLE16(header + 8, 7);
+	header[10] = (u8)bucket;
+	header[12] = (u8)local.m_sizeBytes;
+	header[13] = (u8)local.m_offsetBytes;
+	header[14] = (u8)keyBytes;
+	header[15] = (u8)local.m_offsetBits;
+	StoreLE64(header + 16, local.m_archiveSizeLimit);
+	StoreLE32(header + 0x20, merged.m_size);
+
+	FileIO &file = m_client->m_file;
+	int version = local.m_bucketVersions[bucket] + 1;
+	int err = NGDP_ERROR_SUCCESS;
+	// The temporary name is not BBVVVVVVVV.idx, so readers ignore it.
+	void *f = file.Open(Path("%02x%08x.idx.tmp", bucket, version), "wb");
+	if (!f) {
+		err = NGDP_ERROR_FILE_READ_FAILED;
+	} else {
+		bool ok = file.Write(header, 1, sizeof(header), f) == sizeof(header) &&
+			file.Write(merged.m_storage, 1, merged.m_size, f) == (size_t)merged.m_size &&
+			file.Sync(f) == 0;
+		if (file.Close(f) || !ok) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+		}
+	}
+	if (!err) {
+		StackBuffer<u8, 512> target;
+		target.Init();
+		const char *name = Path("%02x%08x.idx", bucket, version);
+		target.Append(_heap, (const u8 *)name, (int)strlen(name) + 1);
+		if (file.Rename(Path("%02x%08x.idx.tmp", bucket, version), (const char *)target.m_storage)) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+		}
+		target.Destroy(_heap);
+	}
+	if (err) {
+		file.Remove(Path("%02x%08x.idx.tmp", bucket, version));
+		merged.Destroy(_heap);
+		return err;
+	}
+	file.Remove(Path("%02x%08x.idx", bucket, version - 1));
+	local.ReplaceBucket(bucket, version, &merged);
+	return NGDP_ERROR_SUCCESS;
+}
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Key.h"
+
+#include <condition_variable>
+#include <mutex>
+
+namespace ngdp {
+
+struct Client;
+
+// CascWriter stores encoded files in the local CASC installation.  Records
+// are only ever appended to the newest data.NNN archive, and each touched
+// bucket's .idx is republished as a new version: it is written under a
+// temporary name, synced, and renamed into place, so a reader listing the
+// directory sees either the old or the new version, never a partial one.
+//
+// Stores from many threads are group-committed: the first caller to find no
+// commit running takes every queued request as one batch, appends them all,
+// syncs the archive once and publishes each touched bucket once, while later
+// callers queue for the next batch.
+//
+// New archives take the lowest number that is free, so numbers emptied by
+// compaction are used again.
+//
+// Only one process writes to an installation: the writer holds an exclusive
+// lock on Data/data/.lock while it lives, and Create fails if another process
+// has it.  The record header and .idx checksums are written as zero.
+struct CascWriter {
+	struct Request {
+		Key m_ekey;
+		const u8 *m_data;
+		int m_size;
+		int m_result;
+		bool m_done;
+		// Set while committing: the record's archive location
+		int m_archive;
+		int m_offset;
+	};
+
+	Client *m_client;
+	// The open Data/data/.lock: a HANDLE on Windows, a descriptor elsewhere
+	uptr m_lockFile;
+
+	std::mutex m_mutex;
+	std::condition_variable m_committed;
+	Buffer<Request *> m_queue;
+	bool m_committing;
+
+	// Held through a garbage collection, which can take a while, and while
+	// a shared store's list of retained builds is read or changed, so that
+	// collections run one at a time and builds are not retained during one
+	// that would not keep their files
+	std::mutex m_collectMutex;
+
+	// Only used by the committing thread:
+	// The archive being appended to, its indexed size and open handle
+	int m_archive;
+	s64 m_archiveSize;
+	void *m_dataFile;
+	Buffer<u8> m_path;
+
+	// Returns null, so the installation is only read, if another process is
+	// writing to it.
+	static CascWriter *Create(Client *c);
+	static void Free(CascWriter *w);
+
+	// Stores the encoded file ekey, returning once it is durable and
+	// indexed.  data is not copied and must stay valid until Store returns.
+	// A file that is already stored is skipped.
+	int Store(const Key &ekey, const u8 *data, int size);
+
+	// Removes index entries, given as count whole .idx entries, so that
+	// their files are no longer found locally.  An entry that has changed
+	// since it was read (because the file was stored again) is kept.  The
+	// records stay in their archives.
+	int Drop(const u8 *entries, int count);
+
+	// If records are being appended to one of the count archives, finishes
+	// it, so later records go to a fresh archive.
+	int Seal(const int *archives, int count);
+
+	// Appends the batch's files as Store does, and points each one's index
+	// entry at its new record if the entry still equals the matching whole
+	// entry in oldEntries.  Used to move files out of archives.
+	int Relocate(Buffer<Request *> *batch, const u8 *oldEntries);
+
+	// Removes those of the count archives that no index entry points to,
+	// once the reads that may have looked them up have finished, and sets
+	// removed to how many were.
+	int Retire(const int *archives, int count, int *removed);
+
+private:
+	void Init(Client *c);
+	void Destroy();
+	// Waits for the running commit, then commits work other than stores.
+	void TakeTurn();
+	void EndTurn();
+	// Marks the archives the index points to in used.
+	void UsedArchives(bool *used);
+	// The lowest archive number that is not in use and has no file, or -1.
+	int NextArchive();
+	void Commit(Buffer<Request *> *batch);
+	int Append(Buffer<Request *> *batch);
+	// Publishes bucket with added entries merged in and the sorted dropped
+	// entries (which may be null) left out.
+	int PublishBucket(int bucket, Buffer<u8> *added, const Buffer<u8> *dropped);
+	bool OpenArchive(int archive);
+	const char *Path(const char *fmt, ...);
+};
+
+}
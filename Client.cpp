@@ -1,5 +1,7 @@
 #include "Client.h"
 #include "Buffer.h"
+#include "Blte.h"
+#include "Md5.h"
 
 #include <curl/curl.h>
 
@@ -7,25 +9,55 @@ namespace ngdp {
 
 static thread_local Client *threadCurrentClient;
 
-struct ScopedCurrentClient {
-	ScopedCurrentClient(Client *c) {
-		threadCurrentClient = c;
-	}
+ScopedCurrentClient::ScopedCurrentClient(Client *c) : m_deadline(c->m_remote.Deadline()) {
+	m_previous = threadCurrentClient;
+	threadCurrentClient = c;
+}
 
-	~ScopedCurrentClient() {
-		threadCurrentClient = nullptr;
-	}
-};
+ScopedCurrentClient::~ScopedCurrentClient() {
+	threadCurrentClient = m_previous;
+}
 
 struct DownloadContext {
 	Heap *m_heap;
 	Buffer<u8> m_buffer;
 	bool m_bufferTooSmall;
+	// Reports received bytes to Remote, for hedging and resuming
+	DownloadProgress *m_progress;
+	CURL *m_req;
+	bool m_ranged;
+	// Status of the response, once its body starts
+	int m_status;
 };
 
+static int DownloadUrlProgressCallback(void *ctx, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+	DownloadContext *d = (DownloadContext *)ctx;
+	// Non-zero aborts the transfer
+	return d->m_progress->m_cancelled.load() ? 1 : 0;
+}
+
 static size_t DownloadUrlWriteCallback(char *buf, size_t size, size_t nmemb, void *ctx) {
 	DownloadContext *d = (DownloadContext *)ctx;
 	int downloadSize = (int)(size * nmemb);
+	if (!d->m_status) {
+		long status = 0;
+		curl_easy_getinfo(d->m_req, CURLINFO_RESPONSE_CODE, &status);
+		d->m_status = (int)status;
+		double contentLength = -1;
+		curl_easy_getinfo(d->m_req, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &contentLength);
+		// Only the body of the response asked for can be resumed: not an
+		// error page, nor a whole file sent in answer to a range.
+		if (d->m_progress && d->m_status == (d->m_ranged ? 206 : 200)) {
+			d->m_progress->m_expected.store(contentLength >= 0 ? (int)contentLength : -1);
+		}
+		// Allocate the whole body at once rather than growing into it.
+		if (d->m_heap && contentLength > 0 && contentLength <= 0x7fffffff) {
+			d->m_buffer.Init(d->m_heap, (int)contentLength);
+		}
+	}
+	if (d->m_progress && d->m_progress->m_cancelled.load()) {
+		return 0;
+	}
 	if (d->m_heap) {
 		u8 *dst = d->m_buffer.Alloc(d->m_heap, downloadSize);
 		memcpy(dst, buf, downloadSize);
@@ -39,6 +71,10 @@ static size_t DownloadUrlWriteCallback(char *buf, size_t size, size_t nmemb, voi
 			d->m_buffer.m_size += downloadSize;
 		}
 	}
+	// Reported once the bytes are in place, so a sink may decode them
+	if (d->m_progress && d->m_status == (d->m_ranged ? 206 : 200) && downloadSize > 0) {
+		d->m_progress->Received(d->m_progress->m_received.load() + downloadSize);
+	}
 	return size * nmemb;
 }
 
@@ -47,6 +83,9 @@ static int DownloadUrl(const char *url, int rangeStart, int rangeEnd, u8 **buffe
 	ctx.m_heap = nullptr;
 	ctx.m_buffer.Init();
 	ctx.m_bufferTooSmall = false;
+	ctx.m_progress = CurrentDownloadProgress();
+	ctx.m_ranged = rangeEnd > rangeStart && rangeEnd > 0;
+	ctx.m_status = 0;
 
 	Client *client = threadCurrentClient;
 	client->Log("Downloading from %s [%d, %d)", url, rangeStart, rangeEnd);
@@ -60,10 +99,28 @@ static int DownloadUrl(const char *url, int rangeStart, int rangeEnd, u8 **buffe
 		}
 	}
 
+	s64 deadline = CurrentDownloadDeadline();
+	long timeoutMs = 0;
+	if (deadline) {
+		timeoutMs = (long)((deadline - MonotonicMicros()) / 1000);
+		if (timeoutMs <= 0) {
+			return NGDP_DOWNLOAD_SERVER_ERROR;
+		}
+	}
+
 	CURL *req = curl_easy_init();
+	ctx.m_req = req;
 	curl_easy_setopt(req, CURLOPT_URL, url);
+	if (timeoutMs) {
+		curl_easy_setopt(req, CURLOPT_TIMEOUT_MS, timeoutMs);
+	}
 	curl_easy_setopt(req, CURLOPT_WRITEFUNCTION, DownloadUrlWriteCallback);
 	curl_easy_setopt(req, CURLOPT_WRITEDATA, &ctx);
+	if (ctx.m_progress) {
+		curl_easy_setopt(req, CURLOPT_XFERINFOFUNCTION, DownloadUrlProgressCallback);
+		curl_easy_setopt(req, CURLOPT_XFERINFODATA, &ctx);
+		curl_easy_setopt(req, CURLOPT_NOPROGRESS, 0L);
+	}
 	if (!buffer) {
 		curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 	}
@@ -74,7 +131,12 @@ static int DownloadUrl(const char *url, int rangeStart, int rangeEnd, u8 **buffe
 	}
 	CURLcode res = curl_easy_perform(req);
 	if (res != CURLE_OK) {
-		// Usually a connection failure:
+		// Usually a connection failure.  Hand back what was received, so
+		// the download can resume from it.
+		if (buffer && !*buffer) {
+			*buffer = ctx.m_buffer.m_storage;
+			*bufferSize = ctx.m_buffer.m_size;
+		}
 		curl_easy_cleanup(req);
 		return NGDP_DOWNLOAD_SERVER_ERROR;
 	}
@@ -109,10 +171,19 @@ static int DownloadUrl(const char *url, int rangeStart, int rangeEnd, u8 **buffe
 	return 0;
 }
 
+// Used for custom file callbacks without fsyncFn; the callbacks' streams are
+// opaque, so nothing more can be done.
+static int SkipSync(void *stream) {
+	UNUSED(stream);
+	return 0;
+}
+
 void Client::Init(ngdpConfig *config) {
 	ScopedCurrentClient _c(this);
+	m_lazy = new (m_heap.Alloc(sizeof(LazyLoadMutexes))) LazyLoadMutexes();
 
 	bool useFileCallbacks = config->fopenFn || config->fseekFn || config->freadFn || config->fwriteFn || config->fcloseFn;
+	m_file.InitStdio();
 	if (useFileCallbacks) {
 		if (!(config->fopenFn && config->fseekFn && config->freadFn && config->fwriteFn && config->fcloseFn)) {
 			config->errorDetail = "All file callbacks must be set if any are set.";
@@ -124,12 +195,24 @@ void Client::Init(ngdpConfig *config) {
 		m_file.m_fread = config->freadFn;
 		m_file.m_fwrite = config->fwriteFn;
 		m_file.m_fclose = config->fcloseFn;
+		m_file.m_sync = config->fsyncFn ? config->fsyncFn : SkipSync;
+		m_file.m_freadAt = config->freadAtFn;
 	} else {
-		m_file.m_fopen = (ngdpFileOpenFn)fopen;
-		m_file.m_fseek = (ngdpFileSeekFn)fseek;
-		m_file.m_fread = (ngdpFileReadFn)fread;
-		m_file.m_fwrite = (ngdpFileWriteFn)fwrite;
-		m_file.m_fclose = (ngdpFileCloseFn)fclose;
+		if (config->fsyncFn) {
+			m_file.m_sync = config->fsyncFn;
+		}
+		if (config->freadAtFn) {
+			m_file.m_freadAt = config->freadAtFn;
+		}
+	}
+	if (config->renameFn) {
+		m_file.m_rename = config->renameFn;
+	}
+	if (config->removeFn) {
+		m_file.m_remove = config->removeFn;
+	}
+	if (config->listDirectoryFn) {
+		m_file.m_listDir = config->listDirectoryFn;
 	}
 	m_log = config->logFn;
 	if (m_log) {
@@ -146,14 +229,616 @@ void Client::Init(ngdpConfig *config) {
 		m_download = DownloadUrl;
 	}
 
-	m_remote.Init(this, config->httpRetryCount, config->ngdpUrl, config->gameUid, config->ngdpRegion);
+	m_remote.Init(this, config);
+
+	m_store = (Client *)config->sharedStore;
+	if (m_store && m_store->m_store) {
+		m_store = m_store->m_store;
+	}
+	if (m_store) {
+		// Files are found in and stored to the store's installation.
+		m_cascPath = m_store->m_cascPath;
+		m_hasLocal = m_store->m_hasLocal;
+		m_local = &m_store->m_ownLocal;
+		m_writer = m_store->m_writer;
+	} else {
+		m_cascPath = config->cascPath;
+		m_local = &m_ownLocal;
+		if (m_cascPath) {
+			m_hasLocal = m_ownLocal.Init(this, m_cascPath);
+		}
+		m_writer = m_hasLocal ? CascWriter::Create(this) : nullptr;
+	}
+	m_especCache.Init();
+	m_especPlans.Init();
+	m_archiveIndex.Init();
+	m_patchArchiveIndex.Init();
+	m_patchManifest.Init();
+	m_cost.Init();
+	m_snapshot.Init();
+	m_cache = config->decodedCacheSize > 0 ? DecodedCache::Create(this, config->decodedCacheSize) : nullptr;
+	m_workers.store(nullptr);
+	m_workerThreadCount = config->workerThreadCount;
+
+	m_keyring.Init();
+	m_trace.Init(&m_heap, config->tracePath != nullptr);
+	m_tracePath = config->tracePath;
+	int err = NGDP_ERROR_SUCCESS;
+	if (config->keyringPath) {
+		Buffer<u8> file;
+		file.Init();
+		if (!ReadFile(config->keyringPath, &file) || !m_keyring.Parse(&m_heap, file.MakeSlice())) {
+			config->errorDetail = "Unable to load the keyring.";
+			err = NGDP_ERROR_INVALID_CONFIGURATION;
+		}
+		file.Destroy(&m_heap);
+	}
+	if (!err) {
+		TraceSpan span(&m_trace, "api", "LoadBuild");
+		err = span.SetError(LoadBuild(config));
+	}
+	if (!err && m_store && !m_buildConfig.m_encoding[1].IsZero()) {
+		err = RetainInStore(config);
+	}
+	if (err) {
+		config->error = err;
+	}
+}
+
+int Client::RetainInStore(ngdpConfig *config) {
+	int err = m_store->RetainBuild(config->gameUid, config->ngdpRegion, m_buildConfigKey, m_buildConfig);
+	if (err) {
+		config->errorDetail = "Unable to retain the build in the shared store.";
+		return err;
+	}
+	// Loading from a snapshot skips the encoding file, and a collection may
+	// have dropped it before the build was retained; the store needs it.
+	LocalIndexEntry local;
+	if (!m_local->Find(m_buildConfig.m_encoding[1], &local)) {
+		EncodingTable table;
+		memset((void *)&table, 0, sizeof(table));
+		err = LoadEncodingTable(m_buildConfig, &table, &config->errorDetail);
+		table.Destroy(&m_heap);
+	}
+	return err;
+}
+
+void Client::Destroy() {
+	WorkerPool::Free(&m_heap, m_workers.load());
+	// Cancelled hedged attempts may still be running, so their spans can be
+	// missing from the trace.  m_remote.Destroy waits for them to return
+	// before the hosts they use are freed.
+	if (m_tracePath) {
+		Buffer<u8> trace;
+		trace.Init();
+		WriteTrace(&trace);
+		if (!WriteFile(m_tracePath, trace.m_storage, trace.m_size)) {
+			Log("Unable to write the trace to %s", m_tracePath);
+		}
+		trace.Destroy(&m_heap);
+	}
+	DecodedCache::Free(m_cache);
+	m_patchManifest.Destroy(&m_heap);
+	m_patchArchiveIndex.Destroy(&m_heap);
+	m_archiveIndex.Destroy(&m_heap);
+	m_especPlans.Destroy(&m_heap);
+	m_especCache.Destroy(&m_heap);
+	m_encoding.Destroy(&m_heap);
+	m_cdnConfig.Destroy(&m_heap);
+	m_buildConfig.Destroy(&m_heap);
+	m_keyring.Destroy(&m_heap);
+	if (!m_store) {
+		CascWriter::Free(m_writer);
+		if (m_hasLocal) {
+			m_ownLocal.Destroy();
+		}
+	}
+	// Unmapped last, once no buffer views it
+	m_snapshot.Destroy();
+	m_remote.Destroy();
+	m_trace.Destroy();
+	if (m_logBuffer) {
+		m_heap.Free(m_logBuffer);
+	}
+	if (m_lazy) {
+		m_lazy->~LazyLoadMutexes();
+		m_heap.Free(m_lazy);
+	}
+}
+
+bool Client::ReadFile(const char *path, Buffer<u8> *out) {
+	void *f = m_file.Open(path, "rb");
+	if (!f) {
+		return false;
+	}
+	for (;;) {
+		const int kStep = 64 * 1024;
+		u8 *dst = out->Alloc(&m_heap, kStep);
+		int n = (int)m_file.Read(dst, 1, kStep, f);
+		out->m_size -= kStep - n;
+		if (n < kStep) {
+			break;
+		}
+	}
+	m_file.Close(f);
+	return true;
+}
+
+int Client::LoadConfig(const Key &key, Buffer<u8> *out) {
+	if (m_hasLocal) {
+		StackBuffer<u8, 256> path;
+		path.Init();
+		StringBuffer sb;
+		sb.Init(&path);
+		sb.AppendString(&m_heap, m_cascPath);
+		sb.AppendString(&m_heap, "/Data/config/");
+		key.WriteURLFragment(&m_heap, sb);
+		bool found = ReadFile(sb.CString(&m_heap), out);
+		path.Destroy(&m_heap);
+		if (found) {
+			return NGDP_ERROR_SUCCESS;
+		}
+	}
+	if (!m_download) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	return DownloadError(m_remote.DownloadAlloc(out, CDNResourceType::Config, false, key));
+}
+
+int Client::LoadBuild(ngdpConfig *config) {
+	Key buildConfigKey = m_remote.m_buildConfig;
+	Key cdnConfigKey = m_remote.m_cdnConfig;
+	if (config->disableHTTPRequests || config->overrideBuildConfig) {
+		memcpy(buildConfigKey.k, config->buildConfigKey, 16);
+	}
+	if (config->disableHTTPRequests || config->overrideCDNConfig) {
+		memcpy(cdnConfigKey.k, config->cdnConfigKey, 16);
+	}
+
+	// Without a build config or a way to find one, only the local
+	// installation is opened.
+	if (buildConfigKey.IsZero() && !m_download && m_hasLocal) {
+		InitEspecPlans();
+		return NGDP_ERROR_SUCCESS;
+	}
+
+	Buffer<u8> file;
+	file.Init();
+	int err = buildConfigKey.IsZero() ? NGDP_ERROR_FILE_NOT_FOUND : LoadConfig(buildConfigKey, &file);
+	if (err) {
+		config->errorDetail = "Unable to load the build config.";
+		file.Destroy(&m_heap);
+		return err;
+	}
+	m_buildConfig.Init(&m_heap, file.MakeSlice());
+	file.Destroy(&m_heap);
+
+	// The CDN config only lists CDN archives, so a local-only client can do
+	// without it.
+	file.Init();
+	err = cdnConfigKey.IsZero() ? NGDP_ERROR_FILE_NOT_FOUND : LoadConfig(cdnConfigKey, &file);
+	if (err && m_download) {
+		config->errorDetail = "Unable to load the CDN config.";
+		file.Destroy(&m_heap);
+		return err;
+	}
+	m_cdnConfig.Init(&m_heap, file.MakeSlice());
+	file.Destroy(&m_heap);
+
+	m_buildConfigKey = buildConfigKey;
+	m_cdnConfigKey = cdnConfigKey;
+
+	if (config->indexSnapshotPath && LoadSnapshot(config->indexSnapshotPath)) {
+		InitEspecPlans();
+		return NGDP_ERROR_SUCCESS;
+	}
+	err = LoadEncoding(config);
+	if (err) {
+		return err;
+	}
+	InitEspecPlans();
+	if (config->indexSnapshotPath) {
+		// Snapshots carry the archive indexes too, so load them now rather
+		// than on first use; an incomplete index is not worth sharing.
+		if (m_cdnConfig.m_archives.m_size) {
+			err = LoadArchiveIndex(CDNResourceType::Data);
+		}
+		if (!err && m_cdnConfig.m_patchArchives.m_size) {
+			err = LoadArchiveIndex(CDNResourceType::Patch);
+		}
+		if (!err) {
+			err = IndexSnapshot::Write(this, config->indexSnapshotPath);
+		}
+		if (err) {
+			Log("Unable to write the index snapshot %s (%d)", config->indexSnapshotPath, err);
+		}
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::LoadEncoding(ngdpConfig *config) {
+	return LoadEncodingTable(m_buildConfig, &m_encoding, &config->errorDetail);
+}
+
+int Client::LoadEncodingTable(const BuildConfig &build, EncodingTable *table, const char **errorDetail) {
+	int err;
+	// Encoding is fetched by its encoded key, like any other data file, and
+	// is never stored in a CDN archive.
+	const Key &ekey = build.m_encoding[1];
+	Buffer<u8> encoded;
+	encoded.Init();
+	err = NGDP_ERROR_FILE_NOT_FOUND;
+	LocalIndexEntry local;
+	if (m_hasLocal && m_local->Find(ekey, &local)) {
+		int size = local.m_size - LocalStorage::kRecordHeaderSize;
+		u8 *dst = encoded.Alloc(&m_heap, size);
+		if (m_local->ReadRecord(ekey, 0, size, dst, &build.m_encoding[0])) {
+			err = NGDP_ERROR_SUCCESS;
+		} else {
+			encoded.m_size = 0;
+		}
+	}
+	int decodedSize = build.m_encodingSize[0] > 0 ? build.m_encodingSize[0] : -1;
+	int encodedSize = build.m_encodingSize[1];
+	Buffer<u8> decoded;
+	decoded.Init();
+	bool streamed = false;
+	bool whole = true;
+	if (err && m_download && decodedSize > 0 && encodedSize > 0) {
+		// With both sizes known, decode the chunks while the rest downloads.
+		encoded.Destroy(&m_heap);
+		encoded.Init(&m_heap, encodedSize);
+		decoded.Init(&m_heap, decodedSize);
+		decoded.m_size = decodedSize;
+		BlteStream stream;
+		stream.InitFile(encoded.m_storage, encodedSize, decodedSize, [&](const BlteChunk &c, const u8 *p) {
+			if (c.m_decodedOffset + c.m_decodedSize > decodedSize) {
+				return NGDP_ERROR_CORRUPT_DATA;
+			}
+			return BlteDecodeChunk(p, c.m_encodedSize, decoded.m_storage + c.m_decodedOffset, c.m_decodedSize, &m_keyring, c.m_index);
+		});
+		stream.m_tracer = &m_trace;
+		DownloadSinkFn sink = [&](int received) {
+			stream.Advance(received);
+		};
+		Slice<u8> slice{encoded.m_storage, encodedSize};
+		{
+			ScopedDownloadSink _s(&sink);
+			err = DownloadError(m_remote.Download(&slice, CDNResourceType::Data, false, ekey, 0, 0));
+		}
+		if (!err) {
+			err = stream.Advance(encodedSize);
+			if (!err && (!stream.Done() || stream.m_chunk.m_decodedOffset + stream.m_chunk.m_decodedSize != decodedSize)) {
+				err = NGDP_ERROR_CORRUPT_DATA;
+			}
+		}
+		streamed = !err;
+		// The build config's sizes may be wrong; then try the whole file,
+		// without them.
+		whole = err == NGDP_ERROR_CORRUPT_DATA;
+		if (whole) {
+			Log("The encoding file does not match its sizes in the build config");
+			decodedSize = -1;
+		}
+		if (err) {
+			decoded.Destroy(&m_heap);
+			decoded.Init();
+		}
+	}
+	if (err && m_download && whole) {
+		encoded.Destroy(&m_heap);
+		encoded.Init();
+		err = DownloadError(m_remote.DownloadAlloc(&encoded, CDNResourceType::Data, false, ekey));
+	}
+	if (err) {
+		*errorDetail = "Unable to load the encoding file.";
+		encoded.Destroy(&m_heap);
+		return err;
+	}
+
+	// A shared store keeps each build's encoding file, so it can tell the
+	// build's files from garbage offline.
+	if (m_store && m_writer && !m_local->Find(ekey, &local)) {
+		if (m_writer->Store(ekey, encoded.m_storage, streamed ? encodedSize : encoded.m_size)) {
+			Log("Unable to store the encoding file in the shared store");
+		}
+	}
+
+	if (!streamed) {
+		err = BlteDecode(&m_heap, encoded.MakeSlice(), decodedSize, &decoded);
+	}
+	encoded.Destroy(&m_heap);
+	if (err) {
+		*errorDetail = "Unable to decode the encoding file.";
+		decoded.Destroy(&m_heap);
+		return err;
+	}
+	if (!table->Init(&m_heap, &decoded)) {
+		*errorDetail = "Unable to parse the encoding file.";
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::DiffBuild(const Key &buildConfigKey, const EncodingDiffFn &onChange) {
+	if (buildConfigKey.IsZero()) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	Buffer<u8> file;
+	file.Init();
+	int err = LoadConfig(buildConfigKey, &file);
+	if (err) {
+		file.Destroy(&m_heap);
+		return err;
+	}
+	BuildConfig build;
+	memset((void *)&build, 0, sizeof(build));
+	build.Init(&m_heap, file.MakeSlice());
+	file.Destroy(&m_heap);
+
+	// Builds with the same encoding file have the same files.
+	EncodingTable other;
+	memset((void *)&other, 0, sizeof(other));
+	bool same = build.m_encoding[1] == m_buildConfig.m_encoding[1];
+	if (!same) {
+		const char *detail = nullptr;
+		err = LoadEncodingTable(build, &other, &detail);
+		if (err) {
+			Log("Unable to diff builds: %s", detail);
+		}
+	}
+	if (!same && !err) {
+		int skipped;
+		err = EncodingTable::Diff(m_encoding, other, onChange, &skipped);
+		Log("Diffed %d and %d encoding pages; %d pairs were shared", m_encoding.m_cePageCount, other.m_cePageCount, skipped);
+	}
+	other.Destroy(&m_heap);
+	build.Destroy(&m_heap);
+	return err;
+}
+
+int Client::ListFiles(const BuildFileFn &onFile) {
+	if (m_buildConfig.m_encoding[1].IsZero()) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	// Encoding is not listed in its own table.
+	int encodedSize = m_buildConfig.m_encodingSize[1] > 0 ? m_buildConfig.m_encodingSize[1] : -1;
+	int err = onFile(m_buildConfig.m_encoding[0].k, m_buildConfig.m_encoding[1].k, m_buildConfig.m_encodingSize[0], encodedSize);
+	if (err) {
+		return err;
+	}
+	return m_encoding.ForEach([&](const u8 *ckey, const u8 *ekey, s64 fileSize) {
+		Key key;
+		memset(key.k, 0, 16);
+		memcpy(key.k, ekey, m_encoding.m_ekeySize < 16 ? m_encoding.m_ekeySize : 16);
+		int size;
+		int especIndex;
+		if (!m_encoding.FindEncodedKey(key, &size, &especIndex)) {
+			size = -1;
+		}
+		return onFile(ckey, key.k, fileSize, size);
+	});
+}
+
+void Client::InitEspecPlans() {
+	// Parse each spec once up front, so FileInfo only indexes a plan.
+	m_especPlans.Init(&m_heap, m_encoding.m_especs.m_size + 1);
+	for (const String &spec : m_encoding.m_especs) {
+		m_especPlans.Push(&m_heap, m_especCache.Get(&m_heap, spec));
+	}
+}
+
+bool Client::LoadSnapshot(const char *path) {
+	if (!m_snapshot.Open(path, m_buildConfigKey, m_cdnConfigKey)) {
+		return false;
+	}
+	// The snapshot's sections are used in place; buffers with no capacity
+	// are never freed.
+	Slice<u8> section;
+	u32 param;
+	if (!m_snapshot.Section(IndexSnapshot::Encoding, &section, nullptr)) {
+		m_snapshot.Destroy();
+		return false;
+	}
+	Buffer<u8> encoding{section.m_data, section.m_size, 0};
+	if (!m_encoding.Init(&m_heap, &encoding)) {
+		m_encoding.Destroy(&m_heap);
+		m_snapshot.Destroy();
+		return false;
+	}
+	if (m_snapshot.Section(IndexSnapshot::ArchiveIndex, &section, nullptr)) {
+		m_archiveIndex.m_entries = Buffer<ArchiveIndexEntry>{(ArchiveIndexEntry *)section.m_data, section.m_size / (int)sizeof(ArchiveIndexEntry), 0};
+		m_archiveIndex.BuildFilter(&m_heap);
+		m_archiveIndexLoaded = true;
+	}
+	if (m_snapshot.Section(IndexSnapshot::PatchArchiveIndex, &section, nullptr)) {
+		m_patchArchiveIndex.m_entries = Buffer<ArchiveIndexEntry>{(ArchiveIndexEntry *)section.m_data, section.m_size / (int)sizeof(ArchiveIndexEntry), 0};
+		m_patchArchiveIndex.BuildFilter(&m_heap);
+		m_patchArchiveIndexLoaded = true;
+	}
+	// Local buckets are only shared while nothing newer has been published.
+	for (int b = 0; m_hasLocal && !m_store && b < LocalStorage::kBucketCount; b++) {
+		if (m_snapshot.Section(IndexSnapshot::LocalBucket + b, &section, &param) && (int)param == m_local->m_bucketVersions[b]) {
+			Buffer<u8> entries{section.m_data, section.m_size, 0};
+			m_local->ReplaceBucket(b, (int)param, &entries);
+		}
+	}
+	return true;
+}
+
+int Client::LoadPatchManifest() {
+	if (m_patchManifestLoaded.load(std::memory_order_acquire)) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	std::lock_guard<std::mutex> lock(m_lazy->m_patchManifest);
+	if (m_patchManifestLoaded.load(std::memory_order_relaxed)) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	int err = LoadPatchManifestLocked();
+	m_patchManifestLoaded.store(true, std::memory_order_release);
+	return err;
+}
+
+int Client::LoadPatchManifestLocked() {
+	if (!m_download) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+
+	if (!m_buildConfig.m_patchConfig.IsZero()) {
+		Buffer<u8> file;
+		file.Init();
+		if (LoadConfig(m_buildConfig.m_patchConfig, &file) == NGDP_ERROR_SUCCESS) {
+			m_patchManifest.ParseConfig(&m_heap, file.MakeSlice());
+		}
+		file.Destroy(&m_heap);
+	}
+
+	if (m_buildConfig.m_patch.IsZero()) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	Buffer<u8> manifest;
+	manifest.Init();
+	int err = DownloadError(m_remote.DownloadAlloc(&manifest, CDNResourceType::Patch, false, m_buildConfig.m_patch));
+	if (!err && manifest.m_size >= 4 && memcmp(manifest.m_storage, "BLTE", 4) == 0) {
+		Buffer<u8> decoded;
+		decoded.Init();
+		err = BlteDecode(&m_heap, manifest.MakeSlice(), -1, &decoded);
+		manifest.Destroy(&m_heap);
+		manifest = decoded;
+	}
+	if (!err && !m_patchManifest.Parse(&m_heap, &manifest)) {
+		err = NGDP_ERROR_CORRUPT_DATA;
+	}
+	manifest.Destroy(&m_heap);
+	if (err) {
+		Log("Unable to load the patch manifest (%d)", err);
+	}
+	return err;
+}
+
+int Client::LoadArchiveIndex(CDNResourceType type) {
+	bool isPatch = type == CDNResourceType::Patch;
+	std::atomic<bool> *loaded = isPatch ? &m_patchArchiveIndexLoaded : &m_archiveIndexLoaded;
+	if (loaded->load(std::memory_order_acquire)) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	std::lock_guard<std::mutex> lock(isPatch ? m_lazy->m_patchArchiveIndex : m_lazy->m_archiveIndex);
+	if (loaded->load(std::memory_order_relaxed)) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	TraceSpan span(&m_trace, "index", isPatch ? "load patch archive indexes" : "load archive indexes");
+	int err = span.SetError(LoadArchiveIndexLocked(type));
+	loaded->store(true, std::memory_order_release);
+	return err;
+}
+
+int Client::LoadArchiveIndexLocked(CDNResourceType type) {
+	bool isPatch = type == CDNResourceType::Patch;
+	ArchiveIndex *archiveIndex = isPatch ? &m_patchArchiveIndex : &m_archiveIndex;
+	const Slice<Key> &archives = isPatch ? m_cdnConfig.m_patchArchives : m_cdnConfig.m_archives;
+	const Key &group = isPatch ? m_cdnConfig.m_patchArchiveGroup : m_cdnConfig.m_archiveGroup;
+
+	// The archive-group index covers every archive in one file.  Without one
+	// from the CDN, the group is merged from the archives' own indexes and
+	// kept in Data/indices, named by the MD5 of the archive keys if the CDN
+	// config names no group.
+	bool haveGroup = !group.IsZero();
+	Key groupName = group;
+	if (!haveGroup) {
+		Md5::Sum((const u8 *)archives.m_data, archives.m_size * (int)sizeof(Key), &groupName);
+	}
+	if (LoadIndexFile(type, groupName, -1, haveGroup, archiveIndex)) {
+		archiveIndex->Sort(&m_heap, Workers());
+		archiveIndex->BuildFilter(&m_heap);
+		return NGDP_ERROR_SUCCESS;
+	}
+	if (haveGroup) {
+		Log("Unable to load the archive-group index; merging the %d archive indexes", archives.m_size);
+	}
+	// A group index that failed to parse may have left entries behind.
+	archiveIndex->m_entries.m_size = 0;
+
+	int err = NGDP_ERROR_SUCCESS;
+	for (int i = 0; i < archives.m_size; i++) {
+		if (!LoadIndexFile(type, archives[i], i, true, archiveIndex)) {
+			Log("Unable to load archive index %d", i);
+			err = NGDP_ERROR_FILE_NOT_FOUND;
+		}
+	}
+	archiveIndex->Sort(&m_heap, Workers());
+	archiveIndex->BuildFilter(&m_heap);
+	if (!err && m_hasLocal) {
+		Buffer<u8> merged;
+		merged.Init();
+		archiveIndex->WriteGroup(&m_heap, &merged);
+		StackBuffer<u8, 256> path;
+		path.Init();
+		const char *p = IndexPath(groupName, &path);
+		if (!WriteFile(p, merged.m_storage, merged.m_size)) {
+			Log("Unable to save the merged archive index %s", p);
+		}
+		path.Destroy(&m_heap);
+		merged.Destroy(&m_heap);
+	}
+	return err;
+}
+
+const char *Client::IndexPath(const Key &key, Buffer<u8> *path) {
+	StringBuffer sb;
+	sb.Init(path);
+	sb.AppendString(&m_heap, m_cascPath);
+	sb.AppendString(&m_heap, "/Data/indices/");
+	key.WriteHex(&m_heap, sb);
+	sb.AppendString(&m_heap, ".index");
+	return sb.CString(&m_heap);
+}
+
+bool Client::LoadIndexFile(CDNResourceType type, const Key &key, int archive, bool download, ArchiveIndex *archiveIndex) {
+	// Installations keep copies of the CDN indexes in Data/indices.
+	Buffer<u8> index;
+	index.Init();
+	bool found = false;
+	if (m_hasLocal) {
+		StackBuffer<u8, 256> path;
+		path.Init();
+		found = ReadFile(IndexPath(key, &path), &index);
+		path.Destroy(&m_heap);
+	}
+	if (!found && download && m_download) {
+		index.Destroy(&m_heap);
+		index.Init();
+		found = m_remote.DownloadAlloc(&index, type, true, key) == NGDP_DOWNLOAD_SUCCESS;
+	}
+	found = found && archiveIndex->Parse(&m_heap, index.MakeSlice(), archive);
+	index.Destroy(&m_heap);
+	return found;
+}
+
+bool Client::WriteFile(const char *path, const u8 *data, int size) {
+	return m_file.WriteReplacing(&m_heap, path, [&](void *f) {
+		return m_file.Write((void *)data, 1, size, f) == (size_t)size;
+	});
+}
+
+WorkerPool *Client::Workers() {
+	WorkerPool *workers = m_workers.load(std::memory_order_acquire);
+	if (workers) {
+		return workers;
+	}
+	std::lock_guard<std::mutex> lock(m_lazy->m_workers);
+	workers = m_workers.load(std::memory_order_relaxed);
+	if (!workers) {
+		workers = WorkerPool::Create(&m_heap, m_workerThreadCount);
+		m_workers.store(workers, std::memory_order_release);
+	}
+	return workers;
 }
 
 void Client::Log(const char *fmt, ...) {
 	if (!m_log) {
 		return;
 	}
-	// TODO: mutex
+	SpinLockGuard lock(&m_logLock);
 	va_list args;
 	va_start(args, fmt);
 	int w = vsnprintf(m_logBuffer, kDebugLogBufferSize, fmt, args);
@@ -165,11 +850,59 @@ void Client::Log(const char *fmt, ...) {
 	m_log(m_logBuffer);
 }
 
+// Names statistics recorded as trace instants; the rest are covered by spans.
+static const char *statisticTraceName(int type) {
+	switch (type) {
+	case NGDP_STATISTIC_CACHE_HIT:
+		return "cache hit";
+	case NGDP_STATISTIC_CACHE_MISS:
+		return "cache miss";
+	case NGDP_STATISTIC_CACHE_EVICTED:
+		return "cache evicted";
+	case NGDP_STATISTIC_DOWNLOAD_HEDGED:
+		return "download hedged";
+	case NGDP_STATISTIC_HOST_DISABLED:
+		return "host disabled";
+	case NGDP_STATISTIC_CHUNK_SKIPPED:
+		return "chunk skipped";
+	default:
+		return nullptr;
+	}
+}
+
 void Client::Report(int type, int arg0, int arg1, int arg2, const Key *key) {
+	const char *traceName = m_trace.m_enabled ? statisticTraceName(type) : nullptr;
+	if (traceName) {
+		TraceEvent e;
+		memset((void *)&e, 0, sizeof(e));
+		e.m_category = "statistic";
+		e.m_name = traceName;
+		e.m_start = m_trace.Now();
+		e.m_end = -1;
+		e.m_host = type == NGDP_STATISTIC_DOWNLOAD_HEDGED || type == NGDP_STATISTIC_HOST_DISABLED ? arg0 : -1;
+		e.m_bytes = type == NGDP_STATISTIC_CHUNK_SKIPPED ? arg2 : (e.m_host < 0 ? arg0 : -1);
+		if (type == NGDP_STATISTIC_CHUNK_SKIPPED) {
+			e.m_valueArg = "chunk";
+			e.m_value = arg0;
+		}
+		if (key) {
+			e.m_keyArg = "ckey";
+			e.m_key = *key;
+		}
+		m_trace.Record(e);
+	}
 	if (!m_stats) {
 		return;
 	}
-	m_stats(type, arg0, arg1, arg2, key->k);
+	m_stats(type, arg0, arg1, arg2, key ? key->k : nullptr);
+}
+
+void Client::WriteTrace(Buffer<u8> *out) {
+	m_trace.Write(m_remote.m_cdnHosts, m_remote.m_cdnHostCount, out);
+}
+
+Tracer *Client::CurrentTracer(Client *c) {
+	return threadCurrentClient ? &threadCurrentClient->m_trace : &c->m_trace;
 }
 
 }
@@ -192,13 +925,264 @@ extern "C" ngdpClient *ngdpInit(ngdpConfig *config) {
 		heap.m_realloc = realloc;
 	}
 	ngdp::Client *client = (ngdp::Client *)heap.Alloc(sizeof(ngdp::Client));
-	memset(client, 0, sizeof(*client));
+	memset((void *)client, 0, sizeof(*client));
 	client->m_heap = heap;
 	config->error = 0;
 	client->Init(config);
 	if (config->error) {
+		client->Destroy();
 		heap.Free(client);
 		return 0;
 	}
 	return (ngdpClient *)client;
 }
+
+extern "C" void ngdpDestroy(ngdpClient *c) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::Heap heap = client->m_heap;
+	client->Destroy();
+	heap.Free(client);
+}
+
+extern "C" int ngdpDownloadCancelled(void) {
+	ngdp::DownloadProgress *progress = ngdp::CurrentDownloadProgress();
+	return progress && progress->m_cancelled.load() ? 1 : 0;
+}
+
+extern "C" void ngdpDownloadReceived(int received, int contentLength) {
+	ngdp::DownloadProgress *progress = ngdp::CurrentDownloadProgress();
+	if (progress) {
+		progress->m_expected.store(contentLength);
+		progress->Received(received);
+	}
+}
+
+extern "C" int ngdpDownloadTimeLeftMs(void) {
+	s64 deadline = ngdp::CurrentDownloadDeadline();
+	if (!deadline) {
+		return -1;
+	}
+	s64 left = (deadline - ngdp::MonotonicMicros()) / 1000;
+	return left > 0 ? (int)left : 0;
+}
+
+extern "C" int ngdpFileInfo(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	op->error = client->FileInfo(op);
+	return op->error;
+}
+
+extern "C" int ngdpIsLocal(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	op->error = client->IsLocal(op);
+	return op->error;
+}
+
+extern "C" int ngdpRead(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "Read");
+	span.SetKey("ckey", op->contentKey);
+	span.SetValue("offset", op->fileOffset);
+	span.SetBytes(op->bufferSize);
+	op->error = span.SetError(client->Read(op));
+	return op->error;
+}
+
+extern "C" int ngdpAcquire(ngdpClient *c, ngdpOperation *op, ngdpFileHandle **handle, const uint8_t **data) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "Acquire");
+	span.SetKey("ckey", op->contentKey);
+	ngdp::CachedFile *file;
+	op->error = span.SetError(client->Acquire(op, &file));
+	*handle = (ngdpFileHandle *)file;
+	*data = file ? file->Data() : nullptr;
+	return op->error;
+}
+
+extern "C" void ngdpRelease(ngdpClient *c, ngdpFileHandle *handle) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::CachedFile::Release(&client->m_heap, (ngdp::CachedFile *)handle);
+}
+
+extern "C" int ngdpEndRead(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	op->error = client->EndRead(op);
+	return op->error;
+}
+
+extern "C" int ngdpApplyPatch(ngdpClient *c, const uint8_t *baseContentKey, const uint8_t *patchKey, int patchSize, ngdpWriteFn writeFn, void *writeCtx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "ApplyPatch");
+	span.SetKey("ckey", baseContentKey);
+	ngdpOperation base;
+	memset(&base, 0, sizeof(base));
+	memcpy(base.contentKey, baseContentKey, 16);
+	int err = client->FileInfo(&base);
+	if (err) {
+		return err;
+	}
+	if (!client->m_download) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	ngdp::EncodedSource patch;
+	client->FindPatchSource(*(const ngdp::Key *)patchKey, patchSize, &patch);
+	return span.SetError(client->ApplyPatch(*(const ngdp::Key *)base.encodedKey, base.fileSize, patch, [&](const uint8_t *data, int size) {
+		return writeFn(writeCtx, data, size) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	}));
+}
+
+extern "C" int ngdpFetch(ngdpClient *c, ngdpOperation *op, ngdpWriteFn writeFn, void *writeCtx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "Fetch");
+	span.SetKey("ckey", op->contentKey);
+	op->error = span.SetError(client->Fetch(op, [&](const uint8_t *data, int size) {
+		return writeFn(writeCtx, data, size) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	}));
+	return op->error;
+}
+
+extern "C" int ngdpDiffBuild(ngdpClient *c, const uint8_t *buildConfigKey, ngdpDiffFn onChange, void *ctx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "DiffBuild");
+	ngdp::Key key = client->m_remote.m_buildConfig;
+	if (buildConfigKey) {
+		memcpy(key.k, buildConfigKey, 16);
+	}
+	span.SetKey("buildConfig", key);
+	return span.SetError(client->DiffBuild(key, [&](int change, const uint8_t *ckey, const uint8_t *oldEkey, const uint8_t *newEkey, int64_t fileSize) {
+		return onChange(ctx, change, ckey, oldEkey, newEkey, fileSize) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	}));
+}
+
+extern "C" int ngdpListFiles(ngdpClient *c, ngdpFileFn onFile, void *ctx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	return client->ListFiles([&](const uint8_t *ckey, const uint8_t *ekey, int64_t fileSize, int encodedSize) {
+		return onFile(ctx, ckey, ekey, fileSize, encodedSize) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	});
+}
+
+extern "C" int ngdpReadEncoded(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "ReadEncoded");
+	span.SetKey(op->encodedKeyIsValid ? "ekey" : "ckey", op->encodedKeyIsValid ? op->encodedKey : op->contentKey);
+	span.SetValue("offset", op->fileOffset);
+	span.SetBytes(op->bufferSize);
+	op->error = span.SetError(client->ReadEncodedFile(op));
+	return op->error;
+}
+
+extern "C" int ngdpScanLocal(ngdpClient *c, int repair, ngdpScanFn onProblem, void *ctx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "ScanLocal");
+	return span.SetError(client->ScanLocal(repair != 0, [&](int problem, const ngdp::Key &key, int archive, int offset, int size) {
+		return onProblem && onProblem(ctx, problem, key.k, archive, offset, size) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	}));
+}
+
+extern "C" int ngdpCompactLocal(ngdpClient *c, int minWastePercent) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "CompactLocal");
+	return span.SetError(client->CompactLocal(minWastePercent));
+}
+
+extern "C" int ngdpAddKey(ngdpClient *c, uint64_t keyName, const uint8_t *key) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	if (!key) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	client->m_keyring.Add(&client->m_heap, keyName, key);
+	return NGDP_ERROR_SUCCESS;
+}
+
+extern "C" int ngdpWriteTrace(ngdpClient *c, ngdpWriteFn writeFn, void *writeCtx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	if (!client->m_trace.m_enabled) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	ngdp::Buffer<uint8_t> trace;
+	trace.Init();
+	client->WriteTrace(&trace);
+	int err = writeFn && writeFn(writeCtx, trace.m_storage, trace.m_size) ? NGDP_ERROR_ABORTED : NGDP_ERROR_SUCCESS;
+	trace.Destroy(&client->m_heap);
+	return err;
+}
+
+extern "C" int ngdpRetireBuild(ngdpClient *store, const char *gameUid, const char *region, const uint8_t *buildConfigKey,
+	int minWastePercent) {
+	ngdp::Client *client = (ngdp::Client *)store;
+	if (!buildConfigKey) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	ngdp::Key key;
+	memcpy(key.k, buildConfigKey, 16);
+	ngdp::TraceSpan span(&client->m_trace, "api", "RetireBuild");
+	span.SetKey("buildConfig", key);
+	if (client->m_store) {
+		client = client->m_store;
+	}
+	ngdp::ScopedCurrentClient _c(client);
+	return span.SetError(client->RetireBuild(gameUid, region, key, minWastePercent));
+}
+
+extern "C" int ngdpConfigFile(ngdpClient *c, int which, uint8_t *key, ngdpWriteFn writeFn, void *writeCtx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	const ngdp::Key &configKey = which == NGDP_CONFIG_CDN ? client->m_cdnConfigKey : client->m_buildConfigKey;
+	if ((which != NGDP_CONFIG_BUILD && which != NGDP_CONFIG_CDN) || configKey.IsZero()) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	ngdp::Buffer<uint8_t> file;
+	file.Init();
+	int err = client->LoadConfig(configKey, &file);
+	if (!err) {
+		memcpy(key, configKey.k, 16);
+		if (writeFn && writeFn(writeCtx, file.m_storage, file.m_size)) {
+			err = NGDP_ERROR_ABORTED;
+		}
+	}
+	file.Destroy(&client->m_heap);
+	return err;
+}
+
+extern "C" int ngdpCreate(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	op->error = client->Create(op);
+	return op->error;
+}
+
+extern "C" int ngdpWrite(ngdpClient *c, ngdpOperation *op) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	op->error = client->Write(op);
+	return op->error;
+}
+
+extern "C" int ngdpSave(ngdpClient *c, ngdpOperation *op, ngdpWriteFn writeFn, void *writeCtx) {
+	ngdp::Client *client = (ngdp::Client *)c;
+	ngdp::ScopedCurrentClient _c(client);
+	ngdp::TraceSpan span(&client->m_trace, "api", "Save");
+	op->error = span.SetError(client->Save(op, [&](const uint8_t *data, int size) {
+		if (writeFn && writeFn(writeCtx, data, size)) {
+			return NGDP_ERROR_ABORTED;
+		}
+		return NGDP_ERROR_SUCCESS;
+	}));
+	if (!op->error) {
+		span.SetKey("ckey", op->contentKey);
+		span.SetBytes(op->fileSize);
+	}
+	return op->error;
+}
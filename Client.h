@@ -5,15 +5,81 @@
 #include "Heap.h"
 #include "FileIO.h"
 #include "Remote.h"
+#include "Config.h"
+#include "Encoding.h"
+#include "ArchiveIndex.h"
+#include "LocalStorage.h"
+#include "Patch.h"
+#include "PatchManifest.h"
+#include "CostModel.h"
+#include "BlteEncoder.h"
+#include "WorkerPool.h"
+#include "CascWriter.h"
+#include "Snapshot.h"
+#include "Lock.h"
+#include "DecodedCache.h"
+#include "Crypt.h"
+#include "Trace.h"
+
+#include <atomic>
+#include <mutex>
 
 namespace ngdp {
 
+struct BlteHeader;
+struct BlteChunk;
+
+// Where the encoded bytes of a file are read from
+struct EncodedSource {
+	enum Kind {
+		Local,
+		Archive,
+		Loose
+	};
+
+	Kind m_kind;
+	// Where Archive and Loose files live on the CDN
+	CDNResourceType m_type;
+	// Local: data.NNN number; Archive: index into CDNConfig::m_archives
+	int m_archive;
+	// Offset of the encoded file within its archive
+	int m_offset;
+	// Encoded size, or -1 if unknown
+	int m_size;
+	// Archive: the CDN archive's key; Local and Loose: the file's encoded key
+	Key m_key;
+};
+
+struct ReadaheadState;
+
+// Called by Client::ListFiles with a data file of the build: its content and
+// encoded keys, decoded size and encoded size (-1 if unknown).  Returns an
+// NGDP_ERROR code; non-zero stops the listing.
+typedef std::function<int(const u8 *ckey, const u8 *ekey, s64 fileSize, int encodedSize)> BuildFileFn;
+
+// Called by Client::ScanLocal for each bad local index entry, with an
+// NGDP_SCAN problem and the entry's truncated key and location.  Returns an
+// NGDP_ERROR code; non-zero stops the reports.
+typedef std::function<int(int problem, const Key &key, int archive, int offset, int size)> ScanProblemFn;
+
+// Held by the thread building one of the client's lazily loaded parts, while
+// the others that need it wait; allocated by Client::Init, as a Client is
+// never constructed
+struct LazyLoadMutexes {
+	std::mutex m_archiveIndex;
+	std::mutex m_patchArchiveIndex;
+	std::mutex m_patchManifest;
+	std::mutex m_workers;
+};
+
 struct Client {
 	Heap m_heap;
 	FileIO m_file;
 	ngdpDownloadUrlFn m_download;
 
 	ngdpDebugLogFn m_log;
+	// Guards m_logBuffer; messages are passed to m_log one at a time
+	SpinLock m_logLock;
 	char *m_logBuffer;
 	static const int kDebugLogBufferSize = 64 * 1024;
 
@@ -21,10 +87,186 @@ struct Client {
 
 	Remote m_remote;
 
+	const char *m_cascPath;
+	bool m_hasLocal;
+	// m_ownLocal, or the shared store's
+	LocalStorage *m_local;
+	LocalStorage m_ownLocal;
+	// Stores downloaded and saved files locally; null without m_hasLocal, or
+	// if another process is writing to the installation
+	CascWriter *m_writer;
+	// The client whose installation this one uses, if config->sharedStore
+	// was set
+	Client *m_store;
+
+	Key m_buildConfigKey;
+	Key m_cdnConfigKey;
+	BuildConfig m_buildConfig;
+	CDNConfig m_cdnConfig;
+	EncodingTable m_encoding;
+	// Parsed encoding specs, and the plan for each of m_encoding's specs
+	// (null where a spec is unsupported)
+	EspecCache m_especCache;
+	Buffer<const Espec *> m_especPlans;
+
+	// Guards m_especCache
+	SpinLock m_especLock;
+
+	// The archive indexes and patch manifest are built on first use, with
+	// their mutex in m_lazy held.  Once a loaded flag is set, its data is
+	// read without a lock.
+	LazyLoadMutexes *m_lazy;
+	std::atomic<bool> m_archiveIndexLoaded;
+	ArchiveIndex m_archiveIndex;
+	std::atomic<bool> m_patchArchiveIndexLoaded;
+	ArchiveIndex m_patchArchiveIndex;
+	std::atomic<bool> m_patchManifestLoaded;
+	PatchManifest m_patchManifest;
+
+	CostModel m_cost;
+
+	// Null unless config->decodedCacheSize is set
+	DecodedCache *m_cache;
+
+	// Keys for encrypted chunks, from config->keyringPath and ngdpAddKey
+	Keyring m_keyring;
+
+	// Enabled by config->tracePath, which the trace is written to on Destroy
+	Tracer m_trace;
+	const char *m_tracePath;
+
+	// Mapped when config->indexSnapshotPath names a snapshot of this build;
+	// the encoding and index buffers then view it.
+	IndexSnapshot m_snapshot;
+
+	// Started on first use, with m_lazy->m_workers held, then read without
+	// a lock
+	std::atomic<WorkerPool *> m_workers;
+	int m_workerThreadCount;
+
 	void Init(ngdpConfig *config);
+	void Destroy();
 
 	void Log(const char *fmt, ...);
 	void Report(int type, int arg0, int arg1, int arg2, const Key *key);
+	// Writes the trace recorded so far as Chrome trace-event JSON.
+	void WriteTrace(Buffer<u8> *out);
+	// The tracer of the client the calling thread is working for, or else
+	// c's; code shared through a sharedStore traces into the caller's.
+	static Tracer *CurrentTracer(Client *c);
+
+	int LoadBuild(ngdpConfig *config);
+	int LoadEncoding(ngdpConfig *config);
+	// Retains the loaded build in m_store, and makes sure its encoding file
+	// is stored there.
+	int RetainInStore(ngdpConfig *config);
+	// Loads and decodes the encoding file of build into table.
+	int LoadEncodingTable(const BuildConfig &build, EncodingTable *table, const char **errorDetail);
+	void InitEspecPlans();
+	// Uses the indexes in a matching snapshot; returns false if there is none.
+	bool LoadSnapshot(const char *path);
+	// Loads a config file by key from the local installation, falling back to
+	// the CDN.
+	int LoadConfig(const Key &key, Buffer<u8> *out);
+	// Loads the CDN data or patch archive indexes on first use.  Only the
+	// first call's error is returned.
+	int LoadArchiveIndex(CDNResourceType type);
+	int LoadArchiveIndexLocked(CDNResourceType type);
+	// Parses the .index file for key, from Data/indices or else (if download
+	// is set) the CDN, into archiveIndex.
+	bool LoadIndexFile(CDNResourceType type, const Key &key, int archive, bool download, ArchiveIndex *archiveIndex);
+	// Builds the path of key's .index file in Data/indices.
+	const char *IndexPath(const Key &key, Buffer<u8> *path);
+	// Loads the build's patch manifest and patch config on first use.
+	int LoadPatchManifest();
+	int LoadPatchManifestLocked();
+	// Reads a whole local file; returns false if it cannot be opened.
+	bool ReadFile(const char *path, Buffer<u8> *out);
+	// Replaces a local file atomically; returns false on failure.
+	bool WriteFile(const char *path, const u8 *data, int size);
+	// Returns the worker pool, starting it on first use.
+	WorkerPool *Workers();
+
+	int FileInfo(ngdpOperation *op);
+	int IsLocal(ngdpOperation *op);
+	// Serves reads of cached files from m_cache, and caches whole-file reads.
+	int Read(ngdpOperation *op);
+	// Reads from the local archives or the CDN.
+	int ReadStored(ngdpOperation *op);
+	// Returns the whole decoded file with a reference for the caller.
+	int Acquire(ngdpOperation *op, CachedFile **file);
+	// Waits for op's readahead, if any, so its working buffer can be reused.
+	int EndRead(ngdpOperation *op);
+
+	// Rebuilds a file from a local base file, identified by its encoded key
+	// and decoded size, and a ZBSDIFF1 patch read from patch, passing the
+	// result to write as it is produced.
+	int ApplyPatch(const Key &baseEncodedKey, int baseSize, const EncodedSource &patch, const PatchWriteFn &write);
+
+	// Produces the decoded file by the path the cost model expects to finish
+	// first: a local read, a CDN download, or a patch from a local file.
+	int Fetch(ngdpOperation *op, const PatchWriteFn &write);
+
+	// Diffs the encoding table of the build with buildConfigKey against
+	// this client's; see EncodingTable::Diff.
+	int DiffBuild(const Key &buildConfigKey, const EncodingDiffFn &onChange);
+	// Passes the build's encoding file, then every file its encoding table
+	// lists, to onFile.
+	int ListFiles(const BuildFileFn &onFile);
+	// Finds the cheapest patch for op's file whose source is local; returns
+	// false if none is estimated to beat downloading the file.
+	bool ChoosePatch(ngdpOperation *op, PatchCandidate *best);
+
+	int Create(ngdpOperation *op);
+	int Write(ngdpOperation *op);
+	// Finishes encoding the file and passes the encoded file to write.
+	int Save(ngdpOperation *op, const BlteWriteFn &write);
+
+	// Stores a downloaded encoded file locally once its encoded key checks
+	// out, unless op->disableFileWrites is set.  Failures are only logged.
+	void StoreDownloaded(ngdpOperation *op, const BlteHeader &header, const u8 *data, int size);
+
+	int FindSource(ngdpOperation *op, EncodedSource *src);
+	void FindPatchSource(const Key &patchKey, int patchSize, EncodedSource *src);
+	int ReadEncoded(const EncodedSource &src, int offset, int size, u8 *dst, const Key *key);
+	// Decodes chunk c of op's file into dst.  An encrypted chunk whose key is
+	// missing is zeroed and counted in op->skippedChunkCount instead.
+	int DecodeChunk(ngdpOperation *op, const BlteChunk &c, const u8 *data, u8 *dst);
+	// Checks every record the local index points to; see ngdpScanLocal.
+	int ScanLocal(bool repair, const ScanProblemFn &onProblem);
+	// Moves the build's files out of wasteful archives; see
+	// ngdpCompactLocal.
+	int CompactLocal(int minWastePercent);
+	// Moves every file whose key is in the sorted live keys out of wasteful
+	// archives, and drops the rest.
+	int Compact(const Buffer<Key> &live, int minWastePercent);
+	// Adds a build to the shared store's list of retained builds.
+	int RetainBuild(const char *product, const char *region, const Key &buildConfigKey, const BuildConfig &build);
+	// Removes a build from the list and collects the files no other retained
+	// build uses; see ngdpRetireBuild.
+	int RetireBuild(const char *product, const char *region, const Key &buildConfigKey, int minWastePercent);
+	// Copies the list of retained builds into file, with the writer's
+	// m_collectMutex held.  Returns false if this is not a shared store.
+	bool ReadRetained(Buffer<u8> *file);
+	// Lists the sorted keys of the files of every build in file, a copy of
+	// the list of retained builds.
+	int RetainedKeys(const Buffer<u8> &file, Buffer<Key> *live);
+	// Reads a range of op's encoded file into op->buffer, checking and
+	// storing it when the range is the whole file.
+	int ReadEncodedFile(ngdpOperation *op);
+	// Starts fetching and decoding the decoded range after end in the
+	// background, into the working buffer's first wbSize bytes.
+	void StartReadahead(ngdpOperation *op, ReadaheadState *ra, const BlteHeader &header, const EncodedSource &src, int wbSize, int end);
+};
+
+// Makes c the client used by the default download callback on this thread,
+// and starts the deadline shared by the downloads made in the scope.
+struct ScopedCurrentClient {
+	Client *m_previous;
+	ScopedDownloadDeadline m_deadline;
+
+	ScopedCurrentClient(Client *c);
+	~ScopedCurrentClient();
 };
 
 }
@@ -0,0 +1,296 @@
+#include "Client.h"
+#include "Bytes.h"
+#include "KeyMap.h"
+
+#include <algorithm>
+
+#define _heap &c->m_heap
+
+namespace ngdp {
+
+// Live records are copied in batches of about this many bytes, so memory use
+// does not grow with the installation.
+static const int kCompactBatchSize = 32 << 20;
+
+// An index entry pointing into an archive being compacted
+struct CompactEntry {
+	const u8 *m_entry;
+	int m_archive;
+	int m_offset;
+	int m_size;
+	bool m_live;
+	// Where the record goes in the batch's buffer
+	int m_at;
+};
+
+// Reads the records of entries[0, count), which are in key order, into
+// records, visiting them in archive order.  Adds the entries whose record
+// header does not match to bad, and a request and the old entry for each of
+// the others to requests and oldEntries.
+static int readBatch(Client *c, CompactEntry *entries, int count, Buffer<u8> *records, Buffer<CascWriter::Request> *requests,
+	Buffer<u8> *oldEntries, Buffer<u8> *bad) {
+	const LocalStorage &local = *c->m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	int total = 0;
+	for (int i = 0; i < count; i++) {
+		entries[i].m_at = total;
+		total += entries[i].m_size;
+	}
+	records->m_size = 0;
+	records->Alloc(_heap, total);
+	Buffer<CompactEntry *> order;
+	order.Init(_heap, count);
+	for (int i = 0; i < count; i++) {
+		order.Push(_heap, &entries[i]);
+	}
+	std::sort(order.begin(), order.end(), [](const CompactEntry *a, const CompactEntry *b) {
+		return a->m_archive != b->m_archive ? a->m_archive < b->m_archive : a->m_offset < b->m_offset;
+	});
+	int err = NGDP_ERROR_SUCCESS;
+	for (CompactEntry *e : order) {
+		if (!c->m_local->Read(e->m_archive, e->m_offset, e->m_size, records->m_storage + e->m_at, nullptr)) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+			break;
+		}
+	}
+	order.Destroy(_heap);
+	if (err) {
+		return err;
+	}
+
+	for (int i = 0; i < count; i++) {
+		const CompactEntry &e = entries[i];
+		const u8 *record = records->m_storage + e.m_at;
+		// The record header's key is reversed.
+		CascWriter::Request r;
+		memset(&r, 0, sizeof(r));
+		for (int k = 0; k < 16; k++) {
+			r.m_ekey.k[k] = record[15 - k];
+		}
+		if (e.m_size < LocalStorage::kRecordHeaderSize || LoadLE32(record + 16) != (u32)e.m_size ||
+			memcmp(r.m_ekey.k, e.m_entry, local.m_keyBytes) != 0) {
+			bad->Append(_heap, e.m_entry, entrySize);
+			continue;
+		}
+		r.m_data = record + LocalStorage::kRecordHeaderSize;
+		r.m_size = e.m_size - LocalStorage::kRecordHeaderSize;
+		requests->Push(_heap, r);
+		oldEntries->Append(_heap, e.m_entry, entrySize);
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+// Copies the index into index, and lists its entries in entries, marking the
+// ones whose key is in the sorted live keys.
+static void copyIndex(Client *c, const Buffer<Key> &live, Buffer<u8> *index, Buffer<CompactEntry> *entries) {
+	const LocalStorage &local = *c->m_local;
+	int keyBytes = local.m_keyBytes;
+	int entrySize = keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	u64 offsetMask = ((u64)1 << local.m_offsetBits) - 1;
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		local.CopyEntries(b, _heap, index);
+	}
+	// Local keys are 9 bytes in every version seen; other widths search the
+	// sorted keys instead.
+	KeyMap<bool, 9> liveKeys;
+	liveKeys.Init();
+	if (keyBytes == 9) {
+		liveKeys.Reserve(_heap, live.m_size);
+		for (const Key &k : live) {
+			*liveKeys.Insert(_heap, k) = true;
+		}
+	}
+	int total = entrySize ? index->m_size / entrySize : 0;
+	for (int i = 0; i < total; i++) {
+		const u8 *e = index->m_storage + i * entrySize;
+		u64 location = LoadBE40(e + keyBytes);
+		CompactEntry entry;
+		entry.m_entry = e;
+		entry.m_archive = (int)(location >> local.m_offsetBits);
+		entry.m_offset = (int)(location & offsetMask);
+		entry.m_size = (int)LoadLE32(e + keyBytes + local.m_offsetBytes);
+		if (keyBytes == 9) {
+			entry.m_live = liveKeys.Find(e) != nullptr;
+		} else {
+			const Key *k = std::lower_bound(live.begin(), live.end(), e, [&](const Key &a, const u8 *b) {
+				return memcmp(a.k, b, keyBytes) < 0;
+			});
+			entry.m_live = k != live.end() && memcmp(k->k, e, keyBytes) == 0;
+		}
+		entry.m_at = 0;
+		if (entry.m_archive < 256) {
+			entries->Push(_heap, entry);
+		}
+	}
+	liveKeys.Destroy(_heap);
+}
+
+int Client::CompactLocal(int minWastePercent) {
+	if (!m_hasLocal || !m_writer) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	Client *c = this;
+	Buffer<Key> live;
+	live.Init();
+
+	// A shared store keeps what any retained build uses, as listed when
+	// the collection starts; no build is retained until it ends.
+	Client *store = m_store ? m_store : this;
+	std::lock_guard<std::mutex> collecting(m_writer->m_collectMutex);
+	Buffer<u8> retained;
+	retained.Init();
+	int err = NGDP_ERROR_SUCCESS;
+	if (store->ReadRetained(&retained)) {
+		err = store->RetainedKeys(retained, &live);
+	} else {
+		// Without a build, every file would look unused.
+		if (m_buildConfig.m_encoding[1].IsZero()) {
+			retained.Destroy(&store->m_heap);
+			live.Destroy(_heap);
+			return NGDP_ERROR_FILE_NOT_FOUND;
+		}
+		// The build's encoded keys, sorted: encoding itself and every file in it
+		live.Push(_heap, m_buildConfig.m_encoding[1]);
+		m_encoding.ForEach([&](const u8 *, const u8 *ekey, s64) {
+			Key key;
+			memset(key.k, 0, 16);
+			memcpy(key.k, ekey, m_encoding.m_ekeySize < 16 ? m_encoding.m_ekeySize : 16);
+			live.Push(_heap, key);
+			return NGDP_ERROR_SUCCESS;
+		});
+		std::sort(live.begin(), live.end(), [](const Key &a, const Key &b) {
+			return a < b;
+		});
+	}
+	retained.Destroy(&store->m_heap);
+	if (!err) {
+		err = Compact(live, minWastePercent);
+	}
+	live.Destroy(_heap);
+	return err;
+}
+
+int Client::Compact(const Buffer<Key> &live, int minWastePercent) {
+	Client *c = this;
+	const LocalStorage &local = *m_local;
+	int keyBytes = local.m_keyBytes;
+	int entrySize = keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+
+	// Measure each archive from a copy of the index: its extent, and how
+	// much of it the build uses.
+	Buffer<u8> index;
+	Buffer<CompactEntry> entries;
+	index.Init();
+	entries.Init();
+	copyIndex(c, live, &index, &entries);
+	s64 extent[256];
+	s64 used[256];
+	memset(extent, 0, sizeof(extent));
+	memset(used, 0, sizeof(used));
+	for (const CompactEntry &e : entries) {
+		s64 end = (s64)e.m_offset + e.m_size;
+		if (end > extent[e.m_archive]) {
+			extent[e.m_archive] = end;
+		}
+		if (e.m_live) {
+			used[e.m_archive] += e.m_size;
+		}
+	}
+	bool compact[256];
+	Buffer<int> archives;
+	archives.Init();
+	s64 wasted = 0;
+	for (int a = 0; a < 256; a++) {
+		s64 waste = extent[a] - used[a];
+		compact[a] = waste > 0 && waste * 100 >= (s64)minWastePercent * extent[a];
+		if (compact[a]) {
+			archives.Push(_heap, a);
+			wasted += waste;
+		}
+	}
+
+	// Stores go elsewhere from now on, so a second copy of the index lists
+	// every record the chosen archives will ever have.
+	int err = m_writer->Seal(archives.m_storage, archives.m_size);
+	index.m_size = 0;
+	entries.m_size = 0;
+	copyIndex(c, live, &index, &entries);
+
+	// Files to move, in key order, and the unused entries to drop
+	Buffer<CompactEntry> moves;
+	Buffer<u8> dropped;
+	moves.Init();
+	dropped.Init();
+	for (const CompactEntry &e : entries) {
+		if (!compact[e.m_archive]) {
+			continue;
+		}
+		if (e.m_live) {
+			moves.Push(_heap, e);
+		} else {
+			dropped.Append(_heap, e.m_entry, entrySize);
+		}
+	}
+	std::sort(moves.begin(), moves.end(), [&](const CompactEntry &a, const CompactEntry &b) {
+		return memcmp(a.m_entry, b.m_entry, keyBytes) < 0;
+	});
+
+	// Copy the live records in batches; each batch is appended and its
+	// entries republished before the next is read.
+	Buffer<u8> records;
+	Buffer<CascWriter::Request> requests;
+	Buffer<CascWriter::Request *> batch;
+	Buffer<u8> oldEntries;
+	records.Init();
+	requests.Init();
+	batch.Init();
+	oldEntries.Init();
+	s64 movedBytes = 0;
+	int movedCount = 0;
+	int droppedCount = dropped.m_size / entrySize;
+	for (int start = 0; !err && start < moves.m_size;) {
+		int end = start;
+		s64 size = 0;
+		while (end < moves.m_size && (end == start || size + moves[end].m_size <= kCompactBatchSize)) {
+			size += moves[end++].m_size;
+		}
+		requests.m_size = 0;
+		batch.m_size = 0;
+		oldEntries.m_size = 0;
+		err = readBatch(c, moves.m_storage + start, end - start, &records, &requests, &oldEntries, &dropped);
+		if (!err && requests.m_size) {
+			for (CascWriter::Request &r : requests) {
+				batch.Push(_heap, &r);
+			}
+			err = m_writer->Relocate(&batch, oldEntries.m_storage);
+			for (const CascWriter::Request &r : requests) {
+				movedBytes += r.m_size;
+			}
+			movedCount += requests.m_size;
+		}
+		start = end;
+	}
+	int bad = dropped.m_size / entrySize - droppedCount;
+	if (!err && dropped.m_size) {
+		err = m_writer->Drop(dropped.m_storage, dropped.m_size / entrySize);
+	}
+	int removed = 0;
+	if (!err && archives.m_size) {
+		err = m_writer->Retire(archives.m_storage, archives.m_size, &removed);
+	}
+	Log("Compacted %d local archives with %lld unused bytes, %d of them removed: moved %d files (%lld bytes), dropped %d unused and %d bad",
+		archives.m_size, (long long)wasted, removed, movedCount, (long long)movedBytes, droppedCount, bad);
+
+	oldEntries.Destroy(_heap);
+	batch.Destroy(_heap);
+	requests.Destroy(_heap);
+	records.Destroy(_heap);
+	dropped.Destroy(_heap);
+	moves.Destroy(_heap);
+	archives.Destroy(_heap);
+	entries.Destroy(_heap);
+	index.Destroy(_heap);
+	return err;
+}
+
+}
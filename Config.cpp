@@ -3,8 +3,7 @@
 
 namespace ngdp {
 
-// Parse an ini-like config file formatted as `# comment\nkey = value\n...`
-static void ParseConfig(Heap *h, const String &s, std::function<void(const String &key, const String &value)> onData) {
+void ParseConfig(Heap *h, const String &s, std::function<void(const String &key, const String &value)> onData) {
 	Buffer<String> lines = s.Split(h, "\n");
 	for (auto &line : lines) {
 		if (line.m_size == 0 || line[0] == '#') {
@@ -57,6 +56,7 @@ void CDNConfig::ParseKeyList(Heap *h, BufferSegment *seg, const String &keys) {
 			k->InitFromHexString(keyString);
 		}
 	}
+	keyStrings.Destroy(h);
 	seg->m_end = m_allKeys.m_size;
 }
 
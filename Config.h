@@ -3,8 +3,13 @@
 #include "Strings.h"
 #include "Key.h"
 
+#include <functional>
+
 namespace ngdp {
 
+// Parse an ini-like config file formatted as `# comment\nkey = value\n...`
+void ParseConfig(Heap *h, const String &s, std::function<void(const String &key, const String &value)> onData);
+
 struct CDNConfig {
 	Slice<Key> m_archives;
 	Key m_archiveGroup;
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "std.h"
+#include "Lock.h"
+
+namespace ngdp {
+
+// An exponentially weighted moving average of a rate or duration.
+struct Estimate {
+	f64 m_value;
+	int m_samples;
+
+	void Init(f64 initial) {
+		m_value = initial;
+		m_samples = 0;
+	}
+
+	void Add(f64 sample) {
+		// Weight early samples more heavily so the initial guess washes out
+		// quickly.
+		f64 weight = m_samples < 8 ? 1.0 / (m_samples + 1) : 0.125;
+		m_value += (sample - m_value) * weight;
+		m_samples++;
+	}
+};
+
+// CostModel estimates how long the different ways of obtaining a file will
+// take, from measurements of CDN requests, local archive reads and patching.
+// Each path is modeled as a per-request latency plus bytes over throughput.
+// Measurements come from many threads, so every access takes m_lock.
+struct CostModel {
+	mutable SpinLock m_lock;
+
+	// Seconds from issuing a CDN request to its completion, for small bodies
+	Estimate m_cdnLatency;
+	// Bytes per second of CDN bodies, beyond the latency
+	Estimate m_cdnThroughput;
+	// Bytes per second of local archive reads
+	Estimate m_diskThroughput;
+	// Target bytes per second of patch application, excluding I/O
+	Estimate m_patchThroughput;
+
+	// Bodies smaller than this are assumed to measure only latency
+	static const int kLatencyProbeSize = 16 * 1024;
+
+	void Init() {
+		m_lock.Init();
+		m_cdnLatency.Init(0.05);
+		m_cdnThroughput.Init(4.0 * 1024 * 1024);
+		m_diskThroughput.Init(100.0 * 1024 * 1024);
+		m_patchThroughput.Init(50.0 * 1024 * 1024);
+	}
+
+	void AddDownload(int bytes, f64 seconds) {
+		if (seconds <= 0) {
+			return;
+		}
+		SpinLockGuard lock(&m_lock);
+		if (bytes < kLatencyProbeSize) {
+			m_cdnLatency.Add(seconds);
+			return;
+		}
+		f64 transfer = seconds - m_cdnLatency.m_value;
+		if (transfer < seconds * 0.1) {
+			transfer = seconds * 0.1;
+		}
+		m_cdnThroughput.Add(bytes / transfer);
+	}
+
+	void AddDiskRead(int bytes, f64 seconds) {
+		if (seconds > 0 && bytes > 0) {
+			SpinLockGuard lock(&m_lock);
+			m_diskThroughput.Add(bytes / seconds);
+		}
+	}
+
+	void AddPatch(int targetBytes, f64 seconds) {
+		if (seconds > 0 && targetBytes > 0) {
+			SpinLockGuard lock(&m_lock);
+			m_patchThroughput.Add(targetBytes / seconds);
+		}
+	}
+
+	f64 DownloadSeconds(s64 bytes, int requests) const {
+		SpinLockGuard lock(&m_lock);
+		return requests * m_cdnLatency.m_value + bytes / m_cdnThroughput.m_value;
+	}
+
+	f64 DiskSeconds(s64 bytes) const {
+		SpinLockGuard lock(&m_lock);
+		return bytes / m_diskThroughput.m_value;
+	}
+
+	f64 PatchSeconds(s64 targetBytes) const {
+		SpinLockGuard lock(&m_lock);
+		return targetBytes / m_patchThroughput.m_value;
+	}
+};
+
+}
@@ -0,0 +1,293 @@
+#include "Crypt.h"
+#include "Bytes.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NGDP_SALSA20_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace ngdp {
+
+// The rounds are written once over a word type, so the scalar and vector
+// versions are the same code.
+static inline u32 add(u32 a, u32 b) {
+	return a + b;
+}
+
+static inline u32 rotateXor(u32 x, u32 sum, int bits) {
+	return x ^ ((sum << bits) | (sum >> (32 - bits)));
+}
+
+#ifdef NGDP_SALSA20_SSE2
+static inline __m128i add(__m128i a, __m128i b) {
+	return _mm_add_epi32(a, b);
+}
+
+static inline __m128i rotateXor(__m128i x, __m128i sum, int bits) {
+	return _mm_xor_si128(x, _mm_or_si128(_mm_slli_epi32(sum, bits), _mm_srli_epi32(sum, 32 - bits)));
+}
+#endif
+
+template <typename W>
+static inline void quarterRound(W &a, W &b, W &c, W &d) {
+	b = rotateXor(b, add(a, d), 7);
+	c = rotateXor(c, add(b, a), 9);
+	d = rotateXor(d, add(c, b), 13);
+	a = rotateXor(a, add(d, c), 18);
+}
+
+template <typename W>
+static void salsaRounds(W *x) {
+	for (int i = 0; i < 10; i++) {
+		// Columns
+		quarterRound(x[0], x[4], x[8], x[12]);
+		quarterRound(x[5], x[9], x[13], x[1]);
+		quarterRound(x[10], x[14], x[2], x[6]);
+		quarterRound(x[15], x[3], x[7], x[11]);
+		// Rows
+		quarterRound(x[0], x[1], x[2], x[3]);
+		quarterRound(x[5], x[6], x[7], x[4]);
+		quarterRound(x[10], x[11], x[8], x[9]);
+		quarterRound(x[15], x[12], x[13], x[14]);
+	}
+}
+
+void Salsa20::Init(const u8 *key, int keySize, const u8 *nonce) {
+	// "expand 32-byte k", or "expand 16-byte k" with the key used twice
+	const u8 *key2 = keySize == 32 ? key + 16 : key;
+	m_state[0] = 0x61707865;
+	m_state[5] = keySize == 32 ? 0x3320646e : 0x3120646e;
+	m_state[10] = keySize == 32 ? 0x79622d32 : 0x79622d36;
+	m_state[15] = 0x6b206574;
+	for (int i = 0; i < 4; i++) {
+		m_state[1 + i] = LoadLE32(key + 4 * i);
+		m_state[11 + i] = LoadLE32(key2 + 4 * i);
+	}
+	m_state[6] = LoadLE32(nonce);
+	m_state[7] = LoadLE32(nonce + 4);
+	m_state[8] = 0;
+	m_state[9] = 0;
+	m_used = 64;
+}
+
+// Writes the keystream block for the state's counter, and advances it.
+static void salsaBlock(u32 *state, u8 *out) {
+	u32 x[16];
+	memcpy(x, state, sizeof(x));
+	salsaRounds(x);
+	for (int i = 0; i < 16; i++) {
+		StoreLE32(out + 4 * i, x[i] + state[i]);
+	}
+	if (++state[8] == 0) {
+		state[9]++;
+	}
+}
+
+#ifdef NGDP_SALSA20_SSE2
+// XORs the four keystream blocks from the state's counter with src[0, 256)
+// into dst, and advances the counter by four.
+static void salsaBlocks4(u32 *state, const u8 *src, u8 *dst) {
+	__m128i x[16];
+	__m128i in[16];
+	for (int i = 0; i < 16; i++) {
+		in[i] = _mm_set1_epi32((int)state[i]);
+	}
+	// Lane j is block counter + j, carrying into the high word.
+	u64 counter = (u64)state[8] | ((u64)state[9] << 32);
+	u32 lo[4];
+	u32 hi[4];
+	for (int j = 0; j < 4; j++) {
+		lo[j] = (u32)(counter + j);
+		hi[j] = (u32)((counter + j) >> 32);
+	}
+	in[8] = _mm_setr_epi32((int)lo[0], (int)lo[1], (int)lo[2], (int)lo[3]);
+	in[9] = _mm_setr_epi32((int)hi[0], (int)hi[1], (int)hi[2], (int)hi[3]);
+	memcpy(x, in, sizeof(x));
+	salsaRounds(x);
+
+	// Each group of four words, transposed, is 16 bytes of each block.
+	for (int i = 0; i < 16; i += 4) {
+		__m128i a = _mm_add_epi32(x[i], in[i]);
+		__m128i b = _mm_add_epi32(x[i + 1], in[i + 1]);
+		__m128i c = _mm_add_epi32(x[i + 2], in[i + 2]);
+		__m128i d = _mm_add_epi32(x[i + 3], in[i + 3]);
+		__m128i ab0 = _mm_unpacklo_epi32(a, b);
+		__m128i ab1 = _mm_unpackhi_epi32(a, b);
+		__m128i cd0 = _mm_unpacklo_epi32(c, d);
+		__m128i cd1 = _mm_unpackhi_epi32(c, d);
+		__m128i rows[4] = {
+			_mm_unpacklo_epi64(ab0, cd0),
+			_mm_unpackhi_epi64(ab0, cd0),
+			_mm_unpacklo_epi64(ab1, cd1),
+			_mm_unpackhi_epi64(ab1, cd1),
+		};
+		for (int j = 0; j < 4; j++) {
+			int at = j * 64 + i * 4;
+			__m128i s = _mm_loadu_si128((const __m128i *)(src + at));
+			_mm_storeu_si128((__m128i *)(dst + at), _mm_xor_si128(s, rows[j]));
+		}
+	}
+	counter += 4;
+	state[8] = (u32)counter;
+	state[9] = (u32)(counter >> 32);
+}
+#endif
+
+void Salsa20::Apply(const u8 *src, u8 *dst, int size) {
+	while (size > 0 && m_used < 64) {
+		*dst++ = *src++ ^ m_block[m_used++];
+		size--;
+	}
+#ifdef NGDP_SALSA20_SSE2
+	while (size >= 256) {
+		salsaBlocks4(m_state, src, dst);
+		src += 256;
+		dst += 256;
+		size -= 256;
+	}
+#endif
+	while (size > 0) {
+		salsaBlock(m_state, m_block);
+		int n = size < 64 ? size : 64;
+		for (int i = 0; i < n; i++) {
+			dst[i] = src[i] ^ m_block[i];
+		}
+		m_used = n;
+		src += n;
+		dst += n;
+		size -= n;
+	}
+}
+
+void Arc4::Init(const u8 *key, int keySize) {
+	for (int i = 0; i < 256; i++) {
+		m_s[i] = (u8)i;
+	}
+	u8 j = 0;
+	for (int i = 0; i < 256; i++) {
+		j += m_s[i] + key[i % keySize];
+		u8 t = m_s[i];
+		m_s[i] = m_s[j];
+		m_s[j] = t;
+	}
+	m_i = 0;
+	m_j = 0;
+}
+
+void Arc4::Apply(const u8 *src, u8 *dst, int size) {
+	u8 i = m_i;
+	u8 j = m_j;
+	for (int n = 0; n < size; n++) {
+		i++;
+		j += m_s[i];
+		u8 t = m_s[i];
+		m_s[i] = m_s[j];
+		m_s[j] = t;
+		dst[n] = src[n] ^ m_s[(u8)(m_s[i] + m_s[j])];
+	}
+	m_i = i;
+	m_j = j;
+}
+
+void Keyring::Init() {
+	m_lock.Init();
+	m_entries.Init();
+}
+
+void Keyring::Destroy(Heap *h) {
+	m_entries.Destroy(h);
+}
+
+void Keyring::Add(Heap *h, u64 name, const u8 *key) {
+	SpinLockGuard lock(&m_lock);
+	int at = 0;
+	while (at < m_entries.m_size && m_entries[at].m_name < name) {
+		at++;
+	}
+	if (at == m_entries.m_size || m_entries[at].m_name != name) {
+		Entry e;
+		e.m_name = name;
+		m_entries.Push(h, e);
+		memmove(m_entries.m_storage + at + 1, m_entries.m_storage + at, (m_entries.m_size - 1 - at) * sizeof(Entry));
+		m_entries[at].m_name = name;
+	}
+	memcpy(m_entries[at].m_key, key, 16);
+}
+
+bool Keyring::Find(u64 name, u8 *key) const {
+	SpinLockGuard lock(&m_lock);
+	int lo = 0;
+	int hi = m_entries.m_size;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (m_entries[mid].m_name < name) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == m_entries.m_size || m_entries[lo].m_name != name) {
+		return false;
+	}
+	memcpy(key, m_entries[lo].m_key, 16);
+	return true;
+}
+
+// Parses exactly size * 2 hex digits into out, most significant first.
+static bool parseHex(const String &s, u8 *out, int size) {
+	if (s.m_size != size * 2) {
+		return false;
+	}
+	for (int i = 0; i < s.m_size; i++) {
+		u8 c = s[i];
+		u8 v;
+		if (c >= '0' && c <= '9') {
+			v = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			v = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			v = c - 'A' + 10;
+		} else {
+			return false;
+		}
+		out[i / 2] = (i & 1) ? (u8)(out[i / 2] | v) : (u8)(v << 4);
+	}
+	return true;
+}
+
+bool Keyring::Parse(Heap *h, const String &file) {
+	Buffer<String> lines = file.Split(h, "\n");
+	bool ok = true;
+	for (const String &l : lines) {
+		String line = l.Trim();
+		if (line.m_size == 0 || line[0] == '#') {
+			continue;
+		}
+		int sep = 0;
+		while (sep < line.m_size && !isspace(line[sep]) && line[sep] != '=' && line[sep] != ';') {
+			sep++;
+		}
+		String name = line.Substring(0, sep);
+		String key = line.Substring(sep < line.m_size ? sep + 1 : sep).Trim();
+		if (key.m_size && (key[0] == '=' || key[0] == ';')) {
+			key = key.Substring(1).Trim();
+		}
+		// Anything after the key, such as a description, is ignored.
+		int end = 0;
+		while (end < key.m_size && !isspace(key[end]) && key[end] != ';') {
+			end++;
+		}
+		key = key.Substring(0, end);
+		u8 nameBytes[8];
+		u8 keyBytes[16];
+		if (!parseHex(name, nameBytes, 8) || !parseHex(key, keyBytes, 16)) {
+			ok = false;
+			break;
+		}
+		Add(h, LoadBE64(nameBytes), keyBytes);
+	}
+	lines.Destroy(h);
+	return ok;
+}
+
+}
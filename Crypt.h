@@ -0,0 +1,68 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Lock.h"
+#include "Strings.h"
+
+namespace ngdp {
+
+// Salsa20/20 stream cipher, as used by encrypted BLTE chunks.  Where SSE2 is
+// available, four 64-byte blocks of keystream are made at once, one block per
+// vector lane.
+struct Salsa20 {
+	u32 m_state[16];
+	// Keystream of the last partly used block, and how much of it is used
+	u8 m_block[64];
+	int m_used;
+
+	// key is 16 or 32 bytes; nonce is 8 bytes.  The block counter starts at
+	// zero.
+	void Init(const u8 *key, int keySize, const u8 *nonce);
+
+	// XORs the next size bytes of keystream with src into dst, which may be
+	// src.
+	void Apply(const u8 *src, u8 *dst, int size);
+};
+
+// ARC4 (RC4) stream cipher
+struct Arc4 {
+	u8 m_s[256];
+	u8 m_i;
+	u8 m_j;
+
+	void Init(const u8 *key, int keySize);
+	void Apply(const u8 *src, u8 *dst, int size);
+};
+
+// The keys encrypted BLTE chunks name, by their 64-bit name.  Keys may be
+// added while other threads look them up.
+struct Keyring {
+	struct Entry {
+		u64 m_name;
+		u8 m_key[16];
+	};
+
+	mutable SpinLock m_lock;
+	// Sorted by name
+	Buffer<Entry> m_entries;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Adds a key, replacing any key of the same name.
+	void Add(Heap *h, u64 name, const u8 *key);
+
+	// Copies the key called name to key; returns false if there is none.
+	bool Find(u64 name, u8 *key) const;
+
+	// Adds the keys listed in file, one per line: the name as 16 hex digits
+	// (most significant first), then the key as 32, separated by spaces, a
+	// tab, '=' or ';', and optionally followed by a description.  Blank lines
+	// and lines starting with '#' are skipped.
+	// Returns false, having added the lines before it, if a line is malformed.
+	bool Parse(Heap *h, const String &file);
+};
+
+}
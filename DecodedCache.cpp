@@ -0,0 +1,194 @@
+#include "DecodedCache.h"
+#include "Bytes.h"
+#include "Client.h"
+
+#define _heap &m_client->m_heap
+
+namespace ngdp {
+
+CachedFile *CachedFile::Allocate(Heap *h, const Key &key, int size) {
+	CachedFile *file = (CachedFile *)h->Alloc(sizeof(CachedFile) + size);
+	memset((void *)file, 0, sizeof(CachedFile));
+	file->m_key = key;
+	file->m_size = size;
+	file->m_refs.store(1);
+	return file;
+}
+
+void CachedFile::Release(Heap *h, CachedFile *file) {
+	if (file && file->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		h->Free(file);
+	}
+}
+
+static s64 fileCost(const CachedFile *file) {
+	return (s64)sizeof(CachedFile) + file->m_size;
+}
+
+DecodedCache *DecodedCache::Create(Client *c, s64 budget) {
+	DecodedCache *cache = (DecodedCache *)c->m_heap.Alloc(sizeof(DecodedCache));
+	memset((void *)cache, 0, sizeof(DecodedCache));
+	cache->Init(c, budget);
+	return cache;
+}
+
+void DecodedCache::Free(DecodedCache *cache) {
+	if (cache) {
+		Heap h = cache->m_client->m_heap;
+		cache->Destroy();
+		h.Free(cache);
+	}
+}
+
+void DecodedCache::Init(Client *c, s64 budget) {
+	m_client = c;
+	for (Shard &s : m_shards) {
+		s.m_lock.Init();
+		s.m_files.Init();
+		s.m_budget = budget / kShardCount;
+	}
+}
+
+void DecodedCache::Destroy() {
+	for (Shard &s : m_shards) {
+		CachedFile *file = s.m_head;
+		while (file) {
+			CachedFile *next = file->m_next;
+			CachedFile::Release(_heap, file);
+			file = next;
+		}
+		s.m_files.Destroy(_heap);
+	}
+}
+
+DecodedCache::Shard &DecodedCache::ShardFor(const Key &key) {
+	return m_shards[key.k[15] & (kShardCount - 1)];
+}
+
+static int sketchIndex(const Key &key, int row) {
+	return row * DecodedCache::kSketchWidth + (int)((LoadLE32(key.k + 4 * row) >> 4) & (DecodedCache::kSketchWidth - 1));
+}
+
+void DecodedCache::Touch(Shard &s, const Key &key) {
+	for (int row = 0; row < kSketchRows; row++) {
+		u8 &counter = s.m_sketch[sketchIndex(key, row)];
+		if (counter < kSketchMax) {
+			counter++;
+		}
+	}
+	// Age the sketch so old popularity fades
+	if (++s.m_sketchAdds >= 10 * kSketchWidth) {
+		for (u8 &counter : s.m_sketch) {
+			counter >>= 1;
+		}
+		s.m_sketchAdds = 0;
+	}
+}
+
+int DecodedCache::Frequency(const Shard &s, const Key &key) const {
+	int frequency = kSketchMax;
+	for (int row = 0; row < kSketchRows; row++) {
+		int counter = s.m_sketch[sketchIndex(key, row)];
+		if (counter < frequency) {
+			frequency = counter;
+		}
+	}
+	return frequency;
+}
+
+void DecodedCache::Link(Shard &s, CachedFile *file) {
+	file->m_prev = nullptr;
+	file->m_next = s.m_head;
+	if (s.m_head) {
+		s.m_head->m_prev = file;
+	} else {
+		s.m_tail = file;
+	}
+	s.m_head = file;
+}
+
+void DecodedCache::Unlink(Shard &s, CachedFile *file) {
+	if (file->m_prev) {
+		file->m_prev->m_next = file->m_next;
+	} else {
+		s.m_head = file->m_next;
+	}
+	if (file->m_next) {
+		file->m_next->m_prev = file->m_prev;
+	} else {
+		s.m_tail = file->m_prev;
+	}
+	file->m_prev = nullptr;
+	file->m_next = nullptr;
+}
+
+CachedFile *DecodedCache::Find(const Key &key, bool record) {
+	Shard &s = ShardFor(key);
+	SpinLockGuard lock(&s.m_lock);
+	if (record) {
+		Touch(s, key);
+	}
+	CachedFile **found = s.m_files.Find(key);
+	CachedFile *file = found ? *found : nullptr;
+	if (file) {
+		file->m_refs.fetch_add(1, std::memory_order_relaxed);
+		Unlink(s, file);
+		Link(s, file);
+	}
+	return file;
+}
+
+CachedFile *DecodedCache::Insert(CachedFile *file) {
+	Shard &s = ShardFor(file->m_key);
+	s64 cost = fileCost(file);
+	// A file that would take most of its shard is not worth caching.
+	if (cost > s.m_budget / 2) {
+		return file;
+	}
+	CachedFile *evicted = nullptr;
+	{
+		SpinLockGuard lock(&s.m_lock);
+		CachedFile **found = s.m_files.Find(file->m_key);
+		if (found) {
+			CachedFile *resident = *found;
+			resident->m_refs.fetch_add(1, std::memory_order_relaxed);
+			Unlink(s, resident);
+			Link(s, resident);
+			CachedFile::Release(_heap, file);
+			return resident;
+		}
+
+		// Admit the file only if every victim it needs is less popular.
+		int frequency = Frequency(s, file->m_key);
+		s64 freed = 0;
+		for (CachedFile *v = s.m_tail; s.m_used - freed + cost > s.m_budget; v = v->m_prev) {
+			if (Frequency(s, v->m_key) >= frequency) {
+				return file;
+			}
+			freed += fileCost(v);
+		}
+		while (s.m_used + cost > s.m_budget) {
+			CachedFile *victim = s.m_tail;
+			Unlink(s, victim);
+			s.m_files.Remove(victim->m_key);
+			s.m_used -= fileCost(victim);
+			victim->m_evictedNext = evicted;
+			evicted = victim;
+		}
+
+		// The cache's own reference
+		file->m_refs.fetch_add(1, std::memory_order_relaxed);
+		*s.m_files.Insert(_heap, file->m_key) = file;
+		Link(s, file);
+		s.m_used += cost;
+	}
+	while (evicted) {
+		CachedFile *next = evicted->m_evictedNext;
+		m_client->Report(NGDP_STATISTIC_CACHE_EVICTED, evicted->m_size, 0, 0, &evicted->m_key);
+		CachedFile::Release(_heap, evicted);
+		evicted = next;
+	}
+	return file;
+}
+
+}
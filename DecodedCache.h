@@ -0,0 +1,89 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Key.h"
+#include "KeyMap.h"
+#include "Lock.h"
+
+namespace ngdp {
+
+struct Client;
+
+// A decoded file, with its data following the struct.  The cache holds one
+// reference while the file is resident, and every handle given out holds
+// another; the last Release frees it.
+struct CachedFile {
+	Key m_key;
+	int m_size;
+	std::atomic<int> m_refs;
+	// Only used under the owning shard's lock
+	CachedFile *m_prev;
+	CachedFile *m_next;
+	// Chains files evicted together, to be released unlocked
+	CachedFile *m_evictedNext;
+
+	u8 *Data() {
+		return (u8 *)(this + 1);
+	}
+
+	// Allocates an uncached file of size bytes with one reference.
+	static CachedFile *Allocate(Heap *h, const Key &key, int size);
+	static void Release(Heap *h, CachedFile *file);
+};
+
+// DecodedCache keeps whole decoded files in memory, keyed by content key,
+// within a byte budget.  Keys are spread over shards, each with its own lock,
+// hash table, LRU list and share of the budget.
+//
+// Eviction is from the LRU end, but admission follows TinyLFU: a count-min
+// sketch of recent lookups estimates how often each key is asked for, and a
+// new file only displaces files that are asked for less often.  A scan of
+// files read once therefore cannot flush the hot set.  The sketch's counters
+// are halved periodically so that it follows changes in popularity.
+struct DecodedCache {
+	static const int kShardCount = 16;
+	static const int kSketchRows = 4;
+	static const int kSketchWidth = 2048;
+	static const int kSketchMax = 15;
+
+	struct Shard {
+		SpinLock m_lock;
+		KeyMap<CachedFile *> m_files;
+		// Most and least recently used
+		CachedFile *m_head;
+		CachedFile *m_tail;
+		s64 m_used;
+		s64 m_budget;
+		u8 m_sketch[kSketchRows * kSketchWidth];
+		int m_sketchAdds;
+	};
+
+	Client *m_client;
+	Shard m_shards[kShardCount];
+
+	static DecodedCache *Create(Client *c, s64 budget);
+	static void Free(DecodedCache *cache);
+
+	// Returns the cached file with a reference for the caller, or null.  If
+	// record is set, the lookup counts towards the key's frequency.
+	CachedFile *Find(const Key &key, bool record);
+
+	// Offers file, which the caller holds a reference to, to the cache.
+	// Returns the resident file for key with the caller's reference moved to
+	// it: file itself, or a copy cached meanwhile by another thread, or file
+	// uncached if it was not admitted.
+	CachedFile *Insert(CachedFile *file);
+
+private:
+	void Init(Client *c, s64 budget);
+	void Destroy();
+	Shard &ShardFor(const Key &key);
+	void Touch(Shard &s, const Key &key);
+	int Frequency(const Shard &s, const Key &key) const;
+	void Link(Shard &s, CachedFile *file);
+	void Unlink(Shard &s, CachedFile *file);
+};
+
+}
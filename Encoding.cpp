@@ -0,0 +1,247 @@
+#include "Encoding.h"
+#include "Bytes.h"
+#include "ngdp.h"
+
+namespace ngdp {
+
+bool EncodingTable::Init(Heap *h, Buffer<u8> *data) {
+	m_data = *data;
+	data->Init();
+	m_especs.Init();
+
+	const u8 *p = m_data.m_storage;
+	int size = m_data.m_size;
+	if (size < kHeaderSize || p[0] != 'E' || p[1] != 'N' || p[2] != 1) {
+		return false;
+	}
+	m_ckeySize = p[3];
+	m_ekeySize = p[4];
+	m_cePageSize = LoadBE16(p + 5) * 1024;
+	m_ekeyPageSize = LoadBE16(p + 7) * 1024;
+	m_cePageCount = (int)LoadBE32(p + 9);
+	m_ekeyPageCount = (int)LoadBE32(p + 13);
+	int especBlockSize = (int)LoadBE32(p + 18);
+	if (m_ckeySize != 16 || m_ekeySize != 16) {
+		return false;
+	}
+
+	s64 ofs = kHeaderSize;
+	const u8 *especs = p + ofs;
+	ofs += especBlockSize;
+	m_cePageIndex = p + ofs;
+	ofs += (s64)m_cePageCount * (m_ckeySize + 16);
+	m_cePages = p + ofs;
+	ofs += (s64)m_cePageCount * m_cePageSize;
+	m_ekeyPageIndex = p + ofs;
+	ofs += (s64)m_ekeyPageCount * (m_ekeySize + 16);
+	m_ekeyPages = p + ofs;
+	ofs += (s64)m_ekeyPageCount * m_ekeyPageSize;
+	if (ofs > size) {
+		return false;
+	}
+
+	m_especs.Init(h, 64);
+	int start = 0;
+	for (int i = 0; i < especBlockSize; i++) {
+		if (especs[i] == 0) {
+			m_especs.Push(h, String(Slice<u8>{(u8 *)especs + start, i - start}));
+			start = i + 1;
+		}
+	}
+	return true;
+}
+
+void EncodingTable::Destroy(Heap *h) {
+	m_especs.Destroy(h);
+	m_data.Destroy(h);
+}
+
+const u8 *EncodingTable::FindPage(const u8 *pageIndex, const u8 *pages, int pageCount, int keySize, int pageSize, const Key &key) const {
+	// Page index entries are (first key, page md5), sorted by first key; find
+	// the last page whose first key is <= key.
+	int entrySize = keySize + 16;
+	int lo = 0;
+	int hi = pageCount;
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) >> 1);
+		if (memcmp(pageIndex + mid * entrySize, key.k, keySize) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return nullptr;
+	}
+	return pages + (s64)(lo - 1) * pageSize;
+}
+
+bool EncodingTable::FindContentKey(const Key &ckey, int *fileSize, Key *ekey) const {
+	const u8 *page = FindPage(m_cePageIndex, m_cePages, m_cePageCount, m_ckeySize, m_cePageSize, ckey);
+	if (!page) {
+		return false;
+	}
+	const u8 *end = page + m_cePageSize;
+	const u8 *p = page;
+	// entry = u8 keyCount | u40be fileSize | ckey | keyCount * ekey
+	while (p + 6 + m_ckeySize <= end) {
+		int keyCount = p[0];
+		if (keyCount == 0) {
+			break;
+		}
+		int cmp = memcmp(p + 6, ckey.k, m_ckeySize);
+		if (cmp == 0) {
+			*fileSize = (int)LoadBE40(p + 1);
+			memcpy(ekey->k, p + 6 + m_ckeySize, m_ekeySize);
+			return true;
+		} else if (cmp > 0) {
+			break;
+		}
+		p += 6 + m_ckeySize + keyCount * m_ekeySize;
+	}
+	return false;
+}
+
+bool EncodingTable::FindEncodedKey(const Key &ekey, int *encodedSize, int *especIndex) const {
+	const u8 *page = FindPage(m_ekeyPageIndex, m_ekeyPages, m_ekeyPageCount, m_ekeySize, m_ekeyPageSize, ekey);
+	if (!page) {
+		return false;
+	}
+	const u8 *end = page + m_ekeyPageSize;
+	const u8 *p = page;
+	// entry = ekey | u32be especIndex | u40be encodedSize
+	int entrySize = m_ekeySize + 9;
+	while (p + entrySize <= end) {
+		u32 index = LoadBE32(p + m_ekeySize);
+		if (index == 0xffffffff) {
+			break;
+		}
+		int cmp = memcmp(p, ekey.k, m_ekeySize);
+		if (cmp == 0) {
+			*especIndex = (int)index;
+			*encodedSize = (int)LoadBE40(p + m_ekeySize + 4);
+			return true;
+		} else if (cmp > 0) {
+			break;
+		}
+		p += entrySize;
+	}
+	return false;
+}
+
+// A position in the CE pages of a table; m_entry is null past the last page.
+struct CECursor {
+	const EncodingTable *m_table;
+	int m_page;
+	const u8 *m_entry;
+
+	void Init(const EncodingTable *table) {
+		m_table = table;
+		m_page = 0;
+		Load(m_table->m_cePages);
+	}
+
+	const u8 *PageStart() const {
+		return m_table->m_cePages + (s64)m_page * m_table->m_cePageSize;
+	}
+
+	const u8 *IndexEntry() const {
+		return m_table->m_cePageIndex + m_page * (m_table->m_ckeySize + 16);
+	}
+
+	bool AtPageStart() const {
+		return m_entry == PageStart();
+	}
+
+	const u8 *ContentKey() const {
+		return m_entry + 6;
+	}
+
+	const u8 *EncodedKey() const {
+		return m_entry + 6 + m_table->m_ckeySize;
+	}
+
+	s64 FileSize() const {
+		return (s64)LoadBE40(m_entry + 1);
+	}
+
+	// Moves to the entry at p in the current page, or to the next page with
+	// an entry if p is past the last one.
+	void Load(const u8 *p) {
+		for (;;) {
+			if (m_page >= m_table->m_cePageCount) {
+				m_entry = nullptr;
+				return;
+			}
+			// entry = u8 keyCount | u40be fileSize | ckey | keyCount * ekey
+			const u8 *end = PageStart() + m_table->m_cePageSize;
+			if (p + 6 + m_table->m_ckeySize <= end && p[0] != 0 &&
+				p + 6 + m_table->m_ckeySize + p[0] * m_table->m_ekeySize <= end) {
+				m_entry = p;
+				return;
+			}
+			m_page++;
+			p = PageStart();
+		}
+	}
+
+	void Next() {
+		Load(m_entry + 6 + m_table->m_ckeySize + m_entry[0] * m_table->m_ekeySize);
+	}
+
+	void SkipPage() {
+		m_page++;
+		Load(PageStart());
+	}
+};
+
+int EncodingTable::Diff(const EncodingTable &from, const EncodingTable &to, const EncodingDiffFn &onChange, int *pagesSkipped) {
+	*pagesSkipped = 0;
+	if (from.m_ckeySize != to.m_ckeySize || from.m_ekeySize != to.m_ekeySize) {
+		return NGDP_ERROR_UNSUPPORTED_ENCODING;
+	}
+	int keySize = from.m_ckeySize;
+	bool samePageSize = from.m_cePageSize == to.m_cePageSize;
+	CECursor a;
+	CECursor b;
+	a.Init(&from);
+	b.Init(&to);
+	int err = NGDP_ERROR_SUCCESS;
+	while (!err && (a.m_entry || b.m_entry)) {
+		if (a.m_entry && b.m_entry && samePageSize && a.AtPageStart() && b.AtPageStart() &&
+			memcmp(a.IndexEntry(), b.IndexEntry(), keySize + 16) == 0) {
+			a.SkipPage();
+			b.SkipPage();
+			++*pagesSkipped;
+			continue;
+		}
+		int cmp = !a.m_entry ? 1 : !b.m_entry ? -1 : memcmp(a.ContentKey(), b.ContentKey(), keySize);
+		if (cmp < 0) {
+			err = onChange(NGDP_DIFF_REMOVED, a.ContentKey(), a.EncodedKey(), nullptr, a.FileSize());
+			a.Next();
+		} else if (cmp > 0) {
+			err = onChange(NGDP_DIFF_ADDED, b.ContentKey(), nullptr, b.EncodedKey(), b.FileSize());
+			b.Next();
+		} else {
+			if (memcmp(a.EncodedKey(), b.EncodedKey(), from.m_ekeySize) != 0 || a.FileSize() != b.FileSize()) {
+				err = onChange(NGDP_DIFF_CHANGED, b.ContentKey(), a.EncodedKey(), b.EncodedKey(), b.FileSize());
+			}
+			a.Next();
+			b.Next();
+		}
+	}
+	return err;
+}
+
+int EncodingTable::ForEach(const EncodingFileFn &onFile) const {
+	CECursor cursor;
+	cursor.Init(this);
+	int err = NGDP_ERROR_SUCCESS;
+	while (!err && cursor.m_entry) {
+		err = onFile(cursor.ContentKey(), cursor.EncodedKey(), cursor.FileSize());
+		cursor.Next();
+	}
+	return err;
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Strings.h"
+#include "Key.h"
+
+#include <functional>
+
+namespace ngdp {
+
+// Called by EncodingTable::Diff for each content key that differs, with an
+// NGDP_DIFF change, the encoded keys before and after (null for a key added
+// or removed) and the file size in the newer table (the older for a removed
+// key).  Returns an NGDP_ERROR code; non-zero stops the diff.
+typedef std::function<int(int change, const u8 *ckey, const u8 *oldEkey, const u8 *newEkey, s64 fileSize)> EncodingDiffFn;
+
+// Called by EncodingTable::ForEach with each content key, its first encoded
+// key and its file size.  Returns an NGDP_ERROR code; non-zero stops the walk.
+typedef std::function<int(const u8 *ckey, const u8 *ekey, s64 fileSize)> EncodingFileFn;
+
+// EncodingTable is the decoded encoding file of a build.  It maps content keys
+// to encoded keys (CE pages) and encoded keys to their encoding spec and
+// encoded size (EKey-spec pages).  Lookups binary search the page index and
+// then scan a single page, so the table is kept in its file layout rather than
+// expanded into separate structures.
+struct EncodingTable {
+	Buffer<u8> m_data;
+
+	int m_ckeySize;
+	int m_ekeySize;
+	int m_cePageSize;
+	int m_ekeyPageSize;
+	int m_cePageCount;
+	int m_ekeyPageCount;
+
+	// ESpec strings, indexed by the EKey-spec entries; each is null-terminated
+	// within m_data.
+	Buffer<String> m_especs;
+
+	const u8 *m_cePageIndex;
+	const u8 *m_cePages;
+	const u8 *m_ekeyPageIndex;
+	const u8 *m_ekeyPages;
+
+	static const int kHeaderSize = 22;
+
+	// Parses a decoded encoding file.  The table takes ownership of data.
+	bool Init(Heap *h, Buffer<u8> *data);
+	void Destroy(Heap *h);
+
+	// Finds ckey in the CE pages, returning the decoded size and the first
+	// encoded key.
+	bool FindContentKey(const Key &ckey, int *fileSize, Key *ekey) const;
+
+	// Finds ekey in the EKey-spec pages, returning the encoded size and the
+	// index of its ESpec string in m_especs.
+	bool FindEncodedKey(const Key &ekey, int *encodedSize, int *especIndex) const;
+
+	// Walks the CE pages of from and to together in key order, passing each
+	// content key that was added, removed, or changed its first encoded key
+	// or size to onChange.  A pair of pages with the same page index entry
+	// (first key and MD5) is identical and skipped without being read, so
+	// builds that share most pages diff quickly.  Returns an NGDP_ERROR code,
+	// or the first non-zero result of onChange.
+	static int Diff(const EncodingTable &from, const EncodingTable &to, const EncodingDiffFn &onChange, int *pagesSkipped);
+
+	// Passes every content key to onFile in key order.  Returns the first
+	// non-zero result of onFile.
+	int ForEach(const EncodingFileFn &onFile) const;
+
+private:
+	const u8 *FindPage(const u8 *pageIndex, const u8 *pages, int pageCount, int keySize, int pageSize, const Key &key) const;
+};
+
+}
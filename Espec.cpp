@@ -0,0 +1,314 @@
+#include "Espec.h"
+
+namespace ngdp {
+
+void Espec::Init() {
+	m_blocks.Init();
+	m_chunked = false;
+}
+
+void Espec::Destroy(Heap *h) {
+	m_blocks.Destroy(h);
+}
+
+namespace {
+
+struct EspecParser {
+	const u8 *m_p;
+	const u8 *m_end;
+
+	bool Peek(u8 c) const {
+		return m_p < m_end && *m_p == c;
+	}
+
+	bool Accept(u8 c) {
+		if (Peek(c)) {
+			m_p++;
+			return true;
+		}
+		return false;
+	}
+
+	bool Number(int *value) {
+		if (m_p == m_end || !isdigit(*m_p)) {
+			return false;
+		}
+		s64 v = 0;
+		while (m_p < m_end && isdigit(*m_p)) {
+			v = v * 10 + (*m_p++ - '0');
+			if (v > 0x7fffffff) {
+				return false;
+			}
+		}
+		*value = (int)v;
+		return true;
+	}
+
+	bool Size(int *size) {
+		if (!Number(size)) {
+			return false;
+		}
+		s64 v = *size;
+		if (Accept('K')) {
+			v <<= 10;
+		} else if (Accept('M')) {
+			v <<= 20;
+		}
+		if (v <= 0 || v > 0x7fffffff) {
+			return false;
+		}
+		*size = (int)v;
+		return true;
+	}
+
+	// Parses a chunk codec: 'n' or 'z' with its options.
+	bool Codec(EspecBlock *block) {
+		block->m_level = 9;
+		block->m_windowBits = 15;
+		if (Accept('n')) {
+			block->m_codec = 'n';
+			return true;
+		}
+		if (!Accept('z')) {
+			return false;
+		}
+		block->m_codec = 'z';
+		if (!Accept(':')) {
+			return true;
+		}
+		bool braced = Accept('{');
+		int level;
+		if (!Number(&level) || level > 9) {
+			return false;
+		}
+		block->m_level = (s8)level;
+		if (braced) {
+			if (Accept(',')) {
+				int bits;
+				if (Accept('m')) {
+					// 'mpq' streams use the default window
+					if (!Accept('p') || !Accept('q')) {
+						return false;
+					}
+				} else if (!Number(&bits) || bits < 8 || bits > 15) {
+					return false;
+				} else {
+					block->m_windowBits = (s8)bits;
+				}
+			}
+			if (!Accept('}')) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool Block(Heap *h, Espec *spec) {
+		EspecBlock block;
+		if (Accept('*')) {
+			block.m_size = -1;
+			block.m_count = 1;
+		} else {
+			if (!Size(&block.m_size)) {
+				return false;
+			}
+			block.m_count = 1;
+			if (Accept('*')) {
+				if (!Number(&block.m_count)) {
+					block.m_count = -1;
+				} else if (block.m_count == 0) {
+					return false;
+				}
+			}
+		}
+		if (!Accept('=') || !Codec(&block)) {
+			return false;
+		}
+		spec->m_blocks.Push(h, block);
+		return true;
+	}
+};
+
+}
+
+bool Espec::Parse(Heap *h, const String &spec) {
+	m_blocks.m_size = 0;
+	m_chunked = false;
+	EspecParser p{spec.m_data, spec.m_data + spec.m_size};
+	if (p.Accept('b')) {
+		if (!p.Accept(':')) {
+			return false;
+		}
+		m_chunked = true;
+		if (p.Accept('{')) {
+			do {
+				if (!p.Block(h, this)) {
+					return false;
+				}
+			} while (p.Accept(','));
+			if (!p.Accept('}')) {
+				return false;
+			}
+		} else if (!p.Block(h, this)) {
+			return false;
+		}
+		// Nothing can follow a block that runs to the end of the file
+		for (int i = 0; i + 1 < m_blocks.m_size; i++) {
+			if (m_blocks[i].m_size < 0 || m_blocks[i].m_count < 0) {
+				return false;
+			}
+		}
+	} else {
+		EspecBlock block;
+		block.m_size = -1;
+		block.m_count = 1;
+		if (!p.Codec(&block)) {
+			return false;
+		}
+		m_blocks.Push(h, block);
+	}
+	return p.m_p == p.m_end;
+}
+
+void Espec::ChunkLayout(s64 fileSize, int *chunkCount, int *maxDecoded, int *maxEncoded) const {
+	int count = 0;
+	s64 maxSize = 0;
+	s64 maxZlibSize = 0;
+	bool anyZlib = false;
+	s64 remaining = fileSize;
+	for (const EspecBlock &block : m_blocks) {
+		if (remaining <= 0 && count > 0) {
+			break;
+		}
+		s64 chunks;
+		s64 largest;
+		if (block.m_size < 0) {
+			chunks = 1;
+			largest = remaining;
+		} else {
+			chunks = (remaining + block.m_size - 1) / block.m_size;
+			if (block.m_count >= 0 && chunks > block.m_count) {
+				chunks = block.m_count;
+			}
+			largest = remaining < block.m_size ? remaining : block.m_size;
+			if (chunks == 0) {
+				chunks = 1;
+			}
+		}
+		count += (int)chunks;
+		remaining -= chunks * (block.m_size < 0 ? remaining : block.m_size);
+		if (largest > maxSize) {
+			maxSize = largest;
+		}
+		if (block.m_codec == 'z') {
+			anyZlib = true;
+			if (largest > maxZlibSize) {
+				maxZlibSize = largest;
+			}
+		}
+	}
+	// zlib's compressBound for incompressible data, plus the mode byte
+	s64 encoded = maxSize + 1;
+	if (anyZlib) {
+		s64 bound = maxZlibSize + (maxZlibSize >> 12) + (maxZlibSize >> 14) + (maxZlibSize >> 25) + 13 + 1;
+		if (bound > encoded) {
+			encoded = bound;
+		}
+	}
+	*chunkCount = count;
+	*maxDecoded = maxSize > 0x7fffffff ? 0x7fffffff : (int)maxSize;
+	*maxEncoded = encoded > 0x7fffffff ? 0x7fffffff : (int)encoded;
+}
+
+int Espec::HeaderSize(int chunkCount) const {
+	if (!m_chunked) {
+		return 8;
+	}
+	return 12 + 24 * chunkCount;
+}
+
+void EspecCache::Init() {
+	m_entries.Init();
+	m_count = 0;
+}
+
+void EspecCache::Destroy(Heap *h) {
+	for (Entry &e : m_entries) {
+		if (e.m_spec) {
+			h->Free(e.m_spec);
+		}
+		if (e.m_plan) {
+			e.m_plan->Destroy(h);
+			h->Free(e.m_plan);
+		}
+	}
+	m_entries.Destroy(h);
+}
+
+static u32 hashSpec(const String &spec) {
+	// FNV-1a
+	u32 hash = 2166136261u;
+	for (int i = 0; i < spec.m_size; i++) {
+		hash = (hash ^ spec.m_data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+void EspecCache::Grow(Heap *h) {
+	Buffer<Entry> old = m_entries;
+	int capacity = old.m_size ? old.m_size * 2 : 16;
+	m_entries.Init(h, capacity);
+	memset(m_entries.m_storage, 0, capacity * sizeof(Entry));
+	m_entries.m_size = capacity;
+	for (const Entry &e : old) {
+		if (e.m_spec) {
+			int i = e.m_hash & (capacity - 1);
+			while (m_entries[i].m_spec) {
+				i = (i + 1) & (capacity - 1);
+			}
+			m_entries[i] = e;
+		}
+	}
+	old.Destroy(h);
+}
+
+const Espec *EspecCache::Get(Heap *h, const String &spec) {
+	u32 hash = hashSpec(spec);
+	if (m_entries.m_size) {
+		int mask = m_entries.m_size - 1;
+		for (int i = hash & mask; m_entries[i].m_spec; i = (i + 1) & mask) {
+			const Entry &e = m_entries[i];
+			if (e.m_hash == hash && e.m_specSize == spec.m_size && memcmp(e.m_spec, spec.m_data, spec.m_size) == 0) {
+				return e.m_plan;
+			}
+		}
+	}
+
+	// Keep the table at most half full
+	if ((m_count + 1) * 2 > m_entries.m_size) {
+		Grow(h);
+	}
+	Entry e;
+	e.m_hash = hash;
+	e.m_specSize = spec.m_size;
+	e.m_spec = (u8 *)h->Alloc(spec.m_size + 1);
+	memcpy(e.m_spec, spec.m_data, spec.m_size);
+	e.m_spec[spec.m_size] = 0;
+	e.m_plan = (Espec *)h->Alloc(sizeof(Espec));
+	e.m_plan->Init();
+	if (!e.m_plan->Parse(h, spec)) {
+		e.m_plan->Destroy(h);
+		h->Free(e.m_plan);
+		e.m_plan = nullptr;
+	}
+	int mask = m_entries.m_size - 1;
+	int i = hash & mask;
+	while (m_entries[i].m_spec) {
+		i = (i + 1) & mask;
+	}
+	m_entries[i] = e;
+	m_count++;
+	return e.m_plan;
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Strings.h"
+
+namespace ngdp {
+
+// One run of BLTE chunks produced by an encoding spec
+struct EspecBlock {
+	// Decoded bytes per chunk, or -1 for a single chunk holding the rest of
+	// the file
+	int m_size;
+	// Number of chunks of m_size, or -1 to repeat until the end of the file
+	int m_count;
+	// 'n' (stored) or 'z' (zlib)
+	u8 m_codec;
+	// zlib level and window bits
+	s8 m_level;
+	s8 m_windowBits;
+};
+
+// Espec is a parsed encoding spec (ESpec), the string that says how a file is
+// split into BLTE chunks and how each chunk is encoded:
+//
+//   spec  = 'n' | 'z' [':' level | ':{' level ',' (bits | 'mpq') '}'] |
+//           'b:' (block | '{' block (',' block)* '}')
+//   block = size ['*' [count]] '=' spec | '*=' spec
+//   size  = number ['K' | 'M']
+//
+// A size without a count is one chunk; 'size*' repeats until the end of the
+// file, and '*' is a single chunk holding whatever remains.  Only 'b:' specs
+// have a chunk table; any other spec is one chunk without one.  Encrypted
+// ('e:') and other codecs are not supported.
+struct Espec {
+	Buffer<EspecBlock> m_blocks;
+	bool m_chunked;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Returns false if spec is malformed or uses an unsupported codec.
+	bool Parse(Heap *h, const String &spec);
+
+	// Computes the chunks a file of fileSize decoded bytes is split into: the
+	// chunk count, the largest decoded chunk and an upper bound on the
+	// largest encoded chunk.
+	void ChunkLayout(s64 fileSize, int *chunkCount, int *maxDecoded, int *maxEncoded) const;
+	// Size of the BLTE header for chunkCount chunks
+	int HeaderSize(int chunkCount) const;
+};
+
+// EspecCache interns parsed encoding specs by their text, so each distinct
+// spec is parsed once per client however many files use it.  Plans live until
+// the cache is destroyed.
+struct EspecCache {
+	struct Entry {
+		u32 m_hash;
+		int m_specSize;
+		// Owned copy of the spec text
+		u8 *m_spec;
+		// null if the spec did not parse
+		Espec *m_plan;
+	};
+
+	// Open-addressed; the capacity is a power of two
+	Buffer<Entry> m_entries;
+	int m_count;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Returns the plan for spec, parsing it on first use; null if spec is
+	// malformed or unsupported.
+	const Espec *Get(Heap *h, const String &spec);
+
+private:
+	void Grow(Heap *h);
+};
+
+}
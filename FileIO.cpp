@@ -0,0 +1,140 @@
+#include "FileIO.h"
+#include "Strings.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+namespace ngdp {
+
+static int SyncFile(void *stream) {
+	FILE *f = (FILE *)stream;
+	if (fflush(f)) {
+		return -1;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(f));
+#else
+	return fsync(fileno(f));
+#endif
+}
+
+// Reads through the descriptor rather than stdio, whose buffer and position
+// belong to one thread at a time.  The archives are only ever read this way.
+static size_t ReadFileAt(void *buffer, size_t count, int64_t offset, void *stream) {
+	FILE *f = (FILE *)stream;
+	size_t done = 0;
+	while (done < count) {
+#ifdef _WIN32
+		OVERLAPPED o;
+		memset(&o, 0, sizeof(o));
+		u64 at = (u64)offset + done;
+		o.Offset = (DWORD)at;
+		o.OffsetHigh = (DWORD)(at >> 32);
+		DWORD n = 0;
+		if (!ReadFile((HANDLE)_get_osfhandle(_fileno(f)), (u8 *)buffer + done, (DWORD)(count - done), &n, &o) || n == 0) {
+			break;
+		}
+#else
+		ssize_t n = pread(fileno(f), (u8 *)buffer + done, count - done, (off_t)(offset + done));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+#endif
+		done += (size_t)n;
+	}
+	return done;
+}
+
+// Replaces to in one step, as rename does on POSIX; Windows' rename fails
+// if to exists.
+static int RenameReplacing(const char *from, const char *to) {
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+	return rename(from, to);
+#endif
+}
+
+static int ListDirectory(const char *path, ngdpDirectoryEntryFn onEntry, void *ctx) {
+#ifdef _WIN32
+	char pattern[MAX_PATH];
+	snprintf(pattern, MAX_PATH, "%s/*", path);
+	WIN32_FIND_DATAA fd;
+	HANDLE find = FindFirstFileA(pattern, &fd);
+	if (find == INVALID_HANDLE_VALUE) {
+		return 1;
+	}
+	do {
+		onEntry(ctx, fd.cFileName);
+	} while (FindNextFileA(find, &fd));
+	FindClose(find);
+	return 0;
+#else
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return 1;
+	}
+	while (struct dirent *entry = readdir(dir)) {
+		onEntry(ctx, entry->d_name);
+	}
+	closedir(dir);
+	return 0;
+#endif
+}
+
+void FileIO::InitStdio() {
+	m_fopen = (ngdpFileOpenFn)fopen;
+	m_fseek = (ngdpFileSeekFn)fseek;
+	m_fread = (ngdpFileReadFn)fread;
+	m_fwrite = (ngdpFileWriteFn)fwrite;
+	m_fclose = (ngdpFileCloseFn)fclose;
+	m_listDir = ngdp::ListDirectory;
+	m_sync = SyncFile;
+	m_freadAt = ReadFileAt;
+	m_rename = RenameReplacing;
+	m_remove = (ngdpFileRemoveFn)remove;
+}
+
+bool FileIO::WriteReplacing(Heap *h, const char *path, const std::function<bool(void *stream)> &write) {
+	// Write under a name unique to this process, then rename over the old
+	// file, so a reader sees either the old or the new file.
+	StackBuffer<u8, 512> tmpPath;
+	tmpPath.Init();
+	StringBuffer sb;
+	sb.Init(&tmpPath);
+	sb.AppendString(h, path);
+	sb.AppendChar(h, '.');
+#ifdef _WIN32
+	sb.AppendInt(h, _getpid());
+#else
+	sb.AppendInt(h, (int)getpid());
+#endif
+	sb.AppendString(h, ".tmp");
+	const char *tmp = sb.CString(h);
+
+	bool ok = false;
+	void *f = Open(tmp, "wb");
+	if (f) {
+		ok = write(f) && Sync(f) == 0;
+		ok = Close(f) == 0 && ok;
+		ok = ok && Rename(tmp, path) == 0;
+		if (!ok) {
+			Remove(tmp);
+		}
+	}
+	tmpPath.Destroy(h);
+	return ok;
+}
+
+}
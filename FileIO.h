@@ -2,6 +2,9 @@
 
 #include "std.h"
 #include "ngdp.h"
+#include "Heap.h"
+
+#include <functional>
 
 namespace ngdp {
 
@@ -11,6 +14,21 @@ struct FileIO {
 	ngdpFileReadFn m_fread;
 	ngdpFileWriteFn m_fwrite;
 	ngdpFileCloseFn m_fclose;
+	ngdpListDirectoryFn m_listDir;
+	ngdpFileSyncFn m_sync;
+	// Null if reads must seek the stream instead
+	ngdpFileReadAtFn m_freadAt;
+	ngdpFileRenameFn m_rename;
+	ngdpFileRemoveFn m_remove;
+
+	// Uses stdio, and the platform's calls for what it lacks.
+	void InitStdio();
+
+	// Replaces path with what write writes to the stream it is given, by
+	// writing a temporary file, syncing it and renaming it over path, so a
+	// reader sees either the old or the new file and a crash leaves one of
+	// them.  Returns false, leaving path as it was, if anything fails.
+	bool WriteReplacing(Heap *h, const char *path, const std::function<bool(void *stream)> &write);
 
 	void *Open(const char *filename, const char *mode) {
 		return m_fopen(filename, mode);
@@ -28,9 +46,29 @@ struct FileIO {
 		return m_fwrite(buffer, size, count, stream);
 	}
 
+	size_t ReadAt(void *buffer, size_t count, s64 offset, void *stream) {
+		return m_freadAt(buffer, count, offset, stream);
+	}
+
 	int Close(void *stream) {
 		return m_fclose(stream);
 	}
+
+	int Sync(void *stream) {
+		return m_sync(stream);
+	}
+
+	int Rename(const char *from, const char *to) {
+		return m_rename(from, to);
+	}
+
+	int Remove(const char *filename) {
+		return m_remove(filename);
+	}
+
+	int ListDirectory(const char *path, ngdpDirectoryEntryFn onEntry, void *ctx) {
+		return m_listDir(path, onEntry, ctx);
+	}
 };
 
 }
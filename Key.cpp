@@ -15,6 +15,23 @@ static u8 decodeHex(u8 c) {
 	return 0;
 }
 
+static bool isHex(u8 c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+bool Key::ParseHexString(const String &s) {
+	if (s.m_size != 32) {
+		return false;
+	}
+	for (int i = 0; i < 32; i++) {
+		if (!isHex(s[i])) {
+			return false;
+		}
+	}
+	InitFromHexString(s);
+	return true;
+}
+
 void Key::InitFromHexString(const String &s) {
 	assert(s.m_size == 32);
 	for (int i = 0; i < 16; i++) {
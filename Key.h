@@ -3,23 +3,97 @@
 #include "std.h"
 #include "Strings.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NGDP_KEY_SSE2 1
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 namespace ngdp {
 
+// Index of the lowest set bit; mask must not be zero.
+inline int FirstSetBit(u32 mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
 struct Key {
 	uint8_t k[16];
 
 	// Assigns key by decoding a 32-character hex-encoded String
 	void InitFromHexString(const String &s);
 
+	// As InitFromHexString, for text from outside, such as a command line.
+	// Returns false, leaving key unchanged, if s is not 32 hex digits.
+	bool ParseHexString(const String &s);
+
+	// Writes 00000000000000000000000000000000
+	void WriteHex(Heap *h, StringBuffer &sb) const {
+		for (int i = 0; i < 16; i++) {
+			sb.AppendHexByte(h, k[i]);
+		}
+	}
+
 	// Writes 00/00/00000000000000000000000000000000
 	void WriteURLFragment(Heap *h, StringBuffer &sb) const {
 		sb.AppendHexByte(h, k[0]);
 		sb.AppendChar(h, '/');
 		sb.AppendHexByte(h, k[1]);
 		sb.AppendChar(h, '/');
+		WriteHex(h, sb);
+	}
+
+	// Bit i is set where byte i of the keys is the same
+	u32 EqualMask(const Key &rhs) const {
+#ifdef NGDP_KEY_SSE2
+		__m128i a = _mm_loadu_si128((const __m128i *)k);
+		__m128i b = _mm_loadu_si128((const __m128i *)rhs.k);
+		return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+#else
+		u32 mask = 0;
 		for (int i = 0; i < 16; i++) {
-			sb.AppendHexByte(h, k[i]);
+			mask |= (u32)(k[i] == rhs.k[i]) << i;
+		}
+		return mask;
+#endif
+	}
+
+	bool operator==(const Key &rhs) const {
+		return EqualMask(rhs) == 0xffff;
+	}
+
+	bool operator!=(const Key &rhs) const {
+		return EqualMask(rhs) != 0xffff;
+	}
+
+	// Orders keys as memcmp does: by the first byte that differs
+	int Compare(const Key &rhs) const {
+		u32 differ = ~EqualMask(rhs) & 0xffff;
+		if (!differ) {
+			return 0;
+		}
+		int i = FirstSetBit(differ);
+		return (int)k[i] - (int)rhs.k[i];
+	}
+
+	bool operator<(const Key &rhs) const {
+		return Compare(rhs) < 0;
+	}
+
+	bool IsZero() const {
+		for (int i = 0; i < 16; i++) {
+			if (k[i]) {
+				return false;
+			}
 		}
+		return true;
 	}
 };
 
@@ -0,0 +1,53 @@
+#include "KeyFilter.h"
+#include "Bytes.h"
+
+namespace ngdp {
+
+void KeyFilter::Init() {
+	m_storage.Init();
+	m_blocks = nullptr;
+	m_blockCount = 0;
+}
+
+void KeyFilter::Destroy(Heap *h) {
+	m_storage.Destroy(h);
+	Init();
+}
+
+void KeyFilter::Reset(Heap *h, int count) {
+	u32 blockCount = (u32)(((s64)count * kBitsPerKey + 511) / 512);
+	if (blockCount == 0) {
+		blockCount = 1;
+	}
+	int words = (int)blockCount * kBlockWords + kBlockWords - 1;
+	if (m_storage.m_capacity < words) {
+		m_storage.Destroy(h);
+		m_storage.Init(h, words);
+	}
+	m_storage.m_size = words;
+	uptr aligned = ((uptr)m_storage.m_storage + 63) & ~(uptr)63;
+	m_blocks = (u64 *)aligned;
+	m_blockCount = blockCount;
+	memset(m_blocks, 0, blockCount * 64);
+}
+
+u64 KeyFilter::Hash(const u8 *key) {
+	u64 h = LoadLE64(key) ^ ((u64)key[8] * 0x9e3779b97f4a7c15ull);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return h;
+}
+
+void KeyFilter::Add(const u8 *key) {
+	u64 h = Hash(key);
+	u64 *block = m_blocks + BlockIndex(h) * kBlockWords;
+	u32 h1 = (u32)h;
+	u32 h2 = Step(h);
+	for (int i = 0; i < kProbes; i++, h1 += h2) {
+		u32 bit = h1 & 511;
+		block[bit >> 6] |= 1ull << (bit & 63);
+	}
+}
+
+}
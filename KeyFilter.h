@@ -0,0 +1,67 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Key.h"
+
+namespace ngdp {
+
+// KeyFilter is a blocked Bloom filter over encoded keys, kept beside an index
+// so that lookups of absent keys can skip its binary search.  Each key sets
+// kProbes bits within a single 64-byte block, so a miss costs one cache line.
+// At kBitsPerKey the false positive rate is about 1-2%.
+//
+// Only the first kKeyBytes of a key are hashed, since local .idx entries keep
+// no more.  Keys are md5 hashes already, so they are mixed rather than hashed.
+struct KeyFilter {
+	static const int kKeyBytes = 9;
+	static const int kBitsPerKey = 10;
+	static const int kProbes = 6;
+	static const int kBlockWords = 8;
+
+	Buffer<u64> m_storage;
+	// m_storage aligned to a block; null if no filter has been built
+	u64 *m_blocks;
+	u32 m_blockCount;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Clears the filter and sizes it for count keys.
+	void Reset(Heap *h, int count);
+	void Add(const u8 *key);
+
+	// False only if key was never added.  A filter that was never built
+	// cannot rule anything out.
+	bool MayContain(const u8 *key) const {
+		if (!m_blocks) {
+			return true;
+		}
+		u64 h = Hash(key);
+		const u64 *block = m_blocks + BlockIndex(h) * kBlockWords;
+		u32 h1 = (u32)h;
+		u32 h2 = Step(h);
+		for (int i = 0; i < kProbes; i++, h1 += h2) {
+			u32 bit = h1 & 511;
+			if (!(block[bit >> 6] & (1ull << (bit & 63)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static u64 Hash(const u8 *key);
+
+	// Multiply-shift instead of a modulo, from the bits the probes don't use
+	u32 BlockIndex(u64 h) const {
+		return (u32)(((h >> 32) * (u64)m_blockCount) >> 32);
+	}
+
+	// Odd, so the probes of a key are distinct bits
+	static u32 Step(u64 h) {
+		return (u32)((h * 0x9e3779b97f4a7c15ull) >> 40) | 1;
+	}
+};
+
+}
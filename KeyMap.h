@@ -0,0 +1,269 @@
+#pragma once
+
+#include "std.h"
+#include "Bytes.h"
+#include "Heap.h"
+#include "Key.h"
+
+namespace ngdp {
+
+// KeyMap is an open-addressing hash table from keys to trivially copyable
+// values, laid out as in SwissTable.  Slots are probed in aligned groups of
+// 16, whose control bytes hold 7 bits of each key's hash or mark the slot
+// empty or deleted, so one 128-bit compare picks out the few slots of a group
+// whose keys are worth comparing.  Keys are md5 hashes, so their first 8
+// bytes serve as the hash as they are.
+//
+// With KeySize 9, only the first 9 bytes of each key are kept, as local .idx
+// files do; keys that agree in those are the same key to the map.
+//
+// Value pointers are valid until the next Insert or Reserve.
+template <typename V, int KeySize = 16>
+struct KeyMap {
+	static const int kGroupSize = 16;
+	static const u8 kEmpty = 0x80;
+	static const u8 kDeleted = 0xfe;
+
+	struct Slot {
+		u8 m_key[KeySize];
+		V m_value;
+	};
+
+	// The control bytes, then the slots, in one allocation; null until the
+	// first Insert or Reserve
+	u8 *m_control;
+	Slot *m_slots;
+	// A power of two, and at least kGroupSize
+	int m_capacity;
+	int m_size;
+	// Slots marked deleted, which probes pass over until the next rehash
+	int m_deleted;
+
+	void Init() {
+		m_control = nullptr;
+		m_slots = nullptr;
+		m_capacity = 0;
+		m_size = 0;
+		m_deleted = 0;
+	}
+
+	void Destroy(Heap *h) {
+		if (m_control) {
+			h->Free(m_control);
+		}
+		Init();
+	}
+
+	void Clear() {
+		if (m_control) {
+			memset(m_control, kEmpty, m_capacity);
+		}
+		m_size = 0;
+		m_deleted = 0;
+	}
+
+	// Makes room for count keys without rehashing.
+	void Reserve(Heap *h, int count) {
+		if (count > Limit(m_capacity)) {
+			Rehash(h, count);
+		}
+	}
+
+	V *Find(const u8 *key) {
+		int i = FindIndex(key);
+		return i < 0 ? nullptr : &m_slots[i].m_value;
+	}
+
+	const V *Find(const u8 *key) const {
+		int i = FindIndex(key);
+		return i < 0 ? nullptr : &m_slots[i].m_value;
+	}
+
+	V *Find(const Key &key) {
+		return Find(key.k);
+	}
+
+	const V *Find(const Key &key) const {
+		return Find(key.k);
+	}
+
+	// Returns key's value, adding key with a zeroed value if it is absent.
+	V *Insert(Heap *h, const u8 *key, bool *added = nullptr) {
+		int i = FindIndex(key);
+		if (added) {
+			*added = i < 0;
+		}
+		if (i >= 0) {
+			return &m_slots[i].m_value;
+		}
+		if (m_size + m_deleted + 1 > Limit(m_capacity)) {
+			Rehash(h, m_size + 1);
+		}
+		u64 hash = Hash(key);
+		i = FreeIndex(hash);
+		if (m_control[i] == kDeleted) {
+			m_deleted--;
+		}
+		m_control[i] = Tag(hash);
+		memcpy(m_slots[i].m_key, key, KeySize);
+		memset((void *)&m_slots[i].m_value, 0, sizeof(V));
+		m_size++;
+		return &m_slots[i].m_value;
+	}
+
+	V *Insert(Heap *h, const Key &key, bool *added = nullptr) {
+		return Insert(h, key.k, added);
+	}
+
+	// Returns false if key was absent.
+	bool Remove(const u8 *key) {
+		int i = FindIndex(key);
+		if (i < 0) {
+			return false;
+		}
+		// Probes only go on past groups with no empty slot, so if this group
+		// has one, no other key's probe relies on this slot being taken.
+		const u8 *group = m_control + (i & ~(kGroupSize - 1));
+		if (Match(group, kEmpty)) {
+			m_control[i] = kEmpty;
+		} else {
+			m_control[i] = kDeleted;
+			m_deleted++;
+		}
+		m_size--;
+		return true;
+	}
+
+	bool Remove(const Key &key) {
+		return Remove(key.k);
+	}
+
+	// Calls fn(key, value) for every key, in no particular order.
+	template <typename Fn>
+	void ForEach(Fn fn) const {
+		for (int i = 0; i < m_capacity; i++) {
+			if (!(m_control[i] & 0x80)) {
+				fn((const u8 *)m_slots[i].m_key, (const V &)m_slots[i].m_value);
+			}
+		}
+	}
+
+private:
+	static u64 Hash(const u8 *key) {
+		return LoadLE64(key);
+	}
+
+	// The hash bits kept in the control byte; the rest pick the group
+	static u8 Tag(u64 hash) {
+		return (u8)(hash & 0x7f);
+	}
+
+	// Keys a table of capacity slots holds before it grows: 7/8 full
+	static int Limit(int capacity) {
+		return capacity - (capacity >> 3);
+	}
+
+	static bool Equal(const u8 *a, const u8 *b) {
+		return KeySize == 16 ? *(const Key *)a == *(const Key *)b : memcmp(a, b, KeySize) == 0;
+	}
+
+	// Bit i is set where group[i] == b
+	static u32 Match(const u8 *group, u8 b) {
+#ifdef NGDP_KEY_SSE2
+		__m128i control = _mm_loadu_si128((const __m128i *)group);
+		return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)b)));
+#else
+		u32 mask = 0;
+		for (int i = 0; i < kGroupSize; i++) {
+			mask |= (u32)(group[i] == b) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Bit i is set where group[i] is empty or deleted, which both have the
+	// high bit set
+	static u32 MatchFree(const u8 *group) {
+#ifdef NGDP_KEY_SSE2
+		return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+		u32 mask = 0;
+		for (int i = 0; i < kGroupSize; i++) {
+			mask |= (u32)(group[i] >> 7) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Groups are visited at triangular offsets, which reach every group of
+	// a power-of-two table.  A group with an empty slot ends the probe.
+	int FindIndex(const u8 *key) const {
+		if (!m_control) {
+			return -1;
+		}
+		u64 hash = Hash(key);
+		u8 tag = Tag(hash);
+		u32 groupMask = (u32)(m_capacity / kGroupSize - 1);
+		u32 group = (u32)(hash >> 7) & groupMask;
+		for (u32 step = 1;; step++) {
+			const u8 *control = m_control + group * kGroupSize;
+			for (u32 match = Match(control, tag); match; match &= match - 1) {
+				int i = (int)(group * kGroupSize) + FirstSetBit(match);
+				if (Equal(m_slots[i].m_key, key)) {
+					return i;
+				}
+			}
+			if (Match(control, kEmpty)) {
+				return -1;
+			}
+			group = (group + step) & groupMask;
+		}
+	}
+
+	// The first empty or deleted slot on hash's probe sequence; the table is
+	// never full.
+	int FreeIndex(u64 hash) const {
+		u32 groupMask = (u32)(m_capacity / kGroupSize - 1);
+		u32 group = (u32)(hash >> 7) & groupMask;
+		for (u32 step = 1;; step++) {
+			u32 free = MatchFree(m_control + group * kGroupSize);
+			if (free) {
+				return (int)(group * kGroupSize) + FirstSetBit(free);
+			}
+			group = (group + step) & groupMask;
+		}
+	}
+
+	// Moves every key into a table with room for count, dropping deleted
+	// slots.
+	void Rehash(Heap *h, int count) {
+		int capacity = kGroupSize;
+		while (Limit(capacity) < count) {
+			capacity *= 2;
+		}
+		u8 *oldControl = m_control;
+		Slot *oldSlots = m_slots;
+		int oldCapacity = m_capacity;
+		// The control bytes are a multiple of 16 long, so the slots after
+		// them are as aligned as the allocation.  Groups are loaded
+		// unaligned, since 32-bit allocations are only 8-byte aligned.
+		m_control = (u8 *)h->Alloc(capacity + capacity * sizeof(Slot));
+		m_slots = (Slot *)(m_control + capacity);
+		m_capacity = capacity;
+		m_deleted = 0;
+		memset(m_control, kEmpty, capacity);
+		for (int i = 0; i < oldCapacity; i++) {
+			if (!(oldControl[i] & 0x80)) {
+				u64 hash = Hash(oldSlots[i].m_key);
+				int j = FreeIndex(hash);
+				m_control[j] = Tag(hash);
+				memcpy((void *)&m_slots[j], (const void *)&oldSlots[i], sizeof(Slot));
+			}
+		}
+		if (oldControl) {
+			h->Free(oldControl);
+		}
+	}
+};
+
+}
@@ -0,0 +1,338 @@
+#include "LocalStorage.h"
+#include "Bytes.h"
+#include "Client.h"
+
+#include <stdarg.h>
+#include <chrono>
+
+#define _heap &m_client->m_heap
+
+namespace ngdp {
+
+static void ignoreFile(void *, const char *) {
+}
+
+bool LocalStorage::Init(Client *c, const char *cascPath) {
+	memset(this, 0, sizeof(*this));
+	m_client = c;
+
+	StringBuffer sb;
+	sb.Init(&m_path);
+	sb.AppendString(_heap, cascPath);
+	sb.AppendString(_heap, "/Data/data/");
+	m_dataPathSize = m_path.m_size;
+
+	int loaded = 0;
+	int found = 0;
+	for (int i = 0; i < kBucketCount; i++) {
+		m_buckets[i][0].Init();
+		m_buckets[i][1].Init();
+		m_filters[i][0].Init();
+		m_filters[i][1].Init();
+		int version = FindIndexVersion(i);
+		if (version >= 0) {
+			found++;
+		}
+		if (version >= 0 && LoadBucket(i, version)) {
+			loaded++;
+		}
+	}
+	m_path.m_size = m_dataPathSize;
+	if (found == 0 && m_client->m_file.ListDirectory(sb.CString(_heap), ignoreFile, nullptr) == 0) {
+		// An existing Data/data without any index is a new installation,
+		// with the usual version 7 layout.
+		m_keyBytes = 9;
+		m_offsetBytes = 5;
+		m_sizeBytes = 4;
+		m_offsetBits = 30;
+		m_archiveSizeLimit = (u64)1 << 30;
+		return true;
+	}
+	if (loaded == 0) {
+		m_client->Log("No local CASC index in %s", cascPath);
+		return false;
+	}
+	return true;
+}
+
+void LocalStorage::Destroy() {
+	for (int i = 0; i < 256; i++) {
+		void *f = m_archives[i].exchange(nullptr);
+		if (f) {
+			m_client->m_file.Close(f);
+		}
+	}
+	for (int i = 0; i < kBucketCount; i++) {
+		m_buckets[i][0].Destroy(_heap);
+		m_buckets[i][1].Destroy(_heap);
+		m_filters[i][0].Destroy(_heap);
+		m_filters[i][1].Destroy(_heap);
+	}
+	m_path.Destroy(_heap);
+}
+
+const char *LocalStorage::DataPath(const char *fmt, ...) {
+	m_path.m_size = m_dataPathSize;
+	char *dst = (char *)m_path.Alloc(_heap, 64);
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(dst, 64, fmt, args);
+	va_end(args);
+	return (const char *)m_path.m_storage;
+}
+
+int LocalStorage::Bucket(const Key &ekey) {
+	u8 h = 0;
+	for (int i = 0; i < 9; i++) {
+		h ^= ekey.k[i];
+	}
+	return (h & 0xf) ^ (h >> 4);
+}
+
+struct IndexVersionSearch {
+	int m_bucket;
+	int m_version;
+};
+
+static void onIndexFile(void *ctx, const char *name) {
+	// Index files are named BBVVVVVVVV.idx: bucket, then version, in hex
+	IndexVersionSearch *search = (IndexVersionSearch *)ctx;
+	String s(name);
+	if (s.m_size != 14 || !(s.Substring(10) == ".idx")) {
+		return;
+	}
+	if ((int)s.Substring(0, 2).ParseUint(16) != search->m_bucket) {
+		return;
+	}
+	int version = (int)s.Substring(2, 10).ParseUint(16);
+	if (version > search->m_version) {
+		search->m_version = version;
+	}
+}
+
+int LocalStorage::FindIndexVersion(int bucket) {
+	IndexVersionSearch search;
+	search.m_bucket = bucket;
+	search.m_version = -1;
+	m_path.m_size = m_dataPathSize;
+	StringBuffer sb;
+	sb.Init(&m_path);
+	m_client->m_file.ListDirectory(sb.CString(_heap), onIndexFile, &search);
+	return search.m_version;
+}
+
+bool LocalStorage::LoadBucket(int bucket, int version) {
+	void *f = m_client->m_file.Open(DataPath("%02x%08x.idx", bucket, version), "rb");
+	if (!f) {
+		return false;
+	}
+	u8 header[kIndexEntriesOffset];
+	bool ok = m_client->m_file.Read(header, 1, sizeof(header), f) == sizeof(header);
+	if (ok) {
+		int indexVersion = LoadLE16(header + 8);
+		int sizeBytes = header[12];
+		int offsetBytes = header[13];
+		int keyBytes = header[14];
+		int offsetBits = header[15];
+		ok = indexVersion == 7 && header[10] == bucket && sizeBytes == 4 && offsetBytes == 5 && keyBytes == 9 && offsetBits > 0 && offsetBits < 40;
+		m_sizeBytes = sizeBytes;
+		m_offsetBytes = offsetBytes;
+		m_keyBytes = keyBytes;
+		m_offsetBits = offsetBits;
+		m_archiveSizeLimit = LoadLE64(header + 16);
+	}
+	if (ok) {
+		int entriesSize = (int)LoadLE32(header + 0x20);
+		Buffer<u8> *entries = &m_buckets[bucket][0];
+		entries->Init();
+		u8 *dst = entries->Alloc(_heap, entriesSize);
+		entries->m_size = (int)m_client->m_file.Read(dst, 1, entriesSize, f);
+		ok = entries->m_size == entriesSize;
+		m_bucketVersions[bucket] = version;
+		if (ok) {
+			BuildFilter(bucket, 0);
+		}
+	}
+	m_client->m_file.Close(f);
+	return ok;
+}
+
+void LocalStorage::BuildFilter(int bucket, int slot) {
+	int entrySize = m_keyBytes + m_offsetBytes + m_sizeBytes;
+	const Buffer<u8> &entries = m_buckets[bucket][slot];
+	int count = entries.m_size / entrySize;
+	KeyFilter &filter = m_filters[bucket][slot];
+	filter.Reset(_heap, count);
+	for (int i = 0; i < count; i++) {
+		filter.Add(entries.m_storage + i * entrySize);
+	}
+}
+
+void LocalStorage::ReplaceBucket(int bucket, int version, Buffer<u8> *entries) {
+	// The other slot is empty: the previous replacement freed it.
+	int slot = m_bucketSlot[bucket].load();
+	m_buckets[bucket][slot ^ 1] = *entries;
+	entries->Init();
+	BuildFilter(bucket, slot ^ 1);
+	m_bucketVersions[bucket] = version;
+	m_bucketSlot[bucket].store(slot ^ 1);
+	// Readers that entered the old slot before the switch may still be
+	// searching it; later readers find the new one.
+	while (m_bucketReaders[bucket][slot].load()) {
+		std::this_thread::yield();
+	}
+	m_buckets[bucket][slot].Destroy(_heap);
+	m_buckets[bucket][slot].Init();
+	m_filters[bucket][slot].Destroy(_heap);
+}
+
+void LocalStorage::CopyEntries(int bucket, Heap *h, Buffer<u8> *out) const {
+	// Enter the slot as Find does, so it is not freed while being copied.
+	int slot;
+	for (;;) {
+		slot = m_bucketSlot[bucket].load();
+		m_bucketReaders[bucket][slot].fetch_add(1);
+		if (m_bucketSlot[bucket].load() == slot) {
+			break;
+		}
+		m_bucketReaders[bucket][slot].fetch_sub(1);
+	}
+	const Buffer<u8> &entries = m_buckets[bucket][slot];
+	if (entries.m_size) {
+		out->Append(h, entries.m_storage, entries.m_size);
+	}
+	m_bucketReaders[bucket][slot].fetch_sub(1);
+}
+
+bool LocalStorage::Find(const Key &ekey, LocalIndexEntry *entry) const {
+	int entrySize = m_keyBytes + m_offsetBytes + m_sizeBytes;
+	if (entrySize == 0) {
+		return false;
+	}
+	// Enter the current slot, retrying if it was switched in between, so
+	// ReplaceBucket sees this reader before freeing the entries.
+	int bucket = Bucket(ekey);
+	int slot;
+	for (;;) {
+		slot = m_bucketSlot[bucket].load();
+		m_bucketReaders[bucket][slot].fetch_add(1);
+		if (m_bucketSlot[bucket].load() == slot) {
+			break;
+		}
+		m_bucketReaders[bucket][slot].fetch_sub(1);
+	}
+	if (!m_filters[bucket][slot].MayContain(ekey.k)) {
+		m_bucketReaders[bucket][slot].fetch_sub(1);
+		return false;
+	}
+	const Buffer<u8> &entries = m_buckets[bucket][slot];
+	bool found = false;
+	int lo = 0;
+	int hi = entries.m_size / entrySize;
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) >> 1);
+		const u8 *e = entries.m_storage + mid * entrySize;
+		int cmp = memcmp(e, ekey.k, m_keyBytes);
+		if (cmp == 0) {
+			u64 location = LoadBE40(e + m_keyBytes);
+			entry->m_archive = (int)(location >> m_offsetBits);
+			entry->m_offset = (int)(location & ((1ull << m_offsetBits) - 1));
+			entry->m_size = (int)LoadLE32(e + m_keyBytes + m_offsetBytes);
+			found = true;
+			break;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	m_bucketReaders[bucket][slot].fetch_sub(1);
+	return found;
+}
+
+bool LocalStorage::Read(int archive, int offset, int size, u8 *dst, const Key *key) {
+	if (archive < 0 || archive >= 256) {
+		return false;
+	}
+	void *f = m_archives[archive].load(std::memory_order_acquire);
+	if (!f) {
+		SpinLockGuard lock(&m_archiveLocks[archive]);
+		f = m_archives[archive].load(std::memory_order_relaxed);
+		if (!f) {
+			// m_path is shared, so build the name here
+			char name[16];
+			snprintf(name, sizeof(name), "data.%03d", archive);
+			StackBuffer<u8, 256> path;
+			path.Init();
+			path.Append(_heap, m_path.m_storage, m_dataPathSize);
+			path.Append(_heap, (const u8 *)name, (int)strlen(name) + 1);
+			f = m_client->m_file.Open((const char *)path.m_storage, "rb");
+			path.Destroy(_heap);
+			if (!f) {
+				return false;
+			}
+			m_archives[archive].store(f, std::memory_order_release);
+		}
+	}
+	m_client->Report(NGDP_STATISTIC_CASC_READ_STARTED, archive, offset, size, key);
+	auto start = std::chrono::system_clock::now();
+	int read = 0;
+	{
+		TraceSpan span(Client::CurrentTracer(m_client), "disk", "local read");
+		if (key) {
+			span.SetKey("ckey", *key);
+		}
+		span.SetValue("archive", archive);
+		if (m_client->m_file.m_freadAt) {
+			read = (int)m_client->m_file.ReadAt(dst, size, offset, f);
+		} else {
+			SpinLockGuard lock(&m_archiveLocks[archive]);
+			if (m_client->m_file.Seek(f, offset, SEEK_SET) == 0) {
+				read = (int)m_client->m_file.Read(dst, 1, size, f);
+			}
+		}
+		span.SetBytes(read);
+		span.SetError(read == size ? NGDP_ERROR_SUCCESS : NGDP_ERROR_FILE_READ_FAILED);
+	}
+	int elapsed_us = (int)(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start).count());
+	m_client->Report(NGDP_STATISTIC_CASC_READ_FINISHED, archive, read, elapsed_us, key);
+	m_client->m_cost.AddDiskRead(read, elapsed_us / 1e6);
+	return read == size;
+}
+
+bool LocalStorage::ReadRecord(const Key &ekey, int offset, int size, u8 *dst, const Key *key) {
+	int epoch;
+	for (;;) {
+		epoch = m_readEpoch.load();
+		m_epochReaders[epoch].fetch_add(1);
+		if (m_readEpoch.load() == epoch) {
+			break;
+		}
+		m_epochReaders[epoch].fetch_sub(1);
+	}
+	LocalIndexEntry entry;
+	bool ok = Find(ekey, &entry) && offset + (s64)size <= entry.m_size - kRecordHeaderSize &&
+		Read(entry.m_archive, entry.m_offset + kRecordHeaderSize + offset, size, dst, key);
+	m_epochReaders[epoch].fetch_sub(1);
+	return ok;
+}
+
+void LocalStorage::WaitForReaders() {
+	// Readers entering from now on see the index as it is now; the ones
+	// counted in the old epoch may have looked up an older version.
+	int epoch = m_readEpoch.load();
+	m_readEpoch.store(epoch ^ 1);
+	while (m_epochReaders[epoch].load()) {
+		std::this_thread::yield();
+	}
+}
+
+void LocalStorage::CloseArchive(int archive) {
+	SpinLockGuard lock(&m_archiveLocks[archive]);
+	void *f = m_archives[archive].exchange(nullptr);
+	if (f) {
+		m_client->m_file.Close(f);
+	}
+}
+
+}
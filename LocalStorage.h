@@ -0,0 +1,125 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Strings.h"
+#include "Key.h"
+#include "Lock.h"
+#include "KeyFilter.h"
+
+namespace ngdp {
+
+struct Client;
+
+// Location of an encoded file in a local data.NNN archive.  m_offset points to
+// the 30-byte record header, and m_size includes it.
+struct LocalIndexEntry {
+	int m_archive;
+	int m_offset;
+	int m_size;
+};
+
+// LocalStorage reads a local CASC installation: the 16 bucketed .idx files in
+// Data/data, which map truncated encoded keys to archive locations, and the
+// data.NNN archives they point into.
+//
+// .idx (version 7) layout, little-endian unless noted:
+//   0x00 u32 headerSize | u32 headerHash | u16 version | u8 bucket | u8 _ |
+//        u8 sizeBytes | u8 offsetBytes | u8 keyBytes | u8 offsetBits |
+//        u64 archiveSizeLimit
+//   0x20 u32 entriesSize | u32 entriesHash
+//   0x28 entries = key[keyBytes] | beN location | u32 encodedSize
+// The location's high bits are the archive number and its low offsetBits are
+// the offset within that archive.
+struct LocalStorage {
+	Client *m_client;
+
+	Buffer<u8> m_path;
+	// Length of "<cascPath>/Data/data/" within m_path
+	int m_dataPathSize;
+
+	// Each bucket's entries live in one of two slots.  A new version is
+	// published into the unused slot, and the old one is freed once the
+	// readers that entered it have left, so Find never waits.  Each slot has
+	// a filter of its keys, so most misses skip the search.
+	Buffer<u8> m_buckets[16][2];
+	KeyFilter m_filters[16][2];
+	std::atomic<int> m_bucketSlot[16];
+	mutable std::atomic<int> m_bucketReaders[16][2];
+	int m_bucketVersions[16];
+	int m_keyBytes;
+	int m_offsetBytes;
+	int m_sizeBytes;
+	int m_offsetBits;
+	u64 m_archiveSizeLimit;
+
+	// Open archives, shared by every reader, which read them at an offset
+	// without a lock.  Each lock covers opening its archive, and a seek +
+	// read on the handle when the file callbacks have no freadAtFn.
+	std::atomic<void *> m_archives[256];
+	SpinLock m_archiveLocks[256];
+
+	// ReadRecord runs inside the current epoch, so WaitForReaders can tell
+	// when no reader can still be using a location it looked up earlier.
+	std::atomic<int> m_readEpoch;
+	mutable std::atomic<int> m_epochReaders[2];
+
+	static const int kBucketCount = 16;
+	static const int kRecordHeaderSize = 30;
+	static const int kIndexEntriesOffset = 0x28;
+
+	// Loads the newest .idx file of every bucket.  Returns false if cascPath
+	// has no usable index.
+	bool Init(Client *c, const char *cascPath);
+	void Destroy();
+
+	static int Bucket(const Key &ekey);
+
+	bool Find(const Key &ekey, LocalIndexEntry *entry) const;
+
+	// The current entries of bucket.  Only safe on the thread that publishes
+	// buckets, or before the client is shared.
+	const Buffer<u8> &Entries(int bucket) const {
+		return m_buckets[bucket][m_bucketSlot[bucket].load(std::memory_order_relaxed)];
+	}
+
+	// Appends a copy of bucket's current entries to out.  Safe while
+	// buckets are being replaced.
+	void CopyEntries(int bucket, Heap *h, Buffer<u8> *out) const;
+
+	// Reads size bytes at offset of data.NNN into dst.  Returns false on a
+	// short read or if the archive cannot be opened.  key is only used for
+	// statistics.
+	bool Read(int archive, int offset, int size, u8 *dst, const Key *key);
+
+	// Reads size bytes at offset of ekey's data (after the record header)
+	// from wherever the index has it now, so a location looked up before a
+	// compaction moved the file is never read.  Returns false if ekey is not
+	// local or on a short read.
+	bool ReadRecord(const Key &ekey, int offset, int size, u8 *dst, const Key *key);
+
+	// Returns once every ReadRecord that started before the call has
+	// finished.  Calls must come from one thread at a time.
+	void WaitForReaders();
+
+	// Closes the shared handle of archive, so the file can be removed.  No
+	// read of the archive may be running.
+	void CloseArchive(int archive);
+
+	// Builds the path of a file in Data/data into m_path and returns it; the
+	// result is valid until the next call.  Not used once the client is
+	// shared.
+	const char *DataPath(const char *fmt, ...);
+
+	// Switches bucket to a newly published index version, taking ownership
+	// of its sorted entries.  Waits for readers of the old version, so calls
+	// must come from one thread at a time.
+	void ReplaceBucket(int bucket, int version, Buffer<u8> *entries);
+
+private:
+	bool LoadBucket(int bucket, int version);
+	void BuildFilter(int bucket, int slot);
+	int FindIndexVersion(int bucket);
+};
+
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "std.h"
+
+#include <atomic>
+#include <thread>
+
+namespace ngdp {
+
+// A lock for the client's short critical sections.  Zeroed memory is an
+// unlocked SpinLock, so it can live in the structs that are memset rather
+// than constructed.  Waiters spin briefly, then yield.
+struct SpinLock {
+	std::atomic<int> m_locked;
+
+	void Init() {
+		m_locked.store(0, std::memory_order_relaxed);
+	}
+
+	void Lock() {
+		int spins = 0;
+		while (m_locked.exchange(1, std::memory_order_acquire)) {
+			// Wait on a plain load so waiters don't keep taking the line
+			while (m_locked.load(std::memory_order_relaxed)) {
+				if (++spins > 64) {
+					std::this_thread::yield();
+				}
+			}
+		}
+	}
+
+	void Unlock() {
+		m_locked.store(0, std::memory_order_release);
+	}
+};
+
+struct SpinLockGuard {
+	SpinLock *m_lock;
+
+	SpinLockGuard(SpinLock *lock) : m_lock(lock) {
+		m_lock->Lock();
+	}
+
+	~SpinLockGuard() {
+		m_lock->Unlock();
+	}
+};
+
+}
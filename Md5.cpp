@@ -0,0 +1,113 @@
+#include "Md5.h"
+#include "Bytes.h"
+
+namespace ngdp {
+
+static const u32 kMd5Sines[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const u8 kMd5Shifts[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static inline u32 rotl(u32 x, int c) {
+	return (x << c) | (x >> (32 - c));
+}
+
+static void md5Block(u32 *state, const u8 *block) {
+	u32 m[16];
+	for (int i = 0; i < 16; i++) {
+		m[i] = LoadLE32(block + i * 4);
+	}
+	u32 a = state[0];
+	u32 b = state[1];
+	u32 c = state[2];
+	u32 d = state[3];
+	for (int i = 0; i < 64; i++) {
+		u32 f;
+		int g;
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		u32 t = d;
+		d = c;
+		c = b;
+		b = b + rotl(a + f + kMd5Sines[i] + m[g], kMd5Shifts[i]);
+		a = t;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+void Md5::Init() {
+	m_state[0] = 0x67452301;
+	m_state[1] = 0xefcdab89;
+	m_state[2] = 0x98badcfe;
+	m_state[3] = 0x10325476;
+	m_length = 0;
+}
+
+void Md5::Update(const void *data, size_t size) {
+	const u8 *p = (const u8 *)data;
+	int used = (int)(m_length & 63);
+	m_length += size;
+	if (used) {
+		size_t fill = 64 - used;
+		if (size < fill) {
+			memcpy(m_block + used, p, size);
+			return;
+		}
+		memcpy(m_block + used, p, fill);
+		md5Block(m_state, m_block);
+		p += fill;
+		size -= fill;
+	}
+	while (size >= 64) {
+		md5Block(m_state, p);
+		p += 64;
+		size -= 64;
+	}
+	memcpy(m_block, p, size);
+}
+
+void Md5::Final(Key *digest) {
+	u64 bits = m_length << 3;
+	int used = (int)(m_length & 63);
+	m_block[used++] = 0x80;
+	if (used > 56) {
+		memset(m_block + used, 0, 64 - used);
+		md5Block(m_state, m_block);
+		used = 0;
+	}
+	memset(m_block + used, 0, 56 - used);
+	StoreLE64(m_block + 56, bits);
+	md5Block(m_state, m_block);
+	for (int i = 0; i < 4; i++) {
+		StoreLE32(digest->k + i * 4, m_state[i]);
+	}
+}
+
+}
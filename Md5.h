@@ -0,0 +1,26 @@
+#pragma once
+
+#include "std.h"
+#include "Key.h"
+
+namespace ngdp {
+
+// MD5 digest, used to verify BLTE chunks and encoded keys.
+struct Md5 {
+	u32 m_state[4];
+	u64 m_length;
+	u8 m_block[64];
+
+	void Init();
+	void Update(const void *data, size_t size);
+	void Final(Key *digest);
+
+	static void Sum(const void *data, size_t size, Key *digest) {
+		Md5 md5;
+		md5.Init();
+		md5.Update(data, size);
+		md5.Final(digest);
+	}
+};
+
+}
@@ -0,0 +1,533 @@
+#include "std.h"
+#include "Mirror.h"
+
+#include "ngdp.h"
+#include "FileIO.h"
+#include "Key.h"
+#include "Md5.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// One data file of the build
+struct MirrorFile {
+	u8 m_contentKey[16];
+	u8 m_encodedKey[16];
+	s64 m_fileSize;
+	int m_encodedSize;
+};
+
+// Bounds the encoded bytes the workers hold at once.  A file larger than the
+// whole budget is let through once nothing else is in flight.
+struct ByteBudget {
+	std::mutex m_mutex;
+	std::condition_variable m_released;
+	s64 m_limit;
+	s64 m_used;
+
+	void Acquire(s64 size) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_used > 0 && m_used + size > m_limit) {
+			m_released.wait(lock);
+		}
+		m_used += size;
+	}
+
+	void Release(s64 size) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_used -= size;
+		m_released.notify_all();
+	}
+};
+
+struct MirrorOptions {
+	const char *m_url;
+	const char *m_region;
+	const char *m_product;
+	const char *m_source;
+	const char *m_buildConfig;
+	const char *m_cdnConfig;
+	const char *m_cascPath;
+	const char *m_cdnPath;
+	int m_workers;
+	s64 m_budget;
+	int m_retries;
+	const char *m_trace;
+};
+
+// The download and statistics callbacks take no context.
+static std::string g_sourceRoot;
+static std::atomic<s64> g_downloadedBytes;
+static std::atomic<int> g_downloads;
+static std::atomic<int> g_retries;
+
+static void mirrorLog(const char *message) {
+	fprintf(stderr, "[ngdp] %s\n", message);
+}
+
+static void mirrorStat(int type, int arg0, int arg1, int arg2, const uint8_t *key) {
+	UNUSED(arg0);
+	UNUSED(arg2);
+	UNUSED(key);
+	if (type == NGDP_STATISTIC_DOWNLOAD_FINISHED) {
+		g_downloadedBytes += arg1;
+		g_downloads++;
+	} else if (type == NGDP_STATISTIC_DOWNLOAD_RETRY) {
+		g_retries++;
+	}
+}
+
+static bool hasSuffix(const char *s, const char *suffix) {
+	size_t n = strlen(s);
+	size_t m = strlen(suffix);
+	return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// Serves a CDN's URLs from a directory: cdns and versions at its root, and
+// everything else at the URL's path below it.
+static int sourceDownload(const char *url, int rangeStart, int rangeEnd, uint8_t **buffer, int *bufferSize) {
+	const char *path = strstr(url, "://");
+	path = path ? strchr(path + 3, '/') : nullptr;
+	if (!path) {
+		return NGDP_DOWNLOAD_400_ERROR;
+	}
+	std::string name = g_sourceRoot;
+	if (hasSuffix(path, "/cdns")) {
+		name += "/cdns";
+	} else if (hasSuffix(path, "/versions")) {
+		name += "/versions";
+	} else {
+		name += path;
+	}
+	FILE *f = fopen(name.c_str(), "rb");
+	if (!f) {
+		return NGDP_DOWNLOAD_400_ERROR;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	long start = 0;
+	long end = size;
+	if (rangeStart >= 0 && rangeStart < rangeEnd) {
+		start = std::min((long)rangeStart, size);
+		end = std::min((long)rangeEnd, size);
+	}
+	int length = (int)(end - start);
+	if (!buffer) {
+		fclose(f);
+		*bufferSize = length;
+		return NGDP_DOWNLOAD_SUCCESS;
+	}
+	bool allocated = !*buffer;
+	if (allocated) {
+		*buffer = (uint8_t *)malloc(length > 0 ? length : 1);
+	} else if (length > *bufferSize) {
+		fclose(f);
+		*bufferSize = length;
+		return NGDP_DOWNLOAD_BUFFER_TOO_SMALL;
+	}
+	bool ok = fseek(f, start, SEEK_SET) == 0 && fread(*buffer, 1, length, f) == (size_t)length;
+	fclose(f);
+	if (!ok) {
+		if (allocated) {
+			free(*buffer);
+			*buffer = nullptr;
+		}
+		return NGDP_DOWNLOAD_400_ERROR;
+	}
+	*bufferSize = length;
+	ngdpDownloadReceived(length, length);
+	return NGDP_DOWNLOAD_SUCCESS;
+}
+
+static void makeDirectories(const std::string &path) {
+	for (size_t i = 1; i <= path.size(); i++) {
+		if (i == path.size() || path[i] == '/') {
+			std::string dir = path.substr(0, i);
+#ifdef _WIN32
+			_mkdir(dir.c_str());
+#else
+			mkdir(dir.c_str(), 0755);
+#endif
+		}
+	}
+}
+
+static std::string hexString(const u8 *key) {
+	static const char digits[] = "0123456789abcdef";
+	std::string s;
+	for (int i = 0; i < 16; i++) {
+		s += digits[key[i] >> 4];
+		s += digits[key[i] & 15];
+	}
+	return s;
+}
+
+// <root>/<kind>/ab/cd/abcd...
+static std::string keyPath(const std::string &root, const char *kind, const u8 *key) {
+	std::string hex = hexString(key);
+	return root + "/" + kind + "/" + hex.substr(0, 2) + "/" + hex.substr(2, 2) + "/" + hex;
+}
+
+// Returns the size of the file at path, or -1 if it cannot be opened.
+static long fileSize(const std::string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fclose(f);
+	return size;
+}
+
+// Writes under a temporary name and renames it into place, so a mirror
+// interrupted part way never leaves a truncated file under its final name.
+static bool writeFile(const std::string &path, const void *data, size_t size) {
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos) {
+		makeDirectories(path.substr(0, slash));
+	}
+	ngdp::Heap heap = {malloc, free, realloc};
+	ngdp::FileIO file;
+	file.InitStdio();
+	return file.WriteReplacing(&heap, path.c_str(), [&](void *f) {
+		return file.Write((void *)data, 1, size, f) == size;
+	});
+}
+
+static int appendToString(void *ctx, const uint8_t *data, int size) {
+	((std::string *)ctx)->append((const char *)data, size);
+	return 0;
+}
+
+static int collectFile(void *ctx, const uint8_t *contentKey, const uint8_t *encodedKey, int64_t fileSize, int encodedSize) {
+	MirrorFile file;
+	memcpy(file.m_contentKey, contentKey, 16);
+	memcpy(file.m_encodedKey, encodedKey, 16);
+	file.m_fileSize = fileSize;
+	file.m_encodedSize = encodedSize;
+	((std::vector<MirrorFile> *)ctx)->push_back(file);
+	return 0;
+}
+
+// Mirrored files are stored loose, so the mirror's CDN config lists no
+// archives.
+static std::string withoutArchives(const std::string &config) {
+	std::string out;
+	size_t pos = 0;
+	while (pos < config.size()) {
+		size_t end = config.find('\n', pos);
+		end = end == std::string::npos ? config.size() : end + 1;
+		if (config.compare(pos, 7, "archive") != 0 && config.compare(pos, 13, "patch-archive") != 0) {
+			out.append(config, pos, end - pos);
+		}
+		pos = end;
+	}
+	return out;
+}
+
+// Writes the build's configs so that the destination can be used without
+// the source: beside the data of a CASC installation, or as the config,
+// versions and cdns files of a CDN layout.
+static bool writeConfigs(ngdpClient *c, const MirrorOptions &opt, const std::string &cdnRoot) {
+	std::string build;
+	std::string cdn;
+	u8 buildKey[16];
+	u8 cdnKey[16];
+	if (ngdpConfigFile(c, NGDP_CONFIG_BUILD, buildKey, appendToString, &build) ||
+		ngdpConfigFile(c, NGDP_CONFIG_CDN, cdnKey, appendToString, &cdn)) {
+		fprintf(stderr, "Unable to load the build's configs\n");
+		return false;
+	}
+	if (opt.m_cascPath) {
+		std::string root = std::string(opt.m_cascPath) + "/Data";
+		return writeFile(keyPath(root, "config", buildKey), build.data(), build.size()) &&
+			writeFile(keyPath(root, "config", cdnKey), cdn.data(), cdn.size());
+	}
+
+	cdn = withoutArchives(cdn);
+	ngdp::Key key;
+	ngdp::Md5::Sum(cdn.data(), cdn.size(), &key);
+	memcpy(cdnKey, key.k, 16);
+	std::string path = std::string("tpr/") + opt.m_product;
+	std::string versions = "Region!STRING:0|BuildConfig!HEX:16|CDNConfig!HEX:16|VersionsName!String:0\n";
+	versions += std::string(opt.m_region) + "|" + hexString(buildKey) + "|" + hexString(cdnKey) + "|mirror\n";
+	std::string cdns = "Name!STRING:0|Path!STRING:0|Hosts!STRING:0\n";
+	cdns += std::string(opt.m_region) + "|" + path + "|localhost\n";
+	std::string root = opt.m_cdnPath;
+	return writeFile(keyPath(cdnRoot, "config", buildKey), build.data(), build.size()) &&
+		writeFile(keyPath(cdnRoot, "config", cdnKey), cdn.data(), cdn.size()) &&
+		writeFile(root + "/versions", versions.data(), versions.size()) &&
+		writeFile(root + "/cdns", cdns.data(), cdns.size());
+}
+
+static void usage() {
+	fprintf(stderr,
+		"usage: ngdp mirror (--casc DIR | --cdn DIR) [options]\n"
+		"  --casc DIR          mirror into the local CASC installation at DIR\n"
+		"  --cdn DIR           mirror into DIR, laid out like a CDN\n"
+		"  --source DIR        read from a CDN-layout directory instead of the network\n"
+		"  --url URL           patch server (default http://us.patch.battle.net:1119)\n"
+		"  --region REGION     (default us)\n"
+		"  --product PRODUCT   (default wow)\n"
+		"  --build-config KEY  mirror this build instead of the current one\n"
+		"  --cdn-config KEY    use this CDN config\n"
+		"  --workers N         parallel downloads (default 8)\n"
+		"  --budget MB         encoded bytes in flight (default 256)\n"
+		"  --retries N         retries of a failed download (default 3)\n"
+		"  --trace FILE        write a Chrome trace of the run to FILE\n");
+}
+
+static bool parseOptions(int argc, char **argv, MirrorOptions *opt) {
+	memset(opt, 0, sizeof(*opt));
+	opt->m_url = "http://us.patch.battle.net:1119";
+	opt->m_region = "us";
+	opt->m_product = "wow";
+	opt->m_workers = 8;
+	opt->m_budget = (s64)256 << 20;
+	opt->m_retries = 3;
+	for (int i = 0; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!value) {
+			fprintf(stderr, "Missing value for %s\n", arg);
+			return false;
+		}
+		i++;
+		if (strcmp(arg, "--casc") == 0) {
+			opt->m_cascPath = value;
+		} else if (strcmp(arg, "--cdn") == 0) {
+			opt->m_cdnPath = value;
+		} else if (strcmp(arg, "--source") == 0) {
+			opt->m_source = value;
+		} else if (strcmp(arg, "--url") == 0) {
+			opt->m_url = value;
+		} else if (strcmp(arg, "--region") == 0) {
+			opt->m_region = value;
+		} else if (strcmp(arg, "--product") == 0) {
+			opt->m_product = value;
+		} else if (strcmp(arg, "--build-config") == 0) {
+			opt->m_buildConfig = value;
+		} else if (strcmp(arg, "--cdn-config") == 0) {
+			opt->m_cdnConfig = value;
+		} else if (strcmp(arg, "--workers") == 0) {
+			opt->m_workers = atoi(value);
+		} else if (strcmp(arg, "--budget") == 0) {
+			opt->m_budget = (s64)atoi(value) << 20;
+		} else if (strcmp(arg, "--retries") == 0) {
+			opt->m_retries = atoi(value);
+		} else if (strcmp(arg, "--trace") == 0) {
+			opt->m_trace = value;
+		} else {
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return false;
+		}
+	}
+	if (!opt->m_cascPath == !opt->m_cdnPath) {
+		fprintf(stderr, "Give one of --casc and --cdn\n");
+		return false;
+	}
+	if (opt->m_workers <= 0 || opt->m_budget <= 0 || opt->m_retries < 0) {
+		fprintf(stderr, "--workers and --budget must be positive and --retries not negative\n");
+		return false;
+	}
+	return true;
+}
+
+static f64 secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+}
+
+int Mirror(int argc, char **argv) {
+	MirrorOptions opt;
+	if (!parseOptions(argc, argv, &opt)) {
+		usage();
+		return 2;
+	}
+
+	ngdpConfig config;
+	memset(&config, 0, sizeof(config));
+	config.ngdpUrl = opt.m_url;
+	config.ngdpRegion = opt.m_region;
+	config.gameUid = opt.m_product;
+	config.logFn = mirrorLog;
+	config.statsFn = mirrorStat;
+	config.httpRetryCount = opt.m_retries;
+	config.tracePath = opt.m_trace;
+	if (opt.m_source) {
+		g_sourceRoot = opt.m_source;
+		config.downloadUrlFn = sourceDownload;
+	}
+	if (opt.m_buildConfig) {
+		config.overrideBuildConfig = 1;
+		if (!((ngdp::Key *)config.buildConfigKey)->ParseHexString(opt.m_buildConfig)) {
+			fprintf(stderr, "Bad build config key %s\n", opt.m_buildConfig);
+			return 2;
+		}
+	}
+	if (opt.m_cdnConfig) {
+		config.overrideCDNConfig = 1;
+		if (!((ngdp::Key *)config.cdnConfigKey)->ParseHexString(opt.m_cdnConfig)) {
+			fprintf(stderr, "Bad CDN config key %s\n", opt.m_cdnConfig);
+			return 2;
+		}
+	}
+	std::string cdnRoot;
+	if (opt.m_cascPath) {
+		// An empty Data/data is taken as a new installation.
+		makeDirectories(std::string(opt.m_cascPath) + "/Data/data");
+		makeDirectories(std::string(opt.m_cascPath) + "/Data/config");
+		config.cascPath = opt.m_cascPath;
+	} else {
+		cdnRoot = std::string(opt.m_cdnPath) + "/tpr/" + opt.m_product;
+		makeDirectories(cdnRoot);
+	}
+
+	ngdpClient *c = ngdpInit(&config);
+	if (!c) {
+		fprintf(stderr, "Unable to load the build (%d): %s\n", config.error, config.errorDetail ? config.errorDetail : "");
+		return 1;
+	}
+	if (!writeConfigs(c, opt, cdnRoot)) {
+		ngdpDestroy(c);
+		return 1;
+	}
+
+	// A content key sharing its encoded file with another is mirrored once.
+	std::vector<MirrorFile> files;
+	ngdpListFiles(c, collectFile, &files);
+	std::sort(files.begin(), files.end(), [](const MirrorFile &a, const MirrorFile &b) {
+		return memcmp(a.m_encodedKey, b.m_encodedKey, 16) < 0;
+	});
+	files.erase(std::unique(files.begin(), files.end(), [](const MirrorFile &a, const MirrorFile &b) {
+		return memcmp(a.m_encodedKey, b.m_encodedKey, 16) == 0;
+	}), files.end());
+	s64 totalBytes = 0;
+	for (const MirrorFile &f : files) {
+		totalBytes += f.m_encodedSize > 0 ? f.m_encodedSize : 0;
+	}
+	fprintf(stderr, "Mirroring %d files, %.1f MB, with %d workers\n", (int)files.size(), totalBytes / 1048576.0, opt.m_workers);
+
+	ByteBudget budget;
+	budget.m_limit = opt.m_budget;
+	budget.m_used = 0;
+	std::atomic<int> next(0);
+	std::atomic<int> mirrored(0);
+	std::atomic<int> present(0);
+	std::atomic<int> failed(0);
+	std::atomic<s64> mirroredBytes(0);
+	std::atomic<int> running(opt.m_workers);
+
+	// Files already in the destination are skipped, which is what lets an
+	// interrupted mirror pick up where it stopped.
+	auto work = [&]() {
+		std::vector<u8> buffer;
+		for (;;) {
+			int i = next++;
+			if (i >= (int)files.size()) {
+				break;
+			}
+			const MirrorFile &f = files[i];
+			ngdpOperation op;
+			memset(&op, 0, sizeof(op));
+			memcpy(op.contentKey, f.m_contentKey, 16);
+			memcpy(op.encodedKey, f.m_encodedKey, 16);
+			op.encodedKeyIsValid = 1;
+			op.encodedSize = f.m_encodedSize;
+			op.fileSize = f.m_fileSize <= 0x7fffffff ? (int)f.m_fileSize : -1;
+			std::string path;
+			if (opt.m_cascPath) {
+				ngdpIsLocal(c, &op);
+				if (op.dataIsLocal) {
+					present++;
+					continue;
+				}
+			} else {
+				path = keyPath(cdnRoot, "data", f.m_encodedKey);
+				if (f.m_encodedSize > 0 && fileSize(path) == f.m_encodedSize) {
+					present++;
+					continue;
+				}
+			}
+			if (f.m_encodedSize <= 0) {
+				fprintf(stderr, "No encoded size for %s\n", hexString(f.m_encodedKey).c_str());
+				failed++;
+				continue;
+			}
+
+			budget.Acquire(f.m_encodedSize);
+			buffer.resize(f.m_encodedSize);
+			op.buffer = buffer.data();
+			op.bufferSize = f.m_encodedSize;
+			op.disableFileWrites = opt.m_cdnPath ? 1 : 0;
+			int err = ngdpReadEncoded(c, &op);
+			if (!err && opt.m_cdnPath && !writeFile(path, buffer.data(), f.m_encodedSize)) {
+				err = NGDP_ERROR_FILE_READ_FAILED;
+			}
+			budget.Release(f.m_encodedSize);
+			// Don't let one large file pin its buffer for the rest of the run.
+			if (buffer.capacity() > (size_t)(16 << 20)) {
+				std::vector<u8>().swap(buffer);
+			}
+			if (err) {
+				fprintf(stderr, "Unable to mirror %s (%d)\n", hexString(f.m_encodedKey).c_str(), err);
+				failed++;
+			} else {
+				mirrored++;
+				mirroredBytes += f.m_encodedSize;
+			}
+		}
+		running--;
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int i = 0; i < opt.m_workers; i++) {
+		workers.emplace_back(work);
+	}
+
+	// Report each second's rates from the statistics callback's byte count.
+	s64 lastBytes = 0;
+	int lastFiles = 0;
+	auto last = start;
+	while (running.load()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		f64 interval = secondsSince(last);
+		if (interval < 1.0 && running.load()) {
+			continue;
+		}
+		s64 bytes = g_downloadedBytes.load();
+		int done = mirrored.load();
+		fprintf(stderr, "%d/%d files (%d present, %d failed), %.1f MB downloaded, %.1f MB/s, %.0f files/s, %d retries\n",
+			done + present.load() + failed.load(), (int)files.size(), present.load(), failed.load(),
+			bytes / 1048576.0, (bytes - lastBytes) / 1048576.0 / interval, (done - lastFiles) / interval, g_retries.load());
+		lastBytes = bytes;
+		lastFiles = done;
+		last = std::chrono::steady_clock::now();
+	}
+	for (std::thread &t : workers) {
+		t.join();
+	}
+
+	f64 elapsed = secondsSince(start);
+	if (elapsed <= 0) {
+		elapsed = 1e-6;
+	}
+	fprintf(stderr, "Mirrored %d files (%.1f MB) in %.1f s: %.1f MB/s, %.0f files/s; %d already present, %d failed; %d downloads, %.1f MB downloaded\n",
+		mirrored.load(), mirroredBytes.load() / 1048576.0, elapsed, mirroredBytes.load() / 1048576.0 / elapsed, mirrored.load() / elapsed,
+		present.load(), failed.load(), g_downloads.load(), g_downloadedBytes.load() / 1048576.0);
+	ngdpDestroy(c);
+	return failed.load() ? 1 : 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+// `ngdp mirror`: copies every file of a build from a CDN, or a directory laid
+// out like one, into a local CASC installation or a CDN-layout directory.
+// argv holds the arguments after "mirror".  Returns the process exit code.
+int Mirror(int argc, char **argv);
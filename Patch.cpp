@@ -0,0 +1,217 @@
+#include "Patch.h"
+#include "Bytes.h"
+#include "ngdp.h"
+
+namespace ngdp {
+
+static s64 loadPatchInt(const u8 *p) {
+	return (s64)(((u64)LoadBE32(p) << 32) | LoadBE32(p + 4));
+}
+
+int PatchStream::Init(Heap *h, const PatchReadFn *read, int start, int end, int inputCapacity) {
+	m_read = read;
+	m_offset = start;
+	m_end = end;
+	m_inputCapacity = inputCapacity;
+	m_input = (u8 *)h->Alloc(inputCapacity);
+	memset(&m_z, 0, sizeof(m_z));
+	m_zInit = inflateInit(&m_z) == Z_OK;
+	return m_zInit ? NGDP_ERROR_SUCCESS : NGDP_ERROR_CORRUPT_DATA;
+}
+
+void PatchStream::Destroy(Heap *h) {
+	if (m_zInit) {
+		inflateEnd(&m_z);
+		m_zInit = false;
+	}
+	if (m_input) {
+		h->Free(m_input);
+		m_input = nullptr;
+	}
+}
+
+int PatchStream::Read(u8 *dst, int size) {
+	m_z.next_out = dst;
+	m_z.avail_out = (uInt)size;
+	while (m_z.avail_out > 0) {
+		if (m_z.avail_in == 0) {
+			int n = m_end - m_offset;
+			if (n <= 0) {
+				return NGDP_ERROR_CORRUPT_DATA;
+			}
+			if (n > m_inputCapacity) {
+				n = m_inputCapacity;
+			}
+			int err = (*m_read)(m_offset, n, m_input);
+			if (err) {
+				return err;
+			}
+			m_offset += n;
+			m_z.next_in = m_input;
+			m_z.avail_in = (uInt)n;
+		}
+		int zres = inflate(&m_z, Z_NO_FLUSH);
+		if (zres == Z_STREAM_END && m_z.avail_out > 0) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		if (zres != Z_OK && zres != Z_STREAM_END) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int PatchApplier::Init(Heap *h, const PatchReadFn &patch, int patchSize, const PatchReadFn &base, int baseSize) {
+	memset(&m_ctrl, 0, sizeof(m_ctrl));
+	memset(&m_diff, 0, sizeof(m_diff));
+	memset(&m_extra, 0, sizeof(m_extra));
+	m_heap = h;
+	m_patch = patch;
+	m_base = base;
+	m_patchSize = patchSize;
+	m_baseSize = baseSize;
+	m_targetSize = 0;
+	m_work = nullptr;
+	m_window = nullptr;
+	m_windowStart = 0;
+	m_windowEnd = 0;
+
+	if (patchSize < kHeaderSize) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	u8 header[kHeaderSize];
+	int err = m_patch(0, kHeaderSize, header);
+	if (err) {
+		return err;
+	}
+	if (memcmp(header, "ZBSDIFF1", 8) != 0) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	s64 ctrlSize = loadPatchInt(header + 8);
+	s64 diffSize = loadPatchInt(header + 16);
+	s64 targetSize = loadPatchInt(header + 24);
+	if (ctrlSize < 0 || diffSize < 0 || targetSize < 0 || targetSize > 0x7fffffff) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	if (kHeaderSize + ctrlSize + diffSize > patchSize) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	m_targetSize = (int)targetSize;
+
+	int ctrlStart = kHeaderSize;
+	int diffStart = ctrlStart + (int)ctrlSize;
+	int extraStart = diffStart + (int)diffSize;
+	if ((err = m_ctrl.Init(h, &m_patch, ctrlStart, diffStart, kInputSize))) {
+		return err;
+	}
+	if ((err = m_diff.Init(h, &m_patch, diffStart, extraStart, kInputSize))) {
+		return err;
+	}
+	if ((err = m_extra.Init(h, &m_patch, extraStart, patchSize, kInputSize))) {
+		return err;
+	}
+	m_work = (u8 *)h->Alloc(kWorkSize);
+	m_window = (u8 *)h->Alloc(kWindowSize);
+	return NGDP_ERROR_SUCCESS;
+}
+
+void PatchApplier::Destroy() {
+	m_ctrl.Destroy(m_heap);
+	m_diff.Destroy(m_heap);
+	m_extra.Destroy(m_heap);
+	if (m_work) {
+		m_heap->Free(m_work);
+		m_work = nullptr;
+	}
+	if (m_window) {
+		m_heap->Free(m_window);
+		m_window = nullptr;
+	}
+}
+
+// Adds base bytes starting at basePos to dst; positions outside the base add
+// nothing, as in bspatch.
+int PatchApplier::AddBase(u8 *dst, int size, int basePos) {
+	int i = 0;
+	if (basePos < 0) {
+		i = -basePos;
+	}
+	while (i < size && basePos + i < m_baseSize) {
+		int pos = basePos + i;
+		if (pos < m_windowStart || pos >= m_windowEnd) {
+			int n = m_baseSize - pos;
+			if (n > kWindowSize) {
+				n = kWindowSize;
+			}
+			int err = m_base(pos, n, m_window);
+			if (err) {
+				return err;
+			}
+			m_windowStart = pos;
+			m_windowEnd = pos + n;
+		}
+		int n = m_windowEnd - pos;
+		if (n > size - i) {
+			n = size - i;
+		}
+		const u8 *src = m_window + (pos - m_windowStart);
+		for (int j = 0; j < n; j++) {
+			dst[i + j] += src[j];
+		}
+		i += n;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int PatchApplier::Run(const PatchWriteFn &write) {
+	s64 targetPos = 0;
+	s64 basePos = 0;
+	while (targetPos < m_targetSize) {
+		u8 ctrl[24];
+		int err = m_ctrl.Read(ctrl, sizeof(ctrl));
+		if (err) {
+			return err;
+		}
+		s64 diffLength = loadPatchInt(ctrl);
+		s64 extraLength = loadPatchInt(ctrl + 8);
+		s64 seek = loadPatchInt(ctrl + 16);
+		if (diffLength < 0 || extraLength < 0 || targetPos + diffLength + extraLength > m_targetSize) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+
+		while (diffLength > 0) {
+			int n = diffLength < kWorkSize ? (int)diffLength : kWorkSize;
+			if ((err = m_diff.Read(m_work, n))) {
+				return err;
+			}
+			if (basePos < m_baseSize && basePos + n > 0) {
+				if ((err = AddBase(m_work, n, (int)basePos))) {
+					return err;
+				}
+			}
+			if ((err = write(m_work, n))) {
+				return err;
+			}
+			diffLength -= n;
+			basePos += n;
+			targetPos += n;
+		}
+
+		while (extraLength > 0) {
+			int n = extraLength < kWorkSize ? (int)extraLength : kWorkSize;
+			if ((err = m_extra.Read(m_work, n))) {
+				return err;
+			}
+			if ((err = write(m_work, n))) {
+				return err;
+			}
+			extraLength -= n;
+			targetPos += n;
+		}
+
+		basePos += seek;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "std.h"
+#include "Heap.h"
+
+#include <functional>
+#include <zlib.h>
+
+namespace ngdp {
+
+// Reads size bytes at offset of a patch or base file into dst.  Returns an
+// NGDP_ERROR code.
+typedef std::function<int(int offset, int size, u8 *dst)> PatchReadFn;
+// Receives the next size bytes of the patched file.  Returns an NGDP_ERROR
+// code; a non-zero result stops patching.
+typedef std::function<int(const u8 *data, int size)> PatchWriteFn;
+
+// PatchStream inflates one zlib-compressed block of a patch, fetching the
+// compressed bytes in pieces of at most m_inputCapacity.
+struct PatchStream {
+	const PatchReadFn *m_read;
+	int m_offset;
+	int m_end;
+	u8 *m_input;
+	int m_inputCapacity;
+	z_stream m_z;
+	bool m_zInit;
+
+	int Init(Heap *h, const PatchReadFn *read, int start, int end, int inputCapacity);
+	void Destroy(Heap *h);
+
+	// Reads exactly size decoded bytes.
+	int Read(u8 *dst, int size);
+};
+
+// PatchApplier applies a ZBSDIFF1 patch: bsdiff with zlib in place of bzip2.
+//
+//   'ZBSDIFF1' | s64be ctrlSize | s64be diffSize | s64be targetSize |
+//   zlib(ctrl) | zlib(diff) | zlib(extra)
+//
+// ctrl is a sequence of (s64be diffLength, s64be extraLength, s64be seek).
+// For each, diffLength bytes of diff are added to the base at the current
+// base position, extraLength bytes of extra are copied, and the base
+// position moves by seek.
+//
+// The three blocks are inflated as independent streams and the base is read
+// through a fixed window, so memory use is bounded by the window and input
+// sizes rather than by the base, patch or target size.
+struct PatchApplier {
+	Heap *m_heap;
+	PatchReadFn m_patch;
+	PatchReadFn m_base;
+	int m_patchSize;
+	int m_baseSize;
+	int m_targetSize;
+
+	PatchStream m_ctrl;
+	PatchStream m_diff;
+	PatchStream m_extra;
+
+	u8 *m_work;
+	u8 *m_window;
+	int m_windowStart;
+	int m_windowEnd;
+
+	static const int kHeaderSize = 32;
+	static const int kWorkSize = 64 * 1024;
+	static const int kWindowSize = 256 * 1024;
+	static const int kInputSize = 64 * 1024;
+
+	// Reads and checks the patch header, setting m_targetSize.  Destroy must be
+	// called even if Init fails.
+	int Init(Heap *h, const PatchReadFn &patch, int patchSize, const PatchReadFn &base, int baseSize);
+	void Destroy();
+
+	// Produces the whole target, passing it to write in pieces.
+	int Run(const PatchWriteFn &write);
+
+private:
+	int AddBase(u8 *dst, int size, int basePos);
+};
+
+}
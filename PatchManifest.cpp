@@ -0,0 +1,154 @@
+#include "PatchManifest.h"
+#include "Bytes.h"
+#include "Config.h"
+
+namespace ngdp {
+
+void PatchManifest::Init() {
+	m_data.Init();
+	m_configEntries.Init();
+	m_blockCount = 0;
+	m_blocks = nullptr;
+}
+
+void PatchManifest::Destroy(Heap *h) {
+	m_data.Destroy(h);
+	m_configEntries.Destroy(h);
+}
+
+bool PatchManifest::Parse(Heap *h, Buffer<u8> *data) {
+	m_data.Destroy(h);
+	m_data = *data;
+	data->Init();
+	m_blockCount = 0;
+
+	const u8 *p = m_data.m_storage;
+	int size = m_data.m_size;
+	if (size < 10 || p[0] != 'P' || p[1] != 'A') {
+		return false;
+	}
+	m_fileKeySize = p[3];
+	m_sourceKeySize = p[4];
+	m_patchKeySize = p[5];
+	m_blockSize = 1 << p[6];
+	int blockCount = LoadBE16(p + 7);
+	u8 flags = p[9];
+	if (m_fileKeySize > 16 || m_sourceKeySize > 16 || m_patchKeySize > 16 || p[6] > 24) {
+		return false;
+	}
+	int ofs = 10;
+	if (flags & 2) {
+		// The manifest's own encoding details; unused here
+		ofs += 16 + 16 + 4 + 4;
+		if (ofs >= size) {
+			return false;
+		}
+		ofs += 1 + p[ofs];
+	}
+	int entrySize = m_fileKeySize + 16 + 4;
+	if (ofs + blockCount * entrySize > size) {
+		return false;
+	}
+	for (int i = 0; i < blockCount; i++) {
+		u32 blockOffset = LoadBE32(p + ofs + i * entrySize + m_fileKeySize + 16);
+		if (blockOffset >= (u32)size) {
+			return false;
+		}
+	}
+	m_blocks = p + ofs;
+	m_blockCount = blockCount;
+	return true;
+}
+
+void PatchManifest::ParseConfig(Heap *h, const String &configFile) {
+	// patch-entry = <type> <ckey> <csize> <ekey> <esize> <espec>
+	//               (<source ekey> <source size> <patch key> <patch size>)*
+	ngdp::ParseConfig(h, configFile, [&](const String &key, const String &value) {
+		if (!(key == "patch-entry")) {
+			return;
+		}
+		Buffer<String> parts = value.Split(h, " ");
+		if (parts.m_size >= 6 && parts[1].m_size == 32) {
+			Key target;
+			target.InitFromHexString(parts[1]);
+			int targetSize = parts[2].ParseInt();
+			for (int i = 6; i + 4 <= parts.m_size; i += 4) {
+				if (parts[i].m_size != 32 || parts[i + 2].m_size != 32) {
+					break;
+				}
+				PatchConfigEntry *e = m_configEntries.Alloc(h, 1);
+				e->m_target = target;
+				e->m_patch.m_sourceKey.InitFromHexString(parts[i]);
+				e->m_patch.m_sourceSize = parts[i + 1].ParseInt();
+				e->m_patch.m_patchKey.InitFromHexString(parts[i + 2]);
+				e->m_patch.m_patchSize = parts[i + 3].ParseInt();
+				e->m_patch.m_targetSize = targetSize;
+			}
+		}
+		parts.Destroy(h);
+	});
+}
+
+void PatchManifest::Find(const Key &ckey, std::function<void(const PatchCandidate &patch)> onPatch) const {
+	for (const PatchConfigEntry &e : m_configEntries) {
+		if (e.m_target == ckey) {
+			onPatch(e.m_patch);
+		}
+	}
+	if (m_blockCount == 0) {
+		return;
+	}
+
+	// Find the first block whose last key is >= ckey
+	int entrySize = m_fileKeySize + 16 + 4;
+	int lo = 0;
+	int hi = m_blockCount;
+	while (lo < hi) {
+		int mid = lo + ((hi - lo) >> 1);
+		if (memcmp(m_blocks + mid * entrySize, ckey.k, m_fileKeySize) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == m_blockCount) {
+		return;
+	}
+
+	const u8 *data = m_data.m_storage;
+	int blockOffset = (int)LoadBE32(m_blocks + lo * entrySize + m_fileKeySize + 16);
+	const u8 *p = data + blockOffset;
+	const u8 *end = data + (blockOffset + m_blockSize < m_data.m_size ? blockOffset + m_blockSize : m_data.m_size);
+	int patchSize = m_sourceKeySize + 5 + m_patchKeySize + 4 + 1;
+	while (p + 1 + m_fileKeySize + 5 <= end) {
+		int patchCount = p[0];
+		if (patchCount == 0) {
+			break;
+		}
+		const u8 *patches = p + 1 + m_fileKeySize + 5;
+		if (patches + patchCount * patchSize > end) {
+			break;
+		}
+		int cmp = memcmp(p + 1, ckey.k, m_fileKeySize);
+		if (cmp > 0) {
+			break;
+		}
+		if (cmp == 0) {
+			PatchCandidate c;
+			memset(&c, 0, sizeof(c));
+			c.m_targetSize = (int)LoadBE40(p + 1 + m_fileKeySize);
+			for (int i = 0; i < patchCount; i++) {
+				const u8 *e = patches + i * patchSize;
+				memcpy(c.m_sourceKey.k, e, m_sourceKeySize);
+				c.m_sourceSize = (int)LoadBE40(e + m_sourceKeySize);
+				memcpy(c.m_patchKey.k, e + m_sourceKeySize + 5, m_patchKeySize);
+				c.m_patchSize = (int)LoadBE32(e + m_sourceKeySize + 5 + m_patchKeySize);
+				onPatch(c);
+			}
+			return;
+		}
+		p = patches + patchCount * patchSize;
+	}
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Strings.h"
+#include "Key.h"
+
+#include <functional>
+
+namespace ngdp {
+
+// A way to produce a file by patching: apply the patch m_patchKey to the file
+// with encoded key m_sourceKey.
+struct PatchCandidate {
+	Key m_sourceKey;
+	int m_sourceSize;
+	Key m_patchKey;
+	int m_patchSize;
+	int m_targetSize;
+};
+
+// Patch-config entries cover the build's own manifests (encoding, root,
+// install, download), which are not listed in the patch manifest.
+struct PatchConfigEntry {
+	Key m_target;
+	PatchCandidate m_patch;
+};
+
+// PatchManifest is a build's patch manifest: for each target content key, the
+// patches that produce it from files of earlier builds.
+//
+//   'PA' | u8 version | u8 fileKeySize | u8 sourceKeySize | u8 patchKeySize |
+//   u8 blockSizeBits | u16be blockCount | u8 flags |
+//   [flags & 2: encoding ckey, ekey, u32be sizes, u8 especLength, espec] |
+//   blockCount * (lastFileKey | md5[16] | u32be blockOffset)
+//
+// Each block holds target entries sorted by content key:
+//   u8 patchCount | targetKey | u40be targetSize |
+//   patchCount * (sourceKey | u40be sourceSize | patchKey | u32be patchSize | u8 _)
+// and ends at a zero patchCount or its block size.
+//
+// Patches go straight from a source build's file to the target, so every
+// candidate is a single step.
+struct PatchManifest {
+	Buffer<u8> m_data;
+	int m_fileKeySize;
+	int m_sourceKeySize;
+	int m_patchKeySize;
+	int m_blockSize;
+	int m_blockCount;
+	const u8 *m_blocks;
+
+	Buffer<PatchConfigEntry> m_configEntries;
+
+	void Init();
+	void Destroy(Heap *h);
+
+	// Parses a patch manifest.  The manifest takes ownership of data.
+	bool Parse(Heap *h, Buffer<u8> *data);
+	// Adds the patch-entry lines of a patch config.
+	void ParseConfig(Heap *h, const String &configFile);
+
+	// Calls onPatch for every patch that produces ckey.
+	void Find(const Key &ckey, std::function<void(const PatchCandidate &patch)> onPatch) const;
+};
+
+}
@@ -0,0 +1,895 @@
+#include "Client.h"
+#include "Blte.h"
+#include "Md5.h"
+
+#include <chrono>
+#include <new>
+
+namespace ngdp {
+
+// op->state values for reads
+// The file's BLTE header is cached at the start of workingBuffer:
+static const int kReadStateHeader = 1;
+// As above, and the file is a single unchunked 'N' (raw) chunk:
+static const int kReadStateRaw = 2;
+
+// Bytes fetched up front to find the BLTE header; small files are read whole.
+static const int kHeaderPrefetchSize = 4096;
+
+// Readahead bookkeeping, kept at the end of the working buffer of an operation
+// with enableReadahead set.  While a readahead task runs, it owns the rest of
+// the working buffer after the BLTE header: the encoded chunks it fetches go
+// right after the header, and the decoded chunks at the end.
+struct ReadaheadState {
+	u32 m_magic;
+	// Set by the task when it finishes
+	std::atomic<int> m_done;
+	bool m_pending;
+	int m_result;
+	// Decoded bytes [m_readyStart, m_readyEnd) of the file, at m_readyOffset
+	// in the working buffer
+	int m_readyStart;
+	int m_readyEnd;
+	int m_readyOffset;
+	// Where the previous read ended
+	int m_nextOffset;
+	// Decoded bytes to read ahead
+	int m_window;
+	// When the last task was started and finished, in steady_clock ns
+	s64 m_started;
+	s64 m_finished;
+
+	static const u32 kMagic = 0x44414552;
+};
+
+// Working buffer bytes set aside for ReadaheadState, including alignment
+static const int kReadaheadReserve = (int)sizeof(ReadaheadState) + 8;
+
+static s64 steadyNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns op's readahead state at the end of the working buffer and sets
+// wbSize to the size of the working buffer before it, or returns null if
+// readahead is off or does not fit.
+static ReadaheadState *findReadahead(ngdpOperation *op, int *wbSize) {
+	*wbSize = op->workingBufferSize;
+	if (!op->enableReadahead || op->workingBufferSize < kReadaheadReserve) {
+		return nullptr;
+	}
+	uintptr_t at = (uintptr_t)(op->workingBuffer + op->workingBufferSize - sizeof(ReadaheadState));
+	at &= ~(uintptr_t)7;
+	*wbSize = (int)((u8 *)at - op->workingBuffer);
+	return (ReadaheadState *)at;
+}
+
+static int readaheadReserve(const ngdpOperation *op) {
+	return op->enableReadahead ? kReadaheadReserve : 0;
+}
+
+int Client::FileInfo(ngdpOperation *op) {
+	const Key &ckey = *(const Key *)op->contentKey;
+	Key ekey;
+	int fileSize;
+	{
+		TraceSpan span(&m_trace, "index", "encoding lookup");
+		span.SetKey("ckey", ckey);
+		if (!m_encoding.FindContentKey(ckey, &fileSize, &ekey)) {
+			return span.SetError(NGDP_ERROR_FILE_NOT_FOUND);
+		}
+	}
+	op->fileSize = fileSize;
+	memcpy(op->encodedKey, ekey.k, 16);
+	op->encodedKeyIsValid = 1;
+
+	int encodedSize;
+	int especIndex;
+	const Espec *plan = nullptr;
+	if (m_encoding.FindEncodedKey(ekey, &encodedSize, &especIndex)) {
+		op->encodedSize = encodedSize;
+		if (especIndex < m_encoding.m_especs.m_size) {
+			op->encodingSpec = (const char *)m_encoding.m_especs[especIndex].m_data;
+			plan = m_especPlans[especIndex];
+		}
+	} else {
+		op->encodedSize = -1;
+	}
+	if (op->encodedSize <= 0) {
+		return NGDP_ERROR_SUCCESS;
+	}
+
+	// Until the BLTE header is read, the chunk sizes are only known from the
+	// encoding spec; without one, these bounds hold even for a single chunk
+	// covering the whole file.
+	int headerSize = 0;
+	int maxEncoded = op->encodedSize;
+	int maxDecoded = fileSize;
+	if (plan && plan->HeaderSize(1) < op->encodedSize) {
+		int chunkCount;
+		int planEncoded;
+		plan->ChunkLayout(fileSize, &chunkCount, &maxDecoded, &planEncoded);
+		headerSize = plan->HeaderSize(chunkCount);
+		if (planEncoded < op->encodedSize - headerSize) {
+			maxEncoded = planEncoded;
+		} else {
+			maxEncoded = op->encodedSize - headerSize;
+		}
+	}
+	op->workingBufferRequiredSizeWithoutState = headerSize + maxEncoded + readaheadReserve(op);
+	op->workingBufferRequiredSize = headerSize + maxEncoded + maxDecoded + readaheadReserve(op);
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::IsLocal(ngdpOperation *op) {
+	if (!op->encodedKeyIsValid) {
+		int err = FileInfo(op);
+		if (err) {
+			return err;
+		}
+	}
+	op->dataIsLocal = 0;
+	if (!m_hasLocal) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	TraceSpan span(&m_trace, "index", "local index lookup");
+	span.SetKey("ekey", op->encodedKey);
+	LocalIndexEntry entry;
+	if (m_local->Find(*(const Key *)op->encodedKey, &entry)) {
+		op->dataIsLocal = 1;
+		op->localArchiveIndex = (u8)entry.m_archive;
+		op->localArchiveFileOffset = entry.m_offset + LocalStorage::kRecordHeaderSize;
+		if (op->encodedSize <= 0) {
+			op->encodedSize = entry.m_size - LocalStorage::kRecordHeaderSize;
+		}
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+void Client::StoreDownloaded(ngdpOperation *op, const BlteHeader &header, const u8 *data, int size) {
+	if (!m_writer || op->disableFileWrites) {
+		return;
+	}
+	// The encoded key is the MD5 of the chunk table, or of the whole file
+	// without one.
+	Key ekey;
+	{
+		TraceSpan span(&m_trace, "verify", "verify encoded key");
+		span.SetKey("ekey", op->encodedKey);
+		span.SetBytes(header.m_table ? header.m_headerSize : size);
+		Md5::Sum(data, header.m_table ? header.m_headerSize : size, &ekey);
+		if (memcmp(ekey.k, op->encodedKey, 16) != 0) {
+			span.SetError(NGDP_ERROR_CORRUPT_DATA);
+			Log("Not storing a downloaded file that does not match its encoded key");
+			return;
+		}
+	}
+	m_writer->Store(ekey, data, size);
+}
+
+int Client::FindSource(ngdpOperation *op, EncodedSource *src) {
+	src->m_size = op->encodedSize > 0 ? op->encodedSize : -1;
+	src->m_type = CDNResourceType::Data;
+	if (op->dataIsLocal) {
+		src->m_kind = EncodedSource::Local;
+		src->m_archive = op->localArchiveIndex;
+		src->m_offset = op->localArchiveFileOffset;
+		src->m_key = *(const Key *)op->encodedKey;
+		return NGDP_ERROR_SUCCESS;
+	}
+	if (!m_download) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	LoadArchiveIndex(CDNResourceType::Data);
+	const Key &ekey = *(const Key *)op->encodedKey;
+	TraceSpan span(&m_trace, "index", "archive index lookup");
+	span.SetKey("ekey", ekey);
+	const ArchiveIndexEntry *entry = m_archiveIndex.Find(ekey);
+	if (entry && entry->m_archive >= 0 && entry->m_archive < m_cdnConfig.m_archives.m_size) {
+		src->m_kind = EncodedSource::Archive;
+		src->m_archive = entry->m_archive;
+		src->m_offset = (int)entry->m_offset;
+		src->m_size = (int)entry->m_size;
+		src->m_key = m_cdnConfig.m_archives[entry->m_archive];
+	} else {
+		src->m_kind = EncodedSource::Loose;
+		src->m_archive = -1;
+		src->m_offset = 0;
+		src->m_key = ekey;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::ReadEncoded(const EncodedSource &src, int offset, int size, u8 *dst, const Key *key) {
+	if (size == 0) {
+		return NGDP_ERROR_SUCCESS;
+	}
+	if (src.m_size >= 0 && offset + size > src.m_size) {
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	if (src.m_kind == EncodedSource::Local) {
+		// Looked up again, in case the file was moved since IsLocal
+		if (!m_local->ReadRecord(src.m_key, offset, size, dst, key)) {
+			return NGDP_ERROR_FILE_READ_FAILED;
+		}
+		return NGDP_ERROR_SUCCESS;
+	}
+	int start = src.m_offset + offset;
+	Slice<u8> slice{dst, size};
+	int res = m_remote.Download(&slice, src.m_type, false, src.m_key, start, start + size);
+	return DownloadError(res);
+}
+
+int Client::DecodeChunk(ngdpOperation *op, const BlteChunk &c, const u8 *data, u8 *dst) {
+	TraceSpan span(&m_trace, "decode", "decode chunk");
+	span.SetKey("ckey", op->contentKey);
+	span.SetValue("chunk", c.m_index);
+	span.SetBytes(c.m_decodedSize);
+	int err = span.SetError(BlteDecodeChunk(data, c.m_encodedSize, dst, c.m_decodedSize, &m_keyring, c.m_index));
+	if (err == NGDP_ERROR_MISSING_KEY) {
+		u64 name = 0;
+		BlteEncryptedKeyName(data, c.m_encodedSize, &name);
+		Log("Skipped chunk %d of an encrypted file: key %016llx is not in the keyring", c.m_index, (unsigned long long)name);
+		Report(NGDP_STATISTIC_CHUNK_SKIPPED, c.m_index, c.m_decodedOffset, c.m_decodedSize, (const Key *)op->contentKey);
+		op->skippedChunkCount++;
+		err = NGDP_ERROR_SUCCESS;
+	}
+	return err;
+}
+
+int Client::ReadEncodedFile(ngdpOperation *op) {
+	int err = IsLocal(op);
+	if (err) {
+		return err;
+	}
+	if (op->encodedSize <= 0) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	if (op->fileOffset < 0 || op->fileOffset > op->encodedSize || op->bufferSize < 0 || !op->buffer) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	int size = op->encodedSize - op->fileOffset;
+	if (op->bufferSize < size) {
+		size = op->bufferSize;
+	}
+	EncodedSource src;
+	err = FindSource(op, &src);
+	if (!err) {
+		err = ReadEncoded(src, op->fileOffset, size, op->buffer, (const Key *)op->contentKey);
+	}
+	if (err || op->fileOffset != 0 || size != op->encodedSize) {
+		return err;
+	}
+
+	// A whole file is checked against its chunk checksums and encoded key
+	// before it is returned or stored.
+	Key ekey;
+	{
+		TraceSpan span(&m_trace, "verify", "verify file");
+		span.SetKey("ekey", op->encodedKey);
+		span.SetBytes(size);
+		err = BlteVerify(op->buffer, size, &ekey);
+		if (!err && memcmp(ekey.k, op->encodedKey, 16) != 0) {
+			err = NGDP_ERROR_CORRUPT_DATA;
+		}
+		span.SetError(err);
+	}
+	if (!err && m_writer && !op->disableFileWrites && src.m_kind != EncodedSource::Local) {
+		err = m_writer->Store(ekey, op->buffer, size);
+	}
+	return err;
+}
+
+static int setWorkingBufferRequired(ngdpOperation *op, const BlteHeader &header) {
+	int maxEncoded;
+	int maxDecoded;
+	header.MaxChunkSizes(&maxEncoded, &maxDecoded);
+	op->workingBufferRequiredSizeWithoutState = header.m_headerSize + maxEncoded + readaheadReserve(op);
+	op->workingBufferRequiredSize = header.m_headerSize + maxEncoded + maxDecoded + readaheadReserve(op);
+	return maxDecoded;
+}
+
+int Client::Read(ngdpOperation *op) {
+	if (!m_cache) {
+		return ReadStored(op);
+	}
+	int err;
+	if (!op->encodedKeyIsValid) {
+		err = FileInfo(op);
+		if (err) {
+			return err;
+		}
+	}
+	// Only whole-file reads count towards a file's popularity, so streaming
+	// a large file in pieces does not make it look hot.
+	const Key &ckey = *(const Key *)op->contentKey;
+	bool whole = op->fileOffset == 0 && op->bufferSize >= op->fileSize;
+	CachedFile *file = m_cache->Find(ckey, whole);
+	if (file) {
+		Report(NGDP_STATISTIC_CACHE_HIT, file->m_size, 0, 0, &ckey);
+		op->skippedChunkCount = 0;
+		int start = op->fileOffset;
+		if (start < 0 || op->bufferSize < 0 || start > file->m_size) {
+			err = NGDP_ERROR_INVALID_ARGUMENT;
+		} else {
+			memcpy(op->buffer, file->Data() + start, file->m_size - start < op->bufferSize ? file->m_size - start : op->bufferSize);
+			err = NGDP_ERROR_SUCCESS;
+		}
+		CachedFile::Release(&m_heap, file);
+		return err;
+	}
+	if (whole) {
+		Report(NGDP_STATISTIC_CACHE_MISS, op->fileSize, 0, 0, &ckey);
+	}
+	err = ReadStored(op);
+	// A file with zeroed chunks would be served wrong once the key is added.
+	if (!err && whole && !op->skippedChunkCount) {
+		file = CachedFile::Allocate(&m_heap, ckey, op->fileSize);
+		memcpy(file->Data(), op->buffer, op->fileSize);
+		CachedFile::Release(&m_heap, m_cache->Insert(file));
+	}
+	return err;
+}
+
+int Client::Acquire(ngdpOperation *op, CachedFile **out) {
+	*out = nullptr;
+	int err;
+	if (!op->encodedKeyIsValid) {
+		err = FileInfo(op);
+		if (err) {
+			return err;
+		}
+	}
+	const Key &ckey = *(const Key *)op->contentKey;
+	if (m_cache) {
+		CachedFile *file = m_cache->Find(ckey, true);
+		if (file) {
+			Report(NGDP_STATISTIC_CACHE_HIT, file->m_size, 0, 0, &ckey);
+			op->skippedChunkCount = 0;
+			*out = file;
+			return NGDP_ERROR_SUCCESS;
+		}
+		Report(NGDP_STATISTIC_CACHE_MISS, op->fileSize, 0, 0, &ckey);
+	}
+
+	CachedFile *file = CachedFile::Allocate(&m_heap, ckey, op->fileSize);
+	u8 *buffer = op->buffer;
+	int bufferSize = op->bufferSize;
+	int fileOffset = op->fileOffset;
+	op->buffer = file->Data();
+	op->bufferSize = op->fileSize;
+	op->fileOffset = 0;
+	err = ReadStored(op);
+	op->buffer = buffer;
+	op->bufferSize = bufferSize;
+	op->fileOffset = fileOffset;
+	if (err) {
+		CachedFile::Release(&m_heap, file);
+		return err;
+	}
+	*out = m_cache && !op->skippedChunkCount ? m_cache->Insert(file) : file;
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::ReadStored(ngdpOperation *op) {
+	int err;
+	// A readahead from the previous call must finish before the working
+	// buffer is touched.
+	int wbSize;
+	ReadaheadState *ra = findReadahead(op, &wbSize);
+	if (ra && (op->state == 0 || ra->m_magic != ReadaheadState::kMagic)) {
+		new (ra) ReadaheadState();
+		ra->m_magic = ReadaheadState::kMagic;
+		ra->m_done.store(1);
+		ra->m_pending = false;
+		ra->m_readyStart = 0;
+		ra->m_readyEnd = 0;
+		ra->m_nextOffset = -1;
+		ra->m_window = 0;
+	} else if (ra && ra->m_pending) {
+		bool waited = !ra->m_done.load(std::memory_order_acquire);
+		if (waited) {
+			Workers()->Wait(ra->m_done);
+		}
+		ra->m_pending = false;
+		// Adapt the window to the consumer: one that caught up with the
+		// readahead gets larger requests, and one that leaves the result
+		// idle for longer than it took gets smaller ones.
+		if (waited) {
+			ra->m_window *= 2;
+		} else if (steadyNanoseconds() - ra->m_finished > ra->m_finished - ra->m_started) {
+			ra->m_window /= 2;
+		}
+	}
+
+	op->skippedChunkCount = 0;
+	if (!op->encodedKeyIsValid) {
+		err = FileInfo(op);
+		if (err) {
+			return err;
+		}
+	}
+	if (op->state == 0) {
+		err = IsLocal(op);
+		if (err) {
+			return err;
+		}
+	}
+
+	int start = op->fileOffset;
+	if (start < 0 || op->bufferSize < 0 || start > op->fileSize) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	int end = op->fileSize - start < op->bufferSize ? op->fileSize : start + op->bufferSize;
+	if (start == end) {
+		return NGDP_ERROR_SUCCESS;
+	}
+
+	EncodedSource src;
+	err = FindSource(op, &src);
+	if (err) {
+		return err;
+	}
+	const Key *ckey = (const Key *)op->contentKey;
+
+	u8 *wb = op->workingBuffer;
+	// Bytes of the encoded file present at the start of workingBuffer from
+	// this call's header fetch
+	int prefetched = 0;
+	if (op->state != kReadStateHeader && op->state != kReadStateRaw) {
+		int prefetch = kHeaderPrefetchSize;
+		if (src.m_size >= 0 && prefetch > src.m_size) {
+			prefetch = src.m_size;
+		}
+		if (prefetch > wbSize) {
+			prefetch = wbSize;
+		}
+		if (prefetch < BlteHeader::kPrefixSize) {
+			op->workingBufferRequiredSize = kHeaderPrefetchSize + readaheadReserve(op);
+			return NGDP_ERROR_WORKING_BUFFER_TOO_SMALL;
+		}
+		err = ReadEncoded(src, 0, prefetch, wb, ckey);
+		if (err) {
+			return err;
+		}
+		prefetched = prefetch;
+		int headerSize = BlteHeader::RequiredSize(wb, prefetch);
+		if (headerSize < 0) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+		if (headerSize > wbSize) {
+			op->workingBufferRequiredSize = headerSize + readaheadReserve(op);
+			return NGDP_ERROR_WORKING_BUFFER_TOO_SMALL;
+		}
+		if (headerSize > prefetched) {
+			err = ReadEncoded(src, prefetched, headerSize - prefetched, wb + prefetched, ckey);
+			if (err) {
+				return err;
+			}
+			prefetched = headerSize;
+		}
+		op->state = kReadStateHeader;
+		if (headerSize == BlteHeader::kPrefixSize) {
+			u8 mode = 0;
+			if (prefetched > headerSize) {
+				mode = wb[headerSize];
+			} else {
+				err = ReadEncoded(src, headerSize, 1, &mode, ckey);
+				if (err) {
+					return err;
+				}
+			}
+			if (mode == 'N') {
+				op->state = kReadStateRaw;
+			}
+		}
+	}
+
+	BlteHeader header;
+	if (!header.Init(wb, wbSize, src.m_size, op->fileSize)) {
+		op->state = 0;
+		return NGDP_ERROR_CORRUPT_DATA;
+	}
+	int maxDecoded = setWorkingBufferRequired(op, header);
+
+	// Take what the readahead has ready.  A read that goes past it, or
+	// starts elsewhere, reuses the working buffer, so the rest is dropped.
+	int origin = start;
+	bool sequential = start == 0 || (ra && start == ra->m_nextOffset);
+	if (ra && ra->m_readyEnd > ra->m_readyStart) {
+		if (ra->m_result == NGDP_ERROR_SUCCESS && start >= ra->m_readyStart && start < ra->m_readyEnd) {
+			int readyEnd = end < ra->m_readyEnd ? end : ra->m_readyEnd;
+			memcpy(op->buffer, wb + ra->m_readyOffset + (start - ra->m_readyStart), readyEnd - start);
+			start = readyEnd;
+		}
+		if (start < end || start == ra->m_readyEnd) {
+			ra->m_readyStart = 0;
+			ra->m_readyEnd = 0;
+		}
+	}
+
+	if (start == end) {
+		// Served from the readahead
+	} else if (op->state == kReadStateRaw) {
+		// An unchunked raw file maps decoded offsets directly to encoded
+		// offsets, past the header and mode byte.
+		int encodedStart = header.m_headerSize + 1 + start;
+		int size = end - start;
+		if (encodedStart + size <= prefetched) {
+			memcpy(op->buffer + (start - origin), wb + encodedStart, size);
+			if (src.m_kind != EncodedSource::Local && prefetched == src.m_size) {
+				StoreDownloaded(op, header, wb, prefetched);
+			}
+		} else {
+			err = ReadEncoded(src, encodedStart, size, op->buffer + (start - origin), ckey);
+			if (err) {
+				return err;
+			}
+		}
+	} else {
+		BlteChunk chunk;
+		BlteChunk last;
+		if (!header.Seek(start, &chunk) || !header.Seek(end - 1, &last)) {
+			return NGDP_ERROR_CORRUPT_DATA;
+		}
+
+		// Chunks that are only partly inside the range are decoded into the end
+		// of the working buffer and copied out; the rest of the working buffer
+		// after the header holds the encoded chunks being read.
+		bool partial = start != chunk.m_decodedOffset || end != last.m_decodedOffset + last.m_decodedSize;
+		int decodeReserve = partial ? maxDecoded : 0;
+		u8 *readArea = wb + header.m_headerSize;
+		int readAreaSize = wbSize - header.m_headerSize - decodeReserve;
+		u8 *decodeArea = wb + wbSize - decodeReserve;
+
+		bool more = true;
+		while (more && chunk.m_decodedOffset < end) {
+			// Gather the run of consecutive chunks that fits the read area, so
+			// that it can be fetched with a single request.
+			BlteChunk first = chunk;
+			int runSize = chunk.m_encodedSize;
+			int runCount = 1;
+			BlteChunk next = chunk;
+			while (header.Next(&next) && next.m_decodedOffset < end) {
+				int size = next.m_encodedOffset + next.m_encodedSize - first.m_encodedOffset;
+				if (size > readAreaSize) {
+					break;
+				}
+				runSize = size;
+				runCount++;
+			}
+			if (runSize > readAreaSize) {
+				return NGDP_ERROR_WORKING_BUFFER_TOO_SMALL;
+			}
+			BlteStream stream;
+			stream.Init(&header, first, runCount, readArea, [&](const BlteChunk &c, const u8 *p) {
+				int chunkEnd = c.m_decodedOffset + c.m_decodedSize;
+				int copyStart = start > c.m_decodedOffset ? start : c.m_decodedOffset;
+				int copyEnd = end < chunkEnd ? end : chunkEnd;
+				u8 *dst = op->buffer + (copyStart - origin);
+				if (copyStart == c.m_decodedOffset && copyEnd == chunkEnd) {
+					return DecodeChunk(op, c, p, dst);
+				}
+				int res = DecodeChunk(op, c, p, decodeArea);
+				if (!res) {
+					memcpy(dst, decodeArea + (copyStart - c.m_decodedOffset), copyEnd - copyStart);
+				}
+				return res;
+			});
+			stream.m_tracer = &m_trace;
+			bool havePrefetched = first.m_encodedOffset == header.m_headerSize && first.m_encodedOffset + runSize <= prefetched;
+			if (!havePrefetched) {
+				// Chunks are decoded while the ones after them download.
+				DownloadSinkFn sink = [&](int received) {
+					stream.Advance(received);
+				};
+				ScopedDownloadSink _s(&sink);
+				err = ReadEncoded(src, first.m_encodedOffset, runSize, readArea, ckey);
+				if (err) {
+					return err;
+				}
+			}
+			err = stream.Advance(runSize);
+			if (err) {
+				return err;
+			}
+			chunk = stream.m_chunk;
+			more = header.Next(&chunk);
+
+			// A run of every chunk leaves the whole encoded file at the start of
+			// the working buffer, with its chunks verified.
+			if (src.m_kind != EncodedSource::Local && first.m_index == 0 && !more) {
+				StoreDownloaded(op, header, wb, header.m_headerSize + runSize);
+			}
+		}
+	}
+
+	if (ra) {
+		ra->m_nextOffset = end;
+		if (sequential && end < op->fileSize && ra->m_readyEnd == ra->m_readyStart) {
+			StartReadahead(op, ra, header, src, wbSize, end);
+		}
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+void Client::StartReadahead(ngdpOperation *op, ReadaheadState *ra, const BlteHeader &header, const EncodedSource &src, int wbSize, int end) {
+	int space = wbSize - header.m_headerSize;
+	int readSize = end - op->fileOffset;
+	if (ra->m_window < readSize) {
+		// Start with the next two reads' worth
+		ra->m_window = 2 * readSize;
+	}
+	if (ra->m_window > space) {
+		ra->m_window = space;
+	}
+
+	// Whole chunks from the one containing end, until the window is covered
+	// or the working buffer is full.
+	bool raw = op->state == kReadStateRaw;
+	BlteChunk first;
+	memset(&first, 0, sizeof(first));
+	int encodedSize = 0;
+	int decodedSize = 0;
+	int count = 0;
+	if (raw) {
+		first.m_decodedOffset = end;
+		decodedSize = op->fileSize - end < ra->m_window ? op->fileSize - end : ra->m_window;
+	} else {
+		if (!header.Seek(end, &first)) {
+			return;
+		}
+		BlteChunk chunk = first;
+		do {
+			int encoded = chunk.m_encodedOffset + chunk.m_encodedSize - first.m_encodedOffset;
+			int decoded = chunk.m_decodedOffset + chunk.m_decodedSize - first.m_decodedOffset;
+			if (encoded + decoded > space) {
+				break;
+			}
+			encodedSize = encoded;
+			decodedSize = decoded;
+			count++;
+		} while (decodedSize < ra->m_window && header.Next(&chunk));
+	}
+	if (decodedSize <= 0) {
+		return;
+	}
+
+	ra->m_readyStart = first.m_decodedOffset;
+	ra->m_readyEnd = first.m_decodedOffset + decodedSize;
+	ra->m_readyOffset = wbSize - decodedSize;
+	ra->m_result = NGDP_ERROR_SUCCESS;
+	ra->m_done.store(0);
+	ra->m_pending = true;
+	ra->m_started = steadyNanoseconds();
+	u8 *wb = op->workingBuffer;
+	Key ckey = *(const Key *)op->contentKey;
+	Workers()->Submit([=]() {
+		ScopedCurrentClient _c(this);
+		TraceSpan span(&m_trace, "read", "readahead");
+		span.SetKey("ckey", ckey);
+		span.SetValue("offset", first.m_decodedOffset);
+		span.SetBytes(decodedSize);
+		u8 *ready = wb + ra->m_readyOffset;
+		int err;
+		if (raw) {
+			err = ReadEncoded(src, header.m_headerSize + 1 + first.m_decodedOffset, decodedSize, ready, &ckey);
+		} else {
+			BlteStream stream;
+			stream.Init(&header, first, count, wb + header.m_headerSize, [&](const BlteChunk &c, const u8 *p) {
+				TraceSpan chunkSpan(&m_trace, "decode", "decode chunk");
+				chunkSpan.SetKey("ckey", ckey);
+				chunkSpan.SetValue("chunk", c.m_index);
+				chunkSpan.SetBytes(c.m_decodedSize);
+				// A missing key fails the readahead, so the read that wants
+				// the chunk decodes it again and counts it.
+				return chunkSpan.SetError(BlteDecodeChunk(p, c.m_encodedSize, ready + (c.m_decodedOffset - first.m_decodedOffset), c.m_decodedSize,
+					&m_keyring, c.m_index));
+			});
+			stream.m_tracer = &m_trace;
+			{
+				DownloadSinkFn sink = [&](int received) {
+					stream.Advance(received);
+				};
+				ScopedDownloadSink _s(&sink);
+				err = ReadEncoded(src, first.m_encodedOffset, encodedSize, wb + header.m_headerSize, &ckey);
+			}
+			if (!err) {
+				err = stream.Advance(encodedSize);
+			}
+		}
+		ra->m_result = span.SetError(err);
+		ra->m_finished = steadyNanoseconds();
+		ra->m_done.store(1, std::memory_order_release);
+	});
+}
+
+int Client::EndRead(ngdpOperation *op) {
+	int wbSize;
+	ReadaheadState *ra = findReadahead(op, &wbSize);
+	if (ra && op->state != 0 && ra->m_magic == ReadaheadState::kMagic && ra->m_pending) {
+		Workers()->Wait(ra->m_done);
+		ra->m_pending = false;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+void Client::FindPatchSource(const Key &patchKey, int patchSize, EncodedSource *src) {
+	src->m_type = CDNResourceType::Patch;
+	src->m_size = patchSize;
+	LoadArchiveIndex(CDNResourceType::Patch);
+	TraceSpan span(&m_trace, "index", "patch archive index lookup");
+	span.SetKey("patch", patchKey);
+	const ArchiveIndexEntry *entry = m_patchArchiveIndex.Find(patchKey);
+	if (entry && entry->m_archive >= 0 && entry->m_archive < m_cdnConfig.m_patchArchives.m_size) {
+		src->m_kind = EncodedSource::Archive;
+		src->m_archive = entry->m_archive;
+		src->m_offset = (int)entry->m_offset;
+		src->m_size = (int)entry->m_size;
+		src->m_key = m_cdnConfig.m_patchArchives[entry->m_archive];
+	} else {
+		src->m_kind = EncodedSource::Loose;
+		src->m_archive = -1;
+		src->m_offset = 0;
+		src->m_key = patchKey;
+	}
+}
+
+int Client::ApplyPatch(const Key &baseEncodedKey, int baseSize, const EncodedSource &patch, const PatchWriteFn &write) {
+	ngdpOperation base;
+	memset(&base, 0, sizeof(base));
+	memcpy(base.encodedKey, baseEncodedKey.k, 16);
+	base.encodedKeyIsValid = 1;
+	base.encodedSize = -1;
+	base.fileSize = baseSize;
+	int err = IsLocal(&base);
+	if (err) {
+		return err;
+	}
+	if (!base.dataIsLocal) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+
+	// Time spent reading is excluded from the patching throughput sample.
+	f64 ioSeconds = 0;
+	auto startTime = std::chrono::steady_clock::now();
+
+	// The base's working buffer only has to hold its largest chunks, which the
+	// first read reports once it has seen the BLTE header.
+	Buffer<u8> wb;
+	wb.Init(&m_heap, kHeaderPrefetchSize);
+	PatchReadFn readBase = [&](int offset, int size, u8 *dst) {
+		auto readStart = std::chrono::steady_clock::now();
+		base.fileOffset = offset;
+		base.bufferSize = size;
+		base.buffer = dst;
+		int res;
+		for (;;) {
+			base.workingBuffer = wb.m_storage;
+			base.workingBufferSize = wb.m_capacity;
+			res = ReadStored(&base);
+			if (!res && base.skippedChunkCount) {
+				res = NGDP_ERROR_MISSING_KEY;
+			}
+			if (res != NGDP_ERROR_WORKING_BUFFER_TOO_SMALL || base.workingBufferRequiredSize <= wb.m_capacity) {
+				break;
+			}
+			wb.Alloc(&m_heap, base.workingBufferRequiredSize);
+			wb.m_size = 0;
+			base.state = 0;
+		}
+		ioSeconds += std::chrono::duration<f64>(std::chrono::steady_clock::now() - readStart).count();
+		return res;
+	};
+	PatchReadFn readPatch = [&](int offset, int size, u8 *dst) {
+		auto readStart = std::chrono::steady_clock::now();
+		int res = ReadEncoded(patch, offset, size, dst, nullptr);
+		ioSeconds += std::chrono::duration<f64>(std::chrono::steady_clock::now() - readStart).count();
+		return res;
+	};
+
+	PatchApplier applier;
+	err = applier.Init(&m_heap, readPatch, patch.m_size, readBase, baseSize);
+	if (!err) {
+		Report(NGDP_STATISTIC_PATCHING, patch.m_size, applier.m_targetSize, 0, &baseEncodedKey);
+		err = applier.Run(write);
+	}
+	if (!err) {
+		f64 total = std::chrono::duration<f64>(std::chrono::steady_clock::now() - startTime).count();
+		m_cost.AddPatch(applier.m_targetSize, total - ioSeconds);
+	}
+	applier.Destroy();
+	wb.Destroy(&m_heap);
+	return err;
+}
+
+bool Client::ChoosePatch(ngdpOperation *op, PatchCandidate *best) {
+	if (!m_hasLocal || LoadPatchManifest()) {
+		return false;
+	}
+	// A plain download is a header request plus one request for the chunks.
+	s64 encodedSize = op->encodedSize > 0 ? op->encodedSize : op->fileSize;
+	f64 bestSeconds = m_cost.DownloadSeconds(encodedSize, 2);
+	bool found = false;
+	m_patchManifest.Find(*(const Key *)op->contentKey, [&](const PatchCandidate &patch) {
+		LocalIndexEntry entry;
+		if (!m_local->Find(patch.m_sourceKey, &entry)) {
+			return;
+		}
+		// The three patch streams are each fetched in kInputSize requests.
+		int requests = 3 + patch.m_patchSize / PatchApplier::kInputSize;
+		f64 seconds = m_cost.DownloadSeconds(patch.m_patchSize, requests) +
+			m_cost.DiskSeconds(entry.m_size) +
+			m_cost.PatchSeconds(patch.m_targetSize);
+		if (seconds < bestSeconds) {
+			bestSeconds = seconds;
+			*best = patch;
+			found = true;
+		}
+	});
+	return found;
+}
+
+int Client::Fetch(ngdpOperation *op, const PatchWriteFn &write) {
+	int err;
+	if (!op->encodedKeyIsValid) {
+		err = FileInfo(op);
+		if (err) {
+			return err;
+		}
+	}
+	err = IsLocal(op);
+	if (err) {
+		return err;
+	}
+
+	PatchCandidate patch;
+	if (!op->dataIsLocal && ChoosePatch(op, &patch)) {
+		EncodedSource src;
+		FindPatchSource(patch.m_patchKey, patch.m_patchSize, &src);
+		Md5 md5;
+		md5.Init();
+		int written = 0;
+		err = ApplyPatch(patch.m_sourceKey, patch.m_sourceSize, src, [&](const u8 *data, int size) {
+			md5.Update(data, size);
+			written += size;
+			return write(data, size);
+		});
+		if (!err) {
+			TraceSpan span(&m_trace, "verify", "verify patched file");
+			span.SetKey("ckey", op->contentKey);
+			span.SetBytes(written);
+			Key sum;
+			md5.Final(&sum);
+			return span.SetError(memcmp(sum.k, op->contentKey, 16) == 0 && written == op->fileSize ? NGDP_ERROR_SUCCESS : NGDP_ERROR_CORRUPT_DATA);
+		}
+		// Once output has been passed on, falling back would repeat it.
+		if (written || err == NGDP_ERROR_ABORTED) {
+			return err;
+		}
+		Log("Patching failed (%d); downloading instead", err);
+	}
+
+	if (op->bufferSize <= 0) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	int chunkSize = op->bufferSize;
+	int skipped = 0;
+	for (int offset = 0; offset < op->fileSize; offset += chunkSize) {
+		op->fileOffset = offset;
+		op->bufferSize = op->fileSize - offset < chunkSize ? op->fileSize - offset : chunkSize;
+		err = Read(op);
+		skipped += op->skippedChunkCount;
+		if (!err) {
+			err = write(op->buffer, op->bufferSize);
+		}
+		if (err) {
+			break;
+		}
+	}
+	EndRead(op);
+	op->bufferSize = chunkSize;
+	op->skippedChunkCount = skipped;
+	return err;
+}
+
+}
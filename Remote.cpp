@@ -4,6 +4,10 @@
 
 #include <functional>
 #include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
 
 #include "Strings.h"
 
@@ -11,20 +15,32 @@
 
 namespace ngdp {
 
-void Remote::Init(Client *c, int retryLimit, const char *url, const char *uid, const char *region) {
-	memset(this, 0, sizeof(*this));
-	m_url = url;
-	m_uid = uid;
-	m_region = region;
-	m_retryLimit = retryLimit;
+// Defined with the hedged requests below
+static HedgeTimer *createHedgeTimer(Remote *remote);
+static void freeHedgeTimer(HedgeTimer *t);
+
+void Remote::Init(Client *c, const ngdpConfig *config) {
+	memset((void *)this, 0, sizeof(*this));
+	m_retryLimit = config->httpRetryCount;
 	m_client = c;
 	if (m_retryLimit <= 0) {
 		m_retryLimit = 5;
 	}
+	m_hedgeDelayUs = config->hedgeDelayMs > 0 ? config->hedgeDelayMs * 1000 : 0;
+	m_deadlineUs = config->downloadDeadlineMs > 0 ? config->downloadDeadlineMs * (s64)1000 : 0;
+	m_backoffMs = config->retryBackoffMs > 0 ? config->retryBackoffMs : 50;
+	m_hedgeTimer = m_hedgeDelayUs && c->m_download ? createHedgeTimer(this) : nullptr;
+
+	const char *url = config->ngdpUrl;
+	const char *uid = config->gameUid;
+	const char *region = config->ngdpRegion;
 
-	if (!c->m_download) {
+	if (!c->m_download || !url || !uid || !region) {
 		return;
 	}
+	m_url = url;
+	m_uid = uid;
+	m_region = region;
 
 	StackBuffer<u8, 128> buf;
 	buf.Init();
@@ -62,6 +78,11 @@ void Remote::Init(Client *c, int retryLimit, const char *url, const char *uid, c
 }
 
 void Remote::Destroy() {
+	freeHedgeTimer(m_hedgeTimer);
+	// Cancelled attempts still hold the client until their download returns.
+	while (m_hedgesInFlight.load()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
 	m_cdnsResponse.Destroy(_heap);
 	m_versionsResponse.Destroy(_heap);
 }
@@ -132,15 +153,29 @@ void Remote::ParseVersions(const String &s) {
 	});
 }
 
-const char *Remote::_MakeURL(Buffer<u8> *buf, CDNResourceType type, bool isIndex, const Key &key) {
-	StringBuffer sb;
-	sb.Init(buf);
-	int ofs = buf->m_size;
+s64 MonotonicMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	int maxTransfer = 0;
+int Remote::PickCdnHost() {
+	SpinLockGuard lock(&m_hostLock);
+	s64 now = MonotonicMicros();
+	// Start from the next host in turn whose breaker is closed; if every
+	// breaker is open, use the host that reopens first.
 	int bestIdx = m_nextCdnHostIndex;
+	for (int i = 0; i < m_cdnHostCount; i++) {
+		int host = (m_nextCdnHostIndex + i) % m_cdnHostCount;
+		if (m_cdnBreakerUntil[host] <= now) {
+			bestIdx = host;
+			break;
+		}
+		if (m_cdnBreakerUntil[host] < m_cdnBreakerUntil[bestIdx]) {
+			bestIdx = host;
+		}
+	}
+	int maxTransfer = 0;
 	for (int i = 0; i < m_cdnHostIndex; i++) {
-		if (m_cdnTransferRates[i] > maxTransfer) {
+		if (m_cdnTransferRates[i] > maxTransfer && m_cdnBreakerUntil[i] <= now) {
 			bestIdx = i;
 			maxTransfer = m_cdnTransferRates[i];
 		}
@@ -149,9 +184,599 @@ const char *Remote::_MakeURL(Buffer<u8> *buf, CDNResourceType type, bool isIndex
 	if (maxTransfer > 10) {
 		m_cdnTransferRates[m_cdnHostIndex] = maxTransfer / 2;
 	}
+	return m_cdnHostIndex;
+}
+
+// Requests at least this large measure throughput rather than latency
+static const int kLargeRequest = 64 * 1024;
+
+int Remote::PickHedgeHost(int exclude) {
+	SpinLockGuard lock(&m_hostLock);
+	s64 now = MonotonicMicros();
+	int best = -1;
+	for (int i = 0; i < m_cdnHostCount; i++) {
+		if (i == exclude || m_cdnBreakerUntil[i] > now) {
+			continue;
+		}
+		if (best < 0 || m_cdnTransferRates[i] > m_cdnTransferRates[best]) {
+			best = i;
+		}
+	}
+	return best >= 0 ? best : (exclude + 1) % m_cdnHostCount;
+}
+
+void Remote::FinishCdnRequest(int host, int size, double seconds, bool failed) {
+	int tripped = 0;
+	int failures;
+	{
+		SpinLockGuard lock(&m_hostLock);
+		m_cdnTransferRates[host] = (int)(size / seconds);
+		// Small requests are mostly latency
+		if (size > 0 && size < kLargeRequest) {
+			int us = (int)(seconds * 1e6);
+			int &latency = m_cdnLatencies[host];
+			latency = latency ? latency + (us - latency) / 4 : us;
+		} else if (size >= kLargeRequest) {
+			int rate = (int)(size / seconds);
+			int &throughput = m_cdnThroughputs[host];
+			throughput = throughput ? throughput + (rate - throughput) / 4 : rate;
+		}
+		m_nextCdnHostIndex = (host + 1) % m_cdnHostCount;
+
+		failures = failed ? ++m_cdnFailures[host] : 0;
+		if (!failed) {
+			m_cdnFailures[host] = 0;
+			m_cdnCooldownsMs[host] = 0;
+		} else if (failures >= kBreakerFailures && m_cdnBreakerUntil[host] <= MonotonicMicros()) {
+			// A host that fails again once its cooldown ends waits twice as
+			// long.  Failures of requests made before the breaker opened
+			// don't extend it.
+			int cooldown = m_cdnCooldownsMs[host] ? m_cdnCooldownsMs[host] * 2 : kBreakerCooldownMs;
+			if (cooldown > kBreakerMaxCooldownMs) {
+				cooldown = kBreakerMaxCooldownMs;
+			}
+			m_cdnCooldownsMs[host] = cooldown;
+			m_cdnBreakerUntil[host] = MonotonicMicros() + cooldown * (s64)1000;
+			tripped = cooldown;
+		}
+	}
+	if (tripped) {
+		m_client->Log("CDN host %d failed %d times in a row; skipping it for %d ms", host, failures, tripped);
+		m_client->Report(NGDP_STATISTIC_HOST_DISABLED, host, tripped, failures, 0);
+	}
+}
+
+static thread_local s64 threadDownloadDeadline;
+
+s64 CurrentDownloadDeadline() {
+	return threadDownloadDeadline;
+}
+
+ScopedDownloadDeadline::ScopedDownloadDeadline(s64 deadline) {
+	m_previous = threadDownloadDeadline;
+	threadDownloadDeadline = deadline;
+}
+
+ScopedDownloadDeadline::~ScopedDownloadDeadline() {
+	threadDownloadDeadline = m_previous;
+}
+
+s64 Remote::Deadline() const {
+	if (threadDownloadDeadline) {
+		return threadDownloadDeadline;
+	}
+	return m_deadlineUs ? MonotonicMicros() + m_deadlineUs : 0;
+}
+
+// A per-thread xorshift generator for retry jitter
+static u32 jitterRandom() {
+	static thread_local u64 state;
+	if (!state) {
+		state = (u64)MonotonicMicros() * 0x9e3779b97f4a7c15ull | 1;
+	}
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return (u32)(state >> 32);
+}
+
+bool Remote::BackOff(int attempt, s64 deadline) {
+	s64 cap = (s64)m_backoffMs << (attempt - 1 < 16 ? attempt - 1 : 16);
+	if (cap > kMaxBackoffMs) {
+		cap = kMaxBackoffMs;
+	}
+	s64 delayUs = (s64)(jitterRandom() % (u32)(cap * 1000 + 1));
+	if (deadline && MonotonicMicros() + delayUs >= deadline) {
+		return false;
+	}
+	TraceSpan span(&m_client->m_trace, "network", "retry backoff");
+	span.SetValue("attempt", attempt + 1);
+	std::this_thread::sleep_for(std::chrono::microseconds(delayUs));
+	return true;
+}
+
+int Remote::HedgeDelay(int size) {
+	// Compare with the best any host has done, since a host that is always
+	// slow would otherwise set its own threshold late.
+	s64 expected = -1;
+	{
+		SpinLockGuard lock(&m_hostLock);
+		for (int i = 0; i < m_cdnHostCount; i++) {
+			int latency = m_cdnLatencies[i];
+			int rate = size >= kLargeRequest ? m_cdnThroughputs[i] : 0;
+			if (latency <= 0 && rate <= 0) {
+				continue;
+			}
+			s64 e = latency + (rate > 0 ? (s64)size * 1000000 / rate : 0);
+			if (expected < 0 || e < expected) {
+				expected = e;
+			}
+		}
+	}
+	// Without any history, only hedge a request that is well past the
+	// configured delay.
+	s64 delay = expected < 0 ? 4 * (s64)m_hedgeDelayUs : 2 * expected;
+	if (delay < m_hedgeDelayUs) {
+		delay = m_hedgeDelayUs;
+	} else if (delay > 20 * (s64)m_hedgeDelayUs) {
+		delay = 20 * (s64)m_hedgeDelayUs;
+	}
+	return (int)delay;
+}
+
+static thread_local DownloadProgress *threadDownloadProgress;
+static thread_local const DownloadSinkFn *threadDownloadSink;
+
+ScopedDownloadSink::ScopedDownloadSink(const DownloadSinkFn *sink) {
+	m_previous = threadDownloadSink;
+	threadDownloadSink = sink;
+}
+
+ScopedDownloadSink::~ScopedDownloadSink() {
+	threadDownloadSink = m_previous;
+}
+
+DownloadProgress *CurrentDownloadProgress() {
+	return threadDownloadProgress;
+}
+
+int Remote::Request(const char *url, int rangeStart, int rangeEnd, int capacity, u8 **data, int *size, PartialDownload *partial, DownloadProgress *progress) {
+	DownloadProgress own;
+	if (!progress) {
+		own.Init();
+		progress = &own;
+	}
+	// Only a body arriving in the caller's buffer can be streamed.
+	progress->m_sink = partial->m_allocate ? nullptr : threadDownloadSink;
+	DownloadProgress *previous = threadDownloadProgress;
+	threadDownloadProgress = progress;
+	int res;
+	if (partial->m_received > 0) {
+		int have = partial->m_received;
+		int total = partial->m_total;
+		if (partial->m_allocate) {
+			*data = (u8 *)m_client->m_heap.Realloc(*data, total);
+		}
+		progress->m_sinkBase = have;
+		m_client->Log("Resuming %s at byte %d of %d", url, have, total);
+		u8 *dst = *data + have;
+		int n = total - have;
+		res = m_client->m_download(url, rangeStart + have, rangeStart + total, &dst, &n);
+		int expected = progress->m_expected.load();
+		if (res == NGDP_DOWNLOAD_SUCCESS && n == total - have) {
+			partial->m_received = 0;
+			*size = total;
+		} else if (res == NGDP_DOWNLOAD_SERVER_ERROR && (expected < 0 || expected == total - have)) {
+			// Failed again, but what did arrive continues the body
+			int received = progress->m_received.load();
+			partial->m_received += received < total - have ? received : total - have;
+			*size = partial->m_received;
+		} else {
+			// The range was not honored, or the body's length changed; a
+			// server error makes the next request start over.
+			if (res == NGDP_DOWNLOAD_SUCCESS || res == NGDP_DOWNLOAD_BUFFER_TOO_SMALL) {
+				res = NGDP_DOWNLOAD_SERVER_ERROR;
+			}
+			partial->m_received = 0;
+			if (partial->m_allocate) {
+				m_client->m_heap.Free(*data);
+				*data = nullptr;
+			}
+			*size = 0;
+		}
+	} else {
+		int n = capacity;
+		res = m_client->m_download(url, rangeStart, rangeEnd, data, &n);
+		*size = n;
+		if (res == NGDP_DOWNLOAD_SERVER_ERROR) {
+			int received = progress->m_received.load();
+			int total = progress->m_expected.load();
+			bool kept = partial->m_allocate ? *data != nullptr : total <= capacity;
+			if (received > 0 && total > received && kept) {
+				partial->m_received = received;
+				partial->m_total = total;
+				*size = received;
+			} else if (partial->m_allocate && *data) {
+				m_client->m_heap.Free(*data);
+				*data = nullptr;
+				*size = 0;
+			}
+		}
+	}
+	threadDownloadProgress = previous;
+	return res;
+}
+
+struct DownloadAttempt {
+	int m_host;
+	int m_result;
+	u8 *m_data;
+	int m_size;
+	bool m_done;
+	std::chrono::steady_clock::time_point m_start;
+	double m_seconds;
+	DownloadProgress m_progress;
+};
+
+// A hedged request, freed when the caller, the hedge timer and the second
+// attempt's thread have released it.  The first attempt runs on the caller's
+// thread; the second is only started, on a thread of its own, if the first
+// is still running at m_hedgeAt.  m_mutex guards the attempts' results,
+// m_attemptCount and m_winner.
+struct HedgedDownload {
+	Remote *m_remote;
+	std::atomic<int> m_refs;
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+
+	CDNResourceType m_type;
+	bool m_isIndex;
+	Key m_key;
+	int m_rangeStart;
+	int m_rangeEnd;
+	int m_capacity;
+	s64 m_deadline;
+	// Set by the caller, then only used by the hedge timer
+	int m_delay;
+	std::chrono::steady_clock::time_point m_hedgeAt;
+
+	DownloadAttempt m_attempts[2];
+	int m_attemptCount;
+	// An attempt's index, or one of these
+	int m_winner;
+	static const int kUndecided = -1;
+	static const int kTimedOut = -2;
+
+	void Release() {
+		if (m_refs.fetch_sub(1) != 1) {
+			return;
+		}
+		Remote *remote = m_remote;
+		Heap *h = &remote->m_client->m_heap;
+		for (int i = 0; i < m_attemptCount; i++) {
+			if (m_attempts[i].m_data) {
+				h->Free(m_attempts[i].m_data);
+			}
+		}
+		this->~HedgedDownload();
+		h->Free(this);
+		remote->m_hedgesInFlight.fetch_sub(1);
+	}
+
+	// Sets up the next attempt, with m_mutex held, and returns its index.
+	int Begin(int host) {
+		DownloadAttempt &a = m_attempts[m_attemptCount];
+		a.m_host = host;
+		a.m_result = NGDP_DOWNLOAD_SERVER_ERROR;
+		a.m_data = nullptr;
+		a.m_size = 0;
+		a.m_done = false;
+		a.m_start = std::chrono::steady_clock::now();
+		a.m_progress.Init();
+		return m_attemptCount++;
+	}
+
+	// Starts the second attempt, unless the first has finished or is
+	// arriving at its host's usual rate.  Called by the hedge timer; returns
+	// false to be called again at m_hedgeAt.
+	bool Hedge() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const DownloadAttempt &first = m_attempts[0];
+		if (first.m_done || m_attemptCount == 2) {
+			return true;
+		}
+		auto now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - first.m_start).count();
+		int received = first.m_progress.m_received.load();
+		int rate;
+		{
+			SpinLockGuard hostLock(&m_remote->m_hostLock);
+			rate = m_remote->m_cdnThroughputs[first.m_host];
+		}
+		if (received > 0 && rate > 0 && received / seconds >= rate / 2) {
+			m_hedgeAt = now + std::chrono::microseconds(m_delay);
+			return false;
+		}
+		int second = m_remote->PickHedgeHost(first.m_host);
+		m_remote->m_client->Report(NGDP_STATISTIC_DOWNLOAD_HEDGED, second, (int)(seconds * 1e6), first.m_host, 0);
+		int index = Begin(second);
+		m_refs.fetch_add(1);
+		std::thread([this, index]() {
+			u8 *data = m_capacity ? (u8 *)m_remote->m_client->m_heap.Alloc(m_capacity) : nullptr;
+			int size = m_capacity;
+			PartialDownload partial = {0, 0, m_capacity == 0};
+			Run(index, &data, &size, &partial);
+			Release();
+		}).detach();
+		return true;
+	}
+
+	// Makes attempt index's request and records its result.  The first
+	// attempt is received into the caller's *data, resuming partial; the
+	// second into a buffer of its own, which the attempt keeps.
+	void Run(int index, u8 **data, int *size, PartialDownload *partial) {
+		DownloadAttempt &a = m_attempts[index];
+		Client *c = m_remote->m_client;
+		ScopedCurrentClient _c(c);
+		ScopedDownloadDeadline _d(m_deadline);
+		StackBuffer<u8, 128> buf;
+		buf.Init();
+		const char *url = m_remote->_MakeURL(&buf, a.m_host, m_type, m_isIndex, m_key);
+		int res;
+		{
+			TraceSpan span(&c->m_trace, "network", index ? "hedged transfer" : "transfer");
+			span.SetKey("key", m_key);
+			span.SetHost(a.m_host);
+			res = m_remote->Request(url, m_rangeStart, m_rangeEnd, m_capacity, data, size, partial, &a.m_progress);
+			span.SetBytes(*size);
+			span.SetError(DownloadError(res));
+		}
+		buf.Destroy(&c->m_heap);
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - a.m_start).count();
+		bool lost;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			a.m_result = res;
+			a.m_data = index ? *data : nullptr;
+			a.m_size = *size;
+			a.m_seconds = seconds;
+			a.m_done = true;
+			lost = m_winner != kUndecided;
+			// The first attempt holds up the caller until it returns.
+			if (res == NGDP_DOWNLOAD_SUCCESS && !lost && index != 0) {
+				m_attempts[0].m_progress.m_cancelled.store(true);
+			}
+			m_changed.notify_all();
+		}
+		// The caller records the attempts that finished before the winner
+		// was chosen.
+		if (lost) {
+			// A cancelled loser is not the host's fault, but a request
+			// that ran out the deadline is.
+			bool failed = res == NGDP_DOWNLOAD_SERVER_ERROR && (m_winner == kTimedOut || !a.m_progress.m_cancelled.load());
+			m_remote->FinishCdnRequest(a.m_host, res == NGDP_DOWNLOAD_SUCCESS ? *size : 0, seconds, failed);
+		}
+	}
+};
+
+// Starts the second attempts of hedged requests.  One thread per client
+// waits for the earliest hedge time, so a request that is never hedged costs
+// no thread.
+struct HedgeTimer {
+	Remote *m_remote;
+	std::mutex m_mutex;
+	std::condition_variable m_changed;
+	// Requests waiting to be hedged, each holding a reference
+	Buffer<HedgedDownload *> m_pending;
+	bool m_stopping;
+	std::thread m_thread;
+
+	void Add(HedgedDownload *d) {
+		d->m_refs.fetch_add(1);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending.Push(&m_remote->m_client->m_heap, d);
+		m_changed.notify_all();
+	}
+
+	// Drops d if it has not been hedged yet.
+	void Remove(HedgedDownload *d) {
+		bool found = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (int i = 0; i < m_pending.m_size; i++) {
+				if (m_pending[i] == d) {
+					m_pending[i] = m_pending[m_pending.m_size - 1];
+					m_pending.m_size--;
+					found = true;
+					break;
+				}
+			}
+		}
+		if (found) {
+			d->Release();
+		}
+	}
+
+	void Run() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stopping) {
+			if (!m_pending.m_size) {
+				m_changed.wait(lock);
+				continue;
+			}
+			int next = 0;
+			for (int i = 1; i < m_pending.m_size; i++) {
+				if (m_pending[i]->m_hedgeAt < m_pending[next]->m_hedgeAt) {
+					next = i;
+				}
+			}
+			HedgedDownload *d = m_pending[next];
+			// d may be removed and freed while this waits.
+			auto hedgeAt = d->m_hedgeAt;
+			if (std::chrono::steady_clock::now() < hedgeAt) {
+				m_changed.wait_until(lock, hedgeAt);
+				continue;
+			}
+			m_pending[next] = m_pending[m_pending.m_size - 1];
+			m_pending.m_size--;
+			lock.unlock();
+			bool finished = d->Hedge();
+			lock.lock();
+			if (!finished && !m_stopping) {
+				m_pending.Push(&m_remote->m_client->m_heap, d);
+			} else {
+				lock.unlock();
+				d->Release();
+				lock.lock();
+			}
+		}
+	}
+};
+
+static HedgeTimer *createHedgeTimer(Remote *remote) {
+	HedgeTimer *t = new (remote->m_client->m_heap.Alloc(sizeof(HedgeTimer))) HedgeTimer;
+	t->m_remote = remote;
+	t->m_pending.Init();
+	t->m_stopping = false;
+	t->m_thread = std::thread(&HedgeTimer::Run, t);
+	return t;
+}
+
+static void freeHedgeTimer(HedgeTimer *t) {
+	if (!t) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(t->m_mutex);
+		t->m_stopping = true;
+		t->m_changed.notify_all();
+	}
+	t->m_thread.join();
+	Heap *h = &t->m_remote->m_client->m_heap;
+	for (HedgedDownload *d : t->m_pending) {
+		d->Release();
+	}
+	t->m_pending.Destroy(h);
+	t->~HedgeTimer();
+	h->Free(t);
+}
+
+int Remote::DownloadHedged(int *host, CDNResourceType type, bool isIndex, const Key &key, int rangeStart, int rangeEnd, int capacity, u8 **data, int *size, PartialDownload *partial, s64 deadline) {
+	// Includes waiting for the second attempt, which is traced on its own
+	// thread.
+	TraceSpan span(&m_client->m_trace, "network", "hedged download");
+	span.SetKey("key", key);
+	Heap *h = &m_client->m_heap;
+	HedgedDownload *d = new (h->Alloc(sizeof(HedgedDownload))) HedgedDownload;
+	m_hedgesInFlight.fetch_add(1);
+	d->m_remote = this;
+	d->m_refs.store(1);
+	d->m_type = type;
+	d->m_isIndex = isIndex;
+	d->m_key = key;
+	d->m_rangeStart = rangeStart;
+	d->m_rangeEnd = rangeEnd;
+	d->m_capacity = capacity;
+	d->m_deadline = deadline;
+	d->m_delay = HedgeDelay(capacity);
+	d->m_hedgeAt = std::chrono::steady_clock::now() + std::chrono::microseconds(d->m_delay);
+	d->m_attemptCount = 0;
+	d->m_winner = HedgedDownload::kUndecided;
+	{
+		std::lock_guard<std::mutex> lock(d->m_mutex);
+		d->Begin(*host);
+	}
+	m_hedgeTimer->Add(d);
+	d->Run(0, data, size, partial);
+	m_hedgeTimer->Remove(d);
+
+	std::unique_lock<std::mutex> lock(d->m_mutex);
+	auto giveUp = deadline ? std::chrono::steady_clock::time_point(std::chrono::microseconds(deadline)) : std::chrono::steady_clock::time_point::max();
+	int winner = HedgedDownload::kUndecided;
+	for (;;) {
+		int done = 0;
+		for (int i = 0; i < d->m_attemptCount; i++) {
+			const DownloadAttempt &a = d->m_attempts[i];
+			if (a.m_done) {
+				done++;
+				if (a.m_result == NGDP_DOWNLOAD_SUCCESS && winner == HedgedDownload::kUndecided) {
+					winner = i;
+				}
+			}
+		}
+		if (winner != HedgedDownload::kUndecided) {
+			break;
+		}
+		if (std::chrono::steady_clock::now() >= giveUp) {
+			winner = HedgedDownload::kTimedOut;
+			break;
+		}
+		if (done == d->m_attemptCount) {
+			// Every attempt failed.  A failed first attempt is retried by the
+			// caller rather than hedged.
+			winner = 0;
+			break;
+		}
+		// The first attempt failed while the second is still running.
+		d->m_changed.wait_until(lock, giveUp);
+	}
+
+	d->m_winner = winner;
+	for (int i = 0; i < d->m_attemptCount; i++) {
+		DownloadAttempt &a = d->m_attempts[i];
+		if (a.m_done) {
+			// Only a first attempt cut short by the second's success was
+			// cancelled yet, which is not the host's fault.
+			bool failed = a.m_result == NGDP_DOWNLOAD_SERVER_ERROR && !a.m_progress.m_cancelled.load();
+			FinishCdnRequest(a.m_host, a.m_result == NGDP_DOWNLOAD_SUCCESS ? a.m_size : 0, a.m_seconds, failed);
+		}
+		if (i != winner) {
+			a.m_progress.m_cancelled.store(true);
+		}
+	}
+	if (winner == HedgedDownload::kTimedOut) {
+		// The attempts still running count as timeouts once they return.
+		lock.unlock();
+		d->Release();
+		span.SetError(NGDP_ERROR_HTTP_TIMEOUT);
+		return NGDP_DOWNLOAD_SERVER_ERROR;
+	}
+	DownloadAttempt &w = d->m_attempts[winner];
+	*host = w.m_host;
+	int res = w.m_result;
+	if (winner != 0) {
+		// The whole body, in place of what the first attempt received
+		partial->m_received = 0;
+		*size = w.m_size;
+		if (capacity) {
+			memcpy(*data, w.m_data, w.m_size < capacity ? w.m_size : capacity);
+			if (threadDownloadSink && w.m_size <= capacity) {
+				(*threadDownloadSink)(w.m_size);
+			}
+		} else {
+			if (*data) {
+				h->Free(*data);
+			}
+			*data = w.m_data;
+			w.m_data = nullptr;
+		}
+	}
+	span.SetHost(w.m_host);
+	span.SetBytes(*size);
+	span.SetError(DownloadError(res));
+	lock.unlock();
+	d->Release();
+	return res;
+}
+
+const char *Remote::_MakeURL(Buffer<u8> *buf, int host, CDNResourceType type, bool isIndex, const Key &key) {
+	StringBuffer sb;
+	sb.Init(buf);
+	int ofs = buf->m_size;
 
 	sb.AppendString(_heap, "http://");
-	sb.AppendString(_heap, m_cdnHosts[m_cdnHostIndex]);
+	sb.AppendString(_heap, m_cdnHosts[host]);
 	sb.AppendChar(_heap, '/');
 	sb.AppendString(_heap, m_cdnPath);
 	switch (type) {
@@ -183,17 +808,30 @@ int Remote::DownloadAlloc(Buffer<u8> *buffer, const char *url) {
 
 	int res = NGDP_DOWNLOAD_SERVER_ERROR;
 	int resSize = 0;
+	s64 deadline = Deadline();
+	ScopedDownloadDeadline _d(deadline);
+	PartialDownload partial = {0, 0, true};
 	auto overall_start = std::chrono::system_clock::now();
 	for (int i = 0; i < m_retryLimit; i++) {
+		if (i > 0 && !BackOff(i, deadline)) {
+			break;
+		}
 		if (i == 0) {
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_STARTED, -1, 0, 0, 0);
 		} else {
 			int elapsed_us = (int)(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - overall_start).count());
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_RETRY, -1, elapsed_us, i + 1, 0);
 		}
-		res = m_client->m_download(url, 0, 0, &buffer->m_storage, &buffer->m_size);
+		{
+			TraceSpan span(&m_client->m_trace, "network", "transfer");
+			span.SetValue("attempt", i + 1);
+			res = Request(url, 0, 0, 0, &buffer->m_storage, &buffer->m_size, &partial);
+			span.SetBytes(buffer->m_size);
+			span.SetError(DownloadError(res));
+		}
+		buffer->m_capacity = buffer->m_size;
 		resSize = buffer->m_size;
-		if (res != NGDP_DOWNLOAD_SERVER_ERROR) {
+		if (res != NGDP_DOWNLOAD_SERVER_ERROR || (deadline && MonotonicMicros() >= deadline)) {
 			break;
 		}
 	}
@@ -212,12 +850,18 @@ int Remote::DownloadAlloc(Buffer<u8> *buffer, CDNResourceType type, bool isIndex
 	int res = NGDP_DOWNLOAD_SERVER_ERROR;
 	int resSize = 0;
 	int idx = -1;
+	bool hedge = m_hedgeDelayUs > 0 && m_cdnHostCount > 1;
+	s64 deadline = Deadline();
+	ScopedDownloadDeadline _d(deadline);
+	PartialDownload partial = {0, 0, true};
 	auto overall_start = std::chrono::system_clock::now();
 	for (int i = 0; i < m_retryLimit; i++) {
+		if (i > 0 && !BackOff(i, deadline)) {
+			break;
+		}
 		buf.Init();
-		// TODO: lb mutex
-		const char *url = _MakeURL(&buf, type, isIndex, key);
-		idx = m_cdnHostIndex;
+		idx = PickCdnHost();
+		const char *url = _MakeURL(&buf, idx, type, isIndex, key);
 		auto start_time = std::chrono::system_clock::now();
 		if (i == 0) {
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_STARTED, idx, 0, 0, 0);
@@ -226,7 +870,18 @@ int Remote::DownloadAlloc(Buffer<u8> *buffer, CDNResourceType type, bool isIndex
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_RETRY, idx, elapsed_us, i + 1, 0);
 		}
 
-		res = m_client->m_download(url, 0, 0, &buffer->m_storage, &buffer->m_size);
+		if (hedge) {
+			res = DownloadHedged(&idx, type, isIndex, key, 0, 0, 0, &buffer->m_storage, &buffer->m_size, &partial, deadline);
+		} else {
+			TraceSpan span(&m_client->m_trace, "network", "transfer");
+			span.SetKey("key", key);
+			span.SetHost(idx);
+			span.SetValue("attempt", i + 1);
+			res = Request(url, 0, 0, 0, &buffer->m_storage, &buffer->m_size, &partial);
+			span.SetBytes(buffer->m_size);
+			span.SetError(DownloadError(res));
+		}
+		buffer->m_capacity = buffer->m_size;
 		buf.Destroy(_heap);
 
 		auto end_time = std::chrono::system_clock::now();
@@ -235,10 +890,14 @@ int Remote::DownloadAlloc(Buffer<u8> *buffer, CDNResourceType type, bool isIndex
 		if (res != NGDP_DOWNLOAD_SUCCESS) {
 			resSize = 0;
 		}
-		int rate = (int)(resSize / dur_sec);
-		m_cdnTransferRates[idx] = rate;
-		m_nextCdnHostIndex = (idx + 1) % m_cdnHostCount;
-		if (res != NGDP_DOWNLOAD_SERVER_ERROR) {
+		// Hedged requests record each attempt's host themselves
+		if (!hedge) {
+			FinishCdnRequest(idx, resSize, dur_sec, res == NGDP_DOWNLOAD_SERVER_ERROR);
+		}
+		if (res == NGDP_DOWNLOAD_SUCCESS) {
+			m_client->m_cost.AddDownload(resSize, dur_sec);
+		}
+		if (res != NGDP_DOWNLOAD_SERVER_ERROR || (deadline && MonotonicMicros() >= deadline)) {
 			break;
 		}
 	}
@@ -255,8 +914,14 @@ int Remote::Download(Slice<u8> *slice, const char *url, int rangeStart, int rang
 
 	int res = NGDP_DOWNLOAD_SERVER_ERROR;
 	int resSize = 0;
+	s64 deadline = Deadline();
+	ScopedDownloadDeadline _d(deadline);
+	PartialDownload partial = {0, 0, false};
 	auto overall_start = std::chrono::system_clock::now();
 	for (int i = 0; i < m_retryLimit; i++) {
+		if (i > 0 && !BackOff(i, deadline)) {
+			break;
+		}
 		if (i == 0) {
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_STARTED, -1, slice->m_size, 0, 0);
 		} else {
@@ -265,11 +930,17 @@ int Remote::Download(Slice<u8> *slice, const char *url, int rangeStart, int rang
 		}
 
 		int size = slice->m_size;
-		res = m_client->m_download(url, rangeStart, rangeEnd, &slice->m_data, &size);
+		{
+			TraceSpan span(&m_client->m_trace, "network", "transfer");
+			span.SetValue("attempt", i + 1);
+			res = Request(url, rangeStart, rangeEnd, slice->m_size, &slice->m_data, &size, &partial);
+			span.SetBytes(size);
+			span.SetError(DownloadError(res));
+		}
 		if (size > slice->m_size) {
 			res = NGDP_DOWNLOAD_BUFFER_TOO_SMALL;
 		}
-		if (res != NGDP_DOWNLOAD_SERVER_ERROR) {
+		if (res != NGDP_DOWNLOAD_SERVER_ERROR || (deadline && MonotonicMicros() >= deadline)) {
 			break;
 		}
 	}
@@ -288,12 +959,19 @@ int Remote::Download(Slice<u8> *slice, CDNResourceType type, bool isIndex, const
 	int res = NGDP_DOWNLOAD_SERVER_ERROR;
 	int resSize = 0;
 	int idx = -1;
+	// Not worth hedging a HEAD request
+	bool hedge = m_hedgeDelayUs > 0 && m_cdnHostCount > 1 && slice->m_size > 0;
+	s64 deadline = Deadline();
+	ScopedDownloadDeadline _d(deadline);
+	PartialDownload partial = {0, 0, false};
 	auto overall_start = std::chrono::system_clock::now();
 	for (int i = 0; i < m_retryLimit; i++) {
+		if (i > 0 && !BackOff(i, deadline)) {
+			break;
+		}
 		buf.Init();
-		// TODO: lb mutex
-		const char *url = _MakeURL(&buf, type, isIndex, key);
-		idx = m_cdnHostIndex;
+		idx = PickCdnHost();
+		const char *url = _MakeURL(&buf, idx, type, isIndex, key);
 		auto start_time = std::chrono::system_clock::now();
 		if (i == 0) {
 			m_client->Report(NGDP_STATISTIC_DOWNLOAD_STARTED, idx, slice->m_size, 0, 0);
@@ -303,7 +981,17 @@ int Remote::Download(Slice<u8> *slice, CDNResourceType type, bool isIndex, const
 		}
 
 		resSize = slice->m_size;
-		res = m_client->m_download(url, rangeStart, rangeEnd, &slice->m_data, &resSize);
+		if (hedge) {
+			res = DownloadHedged(&idx, type, isIndex, key, rangeStart, rangeEnd, slice->m_size, &slice->m_data, &resSize, &partial, deadline);
+		} else {
+			TraceSpan span(&m_client->m_trace, "network", "transfer");
+			span.SetKey("key", key);
+			span.SetHost(idx);
+			span.SetValue("attempt", i + 1);
+			res = Request(url, rangeStart, rangeEnd, slice->m_size, &slice->m_data, &resSize, &partial);
+			span.SetBytes(resSize);
+			span.SetError(DownloadError(res));
+		}
 		buf.Destroy(_heap);
 
 		auto end_time = std::chrono::system_clock::now();
@@ -315,13 +1003,16 @@ int Remote::Download(Slice<u8> *slice, CDNResourceType type, bool isIndex, const
 			// bogus size for a potential HEAD request
 			size = 512;
 		}
-		int rate = (int)(size / dur_sec);
-		m_cdnTransferRates[idx] = rate;
-		m_nextCdnHostIndex = (idx + 1) % m_cdnHostCount;
+		if (!hedge) {
+			FinishCdnRequest(idx, size, dur_sec, res == NGDP_DOWNLOAD_SERVER_ERROR);
+		}
+		if (res == NGDP_DOWNLOAD_SUCCESS && slice->m_size) {
+			m_client->m_cost.AddDownload(resSize, dur_sec);
+		}
 		if (resSize > slice->m_size) {
 			res = NGDP_DOWNLOAD_BUFFER_TOO_SMALL;
 		}
-		if (res != NGDP_DOWNLOAD_SERVER_ERROR) {
+		if (res != NGDP_DOWNLOAD_SERVER_ERROR || (deadline && MonotonicMicros() >= deadline)) {
 			break;
 		}
 	}
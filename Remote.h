@@ -4,6 +4,8 @@
 #include "ngdp.h"
 #include "Buffer.h"
 #include "Key.h"
+#include "Lock.h"
+#include <atomic>
 #include <functional>
 
 void CASInit();
@@ -17,6 +19,97 @@ enum class CDNResourceType {
 };
 
 struct Client;
+struct HedgeTimer;
+
+// Takes a download's body as it arrives: called with the number of bytes at
+// the start of the caller's buffer that now hold the body.  A request that
+// starts over may report fewer bytes than before, which are rewritten with
+// the same contents.
+typedef std::function<void(int received)> DownloadSinkFn;
+
+// What the download function running on a thread has reported about its
+// request; for a hedged attempt, shared with the request's caller.
+struct DownloadProgress {
+	// Body bytes received so far, if the download function reports them
+	std::atomic<int> m_received;
+	// The response's Content-Length, or -1 if unknown
+	std::atomic<int> m_expected;
+	// Set once another attempt has won
+	std::atomic<bool> m_cancelled;
+	// Told of the body as it arrives in the caller's buffer, after m_sinkBase
+	// bytes already there; null if nobody is streaming this request
+	const DownloadSinkFn *m_sink;
+	int m_sinkBase;
+
+	void Init() {
+		m_received.store(0);
+		m_expected.store(-1);
+		m_cancelled.store(false);
+		m_sink = nullptr;
+		m_sinkBase = 0;
+	}
+
+	// Records that the body's first received bytes are in place.
+	void Received(int received) {
+		m_received.store(received);
+		if (m_sink) {
+			(*m_sink)(m_sinkBase + received);
+		}
+	}
+};
+
+// The progress of the download running on this thread, or null.
+DownloadProgress *CurrentDownloadProgress();
+
+// The part of a body that failed requests have delivered so far, which the
+// next request asks for the rest of
+struct PartialDownload {
+	int m_received;
+	// The body's full length; resuming needs it for the range's end
+	int m_total;
+	// Whether the body is allocated by the download rather than the caller
+	bool m_allocate;
+};
+
+// Streams this thread's fixed-buffer downloads to sink for a scope.  Of a
+// hedged request, the first attempt is streamed as it arrives; the second,
+// which runs elsewhere into a buffer of its own, is passed to sink whole
+// once it has won and been copied.
+struct ScopedDownloadSink {
+	const DownloadSinkFn *m_previous;
+
+	ScopedDownloadSink(const DownloadSinkFn *sink);
+	~ScopedDownloadSink();
+};
+
+// Microseconds on a monotonic clock
+s64 MonotonicMicros();
+
+// When the downloads running on this thread must give up, in MonotonicMicros
+// time, or zero for no deadline.
+s64 CurrentDownloadDeadline();
+
+// Sets this thread's download deadline for a scope
+struct ScopedDownloadDeadline {
+	s64 m_previous;
+
+	ScopedDownloadDeadline(s64 deadline);
+	~ScopedDownloadDeadline();
+};
+
+// Maps an NGDP_DOWNLOAD result to an NGDP_ERROR code
+inline int DownloadError(int res) {
+	switch (res) {
+	case NGDP_DOWNLOAD_SUCCESS:
+		return NGDP_ERROR_SUCCESS;
+	case NGDP_DOWNLOAD_400_ERROR:
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	case NGDP_DOWNLOAD_BUFFER_TOO_SMALL:
+		return NGDP_ERROR_CORRUPT_DATA;
+	default:
+		return NGDP_ERROR_HTTP_SERVER_ERROR;
+	}
+}
 
 struct Remote {
 	String m_url;
@@ -34,12 +127,41 @@ struct Remote {
 
 	Client *m_client;
 	int m_retryLimit;
+	// Guards the host selection state below
+	SpinLock m_hostLock;
 	int m_cdnHostIndex;
 	int m_nextCdnHostIndex;
 	int m_cdnHostCount;
 	int m_cdnTransferRates[8];
+	// Moving averages of the time small requests took, in microseconds, and
+	// of the bytes per second of large ones; the transfer rates above mix
+	// the two.
+	int m_cdnLatencies[8];
+	int m_cdnThroughputs[8];
+
+	// Circuit breakers: after kBreakerFailures consecutive server errors or
+	// timeouts, a host is skipped until m_cdnBreakerUntil.  The cooldown
+	// doubles each time the host fails again right after one.
+	int m_cdnFailures[8];
+	int m_cdnCooldownsMs[8];
+	s64 m_cdnBreakerUntil[8];
+
+	// Zero disables hedging
+	int m_hedgeDelayUs;
+	// Starts the second attempts of hedged requests; null without hedging
+	HedgeTimer *m_hedgeTimer;
+	// Zero means no deadline
+	s64 m_deadlineUs;
+	int m_backoffMs;
+	// Hedged requests whose attempts have not all returned
+	std::atomic<int> m_hedgesInFlight;
+
+	static const int kBreakerFailures = 3;
+	static const int kBreakerCooldownMs = 2000;
+	static const int kBreakerMaxCooldownMs = 60000;
+	static const int kMaxBackoffMs = 5000;
 
-	void Init(Client *c, int retryLimit, const char *url, const char *uid, const char *region);
+	void Init(Client *c, const ngdpConfig *config);
 	void Destroy();
 
 	// Parse pipe-separated value, assuming region is the first column, and
@@ -53,7 +175,39 @@ struct Remote {
 	int DownloadAlloc(Buffer<u8> *buffer, const char *url);
 	int DownloadAlloc(Buffer<u8> *buffer, CDNResourceType type, bool isIndex, const Key &key);
 
-	const char *_MakeURL(Buffer<u8> *buf, CDNResourceType type, bool isIndex, const Key &key);
+	// Picks the CDN host for the next request, favoring the fastest one and
+	// skipping hosts whose breaker is open.
+	int PickCdnHost();
+	// Picks the fastest host other than exclude for a hedged attempt.
+	int PickHedgeHost(int exclude);
+	// Records the size and duration of a finished request to host, and
+	// whether the host failed it (a server error or timeout).
+	void FinishCdnRequest(int host, int size, double seconds, bool failed);
+	// Returns the deadline for a download starting now: the one set for the
+	// thread's current operation, or the configured time from now.
+	s64 Deadline() const;
+	// Waits before retry number attempt, with exponential backoff and full
+	// jitter.  Returns false, without waiting, if the retry could not start
+	// before deadline.
+	bool BackOff(int attempt, s64 deadline);
+	// How long a request of size bytes (zero if unknown) may run before it
+	// is hedged, in microseconds.
+	int HedgeDelay(int size);
+	// Makes one request for url's body, or for the rest of it if partial
+	// holds the start.  capacity is the size of *data, unless
+	// partial->m_allocate is set; then the download function allocates *data
+	// (and it is grown here to resume), and a failed request leaves the part
+	// received in it.  The download function reports to progress if given,
+	// which must have been initialized, so another thread can watch it.
+	int Request(const char *url, int rangeStart, int rangeEnd, int capacity, u8 **data, int *size, PartialDownload *partial, DownloadProgress *progress = nullptr);
+	// Requests key from host, and from a second host too if the first is slow
+	// to respond; the first success wins and the other attempt is cancelled.
+	// capacity is the size of *data, or zero to have the download function
+	// allocate it.  The first attempt resumes partial, as Request does; a
+	// second attempt that wins starts partial over.  *host is set to the
+	// host that answered.  Gives up at deadline (if non-zero).
+	int DownloadHedged(int *host, CDNResourceType type, bool isIndex, const Key &key, int rangeStart, int rangeEnd, int capacity, u8 **data, int *size, PartialDownload *partial, s64 deadline);
+	const char *_MakeURL(Buffer<u8> *buf, int host, CDNResourceType type, bool isIndex, const Key &key);
 };
 
 }
@@ -0,0 +1,201 @@
+#include "Client.h"
+#include "Blte.h"
+#include "Bytes.h"
+
+#include <algorithm>
+#include <chrono>
+
+#define _heap &c->m_heap
+
+namespace ngdp {
+
+// Archives are read in blocks of at least this size, so records are checked
+// out of memory and the disk sees long sequential reads.
+static const int kScanBlockSize = 8 << 20;
+
+// An index entry pointing into the archive being scanned
+struct ScanEntry {
+	const u8 *m_entry;
+	int m_archive;
+	int m_offset;
+	int m_size;
+	int m_problem;
+};
+
+static int checkRecord(const u8 *record, int size, const u8 *indexKey, int keyBytes) {
+	if (size < LocalStorage::kRecordHeaderSize) {
+		return NGDP_SCAN_BAD_RECORD;
+	}
+	// The record header's key is reversed.
+	Key ekey;
+	for (int i = 0; i < 16; i++) {
+		ekey.k[i] = record[15 - i];
+	}
+	if (LoadLE32(record + 16) != (u32)size || memcmp(ekey.k, indexKey, keyBytes) != 0) {
+		return NGDP_SCAN_BAD_RECORD;
+	}
+	Key actual;
+	if (BlteVerify(record + LocalStorage::kRecordHeaderSize, size - LocalStorage::kRecordHeaderSize, &actual)) {
+		return NGDP_SCAN_BAD_BLTE;
+	}
+	if (actual != ekey) {
+		// Data that still matches the index means the header is damaged.
+		return memcmp(actual.k, indexKey, keyBytes) == 0 ? NGDP_SCAN_BAD_RECORD : NGDP_SCAN_BAD_KEY;
+	}
+	return 0;
+}
+
+// Checks entries, sorted by offset, against data.NNN, reading it front to
+// back.  Sets each entry's m_problem.
+static void scanArchive(Client *c, int archive, ScanEntry *entries, int count) {
+	char name[16];
+	snprintf(name, sizeof(name), "data.%03d", archive);
+	StackBuffer<u8, 256> path;
+	path.Init();
+	path.Append(_heap, c->m_local->m_path.m_storage, c->m_local->m_dataPathSize);
+	path.Append(_heap, (const u8 *)name, (int)strlen(name) + 1);
+	void *f = c->m_file.Open((const char *)path.m_storage, "rb");
+	path.Destroy(_heap);
+	if (!f) {
+		for (int i = 0; i < count; i++) {
+			entries[i].m_problem = NGDP_SCAN_MISSING;
+		}
+		return;
+	}
+
+	Buffer<u8> block;
+	block.Init(_heap, kScanBlockSize);
+	int blockStart = 0;
+	int blockSize = 0;
+	int keyBytes = c->m_local->m_keyBytes;
+	for (int i = 0; i < count; i++) {
+		ScanEntry &e = entries[i];
+		if (e.m_offset < blockStart || e.m_offset + (s64)e.m_size > blockStart + (s64)blockSize) {
+			// Refill from this record on; a record larger than a block is
+			// read whole.
+			int want = e.m_size > kScanBlockSize ? e.m_size : kScanBlockSize;
+			block.m_size = 0;
+			block.Alloc(_heap, want);
+			c->Report(NGDP_STATISTIC_CASC_READ_STARTED, archive, e.m_offset, want, nullptr);
+			auto start = std::chrono::steady_clock::now();
+			int read = 0;
+			if (c->m_file.Seek(f, e.m_offset, SEEK_SET) == 0) {
+				read = (int)c->m_file.Read(block.m_storage, 1, want, f);
+			}
+			int elapsed_us = (int)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			c->Report(NGDP_STATISTIC_CASC_READ_FINISHED, archive, read, elapsed_us, nullptr);
+			c->m_cost.AddDiskRead(read, elapsed_us / 1e6);
+			blockStart = e.m_offset;
+			blockSize = read;
+		}
+		if (e.m_offset + (s64)e.m_size > blockStart + (s64)blockSize) {
+			// The archive ends before the record does.
+			e.m_problem = NGDP_SCAN_MISSING;
+			continue;
+		}
+		e.m_problem = checkRecord(block.m_storage + (e.m_offset - blockStart), e.m_size, e.m_entry, keyBytes);
+	}
+	block.Destroy(_heap);
+	c->m_file.Close(f);
+}
+
+int Client::ScanLocal(bool repair, const ScanProblemFn &onProblem) {
+	// Only the process storing files may drop index entries.
+	if (!m_hasLocal || (repair && !m_writer)) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	Client *c = this;
+	const LocalStorage &local = *m_local;
+	int entrySize = local.m_keyBytes + local.m_offsetBytes + local.m_sizeBytes;
+	u64 offsetMask = ((u64)1 << local.m_offsetBits) - 1;
+
+	// Take a copy of the index, so stores can go on during the scan, and
+	// group its entries by archive.
+	Buffer<u8> index;
+	index.Init();
+	for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+		local.CopyEntries(b, _heap, &index);
+	}
+	int total = entrySize ? index.m_size / entrySize : 0;
+	Buffer<ScanEntry> entries;
+	entries.Init(_heap, total > 0 ? total : 1);
+	for (int i = 0; i < total; i++) {
+		const u8 *e = index.m_storage + i * entrySize;
+		u64 location = LoadBE40(e + local.m_keyBytes);
+		ScanEntry s;
+		s.m_entry = e;
+		s.m_offset = (int)(location & offsetMask);
+		s.m_archive = (int)(location >> local.m_offsetBits);
+		s.m_size = (int)LoadLE32(e + local.m_keyBytes + local.m_offsetBytes);
+		s.m_problem = 0;
+		entries.Push(_heap, s);
+	}
+	std::sort(entries.begin(), entries.end(), [](const ScanEntry &a, const ScanEntry &b) {
+		return a.m_archive != b.m_archive ? a.m_archive < b.m_archive : a.m_offset < b.m_offset;
+	});
+	Buffer<int> archives;
+	Buffer<int> starts;
+	archives.Init();
+	starts.Init();
+	for (int i = 0; i < total; i++) {
+		if (i == 0 || entries[i].m_archive != entries[i - 1].m_archive) {
+			archives.Push(_heap, entries[i].m_archive);
+			starts.Push(_heap, i);
+		}
+	}
+	starts.Push(_heap, total);
+
+	// One archive per task: each is read sequentially, and several are read
+	// at once.
+	if (archives.m_size) {
+		WorkerPool *pool = Workers();
+		std::atomic<int> left(archives.m_size);
+		std::atomic<int> done(0);
+		for (int a = 0; a < archives.m_size; a++) {
+			int archive = archives[a];
+			ScanEntry *first = entries.m_storage + starts[a];
+			int count = starts[a + 1] - starts[a];
+			pool->Submit([=, &left, &done]() {
+				scanArchive(c, archive, first, count);
+				if (left.fetch_sub(1) == 1) {
+					done.store(1, std::memory_order_release);
+				}
+			});
+		}
+		pool->Wait(done);
+	}
+
+	// Report in archive and offset order, and collect the bad entries.
+	Buffer<u8> bad;
+	bad.Init();
+	int err = NGDP_ERROR_SUCCESS;
+	for (int a = 0; a < archives.m_size; a++) {
+		for (int i = starts[a]; i < starts[a + 1]; i++) {
+			const ScanEntry &e = entries[i];
+			if (!e.m_problem) {
+				continue;
+			}
+			Key key;
+			memset(key.k, 0, 16);
+			memcpy(key.k, e.m_entry, local.m_keyBytes);
+			if (!err) {
+				err = onProblem(e.m_problem, key, archives[a], e.m_offset, e.m_size);
+			}
+			bad.Append(_heap, e.m_entry, entrySize);
+		}
+	}
+	int badCount = entrySize ? bad.m_size / entrySize : 0;
+	Log("Scanned %d local files in %d archives; %d are bad", total, archives.m_size, badCount);
+	if (!err && repair && badCount) {
+		err = m_writer->Drop(bad.m_storage, badCount);
+	}
+
+	bad.Destroy(_heap);
+	starts.Destroy(_heap);
+	archives.Destroy(_heap);
+	entries.Destroy(_heap);
+	index.Destroy(_heap);
+	return err;
+}
+
+}
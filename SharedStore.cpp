@@ -0,0 +1,234 @@
+#include "Client.h"
+#include "Config.h"
+
+#include <algorithm>
+
+#define _heap &m_heap
+
+namespace ngdp {
+
+// The builds a shared store retains are listed in Data/shared.refs, one per
+// line, with what is needed to find their files without the network:
+//   <gameUid> <region> <build config key> = <encoding ckey> <encoding ekey>
+//       <encoding size> <encoding encoded size>
+struct RetainedBuild {
+	String m_name;
+	String m_line;
+	BuildConfig m_build;
+};
+
+static const char *retainedPath(Client *c, Buffer<u8> *path) {
+	StringBuffer sb;
+	sb.Init(path);
+	sb.AppendString(&c->m_heap, c->m_cascPath);
+	sb.AppendString(&c->m_heap, "/Data/shared.refs");
+	return sb.CString(&c->m_heap);
+}
+
+// Parses file into builds, which point into it.
+static void parseRetained(Heap *h, const Buffer<u8> &file, Buffer<RetainedBuild> *builds) {
+	String s = file.MakeSlice();
+	ParseConfig(h, s, [&](const String &name, const String &value) {
+		Buffer<String> fields = value.Split(h, " ");
+		if (fields.m_size == 4 && fields[0].m_size == 32 && fields[1].m_size == 32) {
+			RetainedBuild r;
+			memset((void *)&r, 0, sizeof(r));
+			r.m_name = name;
+			r.m_line = s.Substring((int)(name.m_data - s.m_data), (int)(value.m_data + value.m_size - s.m_data));
+			r.m_build.m_encoding[0].InitFromHexString(fields[0]);
+			r.m_build.m_encoding[1].InitFromHexString(fields[1]);
+			r.m_build.m_encodingSize[0] = fields[2].ParseInt();
+			r.m_build.m_encodingSize[1] = fields[3].ParseInt();
+			builds->Push(h, r);
+		}
+		fields.Destroy(h);
+	});
+}
+
+static void retainedName(Heap *h, StringBuffer &sb, const char *product, const char *region, const Key &buildConfigKey) {
+	sb.AppendString(h, product && *product ? product : "-");
+	sb.AppendChar(h, ' ');
+	sb.AppendString(h, region && *region ? region : "-");
+	sb.AppendChar(h, ' ');
+	buildConfigKey.WriteHex(h, sb);
+}
+
+int Client::RetainBuild(const char *product, const char *region, const Key &buildConfigKey, const BuildConfig &build) {
+	// Only the process writing to the installation changes the list.
+	if (!m_hasLocal || !m_writer) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	// Waits for a collection that would not keep the build's files.
+	std::lock_guard<std::mutex> collecting(m_writer->m_collectMutex);
+	Buffer<u8> path;
+	Buffer<u8> file;
+	Buffer<u8> name;
+	path.Init();
+	file.Init();
+	name.Init();
+	const char *p = retainedPath(this, &path);
+	ReadFile(p, &file);
+	StringBuffer sb;
+	sb.Init(&name);
+	retainedName(_heap, sb, product, region, buildConfigKey);
+	Buffer<RetainedBuild> builds;
+	builds.Init();
+	parseRetained(_heap, file, &builds);
+	bool found = false;
+	for (const RetainedBuild &r : builds) {
+		found = found || r.m_name == String(name.MakeSlice());
+	}
+	builds.Destroy(_heap);
+
+	int err = NGDP_ERROR_SUCCESS;
+	if (!found) {
+		if (file.m_size && file.m_storage[file.m_size - 1] != '\n') {
+			file.Push(_heap, '\n');
+		}
+		sb.Init(&file);
+		sb.AppendString(_heap, String(name.MakeSlice()));
+		sb.AppendString(_heap, " = ");
+		build.m_encoding[0].WriteHex(_heap, sb);
+		sb.AppendChar(_heap, ' ');
+		build.m_encoding[1].WriteHex(_heap, sb);
+		sb.AppendChar(_heap, ' ');
+		sb.AppendInt(_heap, build.m_encodingSize[0]);
+		sb.AppendChar(_heap, ' ');
+		sb.AppendInt(_heap, build.m_encodingSize[1]);
+		sb.AppendChar(_heap, '\n');
+		if (!WriteFile(p, file.m_storage, file.m_size)) {
+			err = NGDP_ERROR_FILE_READ_FAILED;
+		}
+	}
+	name.Destroy(_heap);
+	file.Destroy(_heap);
+	path.Destroy(_heap);
+	return err;
+}
+
+bool Client::ReadRetained(Buffer<u8> *file) {
+	Buffer<u8> path;
+	path.Init();
+	bool found = ReadFile(retainedPath(this, &path), file);
+	path.Destroy(_heap);
+	return found;
+}
+
+int Client::RetainedKeys(const Buffer<u8> &file, Buffer<Key> *live) {
+	Buffer<RetainedBuild> builds;
+	builds.Init();
+	parseRetained(_heap, file, &builds);
+
+	// Every retained build's files count: one whose encoding cannot be read
+	// stops the collection rather than losing its files.
+	int err = NGDP_ERROR_SUCCESS;
+	for (int i = 0; !err && i < builds.m_size; i++) {
+		const BuildConfig &build = builds[i].m_build;
+		bool seen = false;
+		for (int j = 0; j < i; j++) {
+			seen = seen || builds[j].m_build.m_encoding[1] == build.m_encoding[1];
+		}
+		if (seen) {
+			continue;
+		}
+		EncodingTable table;
+		memset((void *)&table, 0, sizeof(table));
+		const char *detail = nullptr;
+		err = LoadEncodingTable(build, &table, &detail);
+		if (err) {
+			Log("Unable to collect the files of a retained build: %s", detail);
+			break;
+		}
+		live->Push(_heap, build.m_encoding[1]);
+		err = table.ForEach([&](const u8 *, const u8 *ekey, s64) {
+			Key key;
+			memset(key.k, 0, 16);
+			memcpy(key.k, ekey, table.m_ekeySize < 16 ? table.m_ekeySize : 16);
+			live->Push(_heap, key);
+			return NGDP_ERROR_SUCCESS;
+		});
+		table.Destroy(_heap);
+	}
+
+	// Count the builds holding each key, and keep one of each.
+	std::sort(live->begin(), live->end(), [](const Key &a, const Key &b) {
+		return a < b;
+	});
+	int unique = 0;
+	int shared = 0;
+	for (int i = 0; i < live->m_size;) {
+		int j = i + 1;
+		while (j < live->m_size && (*live)[j] == (*live)[i]) {
+			j++;
+		}
+		if (j - i > 1) {
+			shared++;
+		}
+		(*live)[unique++] = (*live)[i];
+		i = j;
+	}
+	live->m_size = unique;
+	if (!err) {
+		Log("%d builds are retained in the shared store: %d files, %d of them shared by builds with different encoding files", builds.m_size, unique, shared);
+	}
+	builds.Destroy(_heap);
+	return err;
+}
+
+int Client::RetireBuild(const char *product, const char *region, const Key &buildConfigKey, int minWastePercent) {
+	if (!m_hasLocal || !m_writer) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	std::lock_guard<std::mutex> collecting(m_writer->m_collectMutex);
+	Buffer<u8> path;
+	Buffer<u8> file;
+	Buffer<u8> name;
+	Buffer<u8> kept;
+	path.Init();
+	file.Init();
+	name.Init();
+	kept.Init();
+	const char *p = retainedPath(this, &path);
+	StringBuffer sb;
+	sb.Init(&name);
+	retainedName(_heap, sb, product, region, buildConfigKey);
+	ReadFile(p, &file);
+	Buffer<RetainedBuild> builds;
+	builds.Init();
+	parseRetained(_heap, file, &builds);
+	bool found = false;
+	sb.Init(&kept);
+	for (const RetainedBuild &r : builds) {
+		if (r.m_name == String(name.MakeSlice())) {
+			found = true;
+			continue;
+		}
+		sb.AppendString(_heap, r.m_line);
+		sb.AppendChar(_heap, '\n');
+	}
+	builds.Destroy(_heap);
+
+	int err = found ? NGDP_ERROR_SUCCESS : NGDP_ERROR_FILE_NOT_FOUND;
+	if (!err && !WriteFile(p, kept.m_storage, kept.m_size)) {
+		err = NGDP_ERROR_FILE_READ_FAILED;
+	}
+
+	// Collect the files no retained build uses any more, marking them from
+	// the list just written, which cannot change until the collection ends.
+	if (!err) {
+		Buffer<Key> live;
+		live.Init();
+		err = RetainedKeys(kept, &live);
+		if (!err) {
+			err = Compact(live, minWastePercent);
+		}
+		live.Destroy(_heap);
+	}
+	kept.Destroy(_heap);
+	name.Destroy(_heap);
+	file.Destroy(_heap);
+	path.Destroy(_heap);
+	return err;
+}
+
+}
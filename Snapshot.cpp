@@ -0,0 +1,222 @@
+#include "Snapshot.h"
+#include "Bytes.h"
+#include "Client.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ngdp {
+
+void MappedFile::Init() {
+	m_data = nullptr;
+	m_size = 0;
+	m_file = nullptr;
+	m_mapping = nullptr;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const char *path) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	}
+	void *data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (!data) {
+		if (mapping) {
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+		return false;
+	}
+	m_data = (const u8 *)data;
+	m_size = size.QuadPart;
+	m_file = file;
+	m_mapping = mapping;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (m_data) {
+		UnmapViewOfFile(m_data);
+		CloseHandle((HANDLE)m_mapping);
+		CloseHandle((HANDLE)m_file);
+	}
+	Init();
+}
+
+#else
+
+bool MappedFile::Open(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	// The mapping keeps the file's pages; the descriptor is not needed.
+	close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	m_data = (const u8 *)data;
+	m_size = st.st_size;
+	return true;
+}
+
+void MappedFile::Close() {
+	if (m_data) {
+		munmap((void *)m_data, (size_t)m_size);
+	}
+	Init();
+}
+
+#endif
+
+static const int kHeaderSize = 8 + 4 * 4 + 16 + 16;
+static const int kSectionEntrySize = 24;
+static const u32 kByteOrder = 0x01020304;
+
+void IndexSnapshot::Init() {
+	m_file.Init();
+	m_sectionCount = 0;
+	m_sections = nullptr;
+}
+
+void IndexSnapshot::Destroy() {
+	m_file.Close();
+	m_sectionCount = 0;
+	m_sections = nullptr;
+}
+
+bool IndexSnapshot::Open(const char *path, const Key &buildConfig, const Key &cdnConfig) {
+	if (!m_file.Open(path)) {
+		return false;
+	}
+	const u8 *p = m_file.m_data;
+	bool ok = m_file.m_size >= kHeaderSize &&
+		memcmp(p, "NGDPSNAP", 8) == 0 &&
+		LoadLE32(p + 8) == kFormatVersion &&
+		*(const u32 *)(p + 12) == kByteOrder &&
+		LoadLE32(p + 16) == sizeof(ArchiveIndexEntry) &&
+		memcmp(p + 24, buildConfig.k, 16) == 0 &&
+		memcmp(p + 40, cdnConfig.k, 16) == 0;
+	if (ok) {
+		m_sectionCount = LoadLE32(p + 20);
+		m_sections = p + kHeaderSize;
+		ok = kHeaderSize + (s64)m_sectionCount * kSectionEntrySize <= m_file.m_size;
+		for (u32 i = 0; ok && i < m_sectionCount; i++) {
+			const u8 *s = m_sections + i * kSectionEntrySize;
+			u64 offset = LoadLE64(s + 8);
+			u64 size = LoadLE64(s + 16);
+			ok = offset <= (u64)m_file.m_size && size <= (u64)m_file.m_size - offset && size <= 0x7fffffff && (offset & 15) == 0;
+		}
+	}
+	if (!ok) {
+		Destroy();
+	}
+	return ok;
+}
+
+bool IndexSnapshot::Section(u32 kind, Slice<u8> *data, u32 *param) const {
+	for (u32 i = 0; i < m_sectionCount; i++) {
+		const u8 *s = m_sections + i * kSectionEntrySize;
+		if (LoadLE32(s) == kind) {
+			data->m_data = (u8 *)m_file.m_data + LoadLE64(s + 8);
+			data->m_size = (int)LoadLE64(s + 16);
+			if (param) {
+				*param = LoadLE32(s + 4);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+struct SnapshotSection {
+	u32 m_kind;
+	u32 m_param;
+	const void *m_data;
+	int m_size;
+};
+
+int IndexSnapshot::Write(Client *c, const char *path) {
+	Heap *h = &c->m_heap;
+	Buffer<SnapshotSection> sections;
+	sections.Init();
+	sections.Push(h, SnapshotSection{Encoding, 0, c->m_encoding.m_data.m_storage, c->m_encoding.m_data.m_size});
+	if (c->m_archiveIndexLoaded) {
+		const Buffer<ArchiveIndexEntry> &e = c->m_archiveIndex.m_entries;
+		sections.Push(h, SnapshotSection{ArchiveIndex, 0, e.m_storage, e.m_size * (int)sizeof(ArchiveIndexEntry)});
+	}
+	if (c->m_patchArchiveIndexLoaded) {
+		const Buffer<ArchiveIndexEntry> &e = c->m_patchArchiveIndex.m_entries;
+		sections.Push(h, SnapshotSection{PatchArchiveIndex, 0, e.m_storage, e.m_size * (int)sizeof(ArchiveIndexEntry)});
+	}
+	// A shared store's index outlives the clients using it, so it cannot
+	// view their snapshots.
+	if (c->m_hasLocal && !c->m_store) {
+		for (int b = 0; b < LocalStorage::kBucketCount; b++) {
+			const Buffer<u8> &e = c->m_local->Entries(b);
+			sections.Push(h, SnapshotSection{(u32)(LocalBucket + b), (u32)c->m_local->m_bucketVersions[b], e.m_storage, e.m_size});
+		}
+	}
+
+	u8 header[kHeaderSize];
+	memcpy(header, "NGDPSNAP", 8);
+	StoreLE32(header + 8, kFormatVersion);
+	memcpy(header + 12, &kByteOrder, 4);
+	StoreLE32(header + 16, sizeof(ArchiveIndexEntry));
+	StoreLE32(header + 20, sections.m_size);
+	memcpy(header + 24, c->m_buildConfigKey.k, 16);
+	memcpy(header + 40, c->m_cdnConfigKey.k, 16);
+
+	Buffer<u8> table;
+	table.Init(h, sections.m_size * kSectionEntrySize + 16);
+	u64 offset = kHeaderSize + sections.m_size * kSectionEntrySize;
+	for (const SnapshotSection &s : sections) {
+		offset = (offset + 15) & ~(u64)15;
+		u8 *e = table.Alloc(h, kSectionEntrySize);
+		StoreLE32(e, s.m_kind);
+		StoreLE32(e + 4, s.m_param);
+		StoreLE64(e + 8, offset);
+		StoreLE64(e + 16, s.m_size);
+		offset += s.m_size;
+	}
+
+	// Readers map either the old or the new snapshot.
+	FileIO &file = c->m_file;
+	bool replaced = file.WriteReplacing(h, path, [&](void *f) {
+		bool ok = file.Write(header, 1, kHeaderSize, f) == (size_t)kHeaderSize &&
+			file.Write(table.m_storage, 1, table.m_size, f) == (size_t)table.m_size;
+		s64 written = kHeaderSize + table.m_size;
+		static const u8 zeros[16] = {};
+		for (int i = 0; ok && i < sections.m_size; i++) {
+			int pad = (int)(((written + 15) & ~(s64)15) - written);
+			ok = file.Write((void *)zeros, 1, pad, f) == (size_t)pad &&
+				file.Write((void *)sections[i].m_data, 1, sections[i].m_size, f) == (size_t)sections[i].m_size;
+			written += pad + sections[i].m_size;
+		}
+		return ok;
+	});
+	table.Destroy(h);
+	sections.Destroy(h);
+	return replaced ? NGDP_ERROR_SUCCESS : NGDP_ERROR_FILE_READ_FAILED;
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Key.h"
+
+namespace ngdp {
+
+struct Client;
+
+// A read-only memory mapping of a whole file
+struct MappedFile {
+	const u8 *m_data;
+	s64 m_size;
+	// Platform handles
+	void *m_file;
+	void *m_mapping;
+
+	void Init();
+	bool Open(const char *path);
+	void Close();
+};
+
+// IndexSnapshot is a file holding a build's parsed indexes in the form they
+// are searched in memory, so that processes sharing a cascPath can map one
+// copy instead of each building their own:
+//
+//   'NGDPSNAP' | u32le formatVersion | u32le byteOrder (0x01020304) |
+//   u32le sizeof(ArchiveIndexEntry) | u32le sectionCount |
+//   buildConfig key | cdnConfig key |
+//   sectionCount * (u32le kind | u32le param | u64le offset | u64le size)
+//
+// Sections start on 16-byte boundaries.  Every section is position
+// independent: the decoded encoding file, the sorted data and patch archive
+// index entries, and each local .idx bucket's entries (param = .idx
+// version).  The snapshot is only valid on hosts with the same byte order and
+// struct layout, which the header records.
+struct IndexSnapshot {
+	enum SectionKind {
+		Encoding = 1,
+		ArchiveIndex = 2,
+		PatchArchiveIndex = 3,
+		// LocalBucket + bucket number
+		LocalBucket = 16
+	};
+
+	MappedFile m_file;
+	u32 m_sectionCount;
+	const u8 *m_sections;
+
+	static const u32 kFormatVersion = 1;
+
+	void Init();
+	void Destroy();
+
+	// Maps the snapshot at path if it exists and was made for these configs.
+	bool Open(const char *path, const Key &buildConfig, const Key &cdnConfig);
+
+	// Finds a section; returns false if the snapshot has none of kind.
+	bool Section(u32 kind, Slice<u8> *data, u32 *param) const;
+
+	// Writes c's current indexes to path, replacing any previous snapshot
+	// atomically.
+	static int Write(Client *c, const char *path);
+};
+
+}
@@ -0,0 +1,508 @@
+#include "std.h"
+
+#include "ngdp.h"
+#include "Md5.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// A stress test of the paths that read and store local files at once, on one
+// client: writer threads encode and store new files while reader threads read
+// ranges and whole files of them back from the archives, and another thread
+// scans every archive.  Every byte read is compared with what was stored.
+//
+// The client has a build loaded, made up of fixture files stored before it is
+// opened, so file reader threads also look those up by content key and read
+// them through the decoded file cache, mixing ranges with whole reads that
+// fill it.
+//
+// Build it with ThreadSanitizer (-fsanitize=thread, with clang or gcc) to have
+// the races the run runs into reported; without it, only the results are
+// checked.  Exits non-zero if any check failed.
+//
+// The installation at --dir is created if needed, and kept, so later runs
+// read and store among the files of earlier ones.
+
+// A file a writer has stored
+struct StoredFile {
+	uint8_t m_encodedKey[16];
+	std::vector<uint8_t> m_encoded;
+};
+
+// A file of the fixture build
+struct FixtureFile {
+	uint8_t m_contentKey[16];
+	uint8_t m_encodedKey[16];
+	int m_encodedSize;
+	std::vector<uint8_t> m_data;
+};
+
+static const int kFixtureFileCount = 32;
+static const char *kEncodingSpec = "b:{16K*=z}";
+// Smaller than the fixture files together, so the cache also evicts
+static const int64_t kDecodedCacheSize = 2 * 1024 * 1024;
+static const int kEncodingPageSize = 4096;
+
+static std::atomic<int> cacheHits;
+
+struct Stress {
+	ngdpClient *m_client;
+	std::chrono::steady_clock::time_point m_end;
+	// Guards m_files, which only grows, so readers keep what they picked
+	std::mutex m_mutex;
+	std::vector<StoredFile *> m_files;
+	// Set up before the threads start, and not changed after
+	std::vector<FixtureFile *> m_fixture;
+	std::atomic<int> m_failures;
+	std::atomic<int> m_stores;
+	std::atomic<int> m_reads;
+	std::atomic<int> m_fileReads;
+	std::atomic<int> m_scans;
+
+	bool Running() const {
+		return std::chrono::steady_clock::now() < m_end;
+	}
+
+	void Fail(const char *what, int err) {
+		m_failures++;
+		fprintf(stderr, "%s failed: %d\n", what, err);
+	}
+
+	void Add(StoredFile *file) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_files.push_back(file);
+	}
+
+	StoredFile *Pick(std::mt19937 &r) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_files.empty() ? nullptr : m_files[r() % m_files.size()];
+	}
+};
+
+static void makeDirectories(const std::string &path) {
+	for (size_t i = 1; i <= path.size(); i++) {
+		if (i == path.size() || path[i] == '/') {
+			std::string dir = path.substr(0, i);
+#ifdef _WIN32
+			_mkdir(dir.c_str());
+#else
+			mkdir(dir.c_str(), 0755);
+#endif
+		}
+	}
+}
+
+static void stressLog(const char *message) {
+	fprintf(stderr, "[ngdp] %s\n", message);
+}
+
+static void countStatistic(int type, int arg0, int arg1, int arg2, const uint8_t *key) {
+	UNUSED(arg0);
+	UNUSED(arg1);
+	UNUSED(arg2);
+	UNUSED(key);
+	if (type == NGDP_STATISTIC_CACHE_HIT) {
+		cacheHits++;
+	}
+}
+
+static int appendEncoded(void *ctx, const uint8_t *data, int size) {
+	std::vector<uint8_t> *encoded = (std::vector<uint8_t> *)ctx;
+	encoded->insert(encoded->end(), data, data + size);
+	return 0;
+}
+
+static int countProblem(void *ctx, int problem, const uint8_t *encodedKey, int archive, int offset, int size) {
+	UNUSED(problem);
+	UNUSED(encodedKey);
+	fprintf(stderr, "scan: data.%03d offset %d size %d is bad\n", archive, offset, size);
+	++*(int *)ctx;
+	return 0;
+}
+
+// Fills data with up to 256K of runs of repeated bytes, so chunks compress
+// by differing amounts.
+static void makeData(std::mt19937 &r, std::vector<uint8_t> *data) {
+	data->resize(1 + r() % (256 * 1024));
+	for (size_t i = 0; i < data->size();) {
+		size_t run = 1 + r() % 64;
+		uint8_t b = (uint8_t)r();
+		for (; run && i < data->size(); run--) {
+			(*data)[i++] = b;
+		}
+	}
+}
+
+// Encodes data with encodingSpec and stores it in the installation, appending
+// the encoded file to encoded; op has its keys and sizes afterwards.
+static int storeFile(ngdpClient *c, const char *encodingSpec, std::vector<uint8_t> &data, ngdpOperation *op, std::vector<uint8_t> *encoded) {
+	uint8_t state[256];
+	memset(op, 0, sizeof(*op));
+	op->workingBuffer = state;
+	op->workingBufferSize = sizeof(state);
+	op->encodingSpec = encodingSpec;
+	int err = ngdpCreate(c, op);
+	if (err) {
+		return err;
+	}
+	op->buffer = data.data();
+	op->bufferSize = (int)data.size();
+	err = ngdpWrite(c, op);
+	if (!err) {
+		err = ngdpSave(c, op, appendEncoded, encoded);
+	}
+	if (!err && op->encodedSize != (int)encoded->size()) {
+		err = NGDP_ERROR_CORRUPT_DATA;
+	}
+	op->workingBuffer = nullptr;
+	op->workingBufferSize = 0;
+	return err;
+}
+
+static void appendBE(std::vector<uint8_t> *out, uint64_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; i--) {
+		out->push_back((uint8_t)(value >> (i * 8)));
+	}
+}
+
+// Packs entries, sorted by the key at keyOffset, into pages of the encoding
+// file, and appends each page's index entry (first key, page MD5) to index.
+// Returns the number of pages.
+static int packPages(const std::vector<std::vector<uint8_t>> &entries, int keyOffset, std::vector<uint8_t> *index, std::vector<uint8_t> *pages) {
+	int count = 0;
+	size_t used = kEncodingPageSize;
+	for (const std::vector<uint8_t> &entry : entries) {
+		if (used + entry.size() > (size_t)kEncodingPageSize) {
+			index->insert(index->end(), entry.begin() + keyOffset, entry.begin() + keyOffset + 16);
+			index->resize(index->size() + 16);
+			pages->resize(pages->size() + kEncodingPageSize);
+			used = 0;
+			count++;
+		}
+		memcpy(pages->data() + pages->size() - kEncodingPageSize + used, entry.data(), entry.size());
+		used += entry.size();
+	}
+	for (int i = 0; i < count; i++) {
+		ngdp::Key digest;
+		ngdp::Md5::Sum(pages->data() + (size_t)i * kEncodingPageSize, kEncodingPageSize, &digest);
+		uint8_t *at = index->data() + index->size() - (size_t)(count - i) * 32 + 16;
+		memcpy(at, digest.k, 16);
+	}
+	return count;
+}
+
+// The decoded encoding file of files, all encoded with kEncodingSpec
+static std::vector<uint8_t> makeEncoding(const std::vector<FixtureFile *> &files) {
+	std::vector<std::vector<uint8_t>> ce;
+	std::vector<std::vector<uint8_t>> ekeys;
+	for (const FixtureFile *file : files) {
+		// u8 keyCount | u40be fileSize | ckey | ekey
+		std::vector<uint8_t> entry(1, 1);
+		appendBE(&entry, file->m_data.size(), 5);
+		entry.insert(entry.end(), file->m_contentKey, file->m_contentKey + 16);
+		entry.insert(entry.end(), file->m_encodedKey, file->m_encodedKey + 16);
+		ce.push_back(entry);
+		// ekey | u32be especIndex | u40be encodedSize
+		entry.assign(file->m_encodedKey, file->m_encodedKey + 16);
+		appendBE(&entry, 0, 4);
+		appendBE(&entry, file->m_encodedSize, 5);
+		ekeys.push_back(entry);
+	}
+	auto byKey = [](int offset) {
+		return [offset](const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+			return memcmp(a.data() + offset, b.data() + offset, 16) < 0;
+		};
+	};
+	std::sort(ce.begin(), ce.end(), byKey(6));
+	std::sort(ekeys.begin(), ekeys.end(), byKey(0));
+	std::vector<uint8_t> ceIndex, cePages, ekeyIndex, ekeyPages;
+	int cePageCount = packPages(ce, 6, &ceIndex, &cePages);
+	int ekeyPageCount = packPages(ekeys, 0, &ekeyIndex, &ekeyPages);
+
+	std::vector<uint8_t> out = {'E', 'N', 1, 16, 16};
+	appendBE(&out, kEncodingPageSize / 1024, 2);
+	appendBE(&out, kEncodingPageSize / 1024, 2);
+	appendBE(&out, cePageCount, 4);
+	appendBE(&out, ekeyPageCount, 4);
+	out.push_back(0);
+	appendBE(&out, strlen(kEncodingSpec) + 1, 4);
+	out.insert(out.end(), kEncodingSpec, kEncodingSpec + strlen(kEncodingSpec) + 1);
+	out.insert(out.end(), ceIndex.begin(), ceIndex.end());
+	out.insert(out.end(), cePages.begin(), cePages.end());
+	out.insert(out.end(), ekeyIndex.begin(), ekeyIndex.end());
+	out.insert(out.end(), ekeyPages.begin(), ekeyPages.end());
+	return out;
+}
+
+static std::string hexString(const uint8_t *key) {
+	char hex[33];
+	for (int i = 0; i < 16; i++) {
+		snprintf(hex + i * 2, 3, "%02x", key[i]);
+	}
+	return hex;
+}
+
+// Stores the fixture files and an encoding file of them, and writes a build
+// config naming it to Data/config, so a client opened with buildConfigKey
+// reads the files by content key.  The files are the same on every run.
+// Returns an NGDP_ERROR code.
+static int buildFixture(ngdpClient *c, const char *dir, std::vector<FixtureFile *> *files, uint8_t *buildConfigKey) {
+	std::mt19937 r(1);
+	std::vector<uint8_t> encoded;
+	ngdpOperation op;
+	for (int i = 0; i < kFixtureFileCount; i++) {
+		FixtureFile *file = new FixtureFile;
+		files->push_back(file);
+		makeData(r, &file->m_data);
+		encoded.clear();
+		int err = storeFile(c, kEncodingSpec, file->m_data, &op, &encoded);
+		if (err) {
+			return err;
+		}
+		memcpy(file->m_contentKey, op.contentKey, 16);
+		memcpy(file->m_encodedKey, op.encodedKey, 16);
+		file->m_encodedSize = op.encodedSize;
+	}
+
+	std::vector<uint8_t> encoding = makeEncoding(*files);
+	encoded.clear();
+	int err = storeFile(c, "b:{*=z}", encoding, &op, &encoded);
+	if (err) {
+		return err;
+	}
+	std::string config = "# Build Configuration\n\nencoding = " + hexString(op.contentKey) + " " + hexString(op.encodedKey) +
+		"\nencoding-size = " + std::to_string(encoding.size()) + " " + std::to_string(op.encodedSize) + "\n";
+	ngdp::Key key;
+	ngdp::Md5::Sum(config.data(), config.size(), &key);
+	memcpy(buildConfigKey, key.k, 16);
+	std::string hex = hexString(key.k);
+	std::string path = std::string(dir) + "/Data/config/" + hex.substr(0, 2) + "/" + hex.substr(2, 2);
+	makeDirectories(path);
+	path += "/" + hex;
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	bool written = fwrite(config.data(), 1, config.size(), f) == config.size();
+	if (fclose(f) || !written) {
+		return NGDP_ERROR_FILE_NOT_FOUND;
+	}
+	return NGDP_ERROR_SUCCESS;
+}
+
+static void writer(Stress *s, unsigned seed) {
+	std::mt19937 r(seed);
+	std::vector<uint8_t> data;
+	while (s->Running()) {
+		makeData(r, &data);
+		ngdpOperation op;
+		StoredFile *file = new StoredFile;
+		int err = storeFile(s->m_client, kEncodingSpec, data, &op, &file->m_encoded);
+		if (err) {
+			s->Fail("Save", err);
+			delete file;
+			continue;
+		}
+		memcpy(file->m_encodedKey, op.encodedKey, 16);
+		op.dataIsLocal = 0;
+		err = ngdpIsLocal(s->m_client, &op);
+		if (err || !op.dataIsLocal) {
+			s->Fail("IsLocal after Save", err);
+		}
+		s->Add(file);
+		s->m_stores++;
+	}
+}
+
+static void reader(Stress *s, unsigned seed) {
+	std::mt19937 r(seed);
+	std::vector<uint8_t> buffer;
+	while (s->Running()) {
+		StoredFile *file = s->Pick(r);
+		if (!file) {
+			std::this_thread::yield();
+			continue;
+		}
+		// Whole reads are also checked against the chunk checksums and key.
+		int size = (int)file->m_encoded.size();
+		bool whole = r() % 4 == 0;
+		int offset = whole ? 0 : (int)(r() % size);
+		int count = whole ? size : 1 + (int)(r() % (size - offset));
+		buffer.resize(count);
+		ngdpOperation op;
+		memset(&op, 0, sizeof(op));
+		memcpy(op.encodedKey, file->m_encodedKey, 16);
+		op.encodedKeyIsValid = 1;
+		op.encodedSize = size;
+		op.fileOffset = offset;
+		op.buffer = buffer.data();
+		op.bufferSize = count;
+		int err = ngdpReadEncoded(s->m_client, &op);
+		if (err || memcmp(buffer.data(), file->m_encoded.data() + offset, count) != 0) {
+			s->Fail("ReadEncoded", err ? err : NGDP_ERROR_CORRUPT_DATA);
+		}
+		s->m_reads++;
+	}
+}
+
+static void fileReader(Stress *s, unsigned seed) {
+	std::mt19937 r(seed);
+	std::vector<uint8_t> working;
+	std::vector<uint8_t> buffer;
+	while (s->Running()) {
+		const FixtureFile *file = s->m_fixture[r() % s->m_fixture.size()];
+		int size = (int)file->m_data.size();
+		ngdpOperation op;
+		memset(&op, 0, sizeof(op));
+		memcpy(op.contentKey, file->m_contentKey, 16);
+		int err = ngdpFileInfo(s->m_client, &op);
+		if (err || op.fileSize != size || op.encodedSize != file->m_encodedSize ||
+			memcmp(op.encodedKey, file->m_encodedKey, 16) != 0) {
+			s->Fail("FileInfo", err ? err : NGDP_ERROR_CORRUPT_DATA);
+			continue;
+		}
+		// Later reads on the operation reuse the chunk table kept in its
+		// working buffer, and a read of the whole file may be served by, or
+		// put in, the cache.
+		working.resize(op.workingBufferRequiredSize);
+		op.workingBuffer = working.data();
+		op.workingBufferSize = (int)working.size();
+		for (int reads = 1 + r() % 3; reads; reads--) {
+			bool whole = r() % 4 == 0;
+			int offset = whole ? 0 : (int)(r() % size);
+			int count = whole ? size : 1 + (int)(r() % (size - offset));
+			buffer.resize(count);
+			op.buffer = buffer.data();
+			op.bufferSize = count;
+			op.fileOffset = offset;
+			err = ngdpRead(s->m_client, &op);
+			if (err || memcmp(buffer.data(), file->m_data.data() + offset, count) != 0) {
+				s->Fail("Read", err ? err : NGDP_ERROR_CORRUPT_DATA);
+				break;
+			}
+			s->m_fileReads++;
+		}
+	}
+}
+
+static void scanner(Stress *s) {
+	while (s->Running()) {
+		int problems = 0;
+		int err = ngdpScanLocal(s->m_client, 0, countProblem, &problems);
+		if (err || problems) {
+			s->Fail("ScanLocal", err ? err : NGDP_ERROR_CORRUPT_DATA);
+		}
+		s->m_scans++;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+}
+
+static int parseCount(const char *arg, const char *name, int *out) {
+	*out = atoi(arg);
+	if (*out <= 0) {
+		fprintf(stderr, "%s must be positive\n", name);
+		return 2;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *dir = "stress-casc";
+	int seconds = 10;
+	int readers = 6;
+	int writers = 2;
+	int fileReaders = 4;
+	for (int i = 1; i < argc; i++) {
+		int err = 0;
+		if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+			dir = argv[++i];
+		} else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+			err = parseCount(argv[++i], "--seconds", &seconds);
+		} else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+			err = parseCount(argv[++i], "--readers", &readers);
+		} else if (strcmp(argv[i], "--writers") == 0 && i + 1 < argc) {
+			err = parseCount(argv[++i], "--writers", &writers);
+		} else if (strcmp(argv[i], "--file-readers") == 0 && i + 1 < argc) {
+			err = parseCount(argv[++i], "--file-readers", &fileReaders);
+		} else {
+			fprintf(stderr, "usage: stress [--dir PATH] [--seconds N] [--readers N] [--writers N] [--file-readers N]\n");
+			return 2;
+		}
+		if (err) {
+			return err;
+		}
+	}
+	makeDirectories(std::string(dir) + "/Data/data");
+
+	ngdpConfig config;
+	memset(&config, 0, sizeof(config));
+	config.cascPath = dir;
+	config.disableHTTPRequests = 1;
+	config.workerThreadCount = 2;
+	config.logFn = stressLog;
+	ngdpClient *client = ngdpInit(&config);
+	if (!client) {
+		fprintf(stderr, "Unable to open %s: %d %s\n", dir, config.error, config.errorDetail ? config.errorDetail : "");
+		return 1;
+	}
+	Stress s;
+	int err = buildFixture(client, dir, &s.m_fixture, config.buildConfigKey);
+	ngdpDestroy(client);
+	if (err) {
+		fprintf(stderr, "Unable to store the fixture build: %d\n", err);
+		return 1;
+	}
+
+	config.decodedCacheSize = kDecodedCacheSize;
+	config.statsFn = countStatistic;
+	client = ngdpInit(&config);
+	if (!client) {
+		fprintf(stderr, "Unable to open the fixture build: %d %s\n", config.error, config.errorDetail ? config.errorDetail : "");
+		return 1;
+	}
+	s.m_client = client;
+	s.m_end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	s.m_failures.store(0);
+	s.m_stores.store(0);
+	s.m_reads.store(0);
+	s.m_fileReads.store(0);
+	s.m_scans.store(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < writers; i++) {
+		threads.emplace_back(writer, &s, 1000u + i);
+	}
+	for (int i = 0; i < readers; i++) {
+		threads.emplace_back(reader, &s, 2000u + i);
+	}
+	for (int i = 0; i < fileReaders; i++) {
+		threads.emplace_back(fileReader, &s, 3000u + i);
+	}
+	threads.emplace_back(scanner, &s);
+	for (std::thread &t : threads) {
+		t.join();
+	}
+	ngdpDestroy(client);
+	for (StoredFile *file : s.m_files) {
+		delete file;
+	}
+	for (FixtureFile *file : s.m_fixture) {
+		delete file;
+	}
+
+	int failures = s.m_failures.load();
+	printf("%d stores, %d reads, %d file reads (%d cache hits), %d scans, %d failures\n", s.m_stores.load(), s.m_reads.load(),
+		s.m_fileReads.load(), cacheHits.load(), s.m_scans.load(), failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <new>
+
+namespace ngdp {
+
+static std::atomic<u32> nextTracerId(1);
+
+// The buffer this thread last recorded into, and whose tracer it belongs to
+struct CachedTraceThread {
+	u32 m_tracer;
+	TraceThread *m_thread;
+};
+
+static thread_local CachedTraceThread threadTrace;
+
+static s64 steadyNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::Init(Heap *h, bool enabled) {
+	m_heap = h;
+	m_enabled = enabled;
+	m_id = nextTracerId.fetch_add(1);
+	m_origin = steadyNanoseconds();
+	m_lock.Init();
+	m_threads = nullptr;
+	m_threadCount = 0;
+}
+
+void Tracer::Destroy() {
+	TraceThread *t = m_threads;
+	while (t) {
+		TraceThread *next = t->m_next;
+		t->m_events.Destroy(m_heap);
+		t->~TraceThread();
+		m_heap->Free(t);
+		t = next;
+	}
+	m_threads = nullptr;
+}
+
+s64 Tracer::Now() const {
+	return steadyNanoseconds() - m_origin;
+}
+
+TraceThread *Tracer::Thread() {
+	if (threadTrace.m_tracer == m_id) {
+		return threadTrace.m_thread;
+	}
+	// A thread that recorded for another tracer since keeps its buffer here.
+	std::thread::id self = std::this_thread::get_id();
+	SpinLockGuard lock(&m_lock);
+	TraceThread *t = m_threads;
+	while (t && t->m_thread != self) {
+		t = t->m_next;
+	}
+	if (!t) {
+		t = new (m_heap->Alloc(sizeof(TraceThread))) TraceThread;
+		t->m_thread = self;
+		t->m_id = ++m_threadCount;
+		t->m_lock.Init();
+		t->m_events.Init();
+		t->m_dropped = 0;
+		t->m_next = m_threads;
+		m_threads = t;
+	}
+	threadTrace.m_tracer = m_id;
+	threadTrace.m_thread = t;
+	return t;
+}
+
+void Tracer::Record(const TraceEvent &e) {
+	TraceThread *t = Thread();
+	SpinLockGuard lock(&t->m_lock);
+	if (t->m_events.m_size >= kMaxThreadEvents) {
+		t->m_dropped++;
+		return;
+	}
+	t->m_events.Push(m_heap, e);
+}
+
+static void appendJsonString(Heap *h, StringBuffer &sb, const String &s) {
+	sb.AppendChar(h, '"');
+	for (int i = 0; i < s.m_size; i++) {
+		u8 c = s[i];
+		if (c == '"' || c == '\\') {
+			sb.AppendChar(h, '\\');
+			sb.AppendChar(h, (char)c);
+		} else if (c < 0x20) {
+			sb.AppendString(h, "\\u00");
+			sb.AppendHexByte(h, c);
+		} else {
+			sb.AppendChar(h, (char)c);
+		}
+	}
+	sb.AppendChar(h, '"');
+}
+
+// Appends nanoseconds as the microseconds Chrome traces are timed in.
+static void appendMicros(Heap *h, StringBuffer &sb, s64 ns) {
+	char text[32];
+	snprintf(text, sizeof(text), "%lld.%03d", (long long)(ns / 1000), (int)(ns % 1000));
+	sb.AppendString(h, text);
+}
+
+static void appendEvent(Heap *h, StringBuffer &sb, const TraceEvent &e, int tid, const String *hosts, int hostCount) {
+	sb.AppendString(h, "{\"name\":");
+	appendJsonString(h, sb, e.m_name);
+	sb.AppendString(h, ",\"cat\":");
+	appendJsonString(h, sb, e.m_category);
+	sb.AppendString(h, e.m_end < 0 ? ",\"ph\":\"i\",\"s\":\"t\"" : ",\"ph\":\"X\"");
+	sb.AppendString(h, ",\"pid\":1,\"tid\":");
+	sb.AppendInt(h, tid);
+	sb.AppendString(h, ",\"ts\":");
+	appendMicros(h, sb, e.m_start);
+	if (e.m_end >= 0) {
+		sb.AppendString(h, ",\"dur\":");
+		appendMicros(h, sb, e.m_end - e.m_start);
+	}
+	sb.AppendString(h, ",\"args\":{");
+	bool first = true;
+	auto arg = [&](const char *name) {
+		sb.AppendString(h, first ? "\"" : ",\"");
+		sb.AppendString(h, name);
+		sb.AppendString(h, "\":");
+		first = false;
+	};
+	if (e.m_keyArg) {
+		arg(e.m_keyArg);
+		sb.AppendChar(h, '"');
+		e.m_key.WriteHex(h, sb);
+		sb.AppendChar(h, '"');
+	}
+	if (e.m_host >= 0) {
+		arg("host");
+		if (e.m_host < hostCount) {
+			appendJsonString(h, sb, hosts[e.m_host]);
+		} else {
+			sb.AppendInt(h, e.m_host);
+		}
+	}
+	if (e.m_bytes >= 0) {
+		char text[24];
+		snprintf(text, sizeof(text), "%lld", (long long)e.m_bytes);
+		arg("bytes");
+		sb.AppendString(h, text);
+	}
+	if (e.m_valueArg) {
+		arg(e.m_valueArg);
+		sb.AppendInt(h, e.m_value);
+	}
+	if (e.m_error) {
+		arg("error");
+		sb.AppendInt(h, e.m_error);
+	}
+	sb.AppendString(h, "}}");
+}
+
+void Tracer::Write(const String *hosts, int hostCount, Buffer<u8> *out) {
+	Heap *h = m_heap;
+	StringBuffer sb;
+	sb.Init(out);
+	sb.AppendString(h, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	sb.AppendString(h, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ngdp\"}}");
+	TraceThread *threads;
+	{
+		SpinLockGuard lock(&m_lock);
+		threads = m_threads;
+	}
+	// Threads are only ever added at the front, so the list from here on is
+	// fixed.
+	for (TraceThread *t = threads; t; t = t->m_next) {
+		SpinLockGuard lock(&t->m_lock);
+		for (const TraceEvent &e : t->m_events) {
+			sb.AppendString(h, ",\n");
+			appendEvent(h, sb, e, t->m_id, hosts, hostCount);
+		}
+		if (t->m_dropped) {
+			TraceEvent e;
+			memset((void *)&e, 0, sizeof(e));
+			e.m_category = "trace";
+			e.m_name = "events dropped";
+			e.m_start = Now();
+			e.m_end = -1;
+			e.m_host = -1;
+			e.m_bytes = -1;
+			e.m_valueArg = "count";
+			e.m_value = t->m_dropped;
+			sb.AppendString(h, ",\n");
+			appendEvent(h, sb, e, t->m_id, hosts, hostCount);
+		}
+	}
+	sb.AppendString(h, "\n]}\n");
+}
+
+}
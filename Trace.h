@@ -0,0 +1,145 @@
+#pragma once
+
+#include "std.h"
+#include "Buffer.h"
+#include "Heap.h"
+#include "Key.h"
+#include "Lock.h"
+#include "Strings.h"
+
+#include <atomic>
+#include <thread>
+
+namespace ngdp {
+
+// A span, or an instant event if m_end is negative.  Names, categories and
+// argument names are static strings.
+struct TraceEvent {
+	const char *m_category;
+	const char *m_name;
+	// Nanoseconds since the tracer started
+	s64 m_start;
+	s64 m_end;
+	// Optional arguments: a key, a CDN host index, a byte count, a number
+	// and an NGDP_ERROR code
+	const char *m_keyArg;
+	Key m_key;
+	int m_host;
+	s64 m_bytes;
+	const char *m_valueArg;
+	int m_value;
+	int m_error;
+};
+
+// The events recorded by one thread.  Only that thread appends to it; m_lock
+// keeps a concurrent Write from seeing the buffer move.
+struct TraceThread {
+	TraceThread *m_next;
+	std::thread::id m_thread;
+	int m_id;
+	SpinLock m_lock;
+	Buffer<TraceEvent> m_events;
+	int m_dropped;
+};
+
+// Records spans of the client's work when config->tracePath is set, for
+// writing as Chrome trace-event JSON.  Each thread appends to a buffer of its
+// own, found through a thread-local cache, so recording takes no shared lock
+// once a thread has its buffer.
+struct Tracer {
+	// Events past this many on one thread are counted but dropped
+	static const int kMaxThreadEvents = 1 << 20;
+
+	Heap *m_heap;
+	bool m_enabled;
+	// Tells this tracer's buffers apart in the thread-local cache
+	u32 m_id;
+	s64 m_origin;
+	// Guards m_threads
+	SpinLock m_lock;
+	TraceThread *m_threads;
+	int m_threadCount;
+
+	void Init(Heap *h, bool enabled);
+	void Destroy();
+
+	// Nanoseconds since Init
+	s64 Now() const;
+	void Record(const TraceEvent &e);
+
+	// Writes every event recorded so far as a Chrome trace-event JSON
+	// object, naming host indexes from hosts.
+	void Write(const String *hosts, int hostCount, Buffer<u8> *out);
+
+private:
+	TraceThread *Thread();
+};
+
+// Records a span from its construction to its destruction, if there is a
+// tracer and it is enabled.  Spans on one thread nest.
+struct TraceSpan {
+	// Null when tracing is off
+	Tracer *m_tracer;
+	TraceEvent m_event;
+
+	TraceSpan(Tracer *t, const char *category, const char *name) {
+		m_tracer = t && t->m_enabled ? t : nullptr;
+		if (m_tracer) {
+			m_event.m_category = category;
+			m_event.m_name = name;
+			m_event.m_keyArg = nullptr;
+			m_event.m_host = -1;
+			m_event.m_bytes = -1;
+			m_event.m_valueArg = nullptr;
+			m_event.m_error = 0;
+			m_event.m_start = m_tracer->Now();
+		}
+	}
+
+	~TraceSpan() {
+		if (m_tracer) {
+			m_event.m_end = m_tracer->Now();
+			m_tracer->Record(m_event);
+		}
+	}
+
+	void SetKey(const char *arg, const Key &key) {
+		if (m_tracer) {
+			m_event.m_keyArg = arg;
+			m_event.m_key = key;
+		}
+	}
+
+	void SetKey(const char *arg, const u8 *key) {
+		SetKey(arg, *(const Key *)key);
+	}
+
+	void SetHost(int host) {
+		if (m_tracer) {
+			m_event.m_host = host;
+		}
+	}
+
+	void SetBytes(s64 bytes) {
+		if (m_tracer) {
+			m_event.m_bytes = bytes;
+		}
+	}
+
+	void SetValue(const char *arg, int value) {
+		if (m_tracer) {
+			m_event.m_valueArg = arg;
+			m_event.m_value = value;
+		}
+	}
+
+	// Returns err, so a span can wrap a function's result.
+	int SetError(int err) {
+		if (m_tracer) {
+			m_event.m_error = err;
+		}
+		return err;
+	}
+};
+
+}
@@ -0,0 +1,81 @@
+#include "WorkerPool.h"
+
+#include <new>
+
+namespace ngdp {
+
+void WorkerPool::Init(int threadCount) {
+	m_stopping = false;
+	if (threadCount <= 0) {
+		threadCount = (int)std::thread::hardware_concurrency();
+		if (threadCount <= 0) {
+			threadCount = 1;
+		}
+	}
+	for (int i = 0; i < threadCount; i++) {
+		m_threads.emplace_back([this] { Run(); });
+	}
+}
+
+void WorkerPool::Destroy() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	for (std::thread &t : m_threads) {
+		t.join();
+	}
+	m_threads.clear();
+}
+
+void WorkerPool::Submit(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_wake.notify_one();
+}
+
+void WorkerPool::Run() {
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+			if (m_tasks.empty()) {
+				return;
+			}
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+		// Notify under the lock, so a waiter cannot check its flag before
+		// the task set it and then miss the wakeup.
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_finished.notify_all();
+	}
+}
+
+void WorkerPool::Wait(const std::atomic<int> &done) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_finished.wait(lock, [&] { return done.load(std::memory_order_acquire) != 0; });
+}
+
+// The pool holds standard library members, so it is constructed in place in
+// memory from the client's heap.
+WorkerPool *WorkerPool::Create(Heap *h, int threadCount) {
+	WorkerPool *pool = new (h->Alloc(sizeof(WorkerPool))) WorkerPool();
+	pool->Init(threadCount);
+	return pool;
+}
+
+void WorkerPool::Free(Heap *h, WorkerPool *pool) {
+	if (pool) {
+		pool->Destroy();
+		pool->~WorkerPool();
+		h->Free(pool);
+	}
+}
+
+}
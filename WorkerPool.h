@@ -0,0 +1,48 @@
+#pragma once
+
+#include "std.h"
+#include "Heap.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ngdp {
+
+// A fixed set of threads running queued tasks in FIFO order.  Tasks must not
+// wait on other tasks.
+struct WorkerPool {
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	// Signaled after each task
+	std::condition_variable m_finished;
+	bool m_stopping;
+
+	// Starts threadCount threads, or one per hardware thread if zero.
+	void Init(int threadCount);
+	// Runs the tasks already queued, then joins the threads.
+	void Destroy();
+
+	void Submit(std::function<void()> task);
+
+	// Blocks until a task sets done to non-zero.
+	void Wait(const std::atomic<int> &done);
+
+	int ThreadCount() const {
+		return (int)m_threads.size();
+	}
+
+	static WorkerPool *Create(Heap *h, int threadCount);
+	static void Free(Heap *h, WorkerPool *pool);
+
+private:
+	void Run();
+};
+
+}
@@ -0,0 +1,99 @@
+#include "Client.h"
+#include "BlteEncoder.h"
+
+namespace ngdp {
+
+// op->state value for a file between Create and Save; workingBuffer holds the
+// file's encoder.
+static const int kWriteStateOpen = 16;
+
+// Used when op->encodingSpec is null
+static const char *kDefaultEncodingSpec = "b:{256K*=z}";
+
+static BlteEncoder *openEncoder(ngdpOperation *op) {
+	if (op->state != kWriteStateOpen || op->workingBufferSize < (int)sizeof(BlteEncoder *)) {
+		return nullptr;
+	}
+	BlteEncoder *encoder;
+	memcpy(&encoder, op->workingBuffer, sizeof(encoder));
+	return encoder;
+}
+
+int Client::Create(ngdpOperation *op) {
+	op->workingBufferRequiredSize = sizeof(BlteEncoder *);
+	op->workingBufferRequiredSizeWithoutState = sizeof(BlteEncoder *);
+	if (op->workingBufferSize < (int)sizeof(BlteEncoder *)) {
+		return NGDP_ERROR_WORKING_BUFFER_TOO_SMALL;
+	}
+	const Espec *spec;
+	{
+		SpinLockGuard lock(&m_especLock);
+		spec = m_especCache.Get(&m_heap, op->encodingSpec ? op->encodingSpec : kDefaultEncodingSpec);
+	}
+	if (!spec) {
+		return NGDP_ERROR_UNSUPPORTED_ENCODING;
+	}
+	BlteEncoder *encoder = BlteEncoder::Create(&m_heap, Workers(), spec);
+	memcpy(op->workingBuffer, &encoder, sizeof(encoder));
+	op->state = kWriteStateOpen;
+	op->encodedKeyIsValid = 0;
+	op->fileSize = 0;
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::Write(ngdpOperation *op) {
+	BlteEncoder *encoder = openEncoder(op);
+	if (!encoder || op->bufferSize < 0) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	int err = encoder->Write(op->buffer, op->bufferSize);
+	if (err) {
+		// A failed write leaves the file incomplete; release it.
+		BlteEncoder::Free(encoder);
+		op->state = 0;
+		return err;
+	}
+	op->fileSize += op->bufferSize;
+	return NGDP_ERROR_SUCCESS;
+}
+
+int Client::Save(ngdpOperation *op, const BlteWriteFn &write) {
+	BlteEncoder *encoder = openEncoder(op);
+	if (!encoder) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	Key contentKey;
+	Key encodedKey;
+	int encodedSize;
+	s64 decodedSize;
+	// Keep a copy of the encoded file to store locally
+	bool store = m_writer && !op->disableFileWrites;
+	Buffer<u8> encoded;
+	encoded.Init();
+	int err = encoder->Finish([&](const u8 *data, int size) {
+		if (store) {
+			encoded.Append(&m_heap, data, size);
+		}
+		return write(data, size);
+	}, &contentKey, &encodedKey, &encodedSize, &decodedSize);
+	BlteEncoder::Free(encoder);
+	if (!err && store) {
+		err = m_writer->Store(encodedKey, encoded.m_storage, encoded.m_size);
+	}
+	encoded.Destroy(&m_heap);
+	op->state = 0;
+	if (err) {
+		return err;
+	}
+	if (decodedSize > 0x7fffffff) {
+		return NGDP_ERROR_INVALID_ARGUMENT;
+	}
+	memcpy(op->contentKey, contentKey.k, 16);
+	memcpy(op->encodedKey, encodedKey.k, 16);
+	op->encodedKeyIsValid = 1;
+	op->encodedSize = encodedSize;
+	op->fileSize = (int)decodedSize;
+	return NGDP_ERROR_SUCCESS;
+}
+
+}
@@ -1,28 +1,178 @@
 #include "std.h"
 
 #include "ngdp.h"
+#include "Key.h"
+#include "Mirror.h"
 
-static void debugLog(const char *message) {
+static void usage() {
+	fprintf(stderr,
+		"usage: ngdp <command> [options]\n"
+		"commands:\n"
+		"  mirror           copy a whole build into a local CASC or a CDN-layout directory\n"
+		"  scan DIR [--repair]\n"
+		"                   check every file of the local CASC at DIR; with --repair,\n"
+		"                   drop the bad ones from its index so they are fetched again\n"
+		"  compact DIR [BUILD_CONFIG] [--min-waste PERCENT]\n"
+		"                   move the files of the build out of the archives of the local\n"
+		"                   CASC at DIR that are at least PERCENT (default 20) unused,\n"
+		"                   and remove those archives; without BUILD_CONFIG, DIR must be\n"
+		"                   a shared store, and the files of its retained builds are kept\n"
+		"  retire DIR PRODUCT REGION BUILD_CONFIG [--min-waste PERCENT]\n"
+		"                   stop retaining a build in the shared store at DIR, and collect\n"
+		"                   the files no other retained build uses\n");
+}
+
+static void commandLog(const char *message) {
 	fprintf(stderr, "[ngdp] %s\n", message);
 }
 
-static void reportStat(int type, int arg0, int arg1, int arg2, const uint8_t *key) {
-	fprintf(stderr, "[stat] %d %d %d %d\n", type, arg0, arg1, arg2);
+static const char *scanProblemName(int problem) {
+	switch (problem) {
+	case NGDP_SCAN_MISSING:
+		return "missing";
+	case NGDP_SCAN_BAD_RECORD:
+		return "bad record header";
+	case NGDP_SCAN_BAD_BLTE:
+		return "bad BLTE data";
+	case NGDP_SCAN_BAD_KEY:
+		return "wrong encoded key";
+	default:
+		return "unknown";
+	}
+}
+
+static int printScanProblem(void *ctx, int problem, const uint8_t *encodedKey, int archive, int offset, int size) {
+	++*(int *)ctx;
+	printf("data.%03d offset %d size %d key ", archive, offset, size);
+	for (int i = 0; i < 9; i++) {
+		printf("%02x", encodedKey[i]);
+	}
+	printf(": %s\n", scanProblemName(problem));
+	return 0;
 }
 
-int main() {
+static int scan(int argc, char **argv) {
+	bool repair = argc == 2 && strcmp(argv[1], "--repair") == 0;
+	if (argc < 1 || argc > 2 || (argc == 2 && !repair)) {
+		usage();
+		return 2;
+	}
 	ngdpConfig config;
 	memset(&config, 0, sizeof(config));
-	config.ngdpUrl = "http://us.patch.battle.net";
-	config.ngdpRegion = "us";
-	config.gameUid = "wow";
-	config.logFn = debugLog;
-	config.statsFn = reportStat;
+	config.cascPath = argv[0];
+	config.disableHTTPRequests = 1;
+	config.logFn = commandLog;
 	ngdpClient *c = ngdpInit(&config);
-	// TODO:
-	// - Create multi-archive index and load & decode encoding
-	// - Write decoder frame stuff for encoding
-	// - Load root
-	// - Query interface for filedataid, filename -> ckey; ckey -> ekey -> buffer
+	if (!c) {
+		fprintf(stderr, "Unable to open %s (%d): %s\n", argv[0], config.error, config.errorDetail ? config.errorDetail : "");
+		return 1;
+	}
+	int problems = 0;
+	int err = ngdpScanLocal(c, repair, printScanProblem, &problems);
+	ngdpDestroy(c);
+	if (err == NGDP_ERROR_FILE_NOT_FOUND && repair) {
+		fprintf(stderr, "Unable to repair %s: another process is storing files in it\n", argv[0]);
+		return 1;
+	}
+	if (err) {
+		fprintf(stderr, "Scan failed (%d)\n", err);
+		return 1;
+	}
+	// A scan that repairs only succeeds once the bad files are dropped.
+	printf("%d bad files%s\n", problems, repair && problems ? ", dropped from the index" : "");
+	return problems ? 1 : 0;
+}
+
+// Opens the local CASC at path, with buildConfigHex's build if it is set.
+static ngdpClient *openLocal(const char *path, const char *buildConfigHex) {
+	// The build's configs are read from the installation.
+	ngdpConfig config;
+	memset(&config, 0, sizeof(config));
+	config.cascPath = path;
+	config.disableHTTPRequests = 1;
+	config.logFn = commandLog;
+	if (buildConfigHex && !((ngdp::Key *)config.buildConfigKey)->ParseHexString(buildConfigHex)) {
+		fprintf(stderr, "Bad build config key %s\n", buildConfigHex);
+		return nullptr;
+	}
+	ngdpClient *c = ngdpInit(&config);
+	if (!c) {
+		fprintf(stderr, "Unable to open %s (%d): %s\n", path, config.error, config.errorDetail ? config.errorDetail : "");
+	}
+	return c;
+}
+
+static int compact(int argc, char **argv) {
+	int minWaste = 20;
+	if (argc >= 3 && strcmp(argv[argc - 2], "--min-waste") == 0) {
+		minWaste = atoi(argv[argc - 1]);
+		argc -= 2;
+	}
+	if (argc != 1 && argc != 2) {
+		usage();
+		return 2;
+	}
+	ngdpClient *c = openLocal(argv[0], argc == 2 ? argv[1] : nullptr);
+	if (!c) {
+		return 1;
+	}
+	int err = ngdpCompactLocal(c, minWaste);
+	ngdpDestroy(c);
+	if (err) {
+		fprintf(stderr, "Compaction failed (%d)\n", err);
+		return 1;
+	}
+	return 0;
+}
+
+static int retire(int argc, char **argv) {
+	int minWaste = 20;
+	if (argc == 6 && strcmp(argv[4], "--min-waste") == 0) {
+		minWaste = atoi(argv[5]);
+	} else if (argc != 4) {
+		usage();
+		return 2;
+	}
+	uint8_t buildConfigKey[16];
+	if (!((ngdp::Key *)buildConfigKey)->ParseHexString(argv[3])) {
+		fprintf(stderr, "Bad build config key %s\n", argv[3]);
+		return 2;
+	}
+	ngdpClient *c = openLocal(argv[0], nullptr);
+	if (!c) {
+		return 1;
+	}
+	// "-" stands for a client configured without a product or region.
+	const char *product = strcmp(argv[1], "-") == 0 ? nullptr : argv[1];
+	const char *region = strcmp(argv[2], "-") == 0 ? nullptr : argv[2];
+	int err = ngdpRetireBuild(c, product, region, buildConfigKey, minWaste);
+	ngdpDestroy(c);
+	if (err) {
+		fprintf(stderr, "Retiring the build failed (%d)\n", err);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		usage();
+		return 2;
+	}
+	int result = 2;
+	if (strcmp(argv[1], "mirror") == 0) {
+		result = Mirror(argc - 2, argv + 2);
+	} else if (strcmp(argv[1], "scan") == 0) {
+		result = scan(argc - 2, argv + 2);
+	} else if (strcmp(argv[1], "compact") == 0) {
+		result = compact(argc - 2, argv + 2);
+	} else if (strcmp(argv[1], "retire") == 0) {
+		result = retire(argc - 2, argv + 2);
+	} else {
+		fprintf(stderr, "Unknown command %s\n", argv[1]);
+		usage();
+	}
+	fflush(stdout);
 	fflush(stderr);
+	return result;
 }
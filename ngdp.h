@@ -19,6 +19,24 @@ typedef size_t (*ngdpFileReadFn)(void *buffer, size_t size, size_t count, void *
 typedef size_t (*ngdpFileWriteFn)(void *buffer, size_t size, size_t count, void *stream);
 typedef int (*ngdpFileCloseFn)(void *stream);
 
+/* Flushes stream and forces its data to stable storage (fflush + fsync) */
+typedef int (*ngdpFileSyncFn)(void *stream);
+/* Reads count bytes at offset of stream without using or moving its position,
+ * so several threads can read one stream at once (pread).  Returns the number
+ * of bytes read.
+ */
+typedef size_t (*ngdpFileReadAtFn)(void *buffer, size_t count, int64_t offset, void *stream);
+/* rename, remove */
+typedef int (*ngdpFileRenameFn)(const char *from, const char *to);
+typedef int (*ngdpFileRemoveFn)(const char *filename);
+
+/* Lists the entries of a directory, calling onEntry with each entry's name
+ * (not its full path).  Returns zero on success, non-zero if the directory
+ * cannot be read.
+ */
+typedef void (*ngdpDirectoryEntryFn)(void *ctx, const char *name);
+typedef int (*ngdpListDirectoryFn)(const char *path, ngdpDirectoryEntryFn onEntry, void *ctx);
+
 /* Downloads data from url.  If 0 <= rangeStart < rangeEnd, will perform a range
  * request.  Downloaded data will be read in to buffer.  If buffer is null, will
  * perform a HEAD request.  The response's Content-Length will be written to
@@ -32,9 +50,34 @@ typedef int (*ngdpFileCloseFn)(void *stream);
  * Returns zero on success, non-zero on failure.  Timeouts and 5xx
  * status codes return 1, indicating the download may be retried; 4xx status
  * codes should not return 1.
+ *
+ * With hedgeDelayMs set, this is called from several threads at once.
+ *
+ * A download that fails part way with 1 may leave the bytes received so far
+ * in buffer (allocating it if the pointer at buffer was null) and report
+ * them with ngdpDownloadReceived; the retry then asks only for the rest.
  */
 typedef int (*ngdpDownloadUrlFn)(const char *url, int rangeStart, int rangeEnd, uint8_t **buffer, int *bufferSize);
 
+/* Returns non-zero when called from a downloadUrlFn whose request has been
+ * hedged and answered by another host.  The download may then stop early and
+ * return 1; its result is ignored.
+ */
+int ngdpDownloadCancelled(void);
+
+/* Returns the milliseconds left before the deadline of the download a
+ * downloadUrlFn is running, or -1 if it has none.
+ */
+int ngdpDownloadTimeLeftMs(void);
+
+/* Called from a downloadUrlFn to report that received bytes of the requested
+ * body have arrived, of contentLength (-1 if unknown).  Only the body of a
+ * 200 response, or of a 206 response to a range request, should be reported.
+ * When the buffer was given by the caller, the bytes must already be in it:
+ * ngdpRead decodes the chunks they complete while the rest arrives.
+ */
+void ngdpDownloadReceived(int received, int contentLength);
+
 #define NGDP_DOWNLOAD_SUCCESS (0)
 #define NGDP_DOWNLOAD_SERVER_ERROR (1)
 #define NGDP_DOWNLOAD_400_ERROR (2)
@@ -76,6 +119,43 @@ typedef void (*ngdpDebugLogFn)(const char *message);
  */
 #define NGDP_STATISTIC_CASC_READ_FINISHED (6)
 
+/* A read or acquire served from the decoded file cache
+ * arg0 = file size
+ */
+#define NGDP_STATISTIC_CACHE_HIT (7)
+
+/* A whole-file read or acquire that the decoded file cache could not serve
+ * arg0 = file size
+ */
+#define NGDP_STATISTIC_CACHE_MISS (8)
+
+/* A file evicted from the decoded file cache
+ * arg0 = file size
+ */
+#define NGDP_STATISTIC_CACHE_EVICTED (9)
+
+/* A slow CDN request duplicated to another host
+ * arg0 = CDN host index of the duplicate
+ * arg1 = time the original request had run in microseconds
+ * arg2 = CDN host index of the original request
+ */
+#define NGDP_STATISTIC_DOWNLOAD_HEDGED (10)
+
+/* A CDN host skipped for a while after consecutive server errors or timeouts
+ * arg0 = CDN host index
+ * arg1 = time it is skipped for in milliseconds
+ * arg2 = consecutive failures
+ */
+#define NGDP_STATISTIC_HOST_DISABLED (11)
+
+/* An encrypted chunk whose key is not in the keyring, zeroed rather than
+ * decoded
+ * arg0 = chunk index
+ * arg1 = decoded offset of the chunk
+ * arg2 = decoded size of the chunk
+ */
+#define NGDP_STATISTIC_CHUNK_SKIPPED (12)
+
 /* Reports a statistic event.  Useful for showing the user progress.
  *   type: one of the NGDP_STATISTIC constants
  *   args: depends on the type
@@ -88,6 +168,10 @@ typedef struct ngdpConfig {
 	const char *ngdpUrl;
 	const char *ngdpRegion;
 	const char *gameUid;
+	/* The local CASC installation.  One process at a time stores files in
+	 * it; a client opened while another process has Data/data/.lock locked
+	 * only reads it.
+	 */
 	const char *cascPath;
 
 	/* callbacks -- if they are null, the stdlib/curl versions will be used
@@ -104,6 +188,25 @@ typedef struct ngdpConfig {
 	ngdpFileReadFn freadFn;
 	ngdpFileWriteFn fwriteFn;
 	ngdpFileCloseFn fcloseFn;
+	/* if null, the platform's directory API is used */
+	ngdpListDirectoryFn listDirectoryFn;
+	/* Used when storing files in the local CASC installation; if null, the
+	 * stdlib/platform versions are used.  If the file callbacks are set but
+	 * fsyncFn is not, stored files are flushed but not synced.
+	 */
+	ngdpFileSyncFn fsyncFn;
+	/* Used to read the local archives, which every reading thread shares; if
+	 * null, the platform's positional read is used.  If the file callbacks
+	 * are set but freadAtFn is not, the reads of each archive take turns
+	 * seeking and reading its stream.
+	 */
+	ngdpFileReadAtFn freadAtFn;
+	/* Must replace an existing file at to in one step, as POSIX rename does,
+	 * so files rewritten in the installation are never missing; if null,
+	 * rename is used, or MoveFileEx on Windows.
+	 */
+	ngdpFileRenameFn renameFn;
+	ngdpFileRemoveFn removeFn;
 	ngdpDownloadUrlFn downloadUrlFn;
 	/* if null, no debug logging will occur */
 	ngdpDebugLogFn logFn;
@@ -114,7 +217,11 @@ typedef struct ngdpConfig {
 	uint8_t overrideBuildConfig;
 	uint8_t overrideCDNConfig;
 	uint8_t overrideCDNs;
-	/* Used if disableHTTPRequests or overrideBuildConfig is set: */
+	/* Used if disableHTTPRequests or overrideBuildConfig is set.  With
+	 * disableHTTPRequests and a zero key, only the local installation is
+	 * opened: no build's files can be found, but IsLocal (with encodedKey
+	 * set) and ScanLocal work.
+	 */
 	uint8_t buildConfigKey[16];
 	/* Used if disableHTTPRequests or overrideCDNConfig is set: */
 	uint8_t cdnConfigKey[16];
@@ -126,6 +233,97 @@ typedef struct ngdpConfig {
 	/* If the server returns a 5xx or times out, retry this number of times */
 	int httpRetryCount;
 
+	/* Retries wait a random time up to retryBackoffMs, doubling with each
+	 * retry (up to 5 seconds); zero uses 50.  A CDN host that fails three
+	 * requests in a row is skipped for a few seconds, and longer if it keeps
+	 * failing.
+	 */
+	int retryBackoffMs;
+
+	/* If set, the downloads made by one call (such as ngdpRead or ngdpFetch)
+	 * give up once this many milliseconds have passed since the call began,
+	 * including retries and backoff.  The default download function also
+	 * stops a transfer at the deadline; a custom one can find the time left
+	 * with ngdpDownloadTimeLeftMs.
+	 */
+	int downloadDeadlineMs;
+
+	/* If set, a CDN request that has run this many milliseconds, and longer
+	 * than its host's past requests suggest, is sent to a second host as
+	 * well; whichever answers first is used and the other is cancelled.  The
+	 * default download function reports progress, so a transfer arriving at
+	 * its host's usual rate is left alone.  The first request runs on the
+	 * calling thread, and the call returns once it does, so a custom
+	 * download function should stop when ngdpDownloadCancelled says so; the
+	 * second gets a thread of its own when it starts.  The first request
+	 * fills the caller's buffer, so ngdpRead decodes its chunks as they
+	 * arrive and a retry resumes it; the second fills a private buffer,
+	 * whose body is copied over and decoded only if it wins.  ngdpDestroy
+	 * waits for cancelled requests to return.
+	 */
+	int hedgeDelayMs;
+
+	/* Threads in the client's worker pool, which starts on first use; zero
+	 * uses one per hardware thread.  The pool
+	 *   - compresses the chunks of files written with Create/Write/Save, so
+	 *     more threads encode a large file faster;
+	 *   - fetches and decodes ahead for Reads with enableReadahead, one task
+	 *     per window, so it bounds how many reads progress in the background;
+	 *   - reads the archives for ScanLocal, one archive per thread, so it
+	 *     sets how many archives (and how much of the disk) a scan uses;
+	 *   - merges the sorted runs of archive indexes as they are loaded.
+	 * Tasks run in the order they were queued, so a scan delays the
+	 * readahead and encoding queued behind it.  If memory callbacks are set,
+	 * they are called from these threads and must be thread-safe.
+	 */
+	int workerThreadCount;
+
+	/* If set, the build's parsed indexes are kept in this file so processes
+	 * sharing an installation map one read-only copy.  A snapshot made for
+	 * the same build and CDN configs is used as-is; otherwise the indexes are
+	 * loaded (archive indexes eagerly) and the snapshot is rewritten.  The
+	 * file is specific to the host's byte order and struct layout, and is
+	 * read with the platform's mapping API rather than the file callbacks.
+	 */
+	const char *indexSnapshotPath;
+
+	/* Bytes of decoded files to keep in memory, keyed by content key; zero
+	 * disables the cache.  Files are cached by Acquire and by Reads of a
+	 * whole file, and any Read of a cached file is served from memory.
+	 * Files still held through handles are not counted once evicted.
+	 */
+	int64_t decodedCacheSize;
+
+	/* If set, a file of the keys encrypted BLTE chunks are decrypted with,
+	 * loaded at init: one key per line, its 64-bit name as 16 hex digits,
+	 * then the key as 32 (see ngdpAddKey).  Lines starting with '#' are
+	 * skipped.  A file that cannot be read or parsed fails the init.
+	 */
+	const char *keyringPath;
+
+	/* If set, spans of the client's work (index lookups, CDN transfers and
+	 * retries, local reads, chunk decoding, verification and stores, within
+	 * the API calls that made them) are recorded per thread, with the
+	 * content or encoded key and CDN host they concern, and written to this
+	 * file by ngdpDestroy as Chrome trace-event JSON, which Perfetto and
+	 * chrome://tracing open.  Statistics events are recorded as instants.
+	 * See also ngdpWriteTrace.
+	 */
+	const char *tracePath;
+
+	/* If set, an ngdpClient whose installation this client stores its files
+	 * in instead of cascPath's, so clients of several products and regions
+	 * keep one copy of each encoded file.  The store is a client opened on
+	 * the shared cascPath, normally with disableHTTPRequests and a zero
+	 * buildConfigKey; it must outlive the clients using it, and all of them
+	 * must be in one process.  Opening a client on the store retains its
+	 * build (see ngdpRetireBuild) and stores its encoding file, so the
+	 * build's files can be told from garbage offline; it fails if another
+	 * process is writing to the shared installation.  Index snapshots of
+	 * such clients hold only the CDN indexes.
+	 */
+	void *sharedStore;
+
 	/* An error message to supplement the error code */
 	const char *errorDetail;
 
@@ -141,12 +339,29 @@ typedef void ngdpClient;
 #define NGDP_ERROR_WORKING_BUFFER_TOO_SMALL (3)
 #define NGDP_ERROR_HTTP_TIMEOUT (4)
 #define NGDP_ERROR_HTTP_SERVER_ERROR (5)
+#define NGDP_ERROR_CORRUPT_DATA (6)
+#define NGDP_ERROR_UNSUPPORTED_ENCODING (7)
+#define NGDP_ERROR_FILE_READ_FAILED (8)
+#define NGDP_ERROR_INVALID_ARGUMENT (9)
+#define NGDP_ERROR_ABORTED (10)
+#define NGDP_ERROR_MISSING_KEY (11)
 
 /* Allocates and initializes a new ngdp client according to config.  If an error
  * occurs during initialization, this will return null and set config->error.
+ *
+ * Once initialized, a client may be used from any number of threads at once:
+ * FileInfo, IsLocal, Read, Fetch and ApplyPatch, and Create/Write/Save of
+ * different files, can run concurrently.  Each ngdpOperation must only be
+ * used by one thread at a time.  The callbacks in config are then called
+ * from several threads at once and must be thread-safe, except for logFn,
+ * which is called by one thread at a time.  ngdpDestroy must not overlap any
+ * other call.
  */
 ngdpClient *ngdpInit(ngdpConfig *config);
 
+/* Releases a client and everything it allocated. */
+void ngdpDestroy(ngdpClient *c);
+
 /* This struct is used for all ngdp operations; it should be zero-initialized.
  */
 typedef struct ngdpOperation {
@@ -202,6 +417,16 @@ typedef struct ngdpOperation {
 	 */
 	uint8_t disableFileWrites;
 
+	/* enableReadahead lets Read fetch and decode the rest of the file in the
+	 * background while the caller consumes a read that started at zero or
+	 * where the previous one ended.  The state is kept at the end of
+	 * workingBuffer, and the window grows or shrinks with the caller's pace,
+	 * bounded by the space workingBuffer has beyond what a plain read needs.
+	 * Call EndRead before modifying or releasing workingBuffer.  Must not
+	 * change while state is set.
+	 */
+	uint8_t enableReadahead;
+
 	uint8_t encodedKeyIsValid;
 	uint8_t encodedKey[16];
 	int encodedSize;
@@ -211,6 +436,15 @@ typedef struct ngdpOperation {
 	 * directly to (encoded) file data.
 	 */
 	int localArchiveFileOffset;
+
+	/* Set by Read, Acquire and Fetch to the number of encrypted chunks in the
+	 * range they decoded whose key is not in the keyring.  Their bytes are
+	 * zeroed, and each is reported as NGDP_STATISTIC_CHUNK_SKIPPED, rather
+	 * than failing the read; such a file is not put in the decoded cache.
+	 * Fetch adds up the counts of its reads, so a chunk two of them share
+	 * counts twice.
+	 */
+	int skippedChunkCount;
 } ngdpOperation;
 
 /* FileInfo looks up contentKey in encoding and sets fields in op accordingly:
@@ -221,22 +455,223 @@ int ngdpFileInfo(ngdpClient *c, ngdpOperation *op);
 
 /* IsLocal looks up the file by encodedKey in the local CASC index and sets
  * dataIsLocal, localArchiveIndex, and localArchiveFileOffset.  If the file does
- * not exist in the CASC index, dataIsLocal will be 0.
+ * not exist in the CASC index, dataIsLocal will be 0.  The location is only
+ * informative: CompactLocal may move the file, and reads look it up again.
  */
 int ngdpIsLocal(ngdpClient *c, ngdpOperation *op);
 
-/* Read reads data from the file to op->buffer.
+/* Read reads data from the file to op->buffer.  The decoded range
+ * [fileOffset, fileOffset + bufferSize) is read, clamped to fileSize; only the
+ * BLTE chunks overlapping that range are read from the local archive or
+ * requested from the CDN.  Read calls FileInfo and IsLocal if they have not
+ * been called yet.
+ *
+ * Unless disableFileWrites is set, a file downloaded whole in one read (for
+ * example, with bufferSize >= fileSize and a large enough workingBuffer) is
+ * stored in the local CASC installation.
+ *
+ * With state set, the file's BLTE header is kept at the start of
+ * workingBuffer, so later reads of the same file skip fetching it again.
+ * Once the header is known, workingBufferRequiredSize and
+ * workingBufferRequiredSizeWithoutState are set exactly; if workingBuffer is
+ * too small for the requested range, NGDP_ERROR_WORKING_BUFFER_TOO_SMALL is
+ * returned.
  */
 int ngdpRead(ngdpClient *c, ngdpOperation *op);
 
-/* Create creates a new file which can be written to.  When creating a new file,
- * the required size of workingBuffer depends on the encodingSpec; if the
- * workingBuffer is too small, Create will return an error.  The workingBuffer
- * must be retained for future writing and saving of this file.
+/* A reference to a decoded file held by Acquire */
+typedef struct ngdpFileHandle ngdpFileHandle;
+
+/* Acquire provides the whole decoded file without copying it: *data points to
+ * its fileSize bytes, which stay valid until ngdpRelease(handle).  The file
+ * comes from the decoded file cache if it is there; otherwise it is read as
+ * with Read (so workingBuffer must be large enough for a whole-file read) and
+ * offered to the cache.  Without a cache, the handle alone holds the file.
+ * Every handle must be released before the client is destroyed.
+ */
+int ngdpAcquire(ngdpClient *c, ngdpOperation *op, ngdpFileHandle **handle, const uint8_t **data);
+void ngdpRelease(ngdpClient *c, ngdpFileHandle *handle);
+
+/* EndRead waits for any readahead started by Read on op, after which op's
+ * workingBuffer may be modified or released.  Does nothing for an operation
+ * without enableReadahead.
+ */
+int ngdpEndRead(ngdpClient *c, ngdpOperation *op);
+
+/* Receives the next size bytes of a file being produced.  Returns non-zero to
+ * abort.
+ */
+typedef int (*ngdpWriteFn)(void *ctx, const uint8_t *data, int size);
+
+/* Create creates a new file which can be written to, BLTE-encoded according
+ * to op->encodingSpec (b:{256K*=z} if null).  workingBuffer holds the state
+ * of the file being written, and workingBufferRequiredSize is set to its
+ * size; if the workingBuffer is too small, Create will return an error.  The
+ * workingBuffer must be retained for future writing and saving of this file.
+ * A spec that is malformed or uses an unsupported codec returns
+ * NGDP_ERROR_UNSUPPORTED_ENCODING.
  */
 int ngdpCreate(ngdpClient *c, ngdpOperation *op);
+
+/* Write appends op->buffer[0, bufferSize) to the file.  Each chunk is
+ * compressed on a worker thread as soon as its data is complete, so the
+ * decoded file is never held whole; Write only waits when the workers fall
+ * behind.  If the data runs past the end of the encoding spec's blocks, the
+ * file is released and NGDP_ERROR_INVALID_ARGUMENT is returned.
+ */
 int ngdpWrite(ngdpClient *c, ngdpOperation *op);
-int ngdpSave(ngdpClient *c, ngdpOperation *op);
+
+/* Save finishes encoding the file and passes the complete encoded file,
+ * chunk table first, to writeFn (which may be null).  Unless
+ * disableFileWrites is set, the encoded file is also stored in the local CASC
+ * installation before Save returns.  It sets contentKey, fileSize,
+ * encodedKey, encodedKeyIsValid and encodedSize, and releases the file's
+ * state whether or not it succeeds.
+ */
+int ngdpSave(ngdpClient *c, ngdpOperation *op, ngdpWriteFn writeFn, void *writeCtx);
+
+/* ApplyPatch rebuilds a file from the local file with content key
+ * baseContentKey and the ZBSDIFF1 patch stored on the CDN with key patchKey
+ * and size patchSize.  The patched file is passed to writeFn in pieces as it
+ * is produced; the base, patch and target are never held in memory whole.
+ * If writeFn returns non-zero, patching stops with NGDP_ERROR_ABORTED.
+ */
+int ngdpApplyPatch(ngdpClient *c, const uint8_t *baseContentKey, const uint8_t *patchKey, int patchSize, ngdpWriteFn writeFn, void *writeCtx);
+
+/* Fetch produces the whole decoded file op->contentKey, passing it to writeFn
+ * in pieces.  A local file is read locally.  Otherwise Fetch estimates, from
+ * measured CDN latency and throughput, local read throughput and patching
+ * throughput, whether downloading the file or applying a patch from the
+ * build's patch manifest to a locally present source file finishes first,
+ * and takes that path.  A patched result is checked against contentKey.
+ *
+ * Reads go through op->buffer and op->workingBuffer as with Read; bufferSize
+ * should be a multiple of the file's chunk size for the best throughput.
+ */
+int ngdpFetch(ngdpClient *c, ngdpOperation *op, ngdpWriteFn writeFn, void *writeCtx);
+
+#define NGDP_DIFF_ADDED (1)
+#define NGDP_DIFF_REMOVED (2)
+/* The content key maps to a different encoded key */
+#define NGDP_DIFF_CHANGED (3)
+
+/* Called by DiffBuild for each content key that differs between the builds.
+ * oldEncodedKey is null for an added key and newEncodedKey for a removed one;
+ * fileSize is the decoded size.  Returning non-zero stops the diff with
+ * NGDP_ERROR_ABORTED.
+ */
+typedef int (*ngdpDiffFn)(void *ctx, int change, const uint8_t *contentKey, const uint8_t *oldEncodedKey, const uint8_t *newEncodedKey, int64_t fileSize);
+
+/* DiffBuild compares the client's build with the build whose build config
+ * key is buildConfigKey, or with the build the versions file lists if that
+ * is null, calling onChange for each content key added, removed or changed.
+ * Only the other build's encoding file is loaded; the two tables are walked
+ * together in key order, and pages the builds share are skipped unread.
+ */
+int ngdpDiffBuild(ngdpClient *c, const uint8_t *buildConfigKey, ngdpDiffFn onChange, void *ctx);
+
+/* Called by ListFiles for each data file of the build, with its decoded size
+ * and its encoded size (-1 if unknown).  Returning non-zero stops the
+ * listing with NGDP_ERROR_ABORTED.
+ */
+typedef int (*ngdpFileFn)(void *ctx, const uint8_t *contentKey, const uint8_t *encodedKey, int64_t fileSize, int encodedSize);
+
+/* ListFiles passes every file of the client's build to onFile: first the
+ * encoding file, which is not listed in itself, then each content key of
+ * the encoding file in key order.
+ */
+int ngdpListFiles(ngdpClient *c, ngdpFileFn onFile, void *ctx);
+
+/* ReadEncoded reads the encoded (BLTE) bytes [fileOffset, fileOffset +
+ * bufferSize) of op->encodedKey, clamped to encodedSize, into op->buffer,
+ * from the local archives or the CDN.  FileInfo and IsLocal are called as
+ * with Read; if encodedKeyIsValid is already set, encodedSize must be set
+ * too.  A read of the whole encoded file is checked
+ * against its chunk checksums and encoded key (NGDP_ERROR_CORRUPT_DATA if it
+ * does not match) and, unless disableFileWrites is set, a downloaded one is
+ * stored in the local CASC installation before ReadEncoded returns.
+ */
+int ngdpReadEncoded(ngdpClient *c, ngdpOperation *op);
+
+/* Problems found by ScanLocal */
+/* The archive is missing or ends before the record */
+#define NGDP_SCAN_MISSING (1)
+/* The 30-byte record header does not match the index entry */
+#define NGDP_SCAN_BAD_RECORD (2)
+/* The BLTE header is malformed or a chunk fails its checksum */
+#define NGDP_SCAN_BAD_BLTE (3)
+/* The data does not hash to the record's encoded key */
+#define NGDP_SCAN_BAD_KEY (4)
+
+/* Called by ScanLocal for each bad file.  encodedKey is the index's
+ * truncated key: its first 9 bytes, then zeros.  archive and offset locate
+ * the record (header included, as in the .idx) and size is its size.
+ * Returning non-zero stops the reports, and the repair, with
+ * NGDP_ERROR_ABORTED.
+ */
+typedef int (*ngdpScanFn)(void *ctx, int problem, const uint8_t *encodedKey, int archive, int offset, int size);
+
+/* ScanLocal checks every file the local CASC index lists: the record header
+ * against the index entry, the BLTE header and chunk checksums, and the MD5
+ * against the encoded key.  Each data.NNN is read front to back in large
+ * blocks on a worker thread (see workerThreadCount), several archives at
+ * once, and reads are reported as CASC_READ statistics.  onProblem is called
+ * on the calling thread once the scan is done, in archive and offset order.
+ * With repair set, the bad entries are then removed from the index, so the
+ * files are downloaded and stored again the next time they are read; a
+ * client that only reads the installation (see cascPath) cannot repair, and
+ * fails with NGDP_ERROR_FILE_NOT_FOUND without scanning.  Files may be read
+ * and stored during the scan.
+ */
+int ngdpScanLocal(ngdpClient *c, int repair, ngdpScanFn onProblem, void *ctx);
+
+/* CompactLocal reclaims the space in the local CASC archives taken by files
+ * that the client's build does not use, or in a shared store (see
+ * sharedStore), that no retained build uses.  Each data.NNN with at least
+ * minWastePercent of its indexed extent unused has the build's files copied,
+ * in encoded key order and in bounded batches, to the archive new files are
+ * stored in, and their .idx entries republished as they go; the unused entries
+ * are then dropped and the emptied archives removed.  Files may be read and
+ * stored meanwhile: reads look each file up again, and an archive is only
+ * removed once the reads that may have found a file in it have finished.
+ * A client without a build cannot compact.
+ */
+int ngdpCompactLocal(ngdpClient *c, int minWastePercent);
+
+/* AddKey adds a key for decrypting encrypted BLTE chunks, replacing any key
+ * with the same name.  keyName is the 64-bit name chunks refer to the key by,
+ * the number usually written as 16 hex digits; key is 16 bytes.  Chunks are
+ * decrypted with Salsa20 or ARC4, as their header says.  Keys may be added
+ * while files are read.
+ */
+int ngdpAddKey(ngdpClient *c, uint64_t keyName, const uint8_t *key);
+
+/* WriteTrace passes the trace recorded so far (see tracePath) to writeFn,
+ * whole; recording goes on meanwhile.  Returns NGDP_ERROR_INVALID_ARGUMENT if
+ * the client was not configured to trace.
+ */
+int ngdpWriteTrace(ngdpClient *c, ngdpWriteFn writeFn, void *writeCtx);
+
+/* RetireBuild removes a build from the builds a shared store retains, which
+ * are listed in Data/shared.refs under its cascPath, then collects garbage as
+ * CompactLocal does: files no remaining build uses are dropped, and files a
+ * build still uses stay however many builds have been retired.  gameUid and
+ * region are those the build's client was configured with (null for none).
+ * Returns NGDP_ERROR_FILE_NOT_FOUND if the build is not retained, and fails
+ * without dropping anything if a retained build's encoding file cannot be
+ * read.  Clients using the build should be destroyed first.
+ */
+int ngdpRetireBuild(ngdpClient *store, const char *gameUid, const char *region, const uint8_t *buildConfigKey,
+	int minWastePercent);
+
+#define NGDP_CONFIG_BUILD (0)
+#define NGDP_CONFIG_CDN (1)
+
+/* ConfigFile passes the client's build config or CDN config file (which is
+ * one of the NGDP_CONFIG constants) to writeFn, whole, and sets key to its
+ * key.
+ */
+int ngdpConfigFile(ngdpClient *c, int which, uint8_t *key, ngdpWriteFn writeFn, void *writeCtx);
 
 #ifdef __cplusplus
 }
@@ -9,17 +9,61 @@ Build {
 				"Remote.cpp",
 				"Key.h",
 				"Key.cpp",
+				"KeyMap.h",
 				"Config.h",
 				"Config.cpp",
+				"Encoding.h",
+				"Encoding.cpp",
+				"ArchiveIndex.h",
+				"ArchiveIndex.cpp",
+				"LocalStorage.h",
+				"LocalStorage.cpp",
+				"Blte.h",
+				"Blte.cpp",
+				"Md5.h",
+				"Md5.cpp",
+				"Read.cpp",
+				"Patch.h",
+				"Patch.cpp",
+				"PatchManifest.h",
+				"PatchManifest.cpp",
+				"CostModel.h",
+				"Espec.h",
+				"Espec.cpp",
+				"BlteEncoder.h",
+				"BlteEncoder.cpp",
+				"WorkerPool.h",
+				"WorkerPool.cpp",
+				"Write.cpp",
+				"Scan.cpp",
+				"Compact.cpp",
+				"SharedStore.cpp",
+				"CascWriter.h",
+				"CascWriter.cpp",
+				"Snapshot.h",
+				"Snapshot.cpp",
+				"Lock.h",
+				"DecodedCache.h",
+				"DecodedCache.cpp",
+				"KeyFilter.h",
+				"KeyFilter.cpp",
+				"Crypt.h",
+				"Crypt.cpp",
+				"Trace.h",
+				"Trace.cpp",
 
 				"main.cpp",
+				"Mirror.h",
+				"Mirror.cpp",
 
 				"ngdp.h",
 
 				"Heap.h",
 				"FileIO.h",
+				"FileIO.cpp",
 				"Strings.h",
 				"Buffer.h",
+				"Bytes.h",
 				"std.h",
 
 				"Containers.natvis",
@@ -33,6 +77,128 @@ Build {
 					"lib/libcurl_a.lib";
 					Config = "win32-vs2015-release"
 				},
+				{
+					"lib/zlib_a_debug.lib";
+					Config = "win32-vs2015-debug"
+				},
+				{
+					"lib/zlib_a.lib";
+					Config = "win32-vs2015-release"
+				},
+			},
+		}
+
+		-- Microbenchmarks of the core primitives; prints one JSON object per
+		-- benchmark, see Bench.cpp.
+		local bench = Program {
+			Name = "bench",
+			Sources = {
+				"Bench.cpp",
+				"ArchiveIndex.h",
+				"ArchiveIndex.cpp",
+				"Config.h",
+				"Config.cpp",
+				"Key.h",
+				"Key.cpp",
+				"KeyMap.h",
+				"KeyFilter.h",
+				"KeyFilter.cpp",
+				"Md5.h",
+				"Md5.cpp",
+				"WorkerPool.h",
+				"WorkerPool.cpp",
+
+				"Heap.h",
+				"Strings.h",
+				"Buffer.h",
+				"Bytes.h",
+				"std.h",
+			},
+		}
+
+		-- Reads, stores and scans one local installation from many threads at
+		-- once, checking every byte read; see Stress.cpp.  Build it with
+		-- ThreadSanitizer to have races reported.
+		local stress = Program {
+			Name = "stress",
+			Sources = {
+				"Stress.cpp",
+				"Client.h",
+				"Client.cpp",
+				"Remote.h",
+				"Remote.cpp",
+				"Key.h",
+				"Key.cpp",
+				"KeyMap.h",
+				"Config.h",
+				"Config.cpp",
+				"Encoding.h",
+				"Encoding.cpp",
+				"ArchiveIndex.h",
+				"ArchiveIndex.cpp",
+				"LocalStorage.h",
+				"LocalStorage.cpp",
+				"Blte.h",
+				"Blte.cpp",
+				"Md5.h",
+				"Md5.cpp",
+				"Read.cpp",
+				"Patch.h",
+				"Patch.cpp",
+				"PatchManifest.h",
+				"PatchManifest.cpp",
+				"CostModel.h",
+				"Espec.h",
+				"Espec.cpp",
+				"BlteEncoder.h",
+				"BlteEncoder.cpp",
+				"WorkerPool.h",
+				"WorkerPool.cpp",
+				"Write.cpp",
+				"Scan.cpp",
+				"Compact.cpp",
+				"SharedStore.cpp",
+				"CascWriter.h",
+				"CascWriter.cpp",
+				"Snapshot.h",
+				"Snapshot.cpp",
+				"Lock.h",
+				"DecodedCache.h",
+				"DecodedCache.cpp",
+				"KeyFilter.h",
+				"KeyFilter.cpp",
+				"Crypt.h",
+				"Crypt.cpp",
+				"Trace.h",
+				"Trace.cpp",
+
+				"ngdp.h",
+
+				"Heap.h",
+				"FileIO.h",
+				"FileIO.cpp",
+				"Strings.h",
+				"Buffer.h",
+				"Bytes.h",
+				"std.h",
+			},
+			Libs = {
+				{
+					"lib/libcurl_a_debug.lib";
+					Config = "win32-vs2015-debug"
+				},
+				{
+					"lib/libcurl_a.lib";
+					Config = "win32-vs2015-release"
+				},
+				{
+					"lib/zlib_a_debug.lib";
+					Config = "win32-vs2015-debug"
+				},
+				{
+					"lib/zlib_a.lib";
+					Config = "win32-vs2015-release"
+				},
 			},
 		}
 